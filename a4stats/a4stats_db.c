@@ -23,6 +23,9 @@ MODULE_VERSION("");
 
 DBAPIConn *a4statsdb;
 
+/* kicks and topics are only ever appended, they go in batches */
+static DBAPIBulk *a4kicks, *a4topics;
+
 static int a4stats_connectdb(void) {
   if(!a4statsdb) {
     a4statsdb = dbapi2open("pqsql", "a4stats");
@@ -74,7 +77,9 @@ static int a4stats_connectdb(void) {
 
   a4statsdb->createtable(a4statsdb, NULL, NULL, "CREATE INDEX relations_channelid_index ON ? (channelid)", "T", "relations");
   a4statsdb->createtable(a4statsdb, NULL, NULL, "CREATE INDEX relations_score_index ON ? (score)", "T", "relations");
- 
+
+  a4kicks = a4statsdb->bulkopen(a4statsdb, "kicks", "channelid, kicker, kickerid, victim, victimid, timestamp, reason", "UsUsUts");
+  a4topics = a4statsdb->bulkopen(a4statsdb, "topics", "channelid, topic, timestamp, setby, setbyid", "UstsU");
 
   return 1;
 }
@@ -83,6 +88,12 @@ static void a4stats_closedb(void) {
   if(!a4statsdb)
     return;
 
+  if(a4kicks)
+    a4kicks->close(a4kicks);
+  if(a4topics)
+    a4topics->close(a4topics);
+  a4kicks = a4topics = NULL;
+
   a4statsdb->close(a4statsdb);
   a4statsdb = NULL;
 }
@@ -513,8 +524,11 @@ static int a4stats_lua_add_kick(lua_State *ps) {
   victimid = lua_tonumber(ps, 5);
   reason = lua_tostring(ps, 6);
 
-  a4statsdb->squery(a4statsdb, "INSERT INTO ? (channelid, kicker, kickerid, victim, victimid, timestamp, reason) VALUES (?, ?, ?, ?, ?, ?, ?)", "TUsUsUts",
-    "kicks", channelid, kicker, kickerid, victim, victimid, time(NULL), reason);
+  if(a4kicks)
+    a4kicks->add(a4kicks, channelid, kicker, kickerid, victim, victimid, time(NULL), reason);
+  else
+    a4statsdb->squery(a4statsdb, "INSERT INTO ? (channelid, kicker, kickerid, victim, victimid, timestamp, reason) VALUES (?, ?, ?, ?, ?, ?, ?)", "TUsUsUts",
+      "kicks", channelid, kicker, kickerid, victim, victimid, time(NULL), reason);
 
   LUA_RETURN(ps, LUA_OK);
 }
@@ -531,8 +545,11 @@ static int a4stats_lua_add_topic(lua_State *ps) {
   setby = lua_tostring(ps, 3);
   setbyid = lua_tonumber(ps, 4);
 
-  a4statsdb->squery(a4statsdb, "INSERT INTO ? (channelid, topic, timestamp, setby, setbyid) VALUES (?, ?, ?, ?, ?)", "TUstsU",
-    "topics", channelid, topic, time(NULL), setby, setbyid);
+  if(a4topics)
+    a4topics->add(a4topics, channelid, topic, time(NULL), setby, setbyid);
+  else
+    a4statsdb->squery(a4statsdb, "INSERT INTO ? (channelid, topic, timestamp, setby, setbyid) VALUES (?, ?, ?, ?, ?)", "TUstsU",
+      "topics", channelid, topic, time(NULL), setby, setbyid);
 
   LUA_RETURN(ps, LUA_OK);
 }
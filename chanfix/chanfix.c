@@ -40,7 +40,7 @@ int cfcmd_save(void *source, int cargc, char **cargv);
 int cfcmd_load(void *source, int cargc, char **cargv);
 
 /* scheduled events */
-void cfsched_dosample(void *arg);
+void cfsched_doreconcile(void *arg);
 void cfsched_doexpire(void *arg);
 void cfsched_dosave(void *arg);
 
@@ -48,15 +48,18 @@ void cfsched_dosave(void *arg);
 void cfhook_autofix(int hook, void *arg);
 void cfhook_statsreport(int hook, void *arg);
 void cfhook_auth(int hook, void *arg);
+void cfhook_opchange(int hook, void *arg);
+void cfhook_newnick(int hook, void *arg);
+void cfhook_lostnick(int hook, void *arg);
 
 /* helper functions */
 regop *cf_createregop(nick *np, chanindex *cip);
 void cf_deleteregop(chanindex *cip, regop *ro);
 unsigned long cf_gethash(nick *np, int type);
-
-int cf_storechanfix(void);
-int cf_loadchanfix(void);
-void cf_free(void);
+time_t cf_clock(void);
+void cf_creditop(chanindex *cip, nick *np, time_t clock);
+void cf_reconcilechannel(chanindex *cip, time_t clock);
+void cf_settlechanfix(chanfix *cf, time_t clock);
 
 #define min(a,b) ((a > b) ? b : a)
 
@@ -70,7 +73,7 @@ void _init() {
     return;
   }
 
-  schedulerecurring(time(NULL), 0, CFSAMPLEINTERVAL, &cfsched_dosample, NULL);
+  schedulerecurring(time(NULL), 0, CFRECONCILEINTERVAL, &cfsched_doreconcile, NULL);
   schedulerecurring(time(NULL), 0, CFEXPIREINTERVAL, &cfsched_doexpire, NULL);
   schedulerecurring(time(NULL), 0, CFAUTOSAVEINTERVAL, &cfsched_dosave, NULL);
 
@@ -101,6 +104,10 @@ void _init() {
 
   registerhook(HOOK_CORE_STATSREQUEST, &cfhook_statsreport);
   registerhook(HOOK_NICK_ACCOUNT, &cfhook_auth);
+  registerhook(HOOK_CHANNEL_OPPED, &cfhook_opchange);
+  registerhook(HOOK_CHANNEL_DEOPPED, &cfhook_opchange);
+  registerhook(HOOK_CHANNEL_NEWNICK, &cfhook_newnick);
+  registerhook(HOOK_CHANNEL_LOSTNICK, &cfhook_lostnick);
 
   cf_loadchanfix();
 
@@ -111,13 +118,15 @@ void _fini() {
   if (cffailedinit)
     return;
 
-  deleteschedule(NULL, &cfsched_dosample, NULL);
+  deleteschedule(NULL, &cfsched_doreconcile, NULL);
   deleteschedule(NULL, &cfsched_doexpire, NULL);
   deleteschedule(NULL, &cfsched_dosave, NULL);
 
-  cf_storechanfix();
+  /* full, so the decay since the last full rewrite isn't lost */
+  cf_storechanfix(1);
 
   cf_free();
+  cf_cleardeleted();
 
   deregistercontrolcmd("cfdebug", &cfcmd_debug);
   deregistercontrolcmd("cfhistogram", &cfcmd_debughistogram);
@@ -144,6 +153,10 @@ void _fini() {
 
   deregisterhook(HOOK_CORE_STATSREQUEST, &cfhook_statsreport);
   deregisterhook(HOOK_NICK_ACCOUNT, &cfhook_auth);
+  deregisterhook(HOOK_CHANNEL_OPPED, &cfhook_opchange);
+  deregisterhook(HOOK_CHANNEL_DEOPPED, &cfhook_opchange);
+  deregisterhook(HOOK_CHANNEL_NEWNICK, &cfhook_newnick);
+  deregisterhook(HOOK_CHANNEL_LOSTNICK, &cfhook_lostnick);
 
   if (cfext >= 0)
     releasechanext(cfext);
@@ -182,12 +195,14 @@ int cfcmd_debug(void *source, int cargc, char **cargv) {
 
   controlreply(np, "Found chanfix information. Dumping...");
 
+  cf_settlechanfix(cf, cf_clock());
+
   for (i=0;i<cf->regops.cursi;i++) {
     ro = ((regop**)cf->regops.content)[i];
 
-    controlreply(np, "%d. type: %s hash: 0x%lx lastopped: %lu uh: %s score: %d",
+    controlreply(np, "%d. type: %s hash: 0x%lx lastopped: %lu uh: %s score: %d opped: %d",
                  i + 1, ro->type == CFACCOUNT ? "CFACCOUNT" : "CFHOST", ro->hash,
-                 ro->lastopped, ro->uh ? ro->uh->content : "(unknown)", ro->score);
+                 ro->lastopped, ro->uh ? ro->uh->content : "(unknown)", ro->score, ro->opcount);
   }
 
   controlreply(np, "Done.");
@@ -205,6 +220,8 @@ int cfcmd_debughistogram(void *source, int cargc, char **cargv) {
   for (i = 0; i < 10001; i++)
     histogram[i] = 0;
 
+  cf_settleall();
+
   for (i=0; i<CHANNELHASHSIZE; i++) {
     for (cip=chantable[i]; cip; cip=cip->next) {
       if ((cf = cip->exts[cfext]) != NULL) {
@@ -234,7 +251,7 @@ int cfcmd_debughistogram(void *source, int cargc, char **cargv) {
 }
 
 int cfcmd_debugsample(void *source, int cargc, char **cargv) {
-  cfsched_dosample(NULL);
+  cf_reconcileall();
 
   controlreply((nick*)source, "Done.");
 
@@ -281,6 +298,8 @@ int cf_getsortedregops(chanfix *cf, int max, regop **list) {
   if (cf == NULL)
     return 0;
 
+  cf_settlechanfix(cf, cf_clock());
+
   qsort(cf->regops.content, cf->regops.cursi, sizeof(regop*), cmpregop);
 
   for (i = 0; i < min(max, cf->regops.cursi); i++)
@@ -599,7 +618,13 @@ int cfcmd_save(void *source, int cargc, char **cargv) {
   nick *np = (nick*)source;
   int count;
 
-  count = cf_storechanfix();
+  count = cf_storechanfix(1);
+
+  if (count < 0) {
+    controlreply(np, "Error saving chanfix data, see the log for details.");
+
+    return CMD_ERROR;
+  }
 
   controlreply(np, "%d chanfix records saved.", count);
 
@@ -607,26 +632,13 @@ int cfcmd_save(void *source, int cargc, char **cargv) {
 }
 
 void cf_free(void) {
-  int a, i;
-  chanfix *cf;
+  int i;
   chanindex *cip;
 
   /* free old stuff */
-  for (i=0; i<CHANNELHASHSIZE; i++) {
-    for (cip=chantable[i]; cip; cip=cip->next) {
-      if ((cf = cip->exts[cfext]) != NULL) {
-        for (a=0;a<cf->regops.cursi;a++) {
-          freesstring(((regop**)cf->regops.content)[a]->uh);
-          free(((regop**)cf->regops.content)[a]);
-        }
-
-        array_free(&(((chanfix*)cip->exts[cfext])->regops));
-      }
-
-      free(cip->exts[cfext]);
-      cip->exts[cfext] = NULL;
-    }
-  }
+  for (i=0; i<CHANNELHASHSIZE; i++)
+    for (cip=chantable[i]; cip; cip=cip->next)
+      cf_freechanfix(cip);
 }
 
 int cfcmd_load(void *source, int cargc, char **cargv) {
@@ -657,86 +669,251 @@ int cf_hasauthedcloneonchan(nick *np, channel *cp) {
   return 0;
 }
 
-void cfsched_dosample(void *arg) {
-  int i,a,now,cfscore,cfnewro,diff;
-  channel *cp;
-  chanindex *cip;
-  nick *np;
-  regop *ro, *roh;
-  struct timeval start;
-  struct timeval end;
+/* Scores are kept by watching ops come and go rather than by sampling
+ * every channel: each opped user on a big enough channel holds a credit
+ * against one regop, and while a regop has credits its op time is turned
+ * into a point per CFSAMPLEINTERVAL.  The time only counts on the chanfix
+ * clock, which stands still while too many servers are split. */
 
-  now = getnettime();
+static time_t cfpaused, cfpausestart;
+static int cfreconcilebucket;
 
-  cfscore = cfnewro = 0;
+time_t cf_clock(void) {
+  time_t now = getnettime();
 
-  if (sp_countsplitservers(SERVERTYPEFLAG_USER_STATE) > CFMAXSPLITSERVERS)
+  if (sp_countsplitservers(SERVERTYPEFLAG_USER_STATE) > CFMAXSPLITSERVERS) {
+    if (!cfpausestart)
+      cfpausestart = now;
+  } else if (cfpausestart) {
+    cfpaused += now - cfpausestart;
+    cfpausestart = 0;
+  }
+
+  return (cfpausestart ? cfpausestart : now) - cfpaused;
+}
+
+/* turns the open op interval into points, leaving it open */
+void cf_settleregop(chanfix *cf, regop *ro, time_t clock) {
+  time_t elapsed;
+
+  if (!ro->opcount)
     return;
 
-  gettimeofday(&start, NULL);
+  elapsed = ro->carry + clock - ro->opsince;
 
-  for (i=0; i<CHANNELHASHSIZE; i++) {
-    for (cip=chantable[i]; cip; cip=cip->next) {
-      cp = cip->channel;
+  /* only a new point is worth saving, lastopped on disk is then
+     at most a sample interval behind */
+  if (elapsed >= CFSAMPLEINTERVAL)
+    cf->dirty = 1;
 
-      if (!cp || cp->users->totalusers < CFMINUSERS)
-        continue;
+  ro->score += elapsed / CFSAMPLEINTERVAL;
+  ro->carry = elapsed % CFSAMPLEINTERVAL;
+  ro->opsince = clock;
+  ro->lastopped = getnettime();
+}
 
-      for (a=0;a<cp->users->hashsize;a++) {
-        if ((cp->users->content[a] != nouser) && (cp->users->content[a] & CUMODE_OP)) {
-          np = getnickbynumeric(cp->users->content[a]);
+void cf_settlechanfix(chanfix *cf, time_t clock) {
+  int a;
 
-          if (!np)
-            continue;
+  for (a=0;a<cf->regops.cursi;a++)
+    cf_settleregop(cf, ((regop**)cf->regops.content)[a], clock);
+}
+
+void cf_settleall(void) {
+  int i;
+  chanindex *cip;
+  time_t clock = cf_clock();
+
+  for (i=0; i<CHANNELHASHSIZE; i++)
+    for (cip=chantable[i]; cip; cip=cip->next)
+      if (cip->exts[cfext])
+        cf_settlechanfix(cip->exts[cfext], clock);
+}
+
+int cf_findcredit(chanfix *cf, long numeric) {
+  int i;
+
+  for (i=0;i<cf->credits.cursi;i++)
+    if (((cfcredit*)cf->credits.content)[i].numeric == numeric)
+      return i;
+
+  return -1;
+}
+
+void cf_uncreditop(chanfix *cf, int i, time_t clock) {
+  regop *ro = ((cfcredit*)cf->credits.content)[i].ro;
+
+  cf_settleregop(cf, ro, clock);
+  ro->opcount--;
+
+  array_delslot(&(cf->credits), i);
+}
+
+void cf_creditop(chanindex *cip, nick *np, time_t clock) {
+  chanfix *cf = cip->exts[cfext];
+  channel *cp = cip->channel;
+  regop *ro, *roh;
+  cfcredit *cr;
+  int slot;
 
 #if !CFDEBUG
-          if (IsService(np))
-            continue;
+  if (IsService(np))
+    return;
 #endif
 
-          roh = ro = cf_findregop(np, cip, CFACCOUNT | CFHOST);
+  if (cf && cf_findcredit(cf, np->numeric) >= 0)
+    return;
 
-          if ((ro == NULL || (IsAccount(np) && ro->type == CFHOST)) &&
-              !cf_hasauthedcloneonchan(np, cp)) {
-            ro = cf_createregop(np, cip);
-            cfnewro++;
-          }
+  roh = ro = cf_findregop(np, cip, CFACCOUNT | CFHOST);
 
-          /* lastopped == now if the user has clones, we obviously
-           * don't want to give them points in this case */
-          if (!ro || ro->lastopped == now)
-            continue;
+  if ((ro == NULL || (IsAccount(np) && ro->type == CFHOST)) &&
+      !cf_hasauthedcloneonchan(np, cp))
+    ro = cf_createregop(np, cip);
 
-          if (ro->type != CFHOST || !cf_hasauthedcloneonchan(np, cp)) {
-            ro->score++;
-            cfscore++;
-          }
+  /* the authed clone gets the points instead */
+  if (!ro || (ro->type == CFHOST && cf_hasauthedcloneonchan(np, cp)))
+    return;
 
-          /* merge any matching CFHOST records */
-          if (roh && roh->type == CFHOST && ro->type == CFACCOUNT) {
-            /* hmm */
-            ro->score += roh->score;
+  /* merge any matching CFHOST record nobody else is using */
+  if (roh && roh->type == CFHOST && ro->type == CFACCOUNT && !roh->opcount) {
+    ro->score += roh->score;
 
-            cf_deleteregop(cip, roh);
-          }
+    cf_deleteregop(cip, roh);
+  }
 
-          ro->lastopped = now;
-        }
-      }
+  cf = cip->exts[cfext];
+
+  if (ro->opcount++ == 0)
+    ro->opsince = clock;
+
+  ro->lastopped = getnettime();
+  cf->dirty = 1;
+
+  slot = array_getfreeslot(&(cf->credits));
+  cr = &((cfcredit*)cf->credits.content)[slot];
+  cr->numeric = np->numeric;
+  cr->ro = ro;
+}
+
+/* brings the credits for a channel in line with who is actually opped,
+ * local services don't trigger any hooks when they op/deop users */
+void cf_reconcilechannel(chanindex *cip, time_t clock) {
+  chanfix *cf = cip->exts[cfext];
+  channel *cp = cip->channel;
+  cfcredit *cr;
+  unsigned long *hand;
+  nick *np;
+  int a, i;
+
+  if (cf) {
+    for (i=cf->credits.cursi-1;i>=0;i--) {
+      cr = &((cfcredit*)cf->credits.content)[i];
+
+      if (!cp || cp->users->totalusers < CFMINUSERS ||
+          !(hand = getnumerichandlefromchanhash(cp->users, cr->numeric)) ||
+          !(*hand & CUMODE_OP))
+        cf_uncreditop(cf, i, clock);
     }
   }
 
-  cp = findchannel("#qnet.chanfix");
+  if (!cp || cp->users->totalusers < CFMINUSERS)
+    return;
 
-  if (cp) {
-    gettimeofday(&end, NULL);
+  for (a=0;a<cp->users->hashsize;a++) {
+    if ((cp->users->content[a] != nouser) && (cp->users->content[a] & CUMODE_OP)) {
+      np = getnickbynumeric(cp->users->content[a]);
 
-    diff = (end.tv_sec * 1000 + end.tv_usec / 1000) -
-           (start.tv_sec * 1000 + start.tv_usec / 1000);
+      if (np)
+        cf_creditop(cip, np, clock);
+    }
+  }
+}
+
+void cf_reconcileall(void) {
+  int i;
+  chanindex *cip;
+  time_t clock = cf_clock();
+
+  for (i=0; i<CHANNELHASHSIZE; i++)
+    for (cip=chantable[i]; cip; cip=cip->next)
+      cf_reconcilechannel(cip, clock);
+}
+
+/* goes through all channels once every CFSAMPLEINTERVAL, a slice at a time */
+void cfsched_doreconcile(void *arg) {
+  int i, buckets;
+  chanindex *cip;
+  time_t clock = cf_clock();
+
+  buckets = (CHANNELHASHSIZE * CFRECONCILEINTERVAL + CFSAMPLEINTERVAL - 1) / CFSAMPLEINTERVAL;
+
+  if (buckets > CHANNELHASHSIZE)
+    buckets = CHANNELHASHSIZE;
+
+  for (i=0;i<buckets;i++) {
+    for (cip=chantable[cfreconcilebucket]; cip; cip=cip->next)
+      cf_reconcilechannel(cip, clock);
 
-    sendmessagetochannel(mynick, cp, "sampled chanfix scores, assigned %d new"
-                         " points, %d new regops, deltaT: %dms", cfscore,
-                         cfnewro, diff);
+    cfreconcilebucket = (cfreconcilebucket + 1) % CHANNELHASHSIZE;
+  }
+}
+
+void cfhook_opchange(int hook, void *arg) {
+  void **args = (void**)arg;
+  channel *cp = args[0];
+  nick *np = args[2];
+  chanfix *cf = cp->index->exts[cfext];
+  int i;
+
+  if (hook == HOOK_CHANNEL_OPPED) {
+    if (cp->users->totalusers >= CFMINUSERS)
+      cf_creditop(cp->index, np, cf_clock());
+  } else if (cf && (i = cf_findcredit(cf, np->numeric)) >= 0) {
+    cf_uncreditop(cf, i, cf_clock());
+  }
+}
+
+void cfhook_newnick(int hook, void *arg) {
+  void **args = (void**)arg;
+  channel *cp = args[0];
+  nick *np = args[1];
+  unsigned long *hand;
+
+  if (cp->users->totalusers < CFMINUSERS)
+    return;
+
+  /* the channel just got big enough, pick up everyone who's already opped */
+  if (cp->users->totalusers == CFMINUSERS) {
+    cf_reconcilechannel(cp->index, cf_clock());
+    return;
+  }
+
+  /* opped users joining from a burst or creating the channel */
+  hand = getnumerichandlefromchanhash(cp->users, np->numeric);
+
+  if (hand && (*hand & CUMODE_OP))
+    cf_creditop(cp->index, np, cf_clock());
+}
+
+void cfhook_lostnick(int hook, void *arg) {
+  void **args = (void**)arg;
+  channel *cp = args[0];
+  nick *np = args[1];
+  chanfix *cf = cp->index->exts[cfext];
+  time_t clock;
+  int i;
+
+  if (cf == NULL || cf->credits.cursi == 0)
+    return;
+
+  clock = cf_clock();
+
+  /* the user is still counted in totalusers here */
+  if (cp->users->totalusers <= CFMINUSERS) {
+    for (i=cf->credits.cursi-1;i>=0;i--)
+      cf_uncreditop(cf, i, clock);
+  } else if ((i = cf_findcredit(cf, np->numeric)) >= 0) {
+    cf_uncreditop(cf, i, clock);
   }
 }
 
@@ -746,7 +923,6 @@ void cfsched_doexpire(void *arg) {
   chanindex *ncip;
   chanfix *cf;
   int i,a,cfscore,cfregop,diff;
-  regop **rolist;
   regop *ro;
   struct timeval start;
   struct timeval end;
@@ -757,24 +933,39 @@ void cfsched_doexpire(void *arg) {
   gettimeofday(&start, NULL);
   currenttime=getnettime();
 
+  cf_settleall();
+
   for (i=0; i<CHANNELHASHSIZE; i++) {
     for (cip=chantable[i]; cip; cip=cip->next) {
       cf = (chanfix*)cip->exts[cfext];
 
       if (cf) {
-        rolist = (regop**)cf->regops.content;
+        /* backwards, cf_deleteregop moves the last regop into the hole
+           and frees cf along with the last one */
+        for (a=cf->regops.cursi-1;a>=0;a--) {
+          ro = ((regop**)cf->regops.content)[a];
 
-        for (a=0;a<cf->regops.cursi;a++) {
-          ro = rolist[a];
+          /* still opped, cf_settleall just updated lastopped */
+          if (ro->opcount)
+            continue;
 
+          /* decay alone doesn't make the channel dirty or the journal
+             would hold nearly every channel each hour, it's saved with
+             the next full rewrite (see CFFULLSAVEINTERVAL) */
           if (((currenttime - ro->lastopped) > (2 * CFSAMPLEINTERVAL)) && ro->score) {
             ro->score--;
             cfscore++;
           }
 
           if (ro->score == 0 || ro->lastopped < (currenttime - CFREMEMBEROPS)) {
-            cf_deleteregop(cip, ro);
             cfregop++;
+
+            if (cf->regops.cursi == 1) {
+              cf_deleteregop(cip, ro);
+              break;
+            }
+
+            cf_deleteregop(cip, ro);
           }
         }
       }
@@ -809,7 +1000,7 @@ void cfsched_doexpire(void *arg) {
 }
 
 void cfsched_dosave(void *arg) {
-  cf_storechanfix();
+  cf_storechanfix(0);
 }
 
 #if CFAUTOFIX
@@ -865,7 +1056,7 @@ void cfhook_statsreport(int hook, void *arg) {
             rc++;
           }
 
-          memory += sizeof(chanfix);
+          memory += sizeof(chanfix) + sizeof(cfcredit) * cf->credits.cursi;
 
           mc++;
         }
@@ -881,11 +1072,28 @@ void cfhook_statsreport(int hook, void *arg) {
 void cfhook_auth(int hook, void *arg) {
   nick *np = (nick*)arg;
 
+  channel **cps;
+  chanfix *cf;
+  time_t clock;
+  int i, c;
+
   /* Invalidate the user's hash */
   np->exts[cfnext] = NULL;
   
   /* Calculate the new hash */
   cf_gethash(np, CFACCOUNT);
+
+  /* move the user's op time over to their account */
+  clock = cf_clock();
+  cps = (channel**)np->channels->content;
+
+  for (c=0;c<np->channels->cursi;c++) {
+    if ((cf = cps[c]->index->exts[cfext]) == NULL || (i = cf_findcredit(cf, np->numeric)) < 0)
+      continue;
+
+    cf_uncreditop(cf, i, clock);
+    cf_creditop(cps[c]->index, np, clock);
+  }
 }
 
 /* Returns the hash of a specific user (np), type can be either CFACCOUNT,
@@ -996,10 +1204,60 @@ nick *cf_findnick(regop *ro, chanindex *cip) {
   return NULL;
 }
 
+#define cf_rohashslot(cf, type, hash) (((hash) ^ (type)) & ((cf)->rohashsize - 1))
+
+static void cf_rohashinsert(chanfix *cf, regop *ro) {
+  unsigned int i = cf_rohashslot(cf, ro->type, ro->hash);
+
+  while (cf->rohash[i])
+    i = (i + 1) & (cf->rohashsize - 1);
+
+  cf->rohash[i] = ro;
+}
+
+static void cf_rohashresize(chanfix *cf, unsigned int size) {
+  regop **old = cf->rohash;
+  unsigned int i, oldsize = cf->rohashsize;
+
+  cf->rohash = (regop**)calloc(size, sizeof(regop*));
+  cf->rohashsize = size;
+
+  for (i=0;i<oldsize;i++)
+    if (old[i])
+      cf_rohashinsert(cf, old[i]);
+
+  free(old);
+}
+
+/* linear probing, so the entries after the hole may need to move up */
+static void cf_rohashdelete(chanfix *cf, regop *ro) {
+  unsigned int i, j, k, mask = cf->rohashsize - 1;
+
+  for (i = cf_rohashslot(cf, ro->type, ro->hash); cf->rohash[i] != ro; i = (i + 1) & mask)
+    if (!cf->rohash[i])
+      return;
+
+  cf->rohash[i] = NULL;
+
+  for (j = (i + 1) & mask; cf->rohash[j]; j = (j + 1) & mask) {
+    k = cf_rohashslot(cf, cf->rohash[j]->type, cf->rohash[j]->hash);
+
+    /* leave it if its home slot is cyclically in (i, j] */
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+
+    cf->rohash[i] = cf->rohash[j];
+    cf->rohash[j] = NULL;
+    i = j;
+  }
+}
+
 regop *cf_findregop(nick *np, chanindex *cip, int type) {
   chanfix *cf = cip->exts[cfext];
   regop *ro;
-  int i, ty;
+  unsigned long hash;
+  unsigned int i;
+  int ty;
 
   if (cf == NULL)
     return NULL;
@@ -1009,10 +1267,10 @@ regop *cf_findregop(nick *np, chanindex *cip, int type) {
   else
     ty = CFHOST;
 
-  for (i=0;i<cf->regops.cursi;i++) {
-    ro = ((regop**)cf->regops.content)[i];
+  hash = cf_gethash(np, ty);
 
-    if (ro->type == ty && cf_cmpregopnick(ro, np))
+  for (i = cf_rohashslot(cf, ty, hash); (ro = cf->rohash[i]); i = (i + 1) & (cf->rohashsize - 1)) {
+    if (ro->type == ty && ro->hash == hash && cf_cmpregopnick(ro, np))
       return ro;
   }
 
@@ -1021,47 +1279,89 @@ regop *cf_findregop(nick *np, chanindex *cip, int type) {
     return cf_findregop(np, cip, CFHOST);
   else
     return NULL;
-
-  return NULL;
 }
 
-regop *cf_createregop(nick *np, chanindex *cip) {
+chanfix *cf_newchanfix(chanindex *cip) {
   chanfix *cf = cip->exts[cfext];
-  int slot, type;
-  regop **rolist;
-  char buf[USERLEN+1+HOSTLEN+1];
 
   if (cf == NULL) {
     cf = (chanfix*)malloc(sizeof(chanfix));
     cf->index = cip;
+    cf->rohash = (regop**)calloc(CFMINHASHSIZE, sizeof(regop*));
+    cf->rohashsize = CFMINHASHSIZE;
+    cf->dirty = 1;
 
     array_init(&(cf->regops), sizeof(regop*));
+    array_init(&(cf->credits), sizeof(cfcredit));
 
     cip->exts[cfext] = cf;
   }
 
+  return cf;
+}
+
+void cf_freechanfix(chanindex *cip) {
+  chanfix *cf = cip->exts[cfext];
+  int a;
+
+  if (cf == NULL)
+    return;
+
+  for (a=0;a<cf->regops.cursi;a++) {
+    freesstring(((regop**)cf->regops.content)[a]->uh);
+    free(((regop**)cf->regops.content)[a]);
+  }
+
+  array_free(&(cf->regops));
+  array_free(&(cf->credits));
+  free(cf->rohash);
+  free(cf);
+
+  cip->exts[cfext] = NULL;
+}
+
+/* adds a regop which already has its type and hash */
+void cf_linkregop(chanfix *cf, regop *ro) {
+  int slot;
+
+  if ((cf->regops.cursi + 1) * 2 > cf->rohashsize)
+    cf_rohashresize(cf, cf->rohashsize * 2);
+
   slot = array_getfreeslot(&(cf->regops));
+  ((regop**)cf->regops.content)[slot] = ro;
 
-  rolist = (regop**)cf->regops.content;
+  cf_rohashinsert(cf, ro);
 
-  rolist[slot] = (regop*)malloc(sizeof(regop));
+  cf->dirty = 1;
+}
+
+regop *cf_createregop(nick *np, chanindex *cip) {
+  chanfix *cf = cf_newchanfix(cip);
+  regop *ro;
+  char buf[USERLEN+1+HOSTLEN+1];
+
+  ro = (regop*)malloc(sizeof(regop));
 
   if (IsAccount(np)) {
-    type = CFACCOUNT;
-    rolist[slot]->uh = getsstring(np->authname, ACCOUNTLEN);
+    ro->type = CFACCOUNT;
+    ro->uh = getsstring(np->authname, ACCOUNTLEN);
   } else {
-    type = CFHOST;
+    ro->type = CFHOST;
 
     snprintf(buf, sizeof(buf), "%s@%s", np->ident, np->host->name->content);
-    rolist[slot]->uh = getsstring(buf, USERLEN+1+HOSTLEN);
+    ro->uh = getsstring(buf, USERLEN+1+HOSTLEN);
   }
 
-  rolist[slot]->type = type;
-  rolist[slot]->hash = cf_gethash(np, type);
-  rolist[slot]->lastopped = 0;
-  rolist[slot]->score = 0;
+  ro->hash = cf_gethash(np, ro->type);
+  ro->lastopped = 0;
+  ro->score = 0;
+  ro->opcount = 0;
+  ro->opsince = 0;
+  ro->carry = 0;
+
+  cf_linkregop(cf, ro);
 
-  return rolist[slot];
+  return ro;
 }
 
 void cf_deleteregop(chanindex *cip, regop *ro) {
@@ -1071,23 +1371,34 @@ void cf_deleteregop(chanindex *cip, regop *ro) {
   if (cf == NULL)
     return;
 
+  /* callers shouldn't delete regops which are in use, but don't leave
+     dangling credits if they do */
+  for (a=cf->credits.cursi-1;a>=0;a--)
+    if (((cfcredit*)cf->credits.content)[a].ro == ro)
+      array_delslot(&(cf->credits), a);
+
   for (a=0;a<cf->regops.cursi;a++) {
     if (((regop**)cf->regops.content)[a] == ro) {
-      freesstring(((regop**)cf->regops.content)[a]->uh);
-      free(((regop**)cf->regops.content)[a]);
+      cf_rohashdelete(cf, ro);
+      freesstring(ro->uh);
+      free(ro);
       array_delslot(&(cf->regops), a);
+      break;
     }
   }
 
+  cf->dirty = 1;
+
   /* get rid of chanfix* if there are no more regops */
   if (cf->regops.cursi == 0) {
-    array_free(&(cf->regops));
-    free(cf);
-    cip->exts[cfext] = NULL;
+    cf_recorddeletion(cip);
+    cf_freechanfix(cip);
 
     /* we could try to free the chanindex* here
-       but that would make cfsched_dosample a lot more
+       but that would make cfsched_doexpire a lot more
        complicated */
+  } else if (cf->rohashsize > CFMINHASHSIZE && cf->regops.cursi * 8 < cf->rohashsize) {
+    cf_rohashresize(cf, cf->rohashsize / 2);
   }
 }
 
@@ -1158,136 +1469,6 @@ int cf_fixchannel(channel *cp) {
     return CFX_FIXEDFEWOPS;
 }
 
-int cf_storechanfix(void) {
-  FILE *cfdata;
-  regop *ro;
-  chanfix *cf;
-  chanindex *cip;
-  char srcfile[300];
-  char dstfile[300];
-  int a, i, count = 0;
-
-  snprintf(dstfile, sizeof(dstfile), "%s.%d", CFSTORAGE, CFSAVEFILES);
-  unlink(dstfile);
-
-  for (i = CFSAVEFILES; i > 0; i--) {
-    snprintf(srcfile, sizeof(srcfile), "%s.%i", CFSTORAGE, i - 1);
-    snprintf(dstfile, sizeof(dstfile), "%s.%i", CFSTORAGE, i);
-    rename(srcfile, dstfile);
-  }
-
-  snprintf(srcfile, sizeof(srcfile), "%s.0", CFSTORAGE);
-  cfdata = fopen(srcfile, "w");
-
-  if (cfdata == NULL)
-    return 0;
-
-  for (i=0; i<CHANNELHASHSIZE; i++) {
-    for (cip=chantable[i]; cip; cip=cip->next) {
-      if ((cf = cip->exts[cfext]) != NULL) {
-        for (a=0;a<cf->regops.cursi;a++) {
-          ro = ((regop**)cf->regops.content)[a];
-
-          if (ro->uh)
-            fprintf(cfdata, "%s %d %lu %lu %d %s\n", cip->name->content,
-                    ro->type, ro->hash, ro->lastopped, ro->score, ro->uh->content);
-          else
-            fprintf(cfdata, "%s %d %lu %lu %d\n", cip->name->content,
-                    ro->type, ro->hash, ro->lastopped, ro->score);
-          count++;
-        }
-      }
-    }
-  }
-
-  fclose(cfdata);
-
-  return count;
-}
-
-/* channel type hash lastopped score host */
-int cf_parseline(char *line) {
-  chanindex *cip;
-  chanfix *cf;
-  int count;
-  int slot;
-  char chan[CHANNELLEN+1];
-  int type, score;
-  unsigned long hash;
-  time_t lastopped;
-  char host[USERLEN+1+HOSTLEN+1];
-  regop **rolist;
-
-  count = sscanf(line, "%s %d %lu %lu %d %s", chan, &type, &hash, &lastopped, &score, host);
-
-  if (count < 5)
-    return 0; /* invalid chanfix record */
-
-  cip = findorcreatechanindex(chan);
-
-  cf = cip->exts[cfext];
-
-  if (cf == NULL) {
-    cf = (chanfix*)malloc(sizeof(chanfix));
-    cf->index = cip;
-
-    array_init(&(cf->regops), sizeof(regop*));
-
-    cip->exts[cfext] = cf;
-  }
-
-  slot = array_getfreeslot(&(cf->regops));
-
-  rolist = (regop**)cf->regops.content;
-
-  rolist[slot] = (regop*)malloc(sizeof(regop));
-
-  rolist[slot]->type = type;
-  rolist[slot]->hash = hash;
-  rolist[slot]->lastopped = lastopped;
-  rolist[slot]->score = score;
-  rolist[slot]->uh = getsstring(host, USERLEN+1+HOSTLEN);
-
-  return 1;
-}
-
-int cf_loadchanfix(void) {
-  char line[4096];
-  FILE *cfdata;
-  char srcfile[300];
-  int count;
-
-  cf_free();
-
-  snprintf(srcfile, sizeof(srcfile), "%s.0", CFSTORAGE);
-  cfdata = fopen(srcfile, "r");
-
-  if (cfdata == NULL)
-    return 0;
-
-  count = 0;
-
-  while (!feof(cfdata)) {
-    if (fgets(line, sizeof(line), cfdata) == NULL)
-      break;
-
-    if (line[strlen(line) - 1] == '\n')
-      line[strlen(line) - 1] = '\0';
-
-    if (line[strlen(line) - 1] == '\r')
-      line[strlen(line) - 1] = '\0';
-
-    if (line[0] != '\0') {
-      if (cf_parseline(line))
-        count++;
-    }
-  }
-
-  fclose(cfdata);
-
-  return count;
-}
-
 /* functions for users of this module */
 chanfix *cf_findchanfix(chanindex *cip) {
   return cip->exts[cfext];
@@ -1307,6 +1488,8 @@ int cf_wouldreop(nick *np, channel *cp) {
   if (ro == NULL)
     return 0;
 
+  cf_settlechanfix(cf, cf_clock());
+
   rolist = (regop**)cf->regops.content;
 
   for (i=0; i<cf->regops.cursi; i++)
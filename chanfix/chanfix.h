@@ -3,9 +3,15 @@
 
 #include "../channel/channel.h"
 
+struct regop;
+
 typedef struct chanfix {
   chanindex      *index;
   array          regops;
+  array          credits;    /* cfcredit, opped users we're currently scoring */
+  struct regop   **rohash;   /* open addressed on (type, hash), all of regops */
+  unsigned int   rohashsize; /* power of 2 */
+  int            dirty;      /* changed since the last save */
 } chanfix;
 
 typedef struct regop {
@@ -14,8 +20,17 @@ typedef struct regop {
   sstring        *uh;        /* account or user@host if the user has enough points */
   time_t         lastopped;  /* when was he last opped */
   unsigned int   score;      /* chanfix score */
+  unsigned int   opcount;    /* opped users currently credited to this regop */
+  time_t         opsince;    /* start of the current op interval (chanfix clock) */
+  time_t         carry;      /* op time which hasn't made a whole point yet */
 } regop;
 
+/* an opped user and the regop their op time goes to */
+typedef struct cfcredit {
+  long           numeric;
+  regop          *ro;
+} cfcredit;
+
 extern int cfext;
 extern int cfnext;
 
@@ -26,11 +41,13 @@ extern int cfnext;
 #define CFSAMPLEINTERVAL 5
 #define CFEXPIREINTERVAL 60
 #define CFAUTOSAVEINTERVAL 60
+#define CFFULLSAVEINTERVAL 24*60
 #define CFREMEMBEROPS 10*24*60
 #else
 #define CFSAMPLEINTERVAL 300
 #define CFEXPIREINTERVAL 3600
 #define CFAUTOSAVEINTERVAL 3600
+#define CFFULLSAVEINTERVAL 24*3600
 #define CFREMEMBEROPS 10*24*3600
 #endif
 
@@ -46,8 +63,16 @@ extern int cfnext;
 #define CFSTORAGE "data/chanfix"
 /* how many chanfix files we have */
 #define CFSAVEFILES 5
+/* rewrite the whole file rather than appending to the journal
+   once the journal is this fraction of its size */
+#define CFJOURNALRATIO 2
+/* smallest regop hash per channel */
+#define CFMINHASHSIZE 8
 /* maximum number of servers which may be split */
 #define CFMAXSPLITSERVERS 10
+/* how often we look at a slice of the channels for ops
+   we weren't told about (e.g. given by local services) */
+#define CFRECONCILEINTERVAL 10
 
 /* track user by account */
 #define CFACCOUNT 0x1
@@ -71,4 +96,16 @@ int cf_fixchannel(channel *cp);
 int cf_getsortedregops(chanfix *cf, int max, regop **list);
 int cf_cmpregopnick(regop *ro, nick *np);
 
+/* used by the storage code */
+chanfix *cf_newchanfix(chanindex *cip);
+void cf_freechanfix(chanindex *cip);
+void cf_linkregop(chanfix *cf, regop *ro);
+void cf_settleall(void);
+void cf_reconcileall(void);
+int cf_storechanfix(int full);
+int cf_loadchanfix(void);
+void cf_free(void);
+void cf_recorddeletion(chanindex *cip);
+void cf_cleardeleted(void);
+
 #endif /* __CHANFIX_H */
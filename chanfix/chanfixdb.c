@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+/*
+ * chanfixdb.c:
+ *  Saving and loading the chanfix scores.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "chanfix.h"
+#include "../core/error.h"
+#include "../lib/irc_string.h"
+
+#define CFDB_MAGIC    0x42444643 /* "CFDB" */
+#define CFDB_VERSION  1
+
+#define CFDB_FILE     CFSTORAGE ".bin"
+#define CFDB_TMPFILE  CFSTORAGE ".bin.tmp"
+#define CFDB_JOURNAL  CFSTORAGE ".journal"
+
+/*
+ * On-disk format (host byte order, it never leaves this machine):
+ *  CFDB_FILE holds every channel, CFDB_JOURNAL has the channels which
+ *  changed since, appended at each autosave.  A channel record replaces
+ *  everything we knew about the channel, one with no regops deletes it.
+ *  The journal is only used if its generation matches the base file's,
+ *  the base file is rewritten (with CFSAVEFILES old copies) when the
+ *  journal gets too big or on cfsave.
+ *
+ *  header:  magic, version, generation
+ *  channel: crc of the rest of the record, regop count, name length, name
+ *  regop:   fixed fields, user@host/account length, user@host/account
+ */
+
+struct cfdbheader {
+  uint32_t magic, version, generation;
+};
+
+struct cfdbchan {
+  uint32_t crc;
+  uint32_t regops;
+  uint16_t namelen;
+};
+
+struct cfdbregop {
+  uint32_t hash, score;
+  int64_t lastopped;
+  uint8_t type, uhlen;
+};
+
+static uint32_t cfgeneration;
+static int cfneedfull;
+static time_t cflastfull;
+static array cfdeleted;
+
+void cf_cleardeleted(void) {
+  int i;
+
+  for (i=0;i<cfdeleted.cursi;i++)
+    freesstring(((sstring**)cfdeleted.content)[i]);
+
+  array_free(&cfdeleted);
+  array_init(&cfdeleted, sizeof(sstring*));
+}
+
+/* called when a channel loses its last regop */
+void cf_recorddeletion(chanindex *cip) {
+  int slot;
+
+  if (cfdeleted.itemsize == 0)
+    array_init(&cfdeleted, sizeof(sstring*));
+
+  slot = array_getfreeslot(&cfdeleted);
+  ((sstring**)cfdeleted.content)[slot] = getsstring(cip->name->content, CHANNELLEN);
+}
+
+static void cf_fillregop(struct cfdbregop *rec, regop *ro) {
+  memset(rec, 0, sizeof(struct cfdbregop));
+  rec->hash = ro->hash;
+  rec->score = ro->score;
+  rec->lastopped = ro->lastopped;
+  rec->type = ro->type;
+  rec->uhlen = ro->uh ? ro->uh->length : 0;
+}
+
+/* writes a channel record, cf may be NULL for a deleted channel */
+static int cf_writechannel(FILE *fp, const char *name, chanfix *cf) {
+  struct cfdbchan hdr;
+  struct cfdbregop rec;
+  unsigned long crc;
+  regop *ro;
+  int a, ok;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.regops = cf ? cf->regops.cursi : 0;
+  hdr.namelen = strlen(name);
+
+  /* the checksum goes first, so that's one pass to work it out... */
+  crc = irc_crc32buf(0, (char *)&hdr + offsetof(struct cfdbchan, regops), sizeof(hdr) - offsetof(struct cfdbchan, regops));
+  crc = irc_crc32buf(crc, name, hdr.namelen);
+
+  for (a=0;a<hdr.regops;a++) {
+    ro = ((regop**)cf->regops.content)[a];
+
+    cf_fillregop(&rec, ro);
+    crc = irc_crc32buf(crc, &rec, sizeof(rec));
+    if (rec.uhlen)
+      crc = irc_crc32buf(crc, ro->uh->content, rec.uhlen);
+  }
+
+  hdr.crc = crc;
+
+  /* ...and one to write it */
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fwrite(name, 1, hdr.namelen, fp) == hdr.namelen;
+
+  for (a=0;a<hdr.regops && ok;a++) {
+    ro = ((regop**)cf->regops.content)[a];
+
+    cf_fillregop(&rec, ro);
+    ok = fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+         (!rec.uhlen || fwrite(ro->uh->content, 1, rec.uhlen, fp) == rec.uhlen);
+  }
+
+  return ok;
+}
+
+static int cf_writeheader(FILE *fp, uint32_t generation) {
+  struct cfdbheader hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = CFDB_MAGIC;
+  hdr.version = CFDB_VERSION;
+  hdr.generation = generation;
+
+  return fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+}
+
+static void cf_markclean(void) {
+  int i;
+  chanindex *cip;
+
+  for (i=0; i<CHANNELHASHSIZE; i++)
+    for (cip=chantable[i]; cip; cip=cip->next)
+      if (cip->exts[cfext])
+        ((chanfix*)cip->exts[cfext])->dirty = 0;
+
+  cf_cleardeleted();
+}
+
+/* appends the channels which changed since the last save */
+static int cf_storejournal(void) {
+  FILE *fp;
+  struct stat st;
+  chanfix *cf;
+  chanindex *cip;
+  int i, ok, count = 0;
+
+  fp = fopen(CFDB_JOURNAL, "ab");
+  if (fp == NULL)
+    return -1;
+
+  ok = 1;
+  if (fstat(fileno(fp), &st) || st.st_size == 0)
+    ok = cf_writeheader(fp, cfgeneration);
+
+  for (i=0;i<cfdeleted.cursi && ok;i++)
+    ok = cf_writechannel(fp, ((sstring**)cfdeleted.content)[i]->content, NULL);
+
+  for (i=0; i<CHANNELHASHSIZE && ok; i++) {
+    for (cip=chantable[i]; cip && ok; cip=cip->next) {
+      if ((cf = cip->exts[cfext]) == NULL || !cf->dirty)
+        continue;
+
+      ok = cf_writechannel(fp, cip->name->content, cf);
+      count += cf->regops.cursi;
+    }
+  }
+
+  if (fclose(fp))
+    ok = 0;
+
+  if (!ok) {
+    /* the journal may end in half a record now, so stop appending to it */
+    Error("chanfix", ERR_WARNING, "Error appending to %s, rewriting %s instead.", CFDB_JOURNAL, CFDB_FILE);
+    cfneedfull = 1;
+    return -1;
+  }
+
+  return count;
+}
+
+static int cf_storefull(void) {
+  FILE *fp;
+  chanfix *cf;
+  chanindex *cip;
+  char srcfile[300];
+  char dstfile[300];
+  int i, ok, count = 0;
+
+  fp = fopen(CFDB_TMPFILE, "wb");
+  if (fp == NULL) {
+    Error("chanfix", ERR_WARNING, "Unable to open %s for writing.", CFDB_TMPFILE);
+    return -1;
+  }
+
+  ok = cf_writeheader(fp, cfgeneration + 1);
+
+  for (i=0; i<CHANNELHASHSIZE && ok; i++) {
+    for (cip=chantable[i]; cip && ok; cip=cip->next) {
+      if ((cf = cip->exts[cfext]) == NULL)
+        continue;
+
+      ok = cf_writechannel(fp, cip->name->content, cf);
+      count += cf->regops.cursi;
+    }
+  }
+
+  if (fclose(fp))
+    ok = 0;
+
+  if (!ok) {
+    Error("chanfix", ERR_WARNING, "Error writing %s.", CFDB_TMPFILE);
+    unlink(CFDB_TMPFILE);
+    return -1;
+  }
+
+  snprintf(dstfile, sizeof(dstfile), "%s.%d", CFDB_FILE, CFSAVEFILES);
+  unlink(dstfile);
+
+  for (i = CFSAVEFILES; i > 1; i--) {
+    snprintf(srcfile, sizeof(srcfile), "%s.%d", CFDB_FILE, i - 1);
+    snprintf(dstfile, sizeof(dstfile), "%s.%d", CFDB_FILE, i);
+    rename(srcfile, dstfile);
+  }
+
+  snprintf(dstfile, sizeof(dstfile), "%s.1", CFDB_FILE);
+  rename(CFDB_FILE, dstfile);
+
+  if (rename(CFDB_TMPFILE, CFDB_FILE)) {
+    Error("chanfix", ERR_WARNING, "Unable to rename %s to %s.", CFDB_TMPFILE, CFDB_FILE);
+    return -1;
+  }
+
+  /* the old journal has the wrong generation now, but don't keep it around */
+  unlink(CFDB_JOURNAL);
+
+  cfgeneration++;
+  cfneedfull = 0;
+  cflastfull = time(NULL);
+
+  return count;
+}
+
+/* Returns the number of regops written or -1, full forces a rewrite of the base file */
+int cf_storechanfix(int full) {
+  struct stat st, jst;
+  int count = -1;
+
+  cf_settleall();
+
+  /* score decay is only saved by full rewrites, so don't put them off forever */
+  if (!full && !cfneedfull && time(NULL) - cflastfull < CFFULLSAVEINTERVAL &&
+      stat(CFDB_FILE, &st) == 0) {
+    if (stat(CFDB_JOURNAL, &jst))
+      jst.st_size = 0;
+
+    if (jst.st_size * CFJOURNALRATIO < st.st_size)
+      count = cf_storejournal();
+  }
+
+  if (count < 0)
+    count = cf_storefull();
+
+  /* keep everything dirty for next time if we couldn't save */
+  if (count >= 0)
+    cf_markclean();
+
+  return count;
+}
+
+static char *cf_readfile(const char *filename, size_t *len) {
+  FILE *fp;
+  struct stat st;
+  char *buf;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return NULL;
+
+  if (fstat(fileno(fp), &st) || st.st_size < sizeof(struct cfdbheader) ||
+      (buf = malloc(st.st_size)) == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+
+  if (fread(buf, 1, st.st_size, fp) != st.st_size) {
+    free(buf);
+    fclose(fp);
+    return NULL;
+  }
+
+  fclose(fp);
+
+  *len = st.st_size;
+  return buf;
+}
+
+/* Applies the channel record at buf, returns its length or 0 if it's truncated or corrupt */
+static size_t cf_loadchannel(const char *buf, size_t len, int *count) {
+  struct cfdbchan hdr;
+  struct cfdbregop rec;
+  char name[CHANNELLEN+1];
+  char uh[256];
+  const char *p = buf, *end = buf + len;
+  unsigned long crc;
+  chanindex *cip;
+  chanfix *cf;
+  regop *ro;
+  uint32_t a;
+
+  if (len < sizeof(hdr))
+    return 0;
+
+  memcpy(&hdr, p, sizeof(hdr));
+  crc = irc_crc32buf(0, p + offsetof(struct cfdbchan, regops), sizeof(hdr) - offsetof(struct cfdbchan, regops));
+  p += sizeof(hdr);
+
+  if (hdr.namelen == 0 || hdr.namelen > CHANNELLEN || end - p < hdr.namelen)
+    return 0;
+
+  crc = irc_crc32buf(crc, p, hdr.namelen);
+  p += hdr.namelen;
+
+  /* check the whole record before touching anything */
+  for (a=0;a<hdr.regops;a++) {
+    if (end - p < sizeof(rec))
+      return 0;
+
+    memcpy(&rec, p, sizeof(rec));
+    if (end - p < sizeof(rec) + rec.uhlen)
+      return 0;
+
+    crc = irc_crc32buf(crc, p, sizeof(rec) + rec.uhlen);
+    p += sizeof(rec) + rec.uhlen;
+  }
+
+  if (crc != hdr.crc)
+    return 0;
+
+  memcpy(name, buf + sizeof(hdr), hdr.namelen);
+  name[hdr.namelen] = '\0';
+
+  /* a record without regops deletes the channel, don't create an index for it */
+  if (hdr.regops == 0) {
+    if ((cip = findchanindex(name)) != NULL && (cf = cip->exts[cfext]) != NULL) {
+      *count -= cf->regops.cursi;
+      cf_freechanfix(cip);
+      releasechanindex(cip);
+    }
+
+    return p - buf;
+  }
+
+  cip = findorcreatechanindex(name);
+
+  if ((cf = cip->exts[cfext]) != NULL) {
+    *count -= cf->regops.cursi;
+    cf_freechanfix(cip);
+  }
+
+  cf = cf_newchanfix(cip);
+
+  for (a=0,p=buf+sizeof(hdr)+hdr.namelen;a<hdr.regops;a++) {
+    memcpy(&rec, p, sizeof(rec));
+    p += sizeof(rec);
+
+    ro = (regop*)malloc(sizeof(regop));
+    ro->type = rec.type;
+    ro->hash = rec.hash;
+    ro->lastopped = rec.lastopped;
+    ro->score = rec.score;
+    ro->opcount = 0;
+    ro->opsince = 0;
+    ro->carry = 0;
+    ro->uh = NULL;
+
+    if (rec.uhlen) {
+      memcpy(uh, p, rec.uhlen);
+      uh[rec.uhlen] = '\0';
+      ro->uh = getsstring(uh, USERLEN+1+HOSTLEN);
+      p += rec.uhlen;
+    }
+
+    cf_linkregop(cf, ro);
+  }
+
+  cf->dirty = 0;
+  *count += hdr.regops;
+
+  return p - buf;
+}
+
+/* Returns 0 if the file is missing or not ours, -1 if it was only partly loaded */
+static int cf_loadfile(const char *filename, uint32_t *generation, int *count) {
+  struct cfdbheader hdr;
+  char *buf;
+  size_t len, pos, reclen;
+
+  buf = cf_readfile(filename, &len);
+  if (buf == NULL)
+    return 0;
+
+  memcpy(&hdr, buf, sizeof(hdr));
+
+  if (hdr.magic != CFDB_MAGIC || hdr.version != CFDB_VERSION ||
+      (generation && hdr.generation != *generation)) {
+    free(buf);
+    return 0;
+  }
+
+  if (generation == NULL)
+    cfgeneration = hdr.generation;
+
+  for (pos=sizeof(hdr);pos<len;pos+=reclen) {
+    if ((reclen = cf_loadchannel(buf + pos, len - pos, count)) == 0) {
+      Error("chanfix", ERR_WARNING, "%s is truncated or corrupt at offset %lu, ignoring the rest.", filename, (unsigned long)pos);
+      free(buf);
+      return -1;
+    }
+  }
+
+  free(buf);
+
+  return 1;
+}
+
+/* channel type hash lastopped score host */
+static int cf_parseline(char *line) {
+  chanindex *cip;
+  chanfix *cf;
+  int count;
+  char chan[CHANNELLEN+1];
+  int type, score;
+  unsigned long hash;
+  time_t lastopped;
+  char host[USERLEN+1+HOSTLEN+1];
+  regop *ro;
+
+  count = sscanf(line, "%s %d %lu %lu %d %s", chan, &type, &hash, &lastopped, &score, host);
+
+  if (count < 5)
+    return 0; /* invalid chanfix record */
+
+  cip = findorcreatechanindex(chan);
+
+  cf = cf_newchanfix(cip);
+
+  ro = (regop*)malloc(sizeof(regop));
+
+  ro->type = type;
+  ro->hash = hash;
+  ro->lastopped = lastopped;
+  ro->score = score;
+  ro->opcount = 0;
+  ro->opsince = 0;
+  ro->carry = 0;
+  ro->uh = (count > 5) ? getsstring(host, USERLEN+1+HOSTLEN) : NULL;
+
+  cf_linkregop(cf, ro);
+
+  return 1;
+}
+
+/* the text files we used to save, the next save will write CFDB_FILE */
+static int cf_loadlegacy(void) {
+  char line[4096];
+  FILE *cfdata;
+  char srcfile[300];
+  int count;
+
+  snprintf(srcfile, sizeof(srcfile), "%s.0", CFSTORAGE);
+  cfdata = fopen(srcfile, "r");
+
+  if (cfdata == NULL)
+    return 0;
+
+  count = 0;
+
+  while (!feof(cfdata)) {
+    if (fgets(line, sizeof(line), cfdata) == NULL)
+      break;
+
+    if (line[strlen(line) - 1] == '\n')
+      line[strlen(line) - 1] = '\0';
+
+    if (line[strlen(line) - 1] == '\r')
+      line[strlen(line) - 1] = '\0';
+
+    if (line[0] != '\0') {
+      if (cf_parseline(line))
+        count++;
+    }
+  }
+
+  fclose(cfdata);
+
+  cfneedfull = 1;
+
+  return count;
+}
+
+int cf_loadchanfix(void) {
+  int count = 0, ret;
+
+  cf_free();
+  cf_cleardeleted();
+
+  cfgeneration = 0;
+  cfneedfull = 0;
+  cflastfull = time(NULL);
+
+  ret = cf_loadfile(CFDB_FILE, NULL, &count);
+
+  if (ret > 0) {
+    if (cf_loadfile(CFDB_JOURNAL, &cfgeneration, &count) < 0)
+      cfneedfull = 1;
+  } else if (ret < 0) {
+    cfneedfull = 1;
+  } else {
+    count = cf_loadlegacy();
+  }
+
+  /* start scoring whoever is opped right now */
+  cf_reconcileall();
+
+  return count;
+}
@@ -17,10 +17,13 @@ void _init() {
   chanservaddcommand("dumpauthtracker",QCMD_DEV,0,at_dumpdb,"Shows servers with dangling authtracker entries.\n","");
   chanservaddcommand("delinkauthtracker",QCMD_DEV,1,at_delinkdb,"Removes a server's dangling authtracker entries (normally after delink).\n","");
   at_finddanglingsessions();
+  schedulerecurring(time(NULL)+AT_FLUSHINTERVAL, 0, AT_FLUSHINTERVAL, at_flushhistory, NULL);
 }
 
 void _fini() {
   at_hookfini();
+  deleteallschedules(at_flushhistory);
+  at_flushhistory(NULL);
   nsfreeall(POOL_AUTHTRACKER);
   
   chanservremovecommand("dumpauthtracker",at_dumpdb);
@@ -41,6 +44,7 @@ void at_dbloaded(int hooknum, void *arg) {
   if (hooknum)
     deregisterhook(HOOK_CHANSERV_RUNNING, at_dbloaded);
   
+  at_beginbatch();
   for (i=0;i<NICKHASHSIZE;i++) {
     for (np=nicktable[i];np;np=np->next) {
       at_newnick(0, np);
@@ -49,5 +53,6 @@ void at_dbloaded(int hooknum, void *arg) {
 
   Error("authtracker",ERR_INFO,"Authtracker running");
   at_flushghosts();  
+  at_endbatch();
   at_hookinit();
 }
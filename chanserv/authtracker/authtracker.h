@@ -11,10 +11,18 @@ extern DBModuleIdentifier authtrackerdb;
 #define AT_NETSPLIT	0	/* User lost in netsplit */
 #define AT_RESTART	1	/* Dangling session found at restart */
 
+#define AT_STATEMENTLEN	7680	/* pqsql formats queries into 8k */
+#define AT_BATCHROWS	200	/* Most rows in one statement */
+#define AT_FLUSHINTERVAL	1
+
+
 /* authtracker_query.c */
 void at_logquit(unsigned long userid, time_t accountts, time_t time, char *reason);
 void at_lognewsession(unsigned int userid, nick *np);
 void at_finddanglingsessions();
+void at_flushhistory(void *arg);
+void at_beginbatch();
+void at_endbatch();
 
 /* authtracker_db.c */
 void at_lostnick(unsigned int numeric, unsigned long userid, time_t accountts, time_t losttime, int reason);
@@ -27,11 +27,14 @@ struct dangling_entry {
   time_t	authts;
   time_t	losttime;
   int		reason; /* AT_NETSPLIT or AT_RESTART */
-  struct dangling_entry *next;
+  struct dangling_entry *next;   /* hash chain */
+  struct dangling_entry *snext, *sprev; /* everything on the server */
 };
 
 struct dangling_server {
   struct dangling_entry *de[DANGLING_HASHSIZE];
+  struct dangling_entry *entries;
+  unsigned int count;
 };
 
 struct dangling_server *ds[MAXSERVERS];
@@ -55,6 +58,8 @@ void at_lostnick(unsigned int numeric, unsigned long userid, time_t accountts, t
     ds[server]=nsmalloc(POOL_AUTHTRACKER, sizeof(struct dangling_server));
     for (i=0;i<DANGLING_HASHSIZE;i++)
       ds[server]->de[i]=NULL;
+    ds[server]->entries=NULL;
+    ds[server]->count=0;
   }
   
   /* Now make an entry */
@@ -66,6 +71,12 @@ void at_lostnick(unsigned int numeric, unsigned long userid, time_t accountts, t
   dep->reason=reason;
   dep->next=ds[server]->de[thehash];
   ds[server]->de[thehash]=dep;
+
+  dep->sprev=NULL;
+  if ((dep->snext=ds[server]->entries))
+    dep->snext->sprev=dep;
+  ds[server]->entries=dep;
+  ds[server]->count++;
 }
 
 /* Removes a returning user from the "dangling" tables.  Return 1 if we found it, 0 otherwise. */
@@ -83,6 +94,15 @@ int at_foundnick(unsigned int numeric, unsigned long userid, time_t accountts) {
     if ((dep->numeric == numeric) && (dep->userid==userid) && (dep->authts==accountts)) {
       /* Got it */
       *deh=dep->next;
+
+      if (dep->sprev)
+        dep->sprev->snext=dep->snext;
+      else
+        ds[server]->entries=dep->snext;
+      if (dep->snext)
+        dep->snext->sprev=dep->sprev;
+      ds[server]->count--;
+
       free_de(dep);
       return 1;
     }
@@ -95,22 +115,22 @@ int at_foundnick(unsigned int numeric, unsigned long userid, time_t accountts) {
 /* When a server is back (fully linked), any remaining dangling users on that server are definately gone. */
 /* Also called manually upon delink via command. */
 int at_serverback(unsigned int server) {
-  int i;
   struct dangling_entry *dep, *ndep;
+  time_t now=time(NULL);
   
   if (!ds[server])
     return -1;
   
-  int count = 0;
-  for (i=0;i<DANGLING_HASHSIZE;i++) {
-    for (dep=ds[server]->de[i];dep;dep=ndep) {
-      ndep=dep->next;
+  int count = ds[server]->count;
+
+  at_beginbatch();
+  for (dep=ds[server]->entries;dep;dep=ndep) {
+    ndep=dep->snext;
       
-      at_logquit(dep->userid, dep->authts, time(NULL), (dep->reason==AT_NETSPLIT)? "(netsplit)" : "(restart)");
-      free_de(dep);
-      count++;
-    }
+    at_logquit(dep->userid, dep->authts, now, (dep->reason==AT_NETSPLIT)? "(netsplit)" : "(restart)");
+    free_de(dep);
   }
+  at_endbatch();
   
   nsfree(POOL_AUTHTRACKER, ds[server]);
   ds[server]=NULL;
@@ -128,19 +148,11 @@ void at_flushghosts() {
 
 int at_dumpdb(void *source, int argc, char **argv) {
   nick *np=source;
-  struct dangling_entry *dep;
-  unsigned int i,j,k;
+  unsigned int i;
   
   for(i=0;i<MAXSERVERS;i++) {
-    if (ds[i]) {
-      k=0;
-      for(j=0;j<DANGLING_HASHSIZE;j++) {
-        for (dep=ds[i]->de[j];dep;dep=dep->next) {
-          k++;
-        }
-      }
-      chanservsendmessage(np, "Server %d (%s) has %d entries.",i,longtonumeric(i,2),k);
-    }
+    if (ds[i])
+      chanservsendmessage(np, "Server %d (%s) has %d entries.",i,longtonumeric(i,2),ds[i]->count);
   }
 
   chanservstdmessage(np,QM_ENDOFLIST);
@@ -9,30 +9,120 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Quits and new sessions are collected into multi-row statements and
+ * sent when a statement is full, when the other kind comes along (so a
+ * session is always inserted before it is closed, and closed before a
+ * new one for the same auth goes in), or every AT_FLUSHINTERVAL.
+ * at_beginbatch()/at_endbatch() put a burst of them in one transaction.
+ *
+ * UPDATE ... FROM (VALUES ...) is PostgreSQL only, on anything else each
+ * quit goes straight out as its own UPDATE.
+ */
+#if defined(USE_DBAPI_PGSQL) || defined(DBAPI_OVERRIDE_PGSQL)
+#define AT_BATCHQUITS
+#endif
+
+static char quitrows[AT_STATEMENTLEN], sessionrows[AT_STATEMENTLEN];
+static size_t quitlen, sessionlen;
+static unsigned int quitcount, sessioncount;
+static int batchdepth;
+
+static void at_flushquits() {
+  if (!quitlen)
+    return;
+
+  dbquery("UPDATE chanserv.authhistory AS a SET disconnecttime=v.disconnecttime, quitreason=v.quitreason "
+          "FROM (VALUES %s) AS v(userID, authtime, disconnecttime, quitreason) "
+          "WHERE a.userID=v.userID AND a.authtime=v.authtime", quitrows);
+  quitlen=0;
+  quitcount=0;
+}
+
+static void at_flushsessions() {
+  if (!sessionlen)
+    return;
+
+  dbquery("INSERT INTO chanserv.authhistory (userID, nick, username, host, authtime, disconnecttime, numeric) "
+          "VALUES %s", sessionrows);
+  sessionlen=0;
+  sessioncount=0;
+}
+
+static void at_addrow(char *rows, size_t *len, unsigned int *count, void (*flush)(), const char *row, size_t rowlen) {
+  if (*len && (*len+rowlen+2>AT_STATEMENTLEN || *count>=AT_BATCHROWS))
+    flush();
+
+  if (*len)
+    rows[(*len)++]=',';
+
+  memcpy(rows+*len, row, rowlen+1);
+  *len+=rowlen;
+  (*count)++;
+}
+
+void at_flushhistory(void *arg) {
+  at_flushsessions();
+  at_flushquits();
+}
+
+void at_beginbatch() {
+  if (batchdepth++)
+    return;
+
+  at_flushhistory(NULL);
+  dbquery("BEGIN TRANSACTION;");
+}
+
+void at_endbatch() {
+  if (--batchdepth)
+    return;
+
+  at_flushhistory(NULL);
+  dbquery("COMMIT;");
+}
  
 void at_logquit(unsigned long userid, time_t accountts, time_t when, char *reason) {
   char lreason[100], escreason[205];
+#ifdef AT_BATCHQUITS
+  char row[300];
+  int rowlen;
+#endif
+
   strncpy(lreason,reason,99);
   lreason[99]='\0';
 
   dbescapestring(escreason, lreason, strlen(lreason));
 
+  at_flushsessions();
+
+#ifdef AT_BATCHQUITS
+  rowlen=snprintf(row, sizeof(row), "(%lu,%lu,%lu,'%s')", userid, accountts, when, escreason);
+  at_addrow(quitrows, &quitlen, &quitcount, at_flushquits, row, rowlen);
+#else
   dbquery("UPDATE chanserv.authhistory SET disconnecttime=%lu, quitreason='%s' WHERE userID=%lu AND authtime=%lu",
-              when, escreason, userid, accountts);
+          when, escreason, userid, accountts);
+#endif
 }
 
 void at_lognewsession(unsigned int userid, nick *np) {
   char escnick[NICKLEN*2+1];
   char escuser[USERLEN*2+1];
   char eschost[HOSTLEN*2+1];
+  char row[NICKLEN*2+USERLEN*2+HOSTLEN*2+100];
+  int rowlen;
 
   dbescapestring(escnick, np->nick, strlen(np->nick));
   dbescapestring(escuser, np->ident, strlen(np->ident));
   dbescapestring(eschost, np->host->name->content, np->host->name->length);
 
-  dbquery("INSERT INTO chanserv.authhistory (userID, nick, username, host, authtime, disconnecttime, numeric) "
-    "VALUES (%u, '%s', '%s', '%s', %lu, %lu, %lu)",
+  at_flushquits();
+
+  rowlen=snprintf(row, sizeof(row), "(%u,'%s','%s','%s',%lu,%lu,%lu)",
     userid, escnick, escuser, eschost, np->accountts, 0UL, np->numeric);
+  at_addrow(sessionrows, &sessionlen, &sessioncount, at_flushsessions, row, rowlen);
 }
 
 static void real_at_finddanglingsessions(DBConn *dbconn, void *arg) {
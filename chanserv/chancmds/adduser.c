@@ -33,7 +33,7 @@
 int csc_doadduser(void *source, int cargc, char **cargv) {
   nick *sender=source;
   chanindex *cip;
-  regchanuser *rcup, *trcup, *rcuplist;
+  regchanuser *rcup, *trcup;
   regchan *rcp;
   reguser *rup;
   flag_t addflags;
@@ -81,10 +81,7 @@ int csc_doadduser(void *source, int cargc, char **cargv) {
 
   flagbuf=printflags(addflags, rcuflags);  
 
-  /* ugh */
-  for (chanlevcount=i=0;i<REGCHANUSERHASHSIZE;i++)
-    for (rcuplist=rcp->regusers[i];rcuplist;rcuplist=rcuplist->nextbychan)
-      chanlevcount++;
+  chanlevcount=rcp->regusercount;
 
   /* If we found flags don't try to add them as a user as well.. */
   for (i=1+foundflags;i<cargc;i++) {
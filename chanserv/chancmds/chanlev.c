@@ -168,16 +168,13 @@ int csc_dochanlev(void *source, int cargc, char **cargv) {
     if (rcp->comment && (cs_privcheck(QPRIV_VIEWCOMMENTS, sender)))
       chanservstdmessage(sender, QM_SHORT_COMMENT, rcp->comment->content);
 
-    /* Count users */
-    for (i=0,usercount=0;i<REGCHANUSERHASHSIZE;i++)
-      for (rcuplist=rcp->regusers[i];rcuplist;rcuplist=rcuplist->nextbychan)
-        usercount++;
+    usercount=rcp->regusercount;
     
     /* Allocate array */
     rusers=(regchanuser **)malloc(usercount * sizeof(regchanuser *));
 
     /* Fill array */
-    for (j=i=0;i<REGCHANUSERHASHSIZE;i++) {
+    for (j=i=0;i<rcp->regusersize;i++) {
       for (rcuplist=rcp->regusers[i];rcuplist;rcuplist=rcuplist->nextbychan) {
         if (!(flags=rcuplist->flags & flagmask))
           continue;
@@ -266,12 +263,8 @@ int csc_dochanlev(void *source, int cargc, char **cargv) {
       }
       
       if (!rcuplist) {
-        /* new user, we could store a count instead... that's probably better... */
-        unsigned int chanlevcount, channelcount;
-
-        for (chanlevcount=i=0;i<REGCHANUSERHASHSIZE;i++)
-          for (rcuplist=rcp->regusers[i];rcuplist;rcuplist=rcuplist->nextbychan)
-            chanlevcount++;
+        /* new user */
+        unsigned int chanlevcount=rcp->regusercount, channelcount;
 
         if(chanlevcount >= MAXCHANLEVS) {
           chanservstdmessage(sender, QM_TOOMANYCHANLEVS);
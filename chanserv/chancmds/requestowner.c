@@ -53,7 +53,7 @@ int csc_dorequestowner(void *source, int cargc, char **cargv) {
   if (!requester || !rcp)
     return CMD_ERROR;
 
-  for(i=0;i<REGCHANUSERHASHSIZE;i++) {
+  for(i=0;i<rcp->regusersize;i++) {
     for(rcup=rcp->regusers[i];rcup;rcup=rcup->nextbychan) {
       if (CUIsOwner(rcup) ||
          (CUIsMaster(rcup) && !CUHasMasterPriv(requester)) ||
@@ -85,7 +85,9 @@ void chanservfinishinit(int hooknum, void *arg) {
   
   /* Schedule the dumps */
   schedulerecurring(time(NULL)+DUMPINTERVAL,0,DUMPINTERVAL,chanservdumpstuff,NULL);
-  schedulerecurring(time(NULL)+5,0,5,csdb_flushchannelcounters,NULL);
+  schedulerecurring(time(NULL)+CSDB_FLUSHINTERVAL,0,CSDB_FLUSHINTERVAL,csdb_flushupdates,NULL);
+  cs_sweeprestore();
+  schedulerecurring(time(NULL)+1,0,1,cs_sweepchannels,NULL);
 
   chanserv_init_status = CS_INIT_NOUSER;
 
@@ -128,16 +130,17 @@ void chanserv_finalinit() {
 }
 
 void _fini() {
-  csdb_flushchannelcounters(NULL);
+  csdb_flushupdates(NULL);
 
   dbfreeid(q9dbid);
 
   deleteallschedules(cs_hourlyfunc);
-  deleteallschedules(cs_timerfunc);
+  deleteallschedules(cs_sweepchannels);
+  cs_sweepclear();
   deleteallschedules(chanservreguser);
   deleteallschedules(chanservdumpstuff);
   deleteallschedules(chanservdgline);
-  deleteallschedules(csdb_flushchannelcounters);
+  deleteallschedules(csdb_flushupdates);
 
   if (chanservext>-1 && chanservnext>-1 && chanservaext>-1) {
     int i;
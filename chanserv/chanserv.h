@@ -58,8 +58,9 @@
 #endif
 
 /* Mini-hash of known users on channels to make lookups faster;
- * how big do we make it?  */
+ * how big does it start and how full do we let it get before it grows?  */
 #define   REGCHANUSERHASHSIZE 5
+#define   REGCHANUSERHASHLOAD 2
 #define   PASSLEN             10
 #define   WELCOMELEN          250
 #define   INFOLEN             100
@@ -67,6 +68,8 @@
 #define   COUNTERSYNCINTERVAL 600
 #define   LINGERTIME          300
 #define   DUMPINTERVAL        300
+#define   CS_SWEEPBUCKETS     1024     /* Channel sweeper buckets, one per second */
+#define   CS_SWEEPBATCH       1000     /* Most channels checked per sweep */
 #define   EMAILLEN            60
 #define   CHANTYPES           9
 #define   CHANOPHISTORY       10
@@ -102,6 +105,16 @@
 
 #define CLEANUP_MIN_CHAN_SIZE     2
 
+/* Database snapshot: how often to write it and how old it can be before we do a full load */
+#define CSDB_SNAPSHOTINTERVAL  3600
+#define CSDB_SNAPSHOTMAXAGE    (86400*7)
+#define CSDB_SNAPSHOTMAXXIDS   20000000 /* well inside vacuum_freeze_min_age */
+
+/* Write-behind of row updates: how often, how many, how many per transaction */
+#define CSDB_FLUSHINTERVAL     5
+#define CSDB_FLUSHMAX          2000
+#define CSDB_FLUSHBATCH        500
+
 /* Sizes of the main hashes */
 #define   REGUSERHASHSIZE     60000
 #define   MAILDOMAINHASHSIZE  60000
@@ -552,9 +565,14 @@ typedef struct regchan {
   sstring            *suspendreason;   /* Suspend reason */
   sstring            *comment;         /* Oper-settable channel comment */
 
-  void               *checksched;      /* Handle for channel check schedule */
+  time_t              checktime;       /* When the sweeper next runs cs_timerfunc */
+  struct regchan     *checknext;       /* Sweeper bucket list */
+  struct regchan    **checkprev;       /* NULL if not in a bucket */
 
-  struct regchanuser *regusers[REGCHANUSERHASHSIZE];
+  struct regchanuser **regusers;       /* Chanlev hash, regusersize buckets */
+  unsigned int        regusersize;
+  unsigned int        regusercount;    /* Entries in the chanlev */
+  struct regchanuser *reguserinline[REGCHANUSERHASHSIZE]; /* Buckets until it grows */
   struct regban      *bans;            /* List of bans on the channel */
   
   char                chanopnicks[CHANOPHISTORY][NICKLEN+1];  /* Last CHANOPHISTORY ppl to get ops */
@@ -632,6 +650,18 @@ typedef struct cslang {
   sstring *name;
 } cslang;
 
+/* A message split up at load time into literal text and $n arguments */
+typedef struct q9segment {
+  const char *text;    /* NULL for an argument */
+  unsigned int len;
+  unsigned int arg;
+} q9segment;
+
+typedef struct q9template {
+  unsigned int segments;
+  q9segment segment[];
+} q9template;
+
 typedef struct cmdsummary {
   sstring *def;
   sstring *bylang[MAXLANG];
@@ -738,6 +768,8 @@ extern cslang *cslanguages[MAXLANG];
 extern unsigned int cslangcount;
 
 extern sstring *csmessages[MAXLANG][MAXMESSAGES];
+extern q9template *cstemplates[MAXLANG][MAXMESSAGES];
+extern q9template *csdefaulttemplates[MAXMESSAGES];
 
 extern const flag rcflags[];
 extern const flag rcuflags[];
@@ -784,6 +816,7 @@ void addregchantohash(regchan *rcp);
 regchan *findregchanbyID(unsigned int ID);
 regchan *findregchanbyname(const char *name);
 void removeregchanfromhash(regchan *rcp);
+void initregchanuserhash(regchan *rcp);
 void addregusertochannel(regchanuser *rcup);
 regchanuser *findreguseronchannel(regchan *rcp, reguser *rup);
 void delreguserfromchannel(regchan *rcp, reguser *rup);
@@ -823,7 +856,33 @@ void csdb_updateban(regchan *rcp, regban *rbp);
 char *csdb_gethelpstr(char *command, int language);
 void csdb_createmail(reguser *rup, int type);
 void csdb_dohelp(nick *np, Command *cmd);
-void csdb_flushchannelcounters(void *arg);
+void csdb_linkmaildomain(reguser *rup);
+void csdb_initregchan(regchan *rcp, time_t now);
+
+/* chanservdb_writebehind.c */
+#define CSDB_USER          0
+#define CSDB_CHANNEL       1
+#define CSDB_CHANUSER      2 /* ID1 is the channel, ID2 the user */
+
+#define CSDB_COLS_ALL      0
+#define CSDB_COLS_AUTH     1
+#define CSDB_COLS_TOPIC    2
+#define CSDB_COLS_COUNTERS 3
+#define CSDB_COLS_TS       4
+#define CSDB_COLS_USETIME  5
+
+#define CSDB_ANYID         ((unsigned int)-1)
+
+void csdb_deferupdate(int table, unsigned int ID1, unsigned int ID2, int columns, char *format, ...) __attribute__ ((format (printf, 5, 6)));
+void csdb_dropupdates(int table, unsigned int ID1, unsigned int ID2);
+void csdb_flushupdates(void *arg);
+void csdb_writebehindstats(long level);
+
+/* chanservdb_snapshot.c */
+int csdb_loadsnapshot(unsigned long long txid, unsigned long long marker);
+void csdb_reconcilesnapshot(void);
+void csdb_snapshotloadcomplete(void);
+void csdb_closesnapshot(void);
 
 #define q9asyncquery(handler, tag, format, ...) dbasyncqueryi(q9dbid, handler, tag, format , ##__VA_ARGS__)
 #define q9a_asyncquery(handler, tag, format, ...) dbasyncqueryi(q9adbid, handler, tag, format , ##__VA_ARGS__)
@@ -871,6 +930,9 @@ void cs_docheckopvoice(channel *cp, modechanges *changes);
 void cs_checkbans(channel *cp);
 void cs_schedupdate(chanindex *cip, int mintime, int maxtime);
 void cs_timerfunc(void *arg);
+void cs_sweepchannels(void *arg);
+void cs_sweepclear();
+void cs_sweeprestore();
 void cs_removechannel(regchan *rcp, char *reason);
 int cs_removechannelifempty(nick *sender, regchan *rcp);
 void cs_doallautomodes(nick *np);
@@ -917,14 +979,46 @@ int cs_ischannelactive(channel *cp, regchan *rcp);
 
 /* chanservmessages.c */
 void initmessages();
+void finimessages();
+q9template *q9compile(const char *format);
 
 /* chanservprivs.c */
 int cs_privcheck(int privnum, nick *np);
 chanindex *cs_checkaccess(nick *np, const char *chan, unsigned int flags, chanindex *cip, const char *cmdname, int priv, int quiet);
 
 /* chanservlog.c */
+
+/*
+ * The log is written as one segment per (UTC) day, chanservlog.YYYYMMDD,
+ * with an index alongside: one cslogblock for every CSLOG_BLOCKSIZE or so
+ * of log, giving the time range and a bloom filter of the (lowercased)
+ * trigrams in that block.  The end of the log past the last block isn't
+ * indexed yet.
+ */
+#define CSLOG_PREFIX        "chanservlog."
+#define CSLOG_INDEXSUFFIX   ".idx"
+#define CSLOG_BLOCKSIZE     16384
+#define CSLOG_BLOOMSHIFT    13
+#define CSLOG_BLOOMBITS     (1<<CSLOG_BLOOMSHIFT)
+#define CSLOG_INDEXMAGIC    0x43534c49 /* "CSLI" */
+#define CSLOG_INDEXVERSION  1
+
+typedef struct cslogindexheader {
+  uint32_t magic, version, blocksize, bloombits;
+} cslogindexheader;
+
+typedef struct cslogblock {
+  uint64_t offset;
+  uint32_t length, pad;
+  int64_t firsttime, lasttime; /* 0 if not known */
+  unsigned char bloom[CSLOG_BLOOMBITS/8];
+} cslogblock;
+
 void cs_initlog();
 void cs_closelog();
+void cslog_segmentname(char *buf, size_t len, const char *day, int index);
+void cslog_bloomadd(unsigned char *bloom, const char *text, size_t len);
+int cslog_bloomcheck(const unsigned char *bloom, const char *text, size_t len);
 void cs_log(nick *np, char *event, ...) __attribute__ ((format (printf, 2, 3)));
 
 /* chanservdump.c */
@@ -966,6 +1060,8 @@ void csdb_updatemaillock(maillock *mlp);
 void q9snprintf(char *buf, size_t size, const char *format, const char *args, ...);
 void q9vsnprintf(char *buf, size_t size, const char *format, const char *args, va_list ap);
 void q9strftime(char *buf, size_t size, time_t t);
+typedef void (*Q9LineCallback)(void *arg, char *line);
+void q9vsendlines(const q9template *tp, const char *args, int maxlinelen, Q9LineCallback fn, void *arg, va_list ap);
 
 /* chanserv_flags.c */
 u_int64_t cs_accountflagmap(reguser *rup);
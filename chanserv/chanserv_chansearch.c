@@ -39,7 +39,7 @@ int cs_cschanlevsizeexe(chanindex *cip, void *arg) {
     return 1;
   
   j=0;
-  for (i=0;i<REGCHANUSERHASHSIZE;i++) {
+  for (i=0;i<rcp->regusersize;i++) {
     for (rcup=rcp->regusers[i];rcup;rcup=rcup->nextbychan) {
       j++;
       if (j>=minlength)
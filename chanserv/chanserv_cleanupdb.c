@@ -2,18 +2,42 @@
 #include "../lib/irc_string.h"
 #include "../lib/version.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 MODULE_VERSION(QVERSION);
 
+#define CLEANUP_SLICE           10000 /* records scanned per second */
+#define CLEANUP_REPORTINTERVAL  60    /* how often the requester hears how it's going */
+
+#define CLEANUP_IDLE      0
+#define CLEANUP_HISTORY   1
+#define CLEANUP_USERS     2
+#define CLEANUP_CHANNELS  3
+
 static void cleanupdb(void *arg);
+static void cleanupdb_slice(void *arg);
+static void cleanupdb_finish();
 static void schedulecleanup(int hooknum, void *arg);
 
-static unsigned int cleanupdb_active;
+/* The cleanup in progress, the phase number is what gets reported */
+static struct {
+  int phase;
+  int bucket;                  /* hash bucket the scan has got to */
+  unsigned int *activeids;     /* sorted userIDs with recent sessions */
+  unsigned int activecount;
+  time_t to_age, unused_age, maxchan_age, authhistory_age;
+  time_t started, phasestarted, lastreport;
+  unsigned long requester;     /* numeric of the oper who started it */
+  int expired, unauthed, chansvaped, chansempty;
+} cj;
+
 static DBModuleIdentifier q9cleanupdbid;
 
 void _init() {
-  q9cleanupdbid = dbgetid();
+  /* everything sent through this is self-contained, so the hours long
+     authhistory scan can sit on its own connection */
+  q9cleanupdbid = dbgetpooledid();
 
   registerhook(HOOK_CHANSERV_DBLOADED, schedulecleanup);
 
@@ -23,6 +47,7 @@ void _init() {
 
 void _fini() {
   deleteallschedules(cleanupdb);
+  cleanupdb_finish();
   dbfreeid(q9cleanupdbid);
 }
 
@@ -50,59 +75,68 @@ static void cleanuplog(char *format, ...) {
   chanservwallmessage("CLEANUPDB: %s", buf);
 }
 
-static void cleanupdb_real(DBConn *dbconn, void *arg) {
-  reguser *vrup, *srup, *founder;
-  regchanuser *rcup, *nrcup;
-  authname *anp;
-  int i,j;
-  time_t t, to_age, unused_age, maxchan_age, authhistory_age;
-  int expired = 0, unauthed = 0, chansvaped = 0, chansempty = 0;
-  chanindex *cip, *ncip;
-  regchan *rcp;
-  DBResult *pgres;
-  unsigned int themarker;
-  unsigned int id;
-  
-  t = time(NULL);
-  to_age = t - (CLEANUP_ACCOUNT_INACTIVE * 3600 * 24);  
-  unused_age = t - (CLEANUP_ACCOUNT_UNUSED * 3600 * 24);
-  maxchan_age = t - (CLEANUP_CHANNEL_INACTIVE * 3600 * 24);
-  authhistory_age = t - (CLEANUP_AUTHHISTORY * 3600 * 24);
+static int compareid(const void *a, const void *b) {
+  unsigned int x=*(const unsigned int *)a, y=*(const unsigned int *)b;
 
-  themarker=nextauthnamemarker();
-  
-  if (!dbconn) {
-    cleanuplog("No DB connection, aborting.");
-    goto out;
-  }
+  return (x>y)-(x<y);
+}
 
-  pgres=dbgetresult(dbconn);
-  
-  if (!dbquerysuccessful(pgres)) {
-    cleanuplog("DB error, aborting.");
-    goto out;
-  }
-  
-  while (dbfetchrow(pgres)) {
-    id=strtoul(dbgetvalue(pgres, 0), NULL, 10);
-    anp=findauthname(id);
-    if (anp)
-      anp->marker=themarker;
-  }
-  
-  dbclear(pgres);
+static int recentlyactive(unsigned int id) {
+  return cj.activeids && bsearch(&id, cj.activeids, cj.activecount, sizeof(unsigned int), compareid);
+}
+
+static void cleanupdb_finish() {
+  deleteallschedules(cleanupdb_slice);
+  free(cj.activeids);
+  cj.activeids=NULL;
+  cj.phase=CLEANUP_IDLE;
+}
+
+/* Tells whoever asked for the cleanup how far it's got */
+static void cleanupdb_progress(int bucket, int buckets) {
+  nick *np;
+  time_t now=time(NULL), eta;
+
+  if (!cj.requester || now-cj.lastreport<CLEANUP_REPORTINTERVAL)
+    return;
+
+  cj.lastreport=now;
+
+  if (!(np=getnickbynumeric(cj.requester)))
+    return;
+
+  if (bucket)
+    eta=(now-cj.phasestarted)*(buckets-bucket)/bucket;
+  else
+    eta=0;
+
+  chanservsendmessage(np, "CLEANUPDB: phase %d %d%% done, about %lds to go for this phase.",
+                      cj.phase, bucket*100/buckets, (long)eta);
+}
+
+static void cleanupdb_startphase(int phase) {
+  cj.phase=phase;
+  cj.bucket=0;
+  cj.phasestarted=time(NULL);
+}
 
-  cleanuplog("Phase 1 complete, starting phase 2 (regusers scan)...");
+/* Scans up to CLEANUP_SLICE regusers from the cursor, returns 1 when they're all done */
+static int cleanupdb_users() {
+  reguser *vrup, *srup;
+  authname *anp;
+  unsigned int scanned=0;
 
-  for (i=0;i<REGUSERHASHSIZE;i++) {
-    for (vrup=regusernicktable[i]; vrup; vrup=srup) {
+  for (;cj.bucket<REGUSERHASHSIZE && scanned<CLEANUP_SLICE;cj.bucket++) {
+    for (vrup=regusernicktable[cj.bucket]; vrup; vrup=srup) {
       srup=vrup->nextbyname;
+      scanned++;
+
       if (!(anp=findauthname(vrup->ID)))
         continue; /* should maybe raise hell instead */
 
-      /* If this user has the right marker, this means the authtracker data
-       * indicates that they have been active recently */
-      if (anp->marker == themarker)
+      /* If the authtracker data says this user has been active recently,
+       * leave them alone */
+      if (recentlyactive(vrup->ID))
         continue;
 
       /* HACK: don't ever delete the last user -- prevents userids being reused */
@@ -110,11 +144,11 @@ static void cleanupdb_real(DBConn *dbconn, void *arg) {
         continue;
 
       if(!anp->nicks && !UHasStaffPriv(vrup) && !UIsCleanupExempt(vrup)) {
-        if(vrup->lastauth && (vrup->lastauth < to_age)) {
-          expired++;
+        if(vrup->lastauth && (vrup->lastauth < cj.to_age)) {
+          cj.expired++;
           cs_log(NULL, "CLEANUPDB inactive user %s %u", vrup->username, vrup->ID);
-        } else if(!vrup->lastauth && (vrup->created < unused_age)) {
-          unauthed++;
+        } else if(!vrup->lastauth && (vrup->created < cj.unused_age)) {
+          cj.unauthed++;
           cs_log(NULL, "CLEANUPDB unused user %s %u", vrup->username, vrup->ID);
         } else {
           continue;
@@ -125,14 +159,28 @@ static void cleanupdb_real(DBConn *dbconn, void *arg) {
     }
   }
 
-  cleanuplog("Phase 2 complete, starting phase 3 (chanindex scan)...");
-    
-  for (i=0;i<CHANNELHASHSIZE;i++) {
-    for (cip=chantable[i];cip;cip=ncip) {
+  cleanupdb_progress(cj.bucket, REGUSERHASHSIZE);
+
+  return cj.bucket>=REGUSERHASHSIZE;
+}
+
+/* Scans up to CLEANUP_SLICE channels from the cursor, returns 1 when they're all done */
+static int cleanupdb_channels() {
+  reguser *founder;
+  regchanuser *rcup, *nrcup;
+  chanindex *cip, *ncip;
+  regchan *rcp;
+  unsigned int scanned=0;
+  int j;
+
+  for (;cj.bucket<CHANNELHASHSIZE && scanned<CLEANUP_SLICE;cj.bucket++) {
+    for (cip=chantable[cj.bucket];cip;cip=ncip) {
       ncip=cip->next;
       if (!(rcp=cip->exts[chanservext]))
         continue;
 
+      scanned++;
+
       /* HACK: don't ever delete the last channel -- prevents channelids being reused */
       if (rcp->ID == lastchannelID)
         continue;
@@ -155,7 +203,7 @@ static void cleanupdb_real(DBConn *dbconn, void *arg) {
       }
 */
 
-      if(rcp->lastactive < maxchan_age) {
+      if(rcp->lastactive < cj.maxchan_age) {
         /* don't remove channels with the original founder as an oper */
         founder=findreguserbyID(rcp->founder);
         if(founder && UHasOperPriv(founder))
@@ -163,12 +211,12 @@ static void cleanupdb_real(DBConn *dbconn, void *arg) {
 
         cs_log(NULL, "CLEANUPDB inactive channel %s", cip->name?cip->name->content:"??");
         cs_removechannel(rcp, "Channel deleted due to lack of activity.");
-        chansvaped++;
+        cj.chansvaped++;
         continue;
       }
       
       /* Get rid of any dead chanlev entries */
-      for (j=0;j<REGCHANUSERHASHSIZE;j++) {
+      for (j=0;j<rcp->regusersize;j++) {
         for (rcup=rcp->regusers[j];rcup;rcup=nrcup) {
           nrcup=rcup->nextbychan;
           
@@ -183,20 +231,102 @@ static void cleanupdb_real(DBConn *dbconn, void *arg) {
 
       if (cs_removechannelifempty(NULL, rcp)) {
         /* logged+parted by cs_removechannelifempty */
-        chansempty++;
+        cj.chansempty++;
         continue;
       }
     }
   }
-  
-  cleanuplog("Phase 3 complete, starting phase 4 (history database cleanup) -- runs in the background.");
+
+  cleanupdb_progress(cj.bucket, CHANNELHASHSIZE);
+
+  return cj.bucket>=CHANNELHASHSIZE;
+}
+
+/*
+ * cleanupdb_slice:
+ *  Does the next CLEANUP_SLICE or so records, with the deletes they cause
+ *  in one transaction.
+ */
+static void cleanupdb_slice(void *arg) {
+  int phasedone;
+
+  dbquery("BEGIN TRANSACTION;");
+  phasedone=(cj.phase==CLEANUP_USERS)?cleanupdb_users():cleanupdb_channels();
+  dbquery("COMMIT;");
+
+  if (!phasedone)
+    return;
+
+  if (cj.phase==CLEANUP_USERS) {
+    cleanuplog("Phase 2 complete (%lds), starting phase 3 (chanindex scan)...", (long)(time(NULL)-cj.phasestarted));
+    cleanupdb_startphase(CLEANUP_CHANNELS);
+    return;
+  }
+
+  cleanuplog("Phase 3 complete (%lds), starting phase 4 (history database cleanup) -- runs in the background.", (long)(time(NULL)-cj.phasestarted));
     
-  csdb_cleanuphistories(authhistory_age);
+  csdb_cleanuphistories(cj.authhistory_age);
   
-  cleanuplog("Stats: %d accounts inactive for %d days, %d accounts weren't used within %d days, %d channels were inactive for %d days, %d channels empty.", expired, CLEANUP_ACCOUNT_INACTIVE, unauthed, CLEANUP_ACCOUNT_UNUSED, chansvaped, CLEANUP_CHANNEL_INACTIVE, chansempty);
+  cleanuplog("Stats: %d accounts inactive for %d days, %d accounts weren't used within %d days, %d channels were inactive for %d days, %d channels empty.", cj.expired, CLEANUP_ACCOUNT_INACTIVE, cj.unauthed, CLEANUP_ACCOUNT_UNUSED, cj.chansvaped, CLEANUP_CHANNEL_INACTIVE, cj.chansempty);
+  cleanuplog("Finished in %lds.", (long)(time(NULL)-cj.started));
 
-out:
-  cleanupdb_active=0;
+  cleanupdb_finish();
+}
+
+static void cleanupdb_real(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+  unsigned int *ids;
+  unsigned int size=0;
+  time_t t;
+  
+  t = time(NULL);
+  cj.to_age = t - (CLEANUP_ACCOUNT_INACTIVE * 3600 * 24);  
+  cj.unused_age = t - (CLEANUP_ACCOUNT_UNUSED * 3600 * 24);
+  cj.maxchan_age = t - (CLEANUP_CHANNEL_INACTIVE * 3600 * 24);
+  cj.authhistory_age = t - (CLEANUP_AUTHHISTORY * 3600 * 24);
+  cj.expired=cj.unauthed=cj.chansvaped=cj.chansempty=0;
+  cj.activecount=0;
+
+  if (!dbconn) {
+    cleanuplog("No DB connection, aborting.");
+    cleanupdb_finish();
+    return;
+  }
+
+  pgres=dbgetresult(dbconn);
+  
+  if (!dbquerysuccessful(pgres)) {
+    cleanuplog("DB error, aborting.");
+    cleanupdb_finish();
+    return;
+  }
+  
+  /* Keep our own list of recently active users: authname markers can't
+   * be held across the slices as other code uses them too. */
+  while (dbfetchrow(pgres)) {
+    if (cj.activecount==size) {
+      size=size?size*2:65536;
+      if (!(ids=realloc(cj.activeids, size*sizeof(unsigned int)))) {
+        dbclear(pgres);
+        cleanuplog("Out of memory, aborting.");
+        cleanupdb_finish();
+        return;
+      }
+      cj.activeids=ids;
+    }
+
+    cj.activeids[cj.activecount++]=strtoul(dbgetvalue(pgres, 0), NULL, 10);
+  }
+  
+  dbclear(pgres);
+
+  if (cj.activecount)
+    qsort(cj.activeids, cj.activecount, sizeof(unsigned int), compareid);
+
+  cleanuplog("Phase 1 complete (%u active users), starting phase 2 (regusers scan)...", cj.activecount);
+
+  cleanupdb_startphase(CLEANUP_USERS);
+  schedulerecurring(time(NULL)+1, 0, 1, cleanupdb_slice, NULL);
 }
 
 void cs_cleanupdb(nick *np) {
@@ -215,24 +345,29 @@ static void cleanupdb(void *arg) {
     cleanuplog("Automatically started.");
   }
 
-  if (cleanupdb_active) {
+  if (cj.phase!=CLEANUP_IDLE) {
     cleanuplog("ABORTED! Cleanup already in progress! BUG BUG BUG!");
     return;
   }
 
+  cj.started=time(NULL);
+  cj.lastreport=cj.started;
+  cj.requester=np?np->numeric:0;
+
   cleanuplog("Phase 1 started (auth history data retrieval)...");
   
   /* This query returns a single column containing the userids of all users
    * who have active sessions now, or sessions which ended in the last
    * CLEANUP_ACCOUNT_INACTIVE days.  */
 
-  dbquery("BEGIN TRANSACTION;");
+  /* all on our own id, the SET LOCAL has to be on the same connection as the SELECT */
+  q9cleanup_asyncquery(NULL, NULL, "BEGIN TRANSACTION;");
 
   /* increase memory for aggregate (GROUP BY) -- query can take hours if this spills to disk */
-  dbquery("SET LOCAL work_mem = '512MB';");
+  q9cleanup_asyncquery(NULL, NULL, "SET LOCAL work_mem = '512MB';");
   q9cleanup_asyncquery(cleanupdb_real, NULL,
     "SELECT userID from chanserv.authhistory WHERE disconnecttime=0 OR disconnecttime > %d GROUP BY userID;", to_age);
-  dbquery("COMMIT;");
+  q9cleanup_asyncquery(NULL, NULL, "COMMIT;");
 
-  cleanupdb_active=1;
+  cj.phase=CLEANUP_HISTORY;
 }
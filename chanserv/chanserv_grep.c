@@ -1,46 +1,68 @@
+#define _GNU_SOURCE
 
 #include "chanserv.h"
 #include "../core/events.h"
 #include "../lib/irc_string.h"
+#include "../lib/acmatch.h"
 #include <pcre.h>
 #include <sys/poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <unistd.h>
 #include "../lib/version.h"
 
 MODULE_VERSION(QVERSION)
 
-#define CSG_BUFSIZE    1024
 #define CSG_MAXSTARTPOINT    30
+#define CSG_BLOCKSPEREVENT   32    /* index blocks searched each time round */
+#define CSG_LEGACYLOG        "chanservlog" /* logs from before segments, .N are older */
+
+/* A log to search, legacy logs have no day and no index */
+typedef struct csgsegment {
+  char filename[64];
+  char day[9];
+  long legacy;                     /* N of chanservlog.N, 0 for chanservlog */
+} csgsegment;
 
 pcre           *csg_curpat;        /* Compiled pattern from pcre */
-int             csg_curfile;       /* Which logfile is being searched */
 unsigned long   csg_curnum;        /* What numeric is doing a search */
 int             csg_matches;       /* How many lines have been returned so far */
 int             csg_maxmatches=0;  /* How many matches are allowed */
-int		csg_direction;     /* Log direction (0 = forward, 1 = reverse) */
-int		csg_bytesread;
 
-char            csg_readbuf[CSG_BUFSIZE];  /* Buffer */
-int             csg_bytesleft;     /* How much valid data there is in the buffer */
+char            csg_literal[AC_MAXLITERAL+1]; /* text every match must contain */
+size_t          csg_literallen;
+
+csgsegment     *csg_segs;          /* Segments to search, in order */
+int             csg_nsegs;
+int             csg_curseg;
+
+/* Segment being searched */
+int             csg_fd=-1;
+char           *csg_map;
+size_t          csg_mapsize;
+cslogblock     *csg_blocks;
+unsigned int    csg_nblocks;
+unsigned int    csg_curblock;      /* csg_nblocks means the unindexed tail */
+size_t          csg_tailpos;       /* how far through the tail we are */
+
+/* stats for the end of the search */
+unsigned int    csg_blocksread, csg_blocksskipped;
 
 void csg_handleevents(int fd, short revents);
 int csg_dogrep(void *source, int cargc, char **cargv);
 int csg_dorgrep(void *source, int cargc, char **cargv);
-int csg_execgrep(nick *sender, char *pattern);
-
-#if !defined(pread)
-extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
-#endif
+int csg_execgrep(nick *sender, char *pattern, int direction, int days);
 
 void _init() {
-  chanservaddcommand("grep",   QCMD_OPER, 1, csg_dogrep,   "Searches the logs.","Usage: GREP <regex>\nSearches the logs.  The current logfile will be specified first, followed by\nall older logfiles found.  This will shuffle the order of results slightly.  Where:\nregex  - regular expression to search for.\nNote: For a case insensitive search, prepend (?i) to the regex.");
-  chanservaddcommand("rgrep",  QCMD_OPER, 2, csg_dorgrep,  "Searches the logs in reverse order.","Usage: RGREP <days> <regex>\nSearches the logs.  The oldest specified log will be specified first meaning\nthat all events returned will be in strict chronological order. Where:\ndays  - number of days of history to search\nregex - regex to search for\nNote: For a case insensitive search, prepend (?i) to the regex.");
+  chanservaddcommand("grep",   QCMD_OPER, 1, csg_dogrep,   "Searches the logs.","Usage: GREP <regex>\nSearches the logs.  Today's log is searched first, followed by each older\nday's log in turn.  Within each day, results are in chronological order.  Where:\nregex  - regular expression to search for.\nNote: For a case insensitive search, prepend (?i) to the regex.\nSearches for a regex containing some plain text (3 or more characters) only\nneed to read the parts of the logs which might contain it, so are much faster.");
+  chanservaddcommand("rgrep",  QCMD_OPER, 2, csg_dorgrep,  "Searches the logs in reverse order.","Usage: RGREP <days> <regex>\nSearches the logs.  The oldest specified log will be specified first meaning\nthat all events returned will be in strict chronological order. Where:\ndays  - number of days of history to search (0 is just today)\nregex - regex to search for\nNote: For a case insensitive search, prepend (?i) to the regex.");
 }
 
 void _fini() {
@@ -60,13 +82,10 @@ int csg_dogrep(void *source, int cargc, char **cargv) {
     return CMD_ERROR;
   }
 
-  csg_curfile=0;
-  csg_direction=0;
-
   chanservwallmessage("%s (%s) used GREP %s", sender->nick, rup->username, cargv[0]);
   cs_log(sender, "GREP %s", cargv[0]);
 
-  return csg_execgrep(sender, cargv[0]);
+  return csg_execgrep(sender, cargv[0], 0, -1);
 }
 
 int csg_dorgrep(void *source, int cargc, char **cargv) {
@@ -100,16 +119,224 @@ int csg_dorgrep(void *source, int cargc, char **cargv) {
   chanservwallmessage("%s (%s) used RGREP %s %s", sender->nick, rup->username, cargv[0], cargv[1]);
   cs_log(sender, "RGREP %s %s", cargv[0], cargv[1]);
 
-  csg_curfile=startpoint;
-  csg_direction=1;
-  return csg_execgrep(sender, cargv[1]);
+  return csg_execgrep(sender, cargv[1], 1, startpoint);
+}
+
+/* Oldest first: legacy logs (highest N first), then the days in order */
+static int csg_compareseg(const void *a, const void *b) {
+  const csgsegment *sa=a, *sb=b;
+
+  if (!sa->day[0] || !sb->day[0]) {
+    if (sa->day[0])
+      return 1;
+    if (sb->day[0])
+      return -1;
+    return (sa->legacy<sb->legacy)?1:(sa->legacy>sb->legacy)?-1:0;
+  }
+
+  return strcmp(sa->day, sb->day);
+}
+
+/*
+ * Finds the log segments: oldest first if direction is 1, otherwise
+ * newest first.  days>=0 limits it to the last that many days, legacy
+ * logs go by when they were last written.
+ */
+static int csg_findsegments(int direction, int days) {
+  DIR *dp;
+  struct dirent *de;
+  csgsegment *nsegs, *sp, tmp;
+  size_t prefixlen=strlen(CSLOG_PREFIX), len;
+  struct stat st;
+  char first[9];
+  time_t t=0;
+  long legacy;
+  int i, size=0;
+
+  if (!(dp=opendir(".")))
+    return -1;
+
+  first[0]='\0';
+  if (days>=0) {
+    t=time(NULL)-days*86400;
+    strftime(first, sizeof(first), "%Y%m%d", gmtime(&t));
+  }
+
+  csg_nsegs=0;
+
+  while ((de=readdir(dp))) {
+    len=strlen(de->d_name);
+    if (len>=sizeof(sp->filename))
+      continue;
+
+    if (!strcmp(de->d_name, CSG_LEGACYLOG)) {
+      legacy=0;
+    } else {
+      if (strncmp(de->d_name, CSLOG_PREFIX, prefixlen) || len==prefixlen)
+        continue;
+
+      for (i=prefixlen;i<len;i++)
+        if (!isdigit((unsigned char)de->d_name[i]))
+          break;
+
+      if (i<len)
+        continue;
+
+      if (len==prefixlen+8) {
+        if (strcmp(de->d_name+prefixlen, first)<0)
+          continue;
+        legacy=-1;
+      } else {
+        legacy=atol(de->d_name+prefixlen);
+      }
+    }
+
+    if (legacy>=0 && days>=0 && (stat(de->d_name, &st) || st.st_mtime<t))
+      continue;
+
+    if (csg_nsegs==size) {
+      size=size?size*2:32;
+      if (!(nsegs=realloc(csg_segs, size*sizeof(csgsegment)))) {
+        closedir(dp);
+        return -1;
+      }
+      csg_segs=nsegs;
+    }
+
+    sp=&csg_segs[csg_nsegs++];
+    strcpy(sp->filename, de->d_name);
+    sp->legacy=legacy;
+    if (legacy<0)
+      strcpy(sp->day, de->d_name+prefixlen);
+    else
+      sp->day[0]='\0';
+  }
+
+  closedir(dp);
+
+  if (csg_nsegs)
+    qsort(csg_segs, csg_nsegs, sizeof(csgsegment), csg_compareseg);
+
+  if (!direction) {
+    for (i=0;i<csg_nsegs/2;i++) {
+      tmp=csg_segs[i];
+      csg_segs[i]=csg_segs[csg_nsegs-1-i];
+      csg_segs[csg_nsegs-1-i]=tmp;
+    }
+  }
+
+  return csg_nsegs;
+}
+
+static void csg_closesegment() {
+  if (csg_fd>=0)
+    deregisterhandler(csg_fd, 1);
+  if (csg_map)
+    munmap(csg_map, csg_mapsize);
+  free(csg_blocks);
+
+  csg_fd=-1;
+  csg_map=NULL;
+  csg_mapsize=0;
+  csg_blocks=NULL;
+  csg_nblocks=csg_curblock=0;
+  csg_tailpos=0;
+}
+
+/* Reads the index for a segment, anything it doesn't cover gets searched anyway */
+static void csg_loadindex(const char *day) {
+  char filename[64];
+  cslogindexheader hdr;
+  struct stat st;
+  unsigned int i;
+  int fd;
+
+  cslog_segmentname(filename, sizeof(filename), day, 1);
+  if ((fd=open(filename, O_RDONLY))<0)
+    return;
+
+  if (fstat(fd, &st) || st.st_size<(off_t)sizeof(hdr) || read(fd, &hdr, sizeof(hdr))!=sizeof(hdr) ||
+      hdr.magic!=CSLOG_INDEXMAGIC || hdr.version!=CSLOG_INDEXVERSION ||
+      hdr.blocksize!=CSLOG_BLOCKSIZE || hdr.bloombits!=CSLOG_BLOOMBITS) {
+    close(fd);
+    return;
+  }
+
+  csg_nblocks=(st.st_size-sizeof(hdr))/sizeof(cslogblock);
+  if (!csg_nblocks || !(csg_blocks=malloc(csg_nblocks*sizeof(cslogblock))) ||
+      read(fd, csg_blocks, csg_nblocks*sizeof(cslogblock))!=(ssize_t)(csg_nblocks*sizeof(cslogblock))) {
+    free(csg_blocks);
+    csg_blocks=NULL;
+    csg_nblocks=0;
+    close(fd);
+    return;
+  }
+
+  close(fd);
+
+  /* the index must be in order and inside the log, or it's no use */
+  for (i=0;i<csg_nblocks;i++) {
+    if (csg_blocks[i].offset+csg_blocks[i].length>csg_mapsize ||
+        csg_blocks[i].offset!=(i?csg_blocks[i-1].offset+csg_blocks[i-1].length:0)) {
+      free(csg_blocks);
+      csg_blocks=NULL;
+      csg_nblocks=0;
+      return;
+    }
+  }
 }
 
-int csg_execgrep(nick *sender, char *pattern) {
+/* Opens the next segment that has anything in it, returns 0 when there are none left */
+static int csg_nextsegment() {
+  csgsegment *sp;
+  struct stat st;
+  int fd;
+
+  csg_closesegment();
+
+  while (csg_curseg<csg_nsegs) {
+    sp=&csg_segs[csg_curseg++];
+    if ((fd=open(sp->filename, O_RDONLY))<0)
+      continue;
+
+    if (fstat(fd, &st) || !st.st_size ||
+        (csg_map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))==MAP_FAILED) {
+      csg_map=NULL;
+      close(fd);
+      continue;
+    }
+
+    csg_mapsize=st.st_size;
+    csg_fd=fd;
+    if (sp->day[0])
+      csg_loadindex(sp->day);
+    if (csg_nblocks)
+      csg_tailpos=csg_blocks[csg_nblocks-1].offset+csg_blocks[csg_nblocks-1].length;
+    registerhandler(csg_fd, POLLIN, csg_handleevents);
+
+    return 1;
+  }
+
+  return 0;
+}
+
+static void csg_finish(nick *np) {
+  csg_closesegment();
+
+  if (np)
+    chanservstdmessage(np, QM_ENDOFLIST);
+
+  pcre_free(csg_curpat);
+  csg_curpat=NULL;
+  free(csg_segs);
+  csg_segs=NULL;
+  csg_nsegs=0;
+  csg_maxmatches=0;
+}
+
+int csg_execgrep(nick *sender, char *pattern, int direction, int days) {
   const char *errptr;
   int erroffset;
-  int fd;
-  char filename[50];
 
   if (csg_maxmatches>0) {
     chanservsendmessage(sender, "Sorry, the grepper is currently busy - try later.");
@@ -121,119 +348,104 @@ int csg_execgrep(nick *sender, char *pattern) {
     return CMD_ERROR;
   }
 
-  if (csg_direction==0 || csg_curfile==0) {
-    if ((fd=open("chanservlog",O_RDONLY))<0) {
-      chanservsendmessage(sender, "Unable to open logfile.");
-      free(csg_curpat);    
-      return CMD_ERROR;
-    }
-  } else {
-    sprintf(filename,"chanservlog.%d",csg_curfile);
-    if ((fd=open(filename,O_RDONLY))<0) {
-      chanservsendmessage(sender, "Unable to open logfile.");
-      free(csg_curpat);    
-      return CMD_ERROR;
-    }
+  if (csg_findsegments(direction, days)<=0) {
+    chanservsendmessage(sender, "Unable to open logfile.");
+    csg_finish(NULL);
+    return CMD_ERROR;
   }
 
   /* Initialise stuff for the match */
   csg_maxmatches=500;
   csg_matches=0;
   csg_curnum=sender->numeric;
-  csg_bytesleft=0;
-  csg_bytesread=0;
+  csg_curseg=0;
+  csg_blocksread=csg_blocksskipped=0;
+  csg_literallen=regexliteral(pattern, csg_literal);
+
+  if (!csg_nextsegment()) {
+    chanservsendmessage(sender, "Unable to open logfile.");
+    csg_finish(NULL);
+    return CMD_ERROR;
+  }
 
-  registerhandler(fd, POLLIN, csg_handleevents);
   chanservsendmessage(sender, "Started grep for %s...",pattern);
 
   return CMD_OK;
 }
 
+/* Searches a run of whole lines, returns 1 if the match limit was hit */
+static int csg_searchrange(nick *np, const char *start, const char *end) {
+  const char *lineend;
+
+  while (start<end) {
+    if (!(lineend=memchr(start, '\n', end-start)))
+      lineend=end;
+
+    if (lineend>start && !pcre_exec(csg_curpat, NULL, start, lineend-start, 0, 0, NULL, 0)) {
+      chanservsendmessage(np, "%.*s", (int)(lineend-start), start);
+      if (++csg_matches >= csg_maxmatches) {
+        chanservstdmessage(np, QM_TRUNCATED, csg_maxmatches);
+        return 1;
+      }
+    }
+
+    start=lineend+1;
+  }
+
+  return 0;
+}
+
 void csg_handleevents(int fd, short revents) {
-  int res;
   nick *np=getnickbynumeric(csg_curnum);
-  char *chp, *linestart;
-  char filename[50];
-  off_t pos;
+  cslogblock *bp;
+  size_t tailend;
+  char *nl;
+  int i;
 
   /* If the target user has vanished, drop everything */
   if (!np) {
-    deregisterhandler(fd, 1);
-    free(csg_curpat);
-    csg_maxmatches=0;
+    csg_finish(NULL);
     return;
   }
 
-retry:
-  res=read(fd, csg_readbuf+csg_bytesleft, CSG_BUFSIZE-csg_bytesleft);
-  
-  if (res<=0) {
-/*    chanservsendmessage(np, "Closing file: res=%d, errno=%d(%s), bytes read=%d",res,errno,sys_errlist[errno],csg_bytesread); */
-    /* End of file (or error) */
-    deregisterhandler(fd, 1);
-    if (csg_direction==0) {
-      sprintf(filename,"chanservlog.%d",++csg_curfile);
-    } else {
-      csg_curfile--;
-      if (csg_curfile<0) {
-        chanservstdmessage(np, QM_ENDOFLIST);
-        free(csg_curpat);
-        csg_maxmatches=0;
-        return;
-      } else if (csg_curfile==0) {
-        sprintf(filename,"chanservlog");
-      } else {
-        sprintf(filename,"chanservlog.%d",csg_curfile);
-      }
-    }
-    if ((fd=open(filename,O_RDONLY))>=0) {
-      /* Found the next file */
-      registerhandler(fd, POLLIN, csg_handleevents);
-    } else {
-      chanservstdmessage(np, QM_ENDOFLIST);
-      free(csg_curpat);
-      csg_maxmatches=0;
+  for (i=0;i<CSG_BLOCKSPEREVENT && csg_curblock<csg_nblocks;i++) {
+    bp=&csg_blocks[csg_curblock++];
+
+    if (csg_literallen>=3 && !cslog_bloomcheck(bp->bloom, csg_literal, csg_literallen)) {
+      csg_blocksskipped++;
+      continue;
     }
 
-    return;
+    csg_blocksread++;
+    if (csg_searchrange(np, csg_map+bp->offset, csg_map+bp->offset+bp->length)) {
+      csg_finish(np);
+      return;
+    }
   }
 
-  csg_bytesread+=res;
+  if (csg_curblock<csg_nblocks)
+    return;
 
-  linestart=chp=csg_readbuf;
-  csg_bytesleft+=res;
-  
-  while (csg_bytesleft) {
-    csg_bytesleft--;
-    if (*chp=='\r' || *chp=='\n' || *chp=='\0') {
-      if (linestart==chp) {
-	linestart=(++chp);
-      } else {
-	*chp++='\0';
-	if (!pcre_exec(csg_curpat, NULL, linestart, strlen(linestart), 0, 0, NULL, 0)) {
-	  chanservsendmessage(np, "%s", linestart);
-	  if (++csg_matches >= csg_maxmatches) {
-	    chanservstdmessage(np, QM_TRUNCATED, csg_maxmatches);
-	    chanservstdmessage(np, QM_ENDOFLIST);
-	    free(csg_curpat);
-	    deregisterhandler(fd, 1);
-	    csg_maxmatches=0;
-	  } 
-	}
-	linestart=chp;
-      }
-    } else {
-      chp++;
+  /* Whatever the index doesn't cover yet, a similar amount at a time */
+  if (csg_tailpos<csg_mapsize) {
+    tailend=csg_tailpos+CSG_BLOCKSPEREVENT*CSLOG_BLOCKSIZE;
+    if (tailend>=csg_mapsize || !(nl=memchr(csg_map+tailend, '\n', csg_mapsize-tailend)))
+      tailend=csg_mapsize;
+    else
+      tailend=nl-csg_map+1;
+
+    if (csg_searchrange(np, csg_map+csg_tailpos, csg_map+tailend)) {
+      csg_finish(np);
+      return;
     }
+
+    if ((csg_tailpos=tailend)<csg_mapsize)
+      return;
+  }
+
+  if (!csg_nextsegment()) {
+    if (csg_blocksskipped)
+      chanservsendmessage(np, "Index skipped %u of %u blocks.", csg_blocksskipped, csg_blocksskipped+csg_blocksread);
+    csg_finish(np);
   }
-  
-  csg_bytesleft=(chp-linestart);
-  memmove(csg_readbuf, linestart, csg_bytesleft);
-  
-  /* BSD hack */
-  pos=lseek(fd, 0, SEEK_CUR);
-  if (!pread(fd, csg_readbuf+csg_bytesleft, 1, pos)) {
-    /* EOF */
-    goto retry;
-  }    
 }
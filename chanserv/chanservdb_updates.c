@@ -20,12 +20,14 @@ void csdb_updateauthinfo(reguser *rup) {
   char eschost[2*HOSTLEN+1];
 
   dbescapestring(eschost,rup->lastuserhost->content,rup->lastuserhost->length);
-  dbquery("UPDATE chanserv.users SET lastauth=%lu,lastuserhost='%s' WHERE ID=%u",
+  csdb_deferupdate(CSDB_USER, rup->ID, 0, CSDB_COLS_AUTH,
+		  "UPDATE chanserv.users SET lastauth=%lu,lastuserhost='%s' WHERE ID=%u",
 		  rup->lastauth,eschost,rup->ID);
 }
 
 void csdb_updatelastjoin(regchanuser *rcup) {
-  dbquery("UPDATE chanserv.chanusers SET usetime=%lu WHERE userID=%u and channelID=%u",
+  csdb_deferupdate(CSDB_CHANUSER, rcup->chan->ID, rcup->user->ID, CSDB_COLS_USETIME,
+	  "UPDATE chanserv.chanusers SET usetime=%lu WHERE userID=%u and channelID=%u",
 	  rcup->usetime, rcup->user->ID, rcup->chan->ID);
 }
 
@@ -37,7 +39,8 @@ void csdb_updatetopic(regchan *rcp) {
   } else {
     esctopic[0]='\0';
   }
-  dbquery("UPDATE chanserv.channels SET topic='%s' WHERE ID=%u",esctopic,rcp->ID);
+  csdb_deferupdate(CSDB_CHANNEL, rcp->ID, 0, CSDB_COLS_TOPIC,
+	  "UPDATE chanserv.channels SET topic='%s' WHERE ID=%u",esctopic,rcp->ID);
 }
 
 void csdb_updatechannel(regchan *rcp) {
@@ -78,7 +81,8 @@ void csdb_updatechannel(regchan *rcp) {
   else
     esccomment[0]='\0';
 
-  dbquery("UPDATE chanserv.channels SET name='%s', flags=%d, forcemodes=%d,"
+  csdb_deferupdate(CSDB_CHANNEL, rcp->ID, 0, CSDB_COLS_ALL,
+		  "UPDATE chanserv.channels SET name='%s', flags=%d, forcemodes=%d,"
 		  "denymodes=%d, chanlimit=%d, autolimit=%d, banstyle=%d,"
 		  "lastactive=%lu,statsreset=%lu, banduration=%lu, founder=%u,"
 		  "addedby=%u, suspendby=%u, suspendtime=%lu, chantype=%d, totaljoins=%u,"
@@ -93,33 +97,9 @@ void csdb_updatechannel(regchan *rcp) {
 		  escwelcome,esctopic,esckey,escreason,esccomment,(intmax_t)rcp->ltimestamp,rcp->ID);
 }
 
-#define CHANNELCOUNTER_BUFSIZE 512
-#define CHANNELCOUNTER_MAX 512
-
-static int channelcounter_count = 0;
-static char channelcounter_bufs[CHANNELCOUNTER_MAX][CHANNELCOUNTER_BUFSIZE];
-
-void csdb_flushchannelcounters(void *arg) {
-  int i;
-
-  if(!channelcounter_count)
-    return;
-
-  dbquery("BEGIN TRANSACTION;");
-
-  for(i=0;i<channelcounter_count;i++)
-    dbquery("%s", channelcounter_bufs[i]);
-
-  dbquery("COMMIT;");
-
-  channelcounter_count = 0;
-}
-
 void csdb_updatechannelcounters(regchan *rcp) {
-  if(channelcounter_count == CHANNELCOUNTER_MAX)
-    csdb_flushchannelcounters(NULL);
-
-  snprintf(channelcounter_bufs[channelcounter_count], CHANNELCOUNTER_BUFSIZE - 1, "UPDATE chanserv.channels SET "
+  csdb_deferupdate(CSDB_CHANNEL, rcp->ID, 0, CSDB_COLS_COUNTERS,
+		  "UPDATE chanserv.channels SET "
 		  "lastactive=%lu, totaljoins=%u,"
 		  "tripjoins=%u, maxusers=%u, tripusers=%u "
 		  "WHERE ID=%u",
@@ -127,12 +107,11 @@ void csdb_updatechannelcounters(regchan *rcp) {
 		  rcp->totaljoins,rcp->tripjoins,
 		  rcp->maxusers,rcp->tripusers,
 		  rcp->ID);
-
-  channelcounter_count++;
 }
 
 void csdb_updatechanneltimestamp(regchan *rcp) {
-  dbquery("UPDATE chanserv.channels SET "
+  csdb_deferupdate(CSDB_CHANNEL, rcp->ID, 0, CSDB_COLS_TS,
+		  "UPDATE chanserv.channels SET "
 		  "lasttimestamp=%jd WHERE ID=%u",
 		  (intmax_t)rcp->ltimestamp, rcp->ID);
 }
@@ -191,12 +170,18 @@ void csdb_createchannel(regchan *rcp) {
 }
 
 void csdb_deletechannel(regchan *rcp) {
+  csdb_dropupdates(CSDB_CHANNEL, rcp->ID, 0);
+  csdb_dropupdates(CSDB_CHANUSER, rcp->ID, CSDB_ANYID);
+
   dbquery("DELETE FROM chanserv.channels WHERE ID=%u",rcp->ID);
   dbquery("DELETE FROM chanserv.chanusers WHERE channelID=%u",rcp->ID);
   dbquery("DELETE FROM chanserv.bans WHERE channelID=%u",rcp->ID);
 }
 
 void csdb_deleteuser(reguser *rup) {
+  csdb_dropupdates(CSDB_USER, rup->ID, 0);
+  csdb_dropupdates(CSDB_CHANUSER, CSDB_ANYID, rup->ID);
+
   dbquery("DELETE FROM chanserv.users WHERE ID=%u",rup->ID);
   dbquery("DELETE FROM chanserv.chanusers WHERE userID=%u",rup->ID);
 }
@@ -242,7 +227,8 @@ void csdb_updateuser(reguser *rup) {
   else
     escinfo[0]='\0';
 
-  dbquery("UPDATE chanserv.users SET lastauth=%lu, lastemailchng=%lu, flags=%u,"
+  csdb_deferupdate(CSDB_USER, rup->ID, 0, CSDB_COLS_ALL,
+		  "UPDATE chanserv.users SET lastauth=%lu, lastemailchng=%lu, flags=%u,"
 		  "language=%u, suspendby=%u, suspendexp=%lu, suspendtime=%lu, lockuntil=%lu, password='%s', email='%s',"
 		  "lastuserhost='%s', suspendreason='%s', comment='%s', info='%s', lastemail='%s', lastpasschng=%lu "
                   " WHERE ID=%u",
@@ -314,7 +300,8 @@ void csdb_updatechanuser(regchanuser *rcup) {
   else
     escinfo[0]='\0';
 
-  dbquery("UPDATE chanserv.chanusers SET flags=%u, changetime=%lu, "
+  csdb_deferupdate(CSDB_CHANUSER, rcup->chan->ID, rcup->user->ID, CSDB_COLS_ALL,
+		  "UPDATE chanserv.chanusers SET flags=%u, changetime=%lu, "
 		  "usetime=%lu, info='%s' WHERE channelID=%u and userID=%u",
 		  rcup->flags, rcup->changetime, rcup->usetime, escinfo, rcup->chan->ID,rcup->user->ID);
 }
@@ -333,6 +320,8 @@ void csdb_createchanuser(regchanuser *rcup) {
 }
 
 void csdb_deletechanuser(regchanuser *rcup) {
+  csdb_dropupdates(CSDB_CHANUSER, rcup->chan->ID, rcup->user->ID);
+
   dbquery("DELETE FROM chanserv.chanusers WHERE channelid=%u AND userID=%u",
 		  rcup->chan->ID, rcup->user->ID);
 }
@@ -32,7 +32,7 @@ int dumplastjoindata(const char *filename) {
 	continue;
       
       lj.chanid=rcp->ID;
-      for (j=0;j<REGCHANUSERHASHSIZE;j++) {	
+      for (j=0;j<rcp->regusersize;j++) {	
 	for (rcup=rcp->regusers[j];rcup;rcup=rcup->nextbychan) {
 	  lj.userid=rcup->user->ID;
 	  lj.lastjoin=rcup->usetime;
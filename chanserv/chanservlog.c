@@ -1,33 +1,238 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include "chanserv.h"
 #include "../core/hooks.h"
 #include "../core/error.h"
+#include "../core/logbuf.h"
 
-int logfd;
+static logbuf *cslog;
+static int idxfd=-1;
+static char logday[9];
+
+/* The block being built, it goes in the index once it's full */
+static uint64_t blockstart;
+static uint32_t blocklen;
+static int64_t blockfirst, blocklast;
+static unsigned char blockbloom[CSLOG_BLOOMBITS/8];
+
+void cslog_segmentname(char *buf, size_t len, const char *day, int index) {
+  snprintf(buf, len, "%s%s%s", CSLOG_PREFIX, day, index?CSLOG_INDEXSUFFIX:"");
+}
+
+static unsigned int trigramhash(const char *p) {
+  unsigned int h;
+
+  h=(tolower((unsigned char)p[0])<<16)|(tolower((unsigned char)p[1])<<8)|tolower((unsigned char)p[2]);
+
+  return ((h*2654435761U)&0xffffffffU)>>(32-CSLOG_BLOOMSHIFT);
+}
+
+void cslog_bloomadd(unsigned char *bloom, const char *text, size_t len) {
+  unsigned int h;
+  size_t i;
+
+  for (i=0;i+2<len;i++) {
+    h=trigramhash(text+i);
+    bloom[h>>3]|=1<<(h&7);
+  }
+}
+
+/* Returns 0 if text can't be in the block, text shorter than 3 always passes */
+int cslog_bloomcheck(const unsigned char *bloom, const char *text, size_t len) {
+  unsigned int h;
+  size_t i;
+
+  for (i=0;i+2<len;i++) {
+    h=trigramhash(text+i);
+    if (!(bloom[h>>3]&(1<<(h&7))))
+      return 0;
+  }
+
+  return 1;
+}
+
+static void flushblock() {
+  cslogblock b;
+
+  if (!blocklen)
+    return;
+
+  if (idxfd>=0) {
+    /* the block has to be in the log before the index points at it */
+    logbuf_flush(cslog);
+
+    memset(&b,0,sizeof(b));
+    b.offset=blockstart;
+    b.length=blocklen;
+    b.firsttime=blockfirst;
+    b.lasttime=blocklast;
+    memcpy(b.bloom,blockbloom,sizeof(b.bloom));
+
+    if (write(idxfd,&b,sizeof(b))!=sizeof(b)) {
+      Error("chanserv",ERR_WARNING,"Error writing log index, searches of %s will be slower.",logday);
+      close(idxfd);
+      idxfd=-1;
+    }
+  }
+
+  blockstart+=blocklen;
+  blocklen=0;
+  blockfirst=blocklast=0;
+  memset(blockbloom,0,sizeof(blockbloom));
+}
+
+static void addline(const char *line, size_t len, time_t t) {
+  if (blocklen && blocklen+len>CSLOG_BLOCKSIZE)
+    flushblock();
+
+  cslog_bloomadd(blockbloom,line,len);
+  if (t) {
+    if (!blockfirst)
+      blockfirst=t;
+    blocklast=t;
+  }
+  blocklen+=len;
+}
+
+/* Indexes log that was written before we (re)opened it, times unknown */
+static void indextail(off_t from, off_t to) {
+  char buf[CSLOG_BLOCKSIZE];
+  size_t have=0, used, want;
+  ssize_t res;
+  char *nl;
+
+  while (from<to) {
+    want=sizeof(buf)-have;
+    if ((off_t)want>to-from)
+      want=to-from;
+
+    if ((res=pread(cslog->fd,buf+have,want,from))<=0)
+      break;
+
+    from+=res;
+    have+=res;
+
+    for (used=0;(nl=memchr(buf+used,'\n',have-used));used=nl-buf+1)
+      addline(buf+used,nl-buf+1-used,0);
+
+    /* a line longer than the buffer goes in as it is */
+    if (!used && have==sizeof(buf))
+      used=have;
+
+    memmove(buf,buf+used,have-used);
+    have-=used;
+  }
+
+  /* unterminated last line */
+  if (have)
+    addline(buf,have,0);
+}
+
+static void closesegment() {
+  if (cslog)
+    logbuf_close(cslog);
+  if (idxfd>=0)
+    close(idxfd);
+
+  cslog=NULL;
+  idxfd=-1;
+  blockstart=blocklen=0;
+  blockfirst=blocklast=0;
+  memset(blockbloom,0,sizeof(blockbloom));
+}
+
+/*
+ * Opens the segment for day, picking up its index where it left off and
+ * indexing anything written after that.  A missing or mismatched index
+ * is rebuilt from the log.
+ */
+static void opensegment(const char *day) {
+  char filename[64];
+  cslogindexheader hdr;
+  cslogblock b;
+  off_t idxsize, logsize;
+  uint64_t nblocks=0;
+
+  closesegment();
+  strcpy(logday,day);
+
+  cslog_segmentname(filename,sizeof(filename),day,0);
+  if (!(cslog=logbuf_open(filename,S_IRUSR|S_IWUSR)))
+    return;
+
+  cslog_segmentname(filename,sizeof(filename),day,1);
+  if ((idxfd=open(filename,O_RDWR|O_CREAT|O_APPEND,S_IRUSR|S_IWUSR))>=0) {
+    idxsize=lseek(idxfd,0,SEEK_END);
+
+    if (idxsize>=(off_t)sizeof(hdr) && pread(idxfd,&hdr,sizeof(hdr),0)==sizeof(hdr) &&
+        hdr.magic==CSLOG_INDEXMAGIC && hdr.version==CSLOG_INDEXVERSION &&
+        hdr.blocksize==CSLOG_BLOCKSIZE && hdr.bloombits==CSLOG_BLOOMBITS) {
+      nblocks=(idxsize-sizeof(hdr))/sizeof(b);
+      if (nblocks && pread(idxfd,&b,sizeof(b),sizeof(hdr)+(nblocks-1)*sizeof(b))==sizeof(b))
+        blockstart=b.offset+b.length;
+      else
+        nblocks=0;
+    } else {
+      hdr.magic=CSLOG_INDEXMAGIC;
+      hdr.version=CSLOG_INDEXVERSION;
+      hdr.blocksize=CSLOG_BLOCKSIZE;
+      hdr.bloombits=CSLOG_BLOOMBITS;
+      if (ftruncate(idxfd,0) || write(idxfd,&hdr,sizeof(hdr))!=sizeof(hdr)) {
+        close(idxfd);
+        idxfd=-1;
+      }
+    }
+  }
+
+  logsize=lseek(cslog->fd,0,SEEK_END);
+
+  /* the log went backwards under us, start the index again */
+  if ((off_t)blockstart>logsize) {
+    nblocks=0;
+    blockstart=0;
+  }
+
+  /* drop any half written block record */
+  if (idxfd>=0 && ftruncate(idxfd,sizeof(hdr)+nblocks*sizeof(b))) {
+    close(idxfd);
+    idxfd=-1;
+  }
+
+  indextail(blockstart,logsize);
+}
+
+static void currentday(char *day, time_t t) {
+  strftime(day,9,"%Y%m%d",gmtime(&t));
+}
 
 /* When we get a sigusr1, reopen the logfile */
 void cs_usr1handler(int hooknum, void *arg) {
-  Error("chanserv",ERR_INFO,"Reopening logfile.");
+  char day[9];
 
-  if (logfd>=0)
-    close(logfd);
+  Error("chanserv",ERR_INFO,"Reopening logfile.");
 
-  logfd=open("chanservlog",O_WRONLY|O_CREAT|O_APPEND,S_IRUSR|S_IWUSR);
+  currentday(day,time(NULL));
+  opensegment(day);
 }
 
 void cs_initlog() {
-  logfd=open("chanservlog",O_WRONLY|O_CREAT|O_APPEND,S_IRUSR|S_IWUSR);
+  char day[9];
+
+  currentday(day,time(NULL));
+  opensegment(day);
   registerhook(HOOK_CORE_SIGUSR1, cs_usr1handler);
 }
 
 void cs_closelog() {
-  if (logfd>=0)
-    close(logfd);
+  /* the partial block is picked up from the log next time */
+  closesegment();
   deregisterhook(HOOK_CORE_SIGUSR1, cs_usr1handler);
 }
 
@@ -37,11 +242,18 @@ void cs_log(nick *np, char *event, ... ) {
   char userbuf[512];
   va_list va;
   char timebuf[TIMELEN];
+  char day[9];
   int len;
   time_t now;
 
-  if (logfd<0)
-    return; 
+  now=time(NULL);
+  currentday(day,now);
+
+  if (!cslog || strcmp(day,logday))
+    opensegment(day);
+
+  if (!cslog)
+    return;
 
   va_start(va,event);
   vsnprintf(buf,512,event,va);
@@ -54,8 +266,11 @@ void cs_log(nick *np, char *event, ... ) {
     userbuf[0]='\0';
   }
 
-  now=time(NULL);
   strftime(timebuf,sizeof(timebuf),Q9_LOG_FORMAT_TIME, gmtime(&now));
   len=snprintf(buf2,sizeof(buf2),"[%s] %s%s\n",timebuf,userbuf,buf);
-  write(logfd, buf2, len);
+  if (len>=(int)sizeof(buf2))
+    len=sizeof(buf2)-1;
+
+  if (logbuf_write(cslog, buf2, len))
+    addline(buf2,len,now);
 }
@@ -362,14 +362,23 @@ static void __chanservstdvmessage(nick *np, reguser *rup, int messageid, int max
   va_end(va);
 }
 
+struct stdmessagetarget {
+  nick *np;
+  void (*callback)(nick *, char *);
+};
+
+static void stdmessage_line(void *arg, char *line) {
+  struct stdmessagetarget *tp=arg;
+
+  if (chanservnick)
+    tp->callback(tp->np, line);
+}
+
 void chanservstdvmessage(nick *np, reguser *rup, int messageid, int max_line_len, void (*callback)(nick *, char *), va_list va) {
-  char buf[5010];
-  char buf2[512];
   int language;
   va_list va2;
-  char *message, *messageargs;
-  char *bp2,*bp;
-  int len;
+  q9template *tp;
+  struct stdmessagetarget target;
 
   if(max_line_len <= 0)
     max_line_len = 490 + max_line_len;
@@ -380,45 +389,20 @@ void chanservstdvmessage(nick *np, reguser *rup, int messageid, int max_line_len
     language=rup->languageid;
   }
 
-  if (csmessages[language][messageid]) {
-    message=csmessages[language][messageid]->content;
-  } else if (csmessages[0][messageid]) {
-    message=csmessages[0][messageid]->content;
-  } else {
-    message=defaultmessages[messageid*2];
+  if (cstemplates[language][messageid]) {
+    tp=cstemplates[language][messageid];
+  } else if (cstemplates[0][messageid]) {
+    tp=cstemplates[0][messageid];
+  } else if (!(tp=csdefaulttemplates[messageid])) {
+    return;
   }
 
-  messageargs=defaultmessages[messageid*2+1];
+  target.np=np;
+  target.callback=callback;
 
   va_copy(va2, va);
-  q9vsnprintf(buf,5000,message,messageargs,va);
-
-  len=0;
-  bp2=buf2;
-  for (bp=buf; ;bp++) {
-    /* We send something if we hit a \n, fill the buffer or run out of source */
-    if (*bp=='\n' || len>max_line_len || !*bp) {
-      if (*bp && *bp!='\n') {
-	bp--;
-      }
-      
-      *bp2='\0';
+  q9vsendlines(tp,defaultmessages[messageid*2+1],max_line_len,stdmessage_line,&target,va);
 
-      if (chanservnick && *buf2)
-        callback(np, buf2);
-
-      /* If we ran out of buffer, get out here */
-      if (!*bp)
-	break;
-      
-      bp2=buf2;
-      len=0;
-    } else {
-      len++;
-      *bp2++=*bp;
-    }
-  }
-  
   /* Special case: If it's a "not enough parameters" message, show the first line of help */
   if (messageid==QM_NOTENOUGHPARAMS) {
     char *command=va_arg(va2, char *);
@@ -934,6 +918,120 @@ void cs_checkbans(channel *cp) {
   localsetmodeflush(&changes,1);
 }
 
+/*
+ * Channel sweeper:
+ *  Rather than a schedule each, channels waiting for cs_timerfunc sit in
+ *  one of CS_SWEEPBUCKETS lists by due time (modulo the bucket count).
+ *  Once a second cs_sweepchannels works through the buckets since the
+ *  last sweep, running anything that is due and leaving the rest for a
+ *  later lap.  No more than CS_SWEEPBATCH channels are run per sweep,
+ *  the rest wait for the next one.
+ */
+static regchan *sweepbuckets[CS_SWEEPBUCKETS];
+static time_t sweeptime; /* buckets up to here have been swept */
+
+static void cs_sweeplink(regchan **head, regchan *rcp) {
+  if ((rcp->checknext=*head))
+    rcp->checknext->checkprev=&(rcp->checknext);
+  rcp->checkprev=head;
+  *head=rcp;
+}
+
+static void cs_sweepunlink(regchan *rcp) {
+  if (!rcp->checkprev)
+    return;
+
+  if ((*(rcp->checkprev)=rcp->checknext))
+    rcp->checknext->checkprev=rcp->checkprev;
+
+  rcp->checknext=NULL;
+  rcp->checkprev=NULL;
+}
+
+static void cs_schedchannel(regchan *rcp, time_t when) {
+  /* Anything due already goes in the next bucket to be swept */
+  time_t slot=(when>sweeptime)?when:sweeptime+1;
+
+  cs_sweepunlink(rcp);
+  rcp->checktime=when;
+  cs_sweeplink(&sweepbuckets[slot%CS_SWEEPBUCKETS], rcp);
+}
+
+/*
+ * cs_sweepclear:
+ *  The regchans outlive this module but the buckets don't, so on unload
+ *  every channel is unhooked from them.  checktime is kept for
+ *  cs_sweeprestore to put them back.
+ */
+void cs_sweepclear() {
+  regchan *rcp, *nrcp;
+  int i;
+
+  for (i=0;i<CS_SWEEPBUCKETS;i++) {
+    for (rcp=sweepbuckets[i];rcp;rcp=nrcp) {
+      nrcp=rcp->checknext;
+      rcp->checknext=NULL;
+      rcp->checkprev=NULL;
+    }
+    sweepbuckets[i]=NULL;
+  }
+}
+
+/* Picks up the channels that were waiting when we were last unloaded */
+void cs_sweeprestore() {
+  chanindex *cip;
+  regchan *rcp;
+  int i;
+
+  for (i=0;i<CHANNELHASHSIZE;i++)
+    for (cip=chantable[i];cip;cip=cip->next)
+      if ((rcp=cip->exts[chanservext]) && rcp->checktime && !rcp->checkprev)
+        cs_schedchannel(rcp, rcp->checktime);
+}
+
+void cs_sweepchannels(void *arg) {
+  time_t now=time(NULL);
+  regchan *pending, *rcp, **bucket;
+  unsigned int done=0;
+
+  /* A lap of the buckets finds everything, no need to go back further */
+  if (now-sweeptime>CS_SWEEPBUCKETS)
+    sweeptime=now-CS_SWEEPBUCKETS;
+
+  while (sweeptime<now) {
+    sweeptime++;
+    bucket=&sweepbuckets[sweeptime%CS_SWEEPBUCKETS];
+
+    /* Take the bucket's list so that rescheduled channels aren't seen again */
+    if ((pending=*bucket))
+      pending->checkprev=&pending;
+    *bucket=NULL;
+
+    while ((rcp=pending)) {
+      cs_sweepunlink(rcp);
+
+      if (rcp->checktime>now) {
+        cs_sweeplink(bucket, rcp);
+        continue;
+      }
+
+      if (done>=CS_SWEEPBATCH) {
+        /* Put it all back and pick up from here next time */
+        cs_sweeplink(bucket, rcp);
+        while ((rcp=pending)) {
+          cs_sweepunlink(rcp);
+          cs_sweeplink(bucket, rcp);
+        }
+        sweeptime--;
+        return;
+      }
+
+      done++;
+      cs_timerfunc(rcp->index);
+    }
+  }
+}
+
 /*
  * cs_schedupdate:
  *  This function schedules an update check on a channel
@@ -945,11 +1043,7 @@ void cs_schedupdate(chanindex *cip, int mintime, int maxtime) {
   if (!(rcp=cip->exts[chanservext]) || CIsSuspended(rcp))
     return;
 
-  if (rcp->checksched) {
-    deleteschedule(rcp->checksched, cs_timerfunc, cip);
-  }
-
-  rcp->checksched=scheduleoneshot(time(NULL)+delay, cs_timerfunc, cip);
+  cs_schedchannel(rcp, time(NULL)+delay);
 }
 
 /*
@@ -979,11 +1073,9 @@ void cs_timerfunc(void *arg) {
 
   verifyregchan(rcp);
 
-  /* Always nullify the checksched even if the channel is suspended.. */
-  if (rcp->checksched) {
-    deleteschedule(rcp->checksched, cs_timerfunc, arg);
-    rcp->checksched=NULL;
-  }
+  /* Always take it out of the sweeper even if the channel is suspended.. */
+  cs_sweepunlink(rcp);
+  rcp->checktime=0;
   
   if (!cp || CIsSuspended(rcp))
     return;
@@ -1084,7 +1176,7 @@ void cs_timerfunc(void *arg) {
   }
 
   if (nextsched) 
-    rcp->checksched=scheduleoneshot(nextsched, cs_timerfunc, arg);
+    cs_schedchannel(rcp, nextsched);
   
   localsetmodeflush(&changes, 1);
 }
@@ -1097,7 +1189,7 @@ void cs_removechannel(regchan *rcp, char *reason) {
 
   cip=rcp->index;
   
-  for (i=0;i<REGCHANUSERHASHSIZE;i++) {
+  for (i=0;i<rcp->regusersize;i++) {
     for (rcup=rcp->regusers[i];rcup;rcup=nrcup) {
       nrcup=rcup->nextbychan;
       delreguserfromchannel(rcp, rcup->user);
@@ -1114,8 +1206,7 @@ void cs_removechannel(regchan *rcp, char *reason) {
 
   rcp->bans=NULL;
 
-  if (rcp->checksched)
-    deleteschedule(rcp->checksched, cs_timerfunc, rcp->index);
+  cs_sweepunlink(rcp);
     
   if (cip->channel) {
     chanservpartchan(cip->channel, reason);
@@ -1140,7 +1231,7 @@ int cs_removechannelifempty(nick *sender, regchan *rcp) {
   unsigned int i;
   regchanuser *rcup;
   
-  for (i=0;i<REGCHANUSERHASHSIZE;i++) {
+  for (i=0;i<rcp->regusersize;i++) {
     for (rcup=rcp->regusers[i];rcup;rcup=rcup->nextbychan) {
       if (rcup->flags & ~(QCUFLAGS_PUNISH))
         return 0;
@@ -1522,9 +1613,11 @@ regchan *cs_addchan(chanindex *cip, nick *sender, reguser *addedby, reguser *fou
   rcp->welcome=rcp->topic=rcp->key=rcp->suspendreason=rcp->comment=NULL;
 
   /* Users */
-  memset(rcp->regusers,0,REGCHANUSERHASHSIZE*sizeof(reguser *));
+  initregchanuserhash(rcp);
 
-  rcp->checksched=NULL;
+  rcp->checktime=0;
+  rcp->checknext=NULL;
+  rcp->checkprev=NULL;
   rcp->ltimestamp=0;
   for (i=0;i<CHANOPHISTORY;i++) {
     rcp->chanopnicks[i][0]='\0';
@@ -40,6 +40,8 @@ void loadmessages_part1(DBConn *, void *);
 void loadmessages_part2(DBConn *, void *);
 void loadcommandsummary_real(DBConn *, void *);
 
+void loadmarker(DBConn *, void *);
+
 /* User loading functions */
 void loadsomeusers(DBConn *, void *);
 void loadusersdone(DBConn *, void *);
@@ -249,12 +251,8 @@ void _init() {
 
     lastuserID=lastchannelID=lastdomainID=0;
 
-    dbloadtable("chanserv.users",NULL,loadsomeusers,loadusersdone);
-    dbloadtable("chanserv.channels",NULL,loadsomechannels,loadchannelsdone);
-    dbloadtable("chanserv.chanusers",loadchanusersinit,loadsomechanusers,loadchanusersdone);
-    dbloadtable("chanserv.bans",NULL,loadsomechanbans,loadchanbansdone);
-    dbloadtable("chanserv.maildomain",NULL, loadsomemaildomains,loadmaildomainsdone);
-    dbloadtable("chanserv.maillocks",NULL, loadsomemaillocks,loadmaillocksdone);
+    /* Decides between the snapshot and a full load */
+    dbasyncquery(loadmarker, NULL, "SELECT txid_current(), txid_snapshot_xmin(txid_current_snapshot())");
     
     loadmessages(); 
   }
@@ -262,8 +260,12 @@ void _init() {
 
 void _fini() {
   deregisterhook(HOOK_CORE_STATSREQUEST, csdb_handlestats);
+
+  csdb_flushupdates(NULL);
+  csdb_closesnapshot();
   
   csdb_freestuff();
+  finimessages();
 
   if (chanservext!=-1)
     releasechanext(chanservext);
@@ -275,10 +277,45 @@ void _fini() {
   dbdetach("chanserv");
 }
 
+/*
+ * loadmarker():
+ *  Gets the change marker before anything is loaded, then either warm
+ *  starts from the snapshot and fetches what changed since, or loads the
+ *  whole lot.
+ */
+void loadmarker(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+  unsigned long long txid=0, marker=0;
+
+  pgres=dbgetresult(dbconn);
+
+  if (dbquerysuccessful(pgres) && dbfetchrow(pgres)) {
+    txid=strtoull(dbgetvalue(pgres,0),NULL,10);
+    marker=strtoull(dbgetvalue(pgres,1),NULL,10);
+  } else {
+    Error("chanserv",ERR_WARNING,"Unable to get change marker, not using snapshot.");
+  }
+
+  if (pgres)
+    dbclear(pgres);
+
+  if (marker && csdb_loadsnapshot(txid, marker)) {
+    csdb_reconcilesnapshot();
+  } else {
+    dbloadtable("chanserv.users",NULL,loadsomeusers,loadusersdone);
+    dbloadtable("chanserv.channels",NULL,loadsomechannels,loadchannelsdone);
+    dbloadtable("chanserv.chanusers",loadchanusersinit,loadsomechanusers,loadchanusersdone);
+    dbloadtable("chanserv.bans",NULL,loadsomechanbans,loadchanbansdone);
+  }
+
+  dbloadtable("chanserv.maildomain",NULL, loadsomemaildomains,loadmaildomainsdone);
+  dbloadtable("chanserv.maillocks",NULL, loadsomemaillocks,loadmaillocksdone);
+}
+
 void csdb_handlestats(int hooknum, void *arg) {
-/*   long level=(long)arg; */
+  long level=(long)arg;
 
-  /* Keeping options open here */
+  csdb_writebehindstats(level);
 }
 
 void chanservdbclose() {
@@ -287,6 +324,105 @@ void chanservdbclose() {
 
 }
 
+/*
+ * csdb_fill*():
+ *  Copy the database fields of a row into the structure, the caller
+ *  deals with linking it in.  Shared by the loaders here and the
+ *  snapshot reconciliation.
+ */
+
+/* Sets localpart and domain from the email address and links the user in */
+void csdb_linkmaildomain(reguser *rup) {
+  char *local;
+  char mailbuf[1024];
+
+  if (rup->email) {
+    rup->domain=findorcreatemaildomain(rup->email->content);
+    addregusertomaildomain(rup, rup->domain);
+
+    strlcpy(mailbuf, rup->email->content, sizeof(mailbuf));
+    if((local=strchr(mailbuf, '@'))) {
+      *(local++)='\0';
+      rup->localpart=getsstring(mailbuf,EMAILLEN);
+    } else {
+      rup->localpart=NULL;
+    }
+  } else {
+    rup->domain=NULL;
+    rup->localpart=NULL;
+  }
+}
+
+void csdb_fillreguser(reguser *rup, DBResult *pgres) {
+  rup->ID=strtoul(dbgetvalue(pgres,0),NULL,10);
+  strncpy(rup->username,dbgetvalue(pgres,1),NICKLEN); rup->username[NICKLEN]='\0';
+  rup->created=strtoul(dbgetvalue(pgres,2),NULL,10);
+  rup->lastauth=strtoul(dbgetvalue(pgres,3),NULL,10);
+  rup->lastemailchange=strtoul(dbgetvalue(pgres,4),NULL,10);
+  rup->flags=strtoul(dbgetvalue(pgres,5),NULL,10);
+  rup->languageid=strtoul(dbgetvalue(pgres,6),NULL,10);
+  rup->suspendby=strtoul(dbgetvalue(pgres,7),NULL,10);
+  rup->suspendexp=strtoul(dbgetvalue(pgres,8),NULL,10);
+  rup->suspendtime=strtoul(dbgetvalue(pgres,9),NULL,10);
+  rup->lockuntil=strtoul(dbgetvalue(pgres,10),NULL,10);
+  strncpy(rup->password,dbgetvalue(pgres,11),PASSLEN); rup->password[PASSLEN]='\0';
+  rup->email=getsstring(dbgetvalue(pgres,12),100);
+  csdb_linkmaildomain(rup);
+  rup->lastemail=getsstring(dbgetvalue(pgres,13),100);
+  rup->lastuserhost=getsstring(dbgetvalue(pgres,14),75);
+  rup->suspendreason=getsstring(dbgetvalue(pgres,15),250);
+  rup->comment=getsstring(dbgetvalue(pgres,16),250);
+  rup->info=getsstring(dbgetvalue(pgres,17),100);
+  rup->lastpasschange=strtoul(dbgetvalue(pgres,18),NULL,10);
+}
+
+void csdb_fillregchan(regchan *rcp, DBResult *pgres) {
+  rcp->ID=strtoul(dbgetvalue(pgres,0),NULL,10);
+  rcp->flags=strtoul(dbgetvalue(pgres,2),NULL,10);
+  rcp->forcemodes=strtoul(dbgetvalue(pgres,3),NULL,10);
+  rcp->denymodes=strtoul(dbgetvalue(pgres,4),NULL,10);
+  rcp->limit=strtoul(dbgetvalue(pgres,5),NULL,10);
+  rcp->autolimit=strtoul(dbgetvalue(pgres,6),NULL,10);
+  rcp->banstyle=strtoul(dbgetvalue(pgres,7),NULL,10);
+  rcp->created=strtoul(dbgetvalue(pgres,8),NULL,10);
+  rcp->lastactive=strtoul(dbgetvalue(pgres,9),NULL,10);
+  rcp->statsreset=strtoul(dbgetvalue(pgres,10),NULL,10);
+  rcp->banduration=strtoul(dbgetvalue(pgres,11),NULL,10);
+  rcp->founder=strtol(dbgetvalue(pgres,12),NULL,10);
+  rcp->addedby=strtol(dbgetvalue(pgres,13),NULL,10);
+  rcp->suspendby=strtol(dbgetvalue(pgres,14),NULL,10);
+  rcp->suspendtime=strtol(dbgetvalue(pgres,15),NULL,10);
+  rcp->chantype=strtoul(dbgetvalue(pgres,16),NULL,10);
+  rcp->totaljoins=strtoul(dbgetvalue(pgres,17),NULL,10);
+  rcp->tripjoins=strtoul(dbgetvalue(pgres,18),NULL,10);
+  rcp->maxusers=strtoul(dbgetvalue(pgres,19),NULL,10);
+  rcp->tripusers=strtoul(dbgetvalue(pgres,20),NULL,10);
+  rcp->welcome=getsstring(dbgetvalue(pgres,21),500);
+  rcp->topic=getsstring(dbgetvalue(pgres,22),TOPICLEN);
+  rcp->key=getsstring(dbgetvalue(pgres,23),KEYLEN);
+  rcp->suspendreason=getsstring(dbgetvalue(pgres,24),250);
+  rcp->comment=getsstring(dbgetvalue(pgres,25),250);
+  rcp->ltimestamp=strtoul(dbgetvalue(pgres,26),NULL,10);
+
+  if (CIsAutoLimit(rcp))
+    rcp->limit=0;
+}
+
+void csdb_fillregchanuser(regchanuser *rcup, DBResult *pgres) {
+  rcup->flags=strtol(dbgetvalue(pgres,2),NULL,10);
+  rcup->changetime=strtol(dbgetvalue(pgres,3),NULL,10);
+  rcup->usetime=strtol(dbgetvalue(pgres,4),NULL,10);
+  rcup->info=getsstring(dbgetvalue(pgres,5),100);
+}
+
+void csdb_fillregban(regban *rbp, DBResult *pgres) {
+  rbp->ID=strtoul(dbgetvalue(pgres,0),NULL,10);
+  rbp->setby=strtoul(dbgetvalue(pgres,2),NULL,10);
+  rbp->expiry=strtoul(dbgetvalue(pgres,4),NULL,10);
+  rbp->reason=getsstring(dbgetvalue(pgres,5),200);
+  rbp->cbp=makeban(dbgetvalue(pgres,3));
+}
+
 /*
  * loadsomeusers():
  *  Loads some users in from the SQL DB
@@ -295,8 +431,6 @@ void chanservdbclose() {
 void loadsomeusers(DBConn *dbconn, void *arg) {
   DBResult *pgres;
   reguser *rup;
-  char *local;
-  char mailbuf[1024];
 
   pgres=dbgetresult(dbconn);
 
@@ -313,40 +447,7 @@ void loadsomeusers(DBConn *dbconn, void *arg) {
   while(dbfetchrow(pgres)) {
     rup=getreguser();
     rup->status=0;
-    rup->ID=strtoul(dbgetvalue(pgres,0),NULL,10);
-    strncpy(rup->username,dbgetvalue(pgres,1),NICKLEN); rup->username[NICKLEN]='\0';
-    rup->created=strtoul(dbgetvalue(pgres,2),NULL,10);
-    rup->lastauth=strtoul(dbgetvalue(pgres,3),NULL,10);
-    rup->lastemailchange=strtoul(dbgetvalue(pgres,4),NULL,10);
-    rup->flags=strtoul(dbgetvalue(pgres,5),NULL,10);
-    rup->languageid=strtoul(dbgetvalue(pgres,6),NULL,10);
-    rup->suspendby=strtoul(dbgetvalue(pgres,7),NULL,10);
-    rup->suspendexp=strtoul(dbgetvalue(pgres,8),NULL,10);
-    rup->suspendtime=strtoul(dbgetvalue(pgres,9),NULL,10);
-    rup->lockuntil=strtoul(dbgetvalue(pgres,10),NULL,10);
-    strncpy(rup->password,dbgetvalue(pgres,11),PASSLEN); rup->password[PASSLEN]='\0';
-    rup->email=getsstring(dbgetvalue(pgres,12),100);
-    if (rup->email) {
-      rup->domain=findorcreatemaildomain(rup->email->content);
-      addregusertomaildomain(rup, rup->domain);
-
-      strlcpy(mailbuf, rup->email->content, sizeof(mailbuf));
-      if((local=strchr(mailbuf, '@'))) {
-        *(local++)='\0';
-        rup->localpart=getsstring(mailbuf,EMAILLEN);
-      } else {
-        rup->localpart=NULL;
-      }
-    } else {
-      rup->domain=NULL;
-      rup->localpart=NULL;
-    }
-    rup->lastemail=getsstring(dbgetvalue(pgres,13),100);
-    rup->lastuserhost=getsstring(dbgetvalue(pgres,14),75);
-    rup->suspendreason=getsstring(dbgetvalue(pgres,15),250);
-    rup->comment=getsstring(dbgetvalue(pgres,16),250);
-    rup->info=getsstring(dbgetvalue(pgres,17),100);
-    rup->lastpasschange=strtoul(dbgetvalue(pgres,18),NULL,10);
+    csdb_fillreguser(rup, pgres);
     rup->knownon=NULL;
     rup->checkshd=NULL;
     rup->stealcount=0;
@@ -369,10 +470,30 @@ void loadusersdone(DBConn *conn, void *arg) {
  * Channel loading functions
  */
 
+/* Sets up the runtime (non-DB) fields of a new regchan */
+void csdb_initregchan(regchan *rcp, time_t now) {
+  int j;
+
+  rcp->status=0;
+  rcp->lastbancheck=0;
+  rcp->lastcountersync=now;
+  rcp->lastpart=0;
+  rcp->bans=NULL;
+  rcp->checktime=0;
+  rcp->checknext=NULL;
+  rcp->checkprev=NULL;
+  initregchanuserhash(rcp);
+
+  for (j=0;j<CHANOPHISTORY;j++) {
+    rcp->chanopnicks[j][0]='\0';
+    rcp->chanopaccts[j]=0;
+  }
+  rcp->chanoppos=0;
+}
+
 void loadsomechannels(DBConn *dbconn, void *arg) {
   DBResult *pgres;
   regchan *rcp;
-  int j;
   chanindex *cip;
   time_t now=time(NULL);
 
@@ -397,52 +518,12 @@ void loadsomechannels(DBConn *dbconn, void *arg) {
     rcp=getregchan();
     cip->exts[chanservext]=rcp;
     
-    rcp->ID=strtoul(dbgetvalue(pgres,0),NULL,10);
     rcp->index=cip;
-    rcp->flags=strtoul(dbgetvalue(pgres,2),NULL,10);
-    rcp->status=0; /* Non-DB field */
-    rcp->lastbancheck=0;
-    rcp->lastcountersync=now;
-    rcp->lastpart=0;
-    rcp->bans=NULL;
-    rcp->forcemodes=strtoul(dbgetvalue(pgres,3),NULL,10);
-    rcp->denymodes=strtoul(dbgetvalue(pgres,4),NULL,10);
-    rcp->limit=strtoul(dbgetvalue(pgres,5),NULL,10);
-    rcp->autolimit=strtoul(dbgetvalue(pgres,6),NULL,10);
-    rcp->banstyle=strtoul(dbgetvalue(pgres,7),NULL,10);
-    rcp->created=strtoul(dbgetvalue(pgres,8),NULL,10);
-    rcp->lastactive=strtoul(dbgetvalue(pgres,9),NULL,10);
-    rcp->statsreset=strtoul(dbgetvalue(pgres,10),NULL,10);
-    rcp->banduration=strtoul(dbgetvalue(pgres,11),NULL,10);
-    rcp->founder=strtol(dbgetvalue(pgres,12),NULL,10);
-    rcp->addedby=strtol(dbgetvalue(pgres,13),NULL,10);
-    rcp->suspendby=strtol(dbgetvalue(pgres,14),NULL,10);
-    rcp->suspendtime=strtol(dbgetvalue(pgres,15),NULL,10);
-    rcp->chantype=strtoul(dbgetvalue(pgres,16),NULL,10);
-    rcp->totaljoins=strtoul(dbgetvalue(pgres,17),NULL,10);
-    rcp->tripjoins=strtoul(dbgetvalue(pgres,18),NULL,10);
-    rcp->maxusers=strtoul(dbgetvalue(pgres,19),NULL,10);
-    rcp->tripusers=strtoul(dbgetvalue(pgres,20),NULL,10);
-    rcp->welcome=getsstring(dbgetvalue(pgres,21),500);
-    rcp->topic=getsstring(dbgetvalue(pgres,22),TOPICLEN);
-    rcp->key=getsstring(dbgetvalue(pgres,23),KEYLEN);
-    rcp->suspendreason=getsstring(dbgetvalue(pgres,24),250);
-    rcp->comment=getsstring(dbgetvalue(pgres,25),250);
-    rcp->checksched=NULL;
-    rcp->ltimestamp=strtoul(dbgetvalue(pgres,26),NULL,10);
-    memset(rcp->regusers,0,REGCHANUSERHASHSIZE*sizeof(reguser *));
+    csdb_initregchan(rcp, now);
+    csdb_fillregchan(rcp, pgres);
 
     if (rcp->ID > lastchannelID)
       lastchannelID=rcp->ID;
-    
-    if (CIsAutoLimit(rcp))
-      rcp->limit=0;
-    
-    for (j=0;j<CHANOPHISTORY;j++) {
-      rcp->chanopnicks[j][0]='\0';
-      rcp->chanopaccts[j]=0;
-    }
-    rcp->chanoppos=0;
   }
 
   dbclear(pgres);
@@ -512,10 +593,7 @@ void loadsomechanusers(DBConn *dbconn, void *arg) {
       rcup=getregchanuser();
       rcup->user=rup;
       rcup->chan=rcp;
-      rcup->flags=strtol(dbgetvalue(pgres,2),NULL,10);
-      rcup->changetime=strtol(dbgetvalue(pgres,3),NULL,10);
-      rcup->usetime=strtol(dbgetvalue(pgres,4),NULL,10);
-      rcup->info=getsstring(dbgetvalue(pgres,5),100);
+      csdb_fillregchanuser(rcup, pgres);
       addregusertochannel(rcup);
       total++;
     }
@@ -532,8 +610,7 @@ void loadsomechanbans(DBConn *dbconn, void *arg) {
   DBResult *pgres;
   regban  *rbp;
   regchan *rcp;
-  int uid,cid,bid;
-  time_t expiry;
+  int cid;
   int total=0;
 
   pgres=dbgetresult(dbconn);
@@ -549,10 +626,7 @@ void loadsomechanbans(DBConn *dbconn, void *arg) {
   }
 
   while(dbfetchrow(pgres)) {
-    bid=strtoul(dbgetvalue(pgres,0),NULL,10);
     cid=strtoul(dbgetvalue(pgres,1),NULL,10);
-    uid=strtoul(dbgetvalue(pgres,2),NULL,10);
-    expiry=strtoul(dbgetvalue(pgres,4),NULL,10);
 
     if (cid>lastchannelID || !(rcp=allchans[cid])) {
       Error("chanserv",ERR_WARNING,"Skipping ban for unknown chan %d",cid);
@@ -560,18 +634,14 @@ void loadsomechanbans(DBConn *dbconn, void *arg) {
     }
 
     rbp=getregban();
-    rbp->setby=uid;
-    rbp->ID=bid;
-    rbp->expiry=expiry;
-    rbp->reason=getsstring(dbgetvalue(pgres,5),200);
-    rbp->cbp=makeban(dbgetvalue(pgres,3));
+    csdb_fillregban(rbp, pgres);
     rbp->next=rcp->bans;
     rcp->bans=rbp;
    
     total++;
 
-    if (bid>lastbanID)
-      lastbanID=bid;
+    if (rbp->ID>lastbanID)
+      lastbanID=rbp->ID;
   }
 
   dbclear(pgres);
@@ -602,6 +672,8 @@ void loadmessages_part1(DBConn *dbconn, void *arg) {
         freesstring(csmessages[i][j]);
         csmessages[i][j]=NULL;
       }
+      free(cstemplates[i][j]);
+      cstemplates[i][j]=NULL;
     }
   }    
 
@@ -665,7 +737,9 @@ void loadmessages_part2(DBConn *dbconn, void *arg) {
       continue;
     }
     
+    free(cstemplates[k][j]);
     csmessages[k][j]=getsstring(dbgetvalue(pgres,2),250);
+    cstemplates[k][j]=q9compile(csmessages[k][j]->content);
   } 
                           
   dbclear(pgres);
@@ -846,5 +920,7 @@ void loadmaillocksdone(DBConn *dbconn, void *arg) {
 
   chanservdb_ready=1;
   triggerhook(HOOK_CHANSERV_DBLOADED, NULL);
+
+  csdb_snapshotloadcomplete();
 }
 
@@ -19,6 +19,8 @@ regchan *getregchan() {
 
 void freeregchan(regchan *rcp) {
   verifyregchan(rcp);
+  if (rcp->regusers!=rcp->reguserinline)
+    nsfree(POOL_CHANSERVDB, rcp->regusers);
   nsfree(POOL_CHANSERVDB, rcp);
 }
 
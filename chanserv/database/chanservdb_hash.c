@@ -10,6 +10,7 @@
 
 #include "../chanserv.h"
 #include "../../lib/irc_string.h"
+#include "../../core/nsmalloc.h"
 
 reguser *regusernicktable[REGUSERHASHSIZE];
 
@@ -115,18 +116,60 @@ void removereguserfromhash(reguser *rup) {
   }  
 }
 
+/*
+ * The chanlev hash starts in the regchan itself and moves out to a bigger
+ * table as the chanlev grows, so big channels keep short chains without
+ * every channel paying for it.
+ */
+void initregchanuserhash(regchan *rcp) {
+  rcp->regusers=rcp->reguserinline;
+  rcp->regusersize=REGCHANUSERHASHSIZE;
+  rcp->regusercount=0;
+  memset(rcp->reguserinline,0,sizeof(rcp->reguserinline));
+}
+
+/* Only ever grows: callers delete entries while walking the buckets */
+static void growregchanuserhash(regchan *rcp, unsigned int newsize) {
+  regchanuser **newtable, *rcup, *nrcup;
+  unsigned int i;
+
+  if (!(newtable=nsmalloc(POOL_CHANSERVDB, newsize*sizeof(regchanuser *))))
+    return;
+
+  memset(newtable,0,newsize*sizeof(regchanuser *));
+
+  for (i=0;i<rcp->regusersize;i++) {
+    for (rcup=rcp->regusers[i];rcup;rcup=nrcup) {
+      nrcup=rcup->nextbychan;
+      rcup->nextbychan=newtable[rcup->user->ID%newsize];
+      newtable[rcup->user->ID%newsize]=rcup;
+    }
+  }
+
+  if (rcp->regusers!=rcp->reguserinline)
+    nsfree(POOL_CHANSERVDB, rcp->regusers);
+
+  rcp->regusers=newtable;
+  rcp->regusersize=newsize;
+}
+
 void addregusertochannel(regchanuser *rcup) {
+  regchan *rcp=rcup->chan;
+
+  if (++rcp->regusercount > rcp->regusersize*REGCHANUSERHASHLOAD)
+    growregchanuserhash(rcp, rcp->regusersize*4);
+
   rcup->nextbyuser=(rcup->user->knownon);
-  rcup->nextbychan=(rcup->chan->regusers[(rcup->user->ID)%REGCHANUSERHASHSIZE]);
+  rcup->nextbychan=(rcp->regusers[(rcup->user->ID)%rcp->regusersize]);
 
   rcup->user->knownon=rcup;
-  rcup->chan->regusers[(rcup->user->ID)%REGCHANUSERHASHSIZE]=rcup;
+  rcp->regusers[(rcup->user->ID)%rcp->regusersize]=rcup;
 }
 
 regchanuser *findreguseronchannel(regchan *rcp, reguser *rup) {
   regchanuser *rcup;
 
-  for (rcup=rcp->regusers[(rup->ID)%REGCHANUSERHASHSIZE];rcup;rcup=rcup->nextbychan) {
+  for (rcup=rcp->regusers[(rup->ID)%rcp->regusersize];rcup;rcup=rcup->nextbychan) {
     if (rcup->user==rup) {
       return rcup;
     }
@@ -140,7 +183,7 @@ void delreguserfromchannel(regchan *rcp, reguser *rup) {
   regchanuser **rcuh;
   int found=0;
 
-  for (rcuh=&(rcp->regusers[(rup->ID)%REGCHANUSERHASHSIZE]);*rcuh;
+  for (rcuh=&(rcp->regusers[(rup->ID)%rcp->regusersize]);*rcuh;
        rcuh=&((*rcuh)->nextbychan)) {
     if ((*rcuh)->user==rup) {
       /* Found the user */
@@ -158,6 +201,8 @@ void delreguserfromchannel(regchan *rcp, reguser *rup) {
     return;
   }
 
+  rcp->regusercount--;
+
   for (rcuh=&(rup->knownon);*rcuh;rcuh=&((*rcuh)->nextbyuser)) {
     if ((*rcuh)->chan==rcp) {
       /* Found the channel */
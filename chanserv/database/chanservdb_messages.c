@@ -3,11 +3,18 @@
 
 #include "../chanserv.h"
 
+#include <stdlib.h>
+#include <ctype.h>
+
 cslang *cslanguages[MAXLANG];
 unsigned int cslangcount;
 
 sstring *csmessages[MAXLANG][MAXMESSAGES];
 
+/* Compiled versions of csmessages and the built in defaults */
+q9template *cstemplates[MAXLANG][MAXMESSAGES];
+q9template *csdefaulttemplates[MAXMESSAGES];
+
 void initmessages() {
   int i;
   int j;
@@ -16,6 +23,94 @@ void initmessages() {
     cslanguages[i]=NULL;
     for (j=0;j<MAXMESSAGES;j++) {
       csmessages[i][j]=NULL;
+      cstemplates[i][j]=NULL;
+    }
+  }
+
+  for (j=0;j<MAXMESSAGES;j++)
+    csdefaulttemplates[j]=defaultmessages[j*2]?q9compile(defaultmessages[j*2]):NULL;
+}
+
+void finimessages() {
+  int i;
+  int j;
+
+  for (j=0;j<MAXMESSAGES;j++) {
+    for (i=0;i<MAXLANG;i++) {
+      free(cstemplates[i][j]);
+      cstemplates[i][j]=NULL;
+    }
+    free(csdefaulttemplates[j]);
+    csdefaulttemplates[j]=NULL;
+  }
+}
+
+/*
+ * Splits format into segments, filling them in if tp is set.  Literal
+ * segments point into text, which is a copy of format.  Returns the
+ * number of segments.
+ */
+static unsigned int q9parse(const char *format, q9template *tp, const char *text) {
+  const char *p, *start=format;
+  unsigned int n=0;
+
+#define q9literal(s, l) do { if (tp) { tp->segment[n].text=(s); tp->segment[n].len=(l); tp->segment[n].arg=0; } n++; } while(0)
+
+  for (p=format;*p;p++) {
+    if (*p!='$')
+      continue;
+
+    /* A $ at the very end is dropped */
+    if (!p[1])
+      break;
+
+    if (p>start)
+      q9literal(text+(start-format), p-start);
+
+    if (p[1]=='$') {
+      /* $$ is a literal $, which starts the next literal */
+      start=++p;
+      continue;
+    }
+
+    if (isdigit((unsigned char)p[1])) {
+      if (tp) {
+        tp->segment[n].text=NULL;
+        tp->segment[n].len=0;
+        tp->segment[n].arg=p[1]-'0';
+      }
+      n++;
+    } else {
+      q9literal("(bad format specifier)", strlen("(bad format specifier)"));
     }
+
+    p++;
+    start=p+1;
   }
+
+  if (p>start)
+    q9literal(text+(start-format), p-start);
+
+#undef q9literal
+
+  return n;
+}
+
+q9template *q9compile(const char *format) {
+  q9template *tp;
+  unsigned int n;
+  size_t len=strlen(format);
+  char *text;
+
+  n=q9parse(format, NULL, format);
+
+  if (!(tp=malloc(sizeof(q9template)+n*sizeof(q9segment)+len+1)))
+    return NULL;
+
+  text=(char *)&tp->segment[n];
+  memcpy(text, format, len+1);
+
+  tp->segments=q9parse(format, tp, text);
+
+  return tp;
 }
@@ -0,0 +1,1194 @@
+#define _GNU_SOURCE
+/*
+ * chanservdb_snapshot.c:
+ *  Local binary copy of the users, channels, chanlevs and bans so we can
+ *  come back up without streaming the whole database, plus the queries
+ *  that bring a loaded snapshot back in line with it.
+ *
+ *  The change marker is the oldest transaction still running when the
+ *  state was captured (txid_snapshot_xmin).  Anything committed after that
+ *  has an xmin at or past the marker, so after loading we only need to
+ *  fetch those rows.  Deletions leave nothing behind, so they are found by
+ *  comparing the IDs in the database with what we have.
+ */
+
+#include "../chanserv.h"
+#include "../../core/error.h"
+#include "../../core/schedule.h"
+#include "../../core/logbuf.h"
+#include "../../dbapi/dbapi.h"
+#include "../../bans/bans.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define SNAPSHOT_MAGIC   0x43534e50 /* "CSNP" */
+#define SNAPSHOT_VERSION 1
+
+#define SNAPSHOT_FILE    "data/chanserv.snapshot"
+#define SNAPSHOT_TMPFILE "data/chanserv.snapshot.tmp"
+
+#define SNAPSHOT_NOSTRING 0xffff
+
+/*
+ * Layout (host byte order, it never leaves this machine):
+ *   header:   magic, version, marker, created, last IDs, counts
+ *   user:     fixed fields, username, password, 6 optional strings
+ *   channel:  fixed fields, name, 5 optional strings, chanusers, bans
+ *   chanuser: fixed fields, info
+ *   ban:      fixed fields, mask, reason
+ *   trailer:  magic
+ */
+
+struct snapshotheader {
+  uint32_t magic, version;
+  uint64_t marker;
+  int64_t created;
+  uint32_t lastuserID, lastchannelID, lastbanID;
+  uint32_t users, channels;
+};
+
+struct snapshotuser {
+  uint32_t ID, flags, suspendby;
+  int32_t languageid;
+  int64_t created, lastauth, lastemailchange, suspendexp, suspendtime, lockuntil, lastpasschange;
+};
+
+struct snapshotchan {
+  uint32_t ID, flags, forcemodes, denymodes;
+  uint32_t founder, addedby, suspendby;
+  uint32_t totaljoins, tripjoins, maxusers, tripusers;
+  int32_t limit, autolimit, banstyle, chantype;
+  int64_t created, lastactive, statsreset, banduration, suspendtime, ltimestamp;
+  uint32_t chanusers, bans;
+};
+
+struct snapshotchanuser {
+  uint32_t userID, flags;
+  int64_t changetime, usetime;
+};
+
+struct snapshotban {
+  uint32_t ID, setby;
+  int64_t expiry;
+};
+
+struct idpair {
+  unsigned int a, b;
+};
+
+static unsigned long long snapshotmarker; /* marker of the snapshot we loaded */
+static unsigned long long startmarker;    /* taken before this run started loading */
+static unsigned long long currentmarker;  /* what the next snapshot we write is good for */
+static int snapshotloaded, snapshotdisabled;
+static pid_t snapshotpid;
+
+/* state for the reconcile queries */
+static regchan **chanbyID;
+static unsigned int chanbyIDsize;
+static unsigned int reconciled;
+
+void csdb_fillreguser(reguser *rup, DBResult *pgres);
+void csdb_fillregchan(regchan *rcp, DBResult *pgres);
+void csdb_fillregchanuser(regchanuser *rcup, DBResult *pgres);
+void csdb_fillregban(regban *rbp, DBResult *pgres);
+
+static void csdb_refreshsnapshot(void *arg);
+
+static int writebuf(FILE *fp, const char *buf, size_t len) {
+  uint16_t slen = len;
+
+  return fwrite(&slen, sizeof(slen), 1, fp) == 1 && fwrite(buf, 1, len, fp) == len;
+}
+
+static int writestring(FILE *fp, sstring *s) {
+  uint16_t len = SNAPSHOT_NOSTRING;
+
+  if(s)
+    return writebuf(fp, s->content, s->length);
+
+  return fwrite(&len, sizeof(len), 1, fp) == 1;
+}
+
+/* returns -1 on error, 0 for a missing string and 1 otherwise */
+static int readbuf(FILE *fp, char *buf, size_t buflen) {
+  uint16_t len;
+
+  if(fread(&len, sizeof(len), 1, fp) != 1)
+    return -1;
+
+  if(len == SNAPSHOT_NOSTRING)
+    return 0;
+
+  if(len >= buflen || fread(buf, 1, len, fp) != len)
+    return -1;
+
+  buf[len] = '\0';
+
+  return 1;
+}
+
+static int readstring(FILE *fp, sstring **s, int maxlen) {
+  char buf[512];
+  int ret;
+
+  *s = NULL;
+
+  ret = readbuf(fp, buf, sizeof(buf));
+  if(ret < 0)
+    return 0;
+
+  if(ret)
+    *s = getsstring(buf, maxlen);
+
+  return 1;
+}
+
+static int csdb_writesnapshot(unsigned long long marker) {
+  struct snapshotheader hdr;
+  struct snapshotuser su;
+  struct snapshotchan sc;
+  struct snapshotchanuser scu;
+  struct snapshotban sb;
+  uint32_t trailer = SNAPSHOT_MAGIC;
+  reguser *rup;
+  regchan *rcp;
+  regchanuser *rcup;
+  regban *rbp;
+  chanindex *cip;
+  FILE *fp;
+  int i, j, ok;
+
+  fp = fopen(SNAPSHOT_TMPFILE, "wb");
+  if(!fp) {
+    Error("chanserv", ERR_WARNING, "Unable to open %s for writing.", SNAPSHOT_TMPFILE);
+    return 0;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SNAPSHOT_MAGIC;
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.marker = marker;
+  hdr.created = time(NULL);
+  hdr.lastuserID = lastuserID;
+  hdr.lastchannelID = lastchannelID;
+  hdr.lastbanID = lastbanID;
+
+  for(i=0;i<REGUSERHASHSIZE;i++)
+    for(rup=regusernicktable[i];rup;rup=rup->nextbyname)
+      hdr.users++;
+
+  for(i=0;i<CHANNELHASHSIZE;i++)
+    for(cip=chantable[i];cip;cip=cip->next)
+      if(cip->exts[chanservext])
+        hdr.channels++;
+
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+  for(i=0;i<REGUSERHASHSIZE && ok;i++) {
+    for(rup=regusernicktable[i];rup && ok;rup=rup->nextbyname) {
+      memset(&su, 0, sizeof(su));
+      su.ID = rup->ID;
+      su.flags = rup->flags;
+      su.suspendby = rup->suspendby;
+      su.languageid = rup->languageid;
+      su.created = rup->created;
+      su.lastauth = rup->lastauth;
+      su.lastemailchange = rup->lastemailchange;
+      su.suspendexp = rup->suspendexp;
+      su.suspendtime = rup->suspendtime;
+      su.lockuntil = rup->lockuntil;
+      su.lastpasschange = rup->lastpasschange;
+
+      ok = fwrite(&su, sizeof(su), 1, fp) == 1 &&
+           writebuf(fp, rup->username, strlen(rup->username)) &&
+           writebuf(fp, rup->password, strlen(rup->password)) &&
+           writestring(fp, rup->email) && writestring(fp, rup->lastemail) &&
+           writestring(fp, rup->lastuserhost) && writestring(fp, rup->suspendreason) &&
+           writestring(fp, rup->comment) && writestring(fp, rup->info);
+    }
+  }
+
+  for(i=0;i<CHANNELHASHSIZE && ok;i++) {
+    for(cip=chantable[i];cip && ok;cip=cip->next) {
+      if(!(rcp=cip->exts[chanservext]))
+        continue;
+
+      memset(&sc, 0, sizeof(sc));
+      sc.ID = rcp->ID;
+      sc.flags = rcp->flags;
+      sc.forcemodes = rcp->forcemodes;
+      sc.denymodes = rcp->denymodes;
+      sc.founder = rcp->founder;
+      sc.addedby = rcp->addedby;
+      sc.suspendby = rcp->suspendby;
+      sc.totaljoins = rcp->totaljoins;
+      sc.tripjoins = rcp->tripjoins;
+      sc.maxusers = rcp->maxusers;
+      sc.tripusers = rcp->tripusers;
+      sc.limit = rcp->limit;
+      sc.autolimit = rcp->autolimit;
+      sc.banstyle = rcp->banstyle;
+      sc.chantype = rcp->chantype;
+      sc.created = rcp->created;
+      sc.lastactive = rcp->lastactive;
+      sc.statsreset = rcp->statsreset;
+      sc.banduration = rcp->banduration;
+      sc.suspendtime = rcp->suspendtime;
+      sc.ltimestamp = rcp->ltimestamp;
+
+      for(j=0;j<rcp->regusersize;j++)
+        for(rcup=rcp->regusers[j];rcup;rcup=rcup->nextbychan)
+          sc.chanusers++;
+
+      for(rbp=rcp->bans;rbp;rbp=rbp->next)
+        sc.bans++;
+
+      ok = fwrite(&sc, sizeof(sc), 1, fp) == 1 && writestring(fp, cip->name) &&
+           writestring(fp, rcp->welcome) && writestring(fp, rcp->topic) &&
+           writestring(fp, rcp->key) && writestring(fp, rcp->suspendreason) &&
+           writestring(fp, rcp->comment);
+
+      for(j=0;j<rcp->regusersize && ok;j++) {
+        for(rcup=rcp->regusers[j];rcup && ok;rcup=rcup->nextbychan) {
+          memset(&scu, 0, sizeof(scu));
+          scu.userID = rcup->user->ID;
+          scu.flags = rcup->flags;
+          scu.changetime = rcup->changetime;
+          scu.usetime = rcup->usetime;
+
+          ok = fwrite(&scu, sizeof(scu), 1, fp) == 1 && writestring(fp, rcup->info);
+        }
+      }
+
+      for(rbp=rcp->bans;rbp && ok;rbp=rbp->next) {
+        char *mask = bantostring(rbp->cbp);
+
+        memset(&sb, 0, sizeof(sb));
+        sb.ID = rbp->ID;
+        sb.setby = rbp->setby;
+        sb.expiry = rbp->expiry;
+
+        ok = fwrite(&sb, sizeof(sb), 1, fp) == 1 && writebuf(fp, mask, strlen(mask)) &&
+             writestring(fp, rbp->reason);
+      }
+    }
+  }
+
+  if(ok)
+    ok = fwrite(&trailer, sizeof(trailer), 1, fp) == 1;
+
+  if(fclose(fp))
+    ok = 0;
+
+  if(!ok || rename(SNAPSHOT_TMPFILE, SNAPSHOT_FILE)) {
+    Error("chanserv", ERR_WARNING, "Error writing chanserv snapshot.");
+    unlink(SNAPSHOT_TMPFILE);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Throws away everything a failed snapshot load put in, nothing else has
+ * been loaded at that point so the user and channel tables are ours.
+ */
+static void csdb_unloadsnapshot(void) {
+  int i, j;
+  reguser *rup, *nrup;
+  regchan *rcp;
+  regchanuser *rcup, *nrcup;
+  regban *rbp, *nrbp;
+  chanindex *cip, *ncip;
+  authname *anp;
+
+  for(i=0;i<CHANNELHASHSIZE;i++) {
+    for(cip=chantable[i];cip;cip=ncip) {
+      ncip=cip->next;
+      if(!(rcp=cip->exts[chanservext]))
+        continue;
+
+      for(j=0;j<rcp->regusersize;j++) {
+        for(rcup=rcp->regusers[j];rcup;rcup=nrcup) {
+          nrcup=rcup->nextbychan;
+          freesstring(rcup->info);
+          freeregchanuser(rcup);
+        }
+      }
+
+      for(rbp=rcp->bans;rbp;rbp=nrbp) {
+        nrbp=rbp->next;
+        freesstring(rbp->reason);
+        freechanban(rbp->cbp);
+        freeregban(rbp);
+      }
+
+      freesstring(rcp->welcome);
+      freesstring(rcp->topic);
+      freesstring(rcp->key);
+      freesstring(rcp->suspendreason);
+      freesstring(rcp->comment);
+      freeregchan(rcp);
+
+      cip->exts[chanservext]=NULL;
+      releasechanindex(cip);
+    }
+  }
+
+  for(i=0;i<REGUSERHASHSIZE;i++) {
+    for(rup=regusernicktable[i];rup;rup=nrup) {
+      nrup=rup->nextbyname;
+
+      delreguserfrommaildomain(rup, rup->domain);
+      freesstring(rup->localpart);
+      freesstring(rup->email);
+      freesstring(rup->lastemail);
+      freesstring(rup->lastuserhost);
+      freesstring(rup->suspendreason);
+      freesstring(rup->comment);
+      freesstring(rup->info);
+
+      if((anp=findauthname(rup->ID))) {
+        anp->exts[chanservaext]=NULL;
+        releaseauthname(anp);
+      }
+
+      freereguser(rup);
+    }
+    regusernicktable[i]=NULL;
+  }
+
+  lastuserID=lastchannelID=lastbanID=0;
+}
+
+static int loadusers(FILE *fp, uint32_t count) {
+  struct snapshotuser su;
+  char username[NICKLEN+1], password[PASSLEN+1];
+  sstring *str[6];
+  reguser *rup;
+  uint32_t i;
+  int j, ok;
+
+  for(i=0;i<count;i++) {
+    if(fread(&su, sizeof(su), 1, fp) != 1 || readbuf(fp, username, sizeof(username)) != 1 ||
+       readbuf(fp, password, sizeof(password)) != 1)
+      return 0;
+
+    memset(str, 0, sizeof(str));
+    ok = readstring(fp, &str[0], 100) && readstring(fp, &str[1], 100) &&
+         readstring(fp, &str[2], 75) && readstring(fp, &str[3], 250) &&
+         readstring(fp, &str[4], 250) && readstring(fp, &str[5], 100);
+
+    if(!ok || findreguserbyID(su.ID)) {
+      for(j=0;j<6;j++)
+        freesstring(str[j]);
+      return 0;
+    }
+
+    rup=getreguser();
+    rup->status=0;
+    rup->ID=su.ID;
+    strcpy(rup->username, username);
+    rup->created=su.created;
+    rup->lastauth=su.lastauth;
+    rup->lastemailchange=su.lastemailchange;
+    rup->flags=su.flags;
+    rup->languageid=su.languageid;
+    rup->suspendby=su.suspendby;
+    rup->suspendexp=su.suspendexp;
+    rup->suspendtime=su.suspendtime;
+    rup->lockuntil=su.lockuntil;
+    strcpy(rup->password, password);
+    rup->email=str[0];
+    csdb_linkmaildomain(rup);
+    rup->lastemail=str[1];
+    rup->lastuserhost=str[2];
+    rup->suspendreason=str[3];
+    rup->comment=str[4];
+    rup->info=str[5];
+    rup->lastpasschange=su.lastpasschange;
+    rup->knownon=NULL;
+    rup->checkshd=NULL;
+    rup->stealcount=0;
+    rup->fakeuser=NULL;
+    addregusertohash(rup);
+  }
+
+  return 1;
+}
+
+static int loadchannels(FILE *fp, uint32_t count) {
+  struct snapshotchan sc;
+  struct snapshotchanuser scu;
+  struct snapshotban sb;
+  char name[CHANNELLEN+1], mask[512];
+  sstring *str[5], *info, *reason;
+  chanindex *cip;
+  regchan *rcp;
+  regchanuser *rcup;
+  regban *rbp, **tail;
+  reguser *rup;
+  time_t now=time(NULL);
+  uint32_t i, j;
+  int k, ok;
+
+  for(i=0;i<count;i++) {
+    if(fread(&sc, sizeof(sc), 1, fp) != 1 || readbuf(fp, name, sizeof(name)) != 1)
+      return 0;
+
+    memset(str, 0, sizeof(str));
+    ok = readstring(fp, &str[0], 500) && readstring(fp, &str[1], TOPICLEN) &&
+         readstring(fp, &str[2], KEYLEN) && readstring(fp, &str[3], 250) &&
+         readstring(fp, &str[4], 250);
+
+    cip=ok ? findorcreatechanindex(name) : NULL;
+    if(!cip || cip->exts[chanservext]) {
+      for(k=0;k<5;k++)
+        freesstring(str[k]);
+      return 0;
+    }
+
+    rcp=getregchan();
+    cip->exts[chanservext]=rcp;
+    rcp->index=cip;
+    csdb_initregchan(rcp, now);
+
+    rcp->ID=sc.ID;
+    rcp->flags=sc.flags;
+    rcp->forcemodes=sc.forcemodes;
+    rcp->denymodes=sc.denymodes;
+    rcp->limit=sc.limit;
+    rcp->autolimit=sc.autolimit;
+    rcp->banstyle=sc.banstyle;
+    rcp->created=sc.created;
+    rcp->lastactive=sc.lastactive;
+    rcp->statsreset=sc.statsreset;
+    rcp->banduration=sc.banduration;
+    rcp->founder=sc.founder;
+    rcp->addedby=sc.addedby;
+    rcp->suspendby=sc.suspendby;
+    rcp->suspendtime=sc.suspendtime;
+    rcp->chantype=sc.chantype;
+    rcp->totaljoins=sc.totaljoins;
+    rcp->tripjoins=sc.tripjoins;
+    rcp->maxusers=sc.maxusers;
+    rcp->tripusers=sc.tripusers;
+    rcp->welcome=str[0];
+    rcp->topic=str[1];
+    rcp->key=str[2];
+    rcp->suspendreason=str[3];
+    rcp->comment=str[4];
+    rcp->ltimestamp=sc.ltimestamp;
+
+    if (CIsAutoLimit(rcp))
+      rcp->limit=0;
+
+    for(j=0;j<sc.chanusers;j++) {
+      if(fread(&scu, sizeof(scu), 1, fp) != 1 || !readstring(fp, &info, 100))
+        return 0;
+
+      if(!(rup=findreguserbyID(scu.userID)) || findreguseronchannel(rcp, rup)) {
+        freesstring(info);
+        return 0;
+      }
+
+      rcup=getregchanuser();
+      rcup->user=rup;
+      rcup->chan=rcp;
+      rcup->flags=scu.flags;
+      rcup->changetime=scu.changetime;
+      rcup->usetime=scu.usetime;
+      rcup->info=info;
+      addregusertochannel(rcup);
+    }
+
+    /* keep the order we wrote them in */
+    tail=&rcp->bans;
+    for(j=0;j<sc.bans;j++) {
+      if(fread(&sb, sizeof(sb), 1, fp) != 1 || readbuf(fp, mask, sizeof(mask)) != 1 ||
+         !readstring(fp, &reason, 200))
+        return 0;
+
+      rbp=getregban();
+      rbp->ID=sb.ID;
+      rbp->setby=sb.setby;
+      rbp->expiry=sb.expiry;
+      rbp->reason=reason;
+      rbp->cbp=makeban(mask);
+      rbp->next=NULL;
+      *tail=rbp;
+      tail=&rbp->next;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * csdb_loadsnapshot:
+ *  Called with the current transaction ID and marker before anything else
+ *  is loaded.  Loads the snapshot if there is a usable one, otherwise
+ *  returns 0 and the caller loads the tables as normal.  Either way marker
+ *  is what snapshots are good for once loading is complete.
+ */
+int csdb_loadsnapshot(unsigned long long txid, unsigned long long marker) {
+  struct snapshotheader hdr;
+  uint32_t trailer;
+  FILE *fp;
+  int ok;
+
+  startmarker=marker;
+
+  fp = fopen(SNAPSHOT_FILE, "rb");
+  if(!fp)
+    return 0;
+
+  if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+    Error("chanserv", ERR_WARNING, "Ignoring chanserv snapshot with bad header.");
+    fclose(fp);
+    return 0;
+  }
+
+  /* too old and vacuum may have frozen rows we would need to see */
+  if(hdr.marker > txid || txid - hdr.marker > CSDB_SNAPSHOTMAXXIDS ||
+     hdr.created < time(NULL) - CSDB_SNAPSHOTMAXAGE) {
+    Error("chanserv", ERR_INFO, "Chanserv snapshot is too old, doing a full load.");
+    fclose(fp);
+    return 0;
+  }
+
+  ok = loadusers(fp, hdr.users) && loadchannels(fp, hdr.channels) &&
+       fread(&trailer, sizeof(trailer), 1, fp) == 1 && trailer == SNAPSHOT_MAGIC;
+
+  fclose(fp);
+
+  if(!ok) {
+    Error("chanserv", ERR_WARNING, "Chanserv snapshot is truncated or corrupt, doing a full load.");
+    csdb_unloadsnapshot();
+    return 0;
+  }
+
+  lastuserID=hdr.lastuserID;
+  lastchannelID=hdr.lastchannelID;
+  lastbanID=hdr.lastbanID;
+  snapshotmarker=hdr.marker;
+  snapshotloaded=1;
+
+  Error("chanserv", ERR_INFO, "Loaded %u users and %u channels from snapshot, fetching changes since %llu.",
+        hdr.users, hdr.channels, (unsigned long long)hdr.marker);
+
+  return 1;
+}
+
+static void reapsnapshot(int block) {
+  int status;
+  pid_t pid;
+
+  if(!snapshotpid)
+    return;
+
+  pid=waitpid(snapshotpid, &status, block?0:WNOHANG);
+  if(pid==0)
+    return;
+
+  snapshotpid=0;
+
+  if(pid<0 || !WIFEXITED(status) || WEXITSTATUS(status))
+    Error("chanserv", ERR_WARNING, "Error writing chanserv snapshot in the background.");
+}
+
+static void forksnapshot(void) {
+  pid_t pid;
+
+  reapsnapshot(0);
+  if(snapshotpid || snapshotdisabled || !currentmarker)
+    return;
+
+  logbuf_flushall();
+  pid=fork();
+  if(pid<0) {
+    Error("chanserv", ERR_WARNING, "Unable to fork to write chanserv snapshot.");
+    return;
+  }
+
+  if(pid==0) {
+    logbuf_unbuffered();
+    _exit(csdb_writesnapshot(currentmarker)?0:1);
+  }
+
+  snapshotpid=pid;
+}
+
+static void gotsnapshotmarker(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+
+  pgres=dbgetresult(dbconn);
+
+  if(!dbquerysuccessful(pgres)) {
+    Error("chanserv", ERR_WARNING, "Error getting snapshot marker.");
+    if(pgres)
+      dbclear(pgres);
+    return;
+  }
+
+  /* anything not written before we asked (e.g. held back updates) commits later than this */
+  if(dbfetchrow(pgres))
+    currentmarker=strtoull(dbgetvalue(pgres,0),NULL,10);
+
+  dbclear(pgres);
+
+  forksnapshot();
+}
+
+static void csdb_refreshsnapshot(void *arg) {
+  reapsnapshot(0);
+  if(snapshotpid || snapshotdisabled || !currentmarker)
+    return;
+
+  dbasyncquery(gotsnapshotmarker, NULL, "SELECT txid_snapshot_xmin(txid_current_snapshot())");
+}
+
+/*
+ * Reconciliation: the changed rows are fetched and the deletions found
+ * before HOOK_CHANSERV_DBLOADED, so nothing can be modified under us and
+ * everything we hold came from the database.
+ */
+
+static regchan *findchanbyID(unsigned int ID) {
+  return ID<chanbyIDsize ? chanbyID[ID] : NULL;
+}
+
+static void reconcileusers(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+  reguser *rup;
+  unsigned int ID;
+  int renamed;
+
+  pgres=dbgetresult(dbconn);
+
+  if (!dbquerysuccessful(pgres)) {
+    Error("chanserv",ERR_ERROR,"Error fetching changed users.");
+    if (pgres)
+      dbclear(pgres);
+    return;
+  }
+
+  if (dbnumfields(pgres)!=19) {
+    Error("chanserv",ERR_ERROR,"User DB format error");
+    dbclear(pgres);
+    return;
+  }
+
+  while(dbfetchrow(pgres)) {
+    ID=strtoul(dbgetvalue(pgres,0),NULL,10);
+
+    if ((rup=findreguserbyID(ID))) {
+      renamed=strcmp(rup->username, dbgetvalue(pgres,1));
+      if (renamed)
+        removereguserfromhash(rup);
+
+      delreguserfrommaildomain(rup, rup->domain);
+      freesstring(rup->localpart);
+      freesstring(rup->email);
+      freesstring(rup->lastemail);
+      freesstring(rup->lastuserhost);
+      freesstring(rup->suspendreason);
+      freesstring(rup->comment);
+      freesstring(rup->info);
+      csdb_fillreguser(rup, pgres);
+
+      if (renamed)
+        addregusertohash(rup);
+    } else {
+      rup=getreguser();
+      rup->status=0;
+      csdb_fillreguser(rup, pgres);
+      rup->knownon=NULL;
+      rup->checkshd=NULL;
+      rup->stealcount=0;
+      rup->fakeuser=NULL;
+      addregusertohash(rup);
+    }
+
+    if (rup->ID > lastuserID)
+      lastuserID=rup->ID;
+
+    reconciled++;
+  }
+
+  dbclear(pgres);
+}
+
+static void reconcilechannels(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+  regchan *rcp;
+  chanindex *cip;
+  unsigned int ID;
+  time_t now=time(NULL);
+  int i;
+
+  pgres=dbgetresult(dbconn);
+
+  if (!dbquerysuccessful(pgres)) {
+    Error("chanserv",ERR_ERROR,"Error fetching changed channels.");
+    if (pgres)
+      dbclear(pgres);
+  } else if (dbnumfields(pgres)!=27) {
+    Error("chanserv",ERR_ERROR,"Channel DB format error");
+    dbclear(pgres);
+  } else {
+    while(dbfetchrow(pgres)) {
+      ID=strtoul(dbgetvalue(pgres,0),NULL,10);
+      cip=findorcreatechanindex(dbgetvalue(pgres,1));
+
+      if ((rcp=cip->exts[chanservext])) {
+        if (rcp->ID!=ID) {
+          Error("chanserv",ERR_WARNING,"%s changed ID in the database (%u to %u), skipping.",cip->name->content,rcp->ID,ID);
+          continue;
+        }
+
+        freesstring(rcp->welcome);
+        freesstring(rcp->topic);
+        freesstring(rcp->key);
+        freesstring(rcp->suspendreason);
+        freesstring(rcp->comment);
+        csdb_fillregchan(rcp, pgres);
+      } else {
+        rcp=getregchan();
+        cip->exts[chanservext]=rcp;
+        rcp->index=cip;
+        csdb_initregchan(rcp, now);
+        csdb_fillregchan(rcp, pgres);
+      }
+
+      if (rcp->ID > lastchannelID)
+        lastchannelID=rcp->ID;
+
+      reconciled++;
+    }
+
+    dbclear(pgres);
+  }
+
+  /* the chanuser and ban changes need to find channels by ID */
+  chanbyIDsize=lastchannelID+1;
+  chanbyID=calloc(chanbyIDsize, sizeof(regchan *));
+  for (i=0;i<CHANNELHASHSIZE;i++)
+    for (cip=chantable[i];cip;cip=cip->next)
+      if ((rcp=cip->exts[chanservext]) && rcp->ID<chanbyIDsize)
+        chanbyID[rcp->ID]=rcp;
+}
+
+static void reconcilechanusers(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+  regchanuser *rcup;
+  regchan *rcp;
+  reguser *rup;
+  unsigned int uid, cid;
+
+  pgres=dbgetresult(dbconn);
+
+  if (!dbquerysuccessful(pgres)) {
+    Error("chanserv",ERR_ERROR,"Error fetching changed chanusers.");
+    if (pgres)
+      dbclear(pgres);
+    return;
+  }
+
+  if (dbnumfields(pgres)!=6) {
+    Error("chanserv",ERR_ERROR,"Chanusers format error");
+    dbclear(pgres);
+    return;
+  }
+
+  while(dbfetchrow(pgres)) {
+    uid=strtoul(dbgetvalue(pgres,0),NULL,10);
+    cid=strtoul(dbgetvalue(pgres,1),NULL,10);
+
+    if (!(rup=findreguserbyID(uid))) {
+      Error("chanserv",ERR_WARNING,"Skipping channeluser for unknown user %u",uid);
+      continue;
+    }
+
+    if (!(rcp=findchanbyID(cid))) {
+      Error("chanserv",ERR_WARNING,"Skipping channeluser for unknown chan %u",cid);
+      continue;
+    }
+
+    if ((rcup=findreguseronchannel(rcp, rup))) {
+      freesstring(rcup->info);
+      csdb_fillregchanuser(rcup, pgres);
+    } else {
+      rcup=getregchanuser();
+      rcup->user=rup;
+      rcup->chan=rcp;
+      csdb_fillregchanuser(rcup, pgres);
+      addregusertochannel(rcup);
+    }
+
+    reconciled++;
+  }
+
+  dbclear(pgres);
+}
+
+static void reconcilebans(DBConn *dbconn, void *arg) {
+  DBResult *pgres;
+  regchan *rcp;
+  regban *rbp;
+  unsigned int bid, cid;
+
+  pgres=dbgetresult(dbconn);
+
+  if (!dbquerysuccessful(pgres)) {
+    Error("chanserv",ERR_ERROR,"Error fetching changed bans.");
+    if (pgres)
+      dbclear(pgres);
+  } else if (dbnumfields(pgres)!=6) {
+    Error("chanserv",ERR_ERROR,"Ban format error");
+    dbclear(pgres);
+  } else {
+    while(dbfetchrow(pgres)) {
+      bid=strtoul(dbgetvalue(pgres,0),NULL,10);
+      cid=strtoul(dbgetvalue(pgres,1),NULL,10);
+
+      if (!(rcp=findchanbyID(cid))) {
+        Error("chanserv",ERR_WARNING,"Skipping ban for unknown chan %u",cid);
+        continue;
+      }
+
+      for (rbp=rcp->bans;rbp;rbp=rbp->next)
+        if (rbp->ID==bid)
+          break;
+
+      if (rbp) {
+        freesstring(rbp->reason);
+        freechanban(rbp->cbp);
+        csdb_fillregban(rbp, pgres);
+      } else {
+        rbp=getregban();
+        csdb_fillregban(rbp, pgres);
+        rbp->next=rcp->bans;
+        rcp->bans=rbp;
+      }
+
+      if (rbp->ID > lastbanID)
+        lastbanID=rbp->ID;
+
+      reconciled++;
+    }
+
+    dbclear(pgres);
+  }
+
+  free(chanbyID);
+  chanbyID=NULL;
+  chanbyIDsize=0;
+
+  Error("chanserv",ERR_INFO,"Applied %u changed rows to the snapshot.",reconciled);
+}
+
+static int idpaircmp(const void *a, const void *b) {
+  const struct idpair *pa=a, *pb=b;
+
+  if (pa->a!=pb->a)
+    return pa->a<pb->a ? -1 : 1;
+  if (pa->b!=pb->b)
+    return pa->b<pb->b ? -1 : 1;
+  return 0;
+}
+
+/* Reads one or two ID columns into a sorted array, NULL on error */
+static struct idpair *fetchids(DBConn *dbconn, int fields, size_t *count, const char *what) {
+  DBResult *pgres;
+  struct idpair *ids=NULL, *nids;
+  size_t size=0;
+
+  *count=0;
+  pgres=dbgetresult(dbconn);
+
+  if (!dbquerysuccessful(pgres) || dbnumfields(pgres)!=fields) {
+    Error("chanserv",ERR_ERROR,"Error scanning %s for deletions.",what);
+    if (pgres)
+      dbclear(pgres);
+    return NULL;
+  }
+
+  while(dbfetchrow(pgres)) {
+    if (*count==size) {
+      size=size?size*2:1024;
+      if (!(nids=realloc(ids, size*sizeof(struct idpair)))) {
+        Error("chanserv",ERR_ERROR,"Out of memory scanning %s for deletions.",what);
+        free(ids);
+        dbclear(pgres);
+        return NULL;
+      }
+      ids=nids;
+    }
+
+    ids[*count].a=strtoul(dbgetvalue(pgres,0),NULL,10);
+    ids[*count].b=(fields>1)?strtoul(dbgetvalue(pgres,1),NULL,10):0;
+    (*count)++;
+  }
+
+  dbclear(pgres);
+
+  if (!ids)
+    ids=malloc(sizeof(struct idpair));
+
+  qsort(ids, *count, sizeof(struct idpair), idpaircmp);
+
+  return ids;
+}
+
+static int hasid(struct idpair *ids, size_t count, unsigned int a, unsigned int b) {
+  struct idpair key;
+
+  key.a=a;
+  key.b=b;
+
+  return bsearch(&key, ids, count, sizeof(struct idpair), idpaircmp)!=NULL;
+}
+
+static void scanbans(DBConn *dbconn, void *arg) {
+  struct idpair *ids;
+  size_t count;
+  chanindex *cip;
+  regchan *rcp;
+  regban **rbh, *rbp;
+  unsigned int removed=0;
+  int i;
+
+  if (!(ids=fetchids(dbconn, 1, &count, "bans")))
+    return;
+
+  for (i=0;i<CHANNELHASHSIZE;i++) {
+    for (cip=chantable[i];cip;cip=cip->next) {
+      if (!(rcp=cip->exts[chanservext]))
+        continue;
+
+      for (rbh=&rcp->bans;(rbp=*rbh);) {
+        if (hasid(ids, count, rbp->ID, 0)) {
+          rbh=&rbp->next;
+          continue;
+        }
+
+        *rbh=rbp->next;
+        freesstring(rbp->reason);
+        freechanban(rbp->cbp);
+        freeregban(rbp);
+        removed++;
+      }
+    }
+  }
+
+  free(ids);
+
+  if (removed)
+    Error("chanserv",ERR_INFO,"Removed %u bans deleted from the database since the snapshot.",removed);
+}
+
+static void scanchanusers(DBConn *dbconn, void *arg) {
+  struct idpair *ids;
+  size_t count;
+  chanindex *cip;
+  regchan *rcp;
+  regchanuser *rcup, *nrcup;
+  unsigned int removed=0;
+  int i, j;
+
+  if (!(ids=fetchids(dbconn, 2, &count, "chanusers")))
+    return;
+
+  for (i=0;i<CHANNELHASHSIZE;i++) {
+    for (cip=chantable[i];cip;cip=cip->next) {
+      if (!(rcp=cip->exts[chanservext]))
+        continue;
+
+      for (j=0;j<rcp->regusersize;j++) {
+        for (rcup=rcp->regusers[j];rcup;rcup=nrcup) {
+          nrcup=rcup->nextbychan;
+
+          if (hasid(ids, count, rcp->ID, rcup->user->ID))
+            continue;
+
+          delreguserfromchannel(rcp, rcup->user);
+          freeregchanuser(rcup);
+          removed++;
+        }
+      }
+    }
+  }
+
+  free(ids);
+
+  if (removed)
+    Error("chanserv",ERR_INFO,"Removed %u chanlev entries deleted from the database since the snapshot.",removed);
+}
+
+/*
+ * Nobody outside the database module has seen these yet, so unlike
+ * cs_removeuser/cs_removechannel there is nothing to part or write back.
+ */
+static void dropuser(reguser *rup) {
+  regchanuser *rcup, *nrcup;
+
+  for (rcup=rup->knownon;rcup;rcup=nrcup) {
+    nrcup=rcup->nextbyuser;
+    delreguserfromchannel(rcup->chan, rup);
+    freeregchanuser(rcup);
+  }
+
+  if (rup->domain)
+    delreguserfrommaildomain(rup, rup->domain);
+  freesstring(rup->localpart);
+  freesstring(rup->email);
+  freesstring(rup->lastemail);
+  freesstring(rup->lastuserhost);
+  freesstring(rup->suspendreason);
+  freesstring(rup->comment);
+  freesstring(rup->info);
+
+  removereguserfromhash(rup);
+  freereguser(rup);
+}
+
+static void dropchannel(regchan *rcp) {
+  chanindex *cip=rcp->index;
+  regchanuser *rcup, *nrcup;
+  regban *rbp, *nrbp;
+  int i;
+
+  for (i=0;i<rcp->regusersize;i++) {
+    for (rcup=rcp->regusers[i];rcup;rcup=nrcup) {
+      nrcup=rcup->nextbychan;
+      delreguserfromchannel(rcp, rcup->user);
+      freeregchanuser(rcup);
+    }
+  }
+
+  for (rbp=rcp->bans;rbp;rbp=nrbp) {
+    nrbp=rbp->next;
+    freesstring(rbp->reason);
+    freechanban(rbp->cbp);
+    freeregban(rbp);
+  }
+
+  freesstring(rcp->welcome);
+  freesstring(rcp->topic);
+  freesstring(rcp->key);
+  freesstring(rcp->suspendreason);
+  freesstring(rcp->comment);
+  freeregchan(rcp);
+
+  cip->exts[chanservext]=NULL;
+  releasechanindex(cip);
+}
+
+static void scanusers(DBConn *dbconn, void *arg) {
+  struct idpair *ids;
+  size_t count;
+  reguser *rup, *nrup;
+  unsigned int removed=0;
+  int i;
+
+  if (!(ids=fetchids(dbconn, 1, &count, "users")))
+    return;
+
+  for (i=0;i<REGUSERHASHSIZE;i++) {
+    for (rup=regusernicktable[i];rup;rup=nrup) {
+      nrup=rup->nextbyname;
+
+      if (hasid(ids, count, rup->ID, 0))
+        continue;
+
+      dropuser(rup);
+      removed++;
+    }
+  }
+
+  free(ids);
+
+  if (removed)
+    Error("chanserv",ERR_INFO,"Removed %u users deleted from the database since the snapshot.",removed);
+}
+
+static void scanchannels(DBConn *dbconn, void *arg) {
+  struct idpair *ids;
+  size_t count;
+  chanindex *cip, *ncip;
+  regchan *rcp;
+  unsigned int removed=0;
+  int i;
+
+  if (!(ids=fetchids(dbconn, 1, &count, "channels")))
+    return;
+
+  for (i=0;i<CHANNELHASHSIZE;i++) {
+    for (cip=chantable[i];cip;cip=ncip) {
+      ncip=cip->next;
+
+      if (!(rcp=cip->exts[chanservext]) || hasid(ids, count, rcp->ID, 0))
+        continue;
+
+      dropchannel(rcp);
+      removed++;
+    }
+  }
+
+  free(ids);
+
+  if (removed)
+    Error("chanserv",ERR_INFO,"Removed %u channels deleted from the database since the snapshot.",removed);
+}
+
+/*
+ * Queues the fetches of everything changed since the snapshot was taken,
+ * then the scans for what was deleted.  They all land before the mail
+ * tables finish loading and so before HOOK_CHANSERV_DBLOADED.
+ */
+void csdb_reconcilesnapshot(void) {
+  reconciled=0;
+
+  dbasyncquery(reconcileusers, NULL, "SELECT * FROM chanserv.users WHERE age(xmin) <= txid_current() - %llu", snapshotmarker);
+  dbasyncquery(reconcilechannels, NULL, "SELECT * FROM chanserv.channels WHERE age(xmin) <= txid_current() - %llu", snapshotmarker);
+  dbasyncquery(reconcilechanusers, NULL, "SELECT * FROM chanserv.chanusers WHERE age(xmin) <= txid_current() - %llu", snapshotmarker);
+  dbasyncquery(reconcilebans, NULL, "SELECT * FROM chanserv.bans WHERE age(xmin) <= txid_current() - %llu", snapshotmarker);
+
+  dbasyncquery(scanbans, NULL, "SELECT banID FROM chanserv.bans");
+  dbasyncquery(scanchanusers, NULL, "SELECT channelID, userID FROM chanserv.chanusers");
+  dbasyncquery(scanchannels, NULL, "SELECT ID FROM chanserv.channels");
+  dbasyncquery(scanusers, NULL, "SELECT ID FROM chanserv.users");
+}
+
+/*
+ * csdb_snapshotloadcomplete:
+ *  Everything is loaded and reconciled: keep the snapshot fresh from now
+ *  on, writing one straight away if we had to do a full load.
+ */
+void csdb_snapshotloadcomplete(void) {
+  currentmarker=startmarker;
+
+  if (!snapshotloaded)
+    forksnapshot();
+
+  schedulerecurring(time(NULL)+CSDB_SNAPSHOTINTERVAL, 0, CSDB_SNAPSHOTINTERVAL, csdb_refreshsnapshot, NULL);
+}
+
+void csdb_closesnapshot(void) {
+  deleteschedule(NULL, csdb_refreshsnapshot, NULL);
+
+  reapsnapshot(1);
+
+  if (chanservdb_ready && currentmarker && !snapshotdisabled)
+    csdb_writesnapshot(currentmarker);
+
+  free(chanbyID);
+  chanbyID=NULL;
+  chanbyIDsize=0;
+}
@@ -0,0 +1,226 @@
+/*
+ * chanservdb_writebehind.c:
+ *  Holds back UPDATEs to users, channels and chanusers so that repeated
+ *  changes to the same row become one statement, then sends them in
+ *  transactions of up to CSDB_FLUSHBATCH statements.
+ *
+ *  Each pending row remembers which columns its statement sets.  A new
+ *  update for the same columns (or the whole row) replaces it; one for
+ *  different columns can't be merged, so the old statement is sent first.
+ */
+
+#include "../chanserv.h"
+#include "../../core/error.h"
+#include "../../dbapi/dbapi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define CSDB_PENDINGHASHSIZE 4096
+
+typedef struct csdbpending {
+  unsigned char table, columns;
+  unsigned int ID1, ID2;
+  time_t dirtysince;
+  char *query;
+  struct csdbpending *nextbyhash;
+  struct csdbpending *prev, *next; /* oldest first */
+} csdbpending;
+
+static csdbpending *pendinghash[CSDB_PENDINGHASHSIZE];
+static csdbpending *pendinghead, *pendingtail;
+static unsigned int pendingcount;
+
+/* stats */
+static unsigned long updatesmarked, statementssent;
+static unsigned int lastflushstatements, lastflushbatches;
+static time_t lastflushlag, maxflushlag;
+
+static unsigned int pendinghashval(int table, unsigned int ID1, unsigned int ID2) {
+  return (table*31 + ID1*7 + ID2) % CSDB_PENDINGHASHSIZE;
+}
+
+static csdbpending *findpending(int table, unsigned int ID1, unsigned int ID2) {
+  csdbpending *pp;
+
+  for (pp=pendinghash[pendinghashval(table, ID1, ID2)];pp;pp=pp->nextbyhash)
+    if (pp->table==table && pp->ID1==ID1 && pp->ID2==ID2)
+      return pp;
+
+  return NULL;
+}
+
+static void removepending(csdbpending *pp) {
+  csdbpending **pph;
+
+  for (pph=&pendinghash[pendinghashval(pp->table, pp->ID1, pp->ID2)];*pph;pph=&((*pph)->nextbyhash)) {
+    if (*pph==pp) {
+      *pph=pp->nextbyhash;
+      break;
+    }
+  }
+
+  if (pp->prev)
+    pp->prev->next=pp->next;
+  else
+    pendinghead=pp->next;
+
+  if (pp->next)
+    pp->next->prev=pp->prev;
+  else
+    pendingtail=pp->prev;
+
+  pendingcount--;
+
+  free(pp->query);
+  free(pp);
+}
+
+/*
+ * csdb_deferupdate:
+ *  Queues an UPDATE for the row (table, ID1, ID2), columns says which
+ *  columns it sets (CSDB_COLS_ALL for the whole row).
+ */
+void csdb_deferupdate(int table, unsigned int ID1, unsigned int ID2, int columns, char *format, ...) {
+  csdbpending *pp;
+  va_list va, va2;
+  char *query;
+  int len;
+
+  va_start(va, format);
+  va_copy(va2, va);
+  len=vsnprintf(NULL, 0, format, va);
+  va_end(va);
+
+  if (len<0 || !(query=malloc(len+1))) {
+    va_end(va2);
+    Error("chanserv",ERR_ERROR,"Unable to queue database update.");
+    return;
+  }
+
+  vsnprintf(query, len+1, format, va2);
+  va_end(va2);
+
+  updatesmarked++;
+
+  if ((pp=findpending(table, ID1, ID2)) && columns!=CSDB_COLS_ALL && pp->columns!=columns) {
+    dbquery("%s", pp->query);
+    statementssent++;
+    removepending(pp);
+    pp=NULL;
+  }
+
+  if (pp) {
+    free(pp->query);
+    pp->query=query;
+    pp->columns=columns;
+    return;
+  }
+
+  if (!(pp=malloc(sizeof(csdbpending)))) {
+    /* better late than never */
+    dbquery("%s", query);
+    statementssent++;
+    free(query);
+    return;
+  }
+
+  pp->table=table;
+  pp->columns=columns;
+  pp->ID1=ID1;
+  pp->ID2=ID2;
+  pp->dirtysince=time(NULL);
+  pp->query=query;
+
+  pp->nextbyhash=pendinghash[pendinghashval(table, ID1, ID2)];
+  pendinghash[pendinghashval(table, ID1, ID2)]=pp;
+
+  pp->next=NULL;
+  pp->prev=pendingtail;
+  if (pendingtail)
+    pendingtail->next=pp;
+  else
+    pendinghead=pp;
+  pendingtail=pp;
+
+  pendingcount++;
+
+  if (pendingcount>=CSDB_FLUSHMAX)
+    csdb_flushupdates(NULL);
+}
+
+/*
+ * csdb_dropupdates:
+ *  Forgets pending updates for rows that are being deleted.  CSDB_ANYID
+ *  matches any ID, e.g. all the chanusers for a user.
+ */
+void csdb_dropupdates(int table, unsigned int ID1, unsigned int ID2) {
+  csdbpending *pp, *npp;
+
+  if (ID1!=CSDB_ANYID && ID2!=CSDB_ANYID) {
+    if ((pp=findpending(table, ID1, ID2)))
+      removepending(pp);
+    return;
+  }
+
+  for (pp=pendinghead;pp;pp=npp) {
+    npp=pp->next;
+    if (pp->table==table && (ID1==CSDB_ANYID || pp->ID1==ID1) && (ID2==CSDB_ANYID || pp->ID2==ID2))
+      removepending(pp);
+  }
+}
+
+/*
+ * csdb_flushupdates:
+ *  Sends everything pending, oldest first, CSDB_FLUSHBATCH to a transaction.
+ */
+void csdb_flushupdates(void *arg) {
+  unsigned int batch;
+  time_t now=time(NULL);
+
+  if (!pendinghead)
+    return;
+
+  lastflushlag=now-pendinghead->dirtysince;
+  if (lastflushlag>maxflushlag)
+    maxflushlag=lastflushlag;
+
+  lastflushstatements=lastflushbatches=0;
+
+  while (pendinghead) {
+    dbquery("BEGIN TRANSACTION;");
+
+    for (batch=0;pendinghead && batch<CSDB_FLUSHBATCH;batch++) {
+      dbquery("%s", pendinghead->query);
+      removepending(pendinghead);
+    }
+
+    dbquery("COMMIT;");
+
+    lastflushstatements+=batch;
+    lastflushbatches++;
+  }
+
+  statementssent+=lastflushstatements;
+}
+
+void csdb_writebehindstats(long level) {
+  char buf[512];
+
+  if (level<=5)
+    return;
+
+  snprintf(buf, sizeof(buf), "ChanServ: %6u rows waiting to be written, oldest %lds.",
+           pendingcount, pendinghead?(long)(time(NULL)-pendinghead->dirtysince):0L);
+  triggerhook(HOOK_CORE_STATSREPLY, buf);
+
+  snprintf(buf, sizeof(buf), "ChanServ: last flush %u statements in %u batches, lag %lds (max %lds).",
+           lastflushstatements, lastflushbatches, (long)lastflushlag, (long)maxflushlag);
+  triggerhook(HOOK_CORE_STATSREPLY, buf);
+
+  snprintf(buf, sizeof(buf), "ChanServ: %lu updates written as %lu statements.",
+           updatesmarked, statementssent+pendingcount);
+  triggerhook(HOOK_CORE_STATSREPLY, buf);
+}
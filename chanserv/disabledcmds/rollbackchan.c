@@ -140,11 +140,7 @@ void csc_dorollbackchan_real(DBConn *dbconn, void *arg) {
       freeregchanuser(rcup);
       rcup=NULL;
 
-      for (j=0; j<REGCHANUSERHASHSIZE; j++)
-        if (rcp->regusers[j])
-          break;
-
-      if (j==REGCHANUSERHASHSIZE) {
+      if (!rcp->regusercount) {
         cs_log(np, "DELCHAN %s (Cleared chanlev from rollback)", cip->name->content);
         chanservsendmessage(np, "Rollback cleared chanlev list, channel deleted.");
         rcp=NULL;
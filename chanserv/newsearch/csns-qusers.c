@@ -66,7 +66,7 @@ void *qusers_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
   if (!(rcp=cip->exts[chanservext]))
     return (void *)0;
   
-  for (i=0;i<REGCHANUSERHASHSIZE;i++) {
+  for (i=0;i<rcp->regusersize;i++) {
     for (rcup=rcp->regusers[i];rcup;rcup=rcup->nextbychan) {
       if ((rcup->flags & localdata->setmodes) != localdata->setmodes)
         continue;
@@ -16,7 +16,7 @@ void printchannel_qusers(searchCtx *ctx, nick *sender, chanindex *cip) {
     return;
   }
   
-  for (i=0;i<REGCHANUSERHASHSIZE;i++) {
+  for (i=0;i<rcp->regusersize;i++) {
     for (rcup=rcp->regusers[i];rcup;rcup=rcup->nextbychan) {
       tot++;
       
@@ -3,73 +3,76 @@
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <float.h>
 #include "../lib/sstring.h"
 #include "../lib/stringbuf.h"
 #include "../lib/ccassert.h"
 #include "../core/error.h"
-#include "chanserv_messages.h"
+#include "chanserv.h"
 
 #define MAXARGS 10
-#define CONVBUF 512
+/* big enough for "%.1f" of any double: sign, DBL_MAX_10_EXP+1 digits, point, decimal */
+#define CONVBUF (DBL_MAX_10_EXP + 32)
+#define Q9MAXLINE 510
+#define Q9MAXOUTPUT 5000
+
+typedef struct q9arg {
+  const char *text;
+  char buf[CONVBUF];
+} q9arg;
 
 void q9strftime(char *buf, size_t size, time_t t) {
   strftime(buf, size, Q9_FORMAT_TIME, gmtime(&t));
 }
 
+/* Strings are used where they are, everything else is converted into buf */
+static void q9getargs(q9arg *argv, const char *format, const char *args, va_list ap) {
+  int argno;
+  char *s;
+
+  CCASSERT(CONVBUF > TIMELEN);
+
+  for(argno=0;argno<MAXARGS;argno++)
+    argv[argno].text = "";
+
+  for(argno=0;*args && argno<MAXARGS;args++,argno++) {
+    q9arg *a = &argv[argno];
+
+    a->text = a->buf;
+    switch(*args) {
+      case 's':
+        s = va_arg(ap, char *);
+        a->text = s ? s : "(null)";
+        break;
+      case 'd':
+        snprintf(a->buf, CONVBUF, "%d", va_arg(ap, int));
+        break;
+      case 'u':
+        snprintf(a->buf, CONVBUF, "%u", va_arg(ap, unsigned int));
+        break;
+      case 'g':
+        snprintf(a->buf, CONVBUF, "%.1f", va_arg(ap, double));
+        break;
+      case 'T':
+        q9strftime(a->buf, CONVBUF, va_arg(ap, time_t));
+        break;
+      default:
+        /* calls exit(0) */
+        Error("chanserv", ERR_STOP, "Bad format specifier '%c' supplied in q9vsnprintf, format: '%s'", *args, format);
+    }
+  }
+}
+
 void q9vsnprintf(char *buf, size_t size, const char *format, const char *args, va_list ap) {
   StringBuf b;
   const char *p;
-  char *c;
-
-  char convbuf[MAXARGS][CONVBUF];
-
-  CCASSERT(CONVBUF > TIMELEN);
+  const char *c;
+  q9arg argv[MAXARGS];
 
   if(size == 0)
     return;
 
-  {
-    int argno = 0, i;
-
-    int d;
-    char *s;
-    double g;
-    unsigned int u;
-    time_t t;
-
-    for(i=0;i<MAXARGS;i++)
-      convbuf[i][0] = '\0';
-
-    for(;*args;args++) {
-      char *cb = convbuf[argno++];
-
-      switch(*args) {
-        case 's':
-          s = va_arg(ap, char *);
-          snprintf(cb, CONVBUF, "%s", s);
-          break;
-        case 'd':
-          d = va_arg(ap, int);
-          snprintf(cb, CONVBUF, "%d", d);
-          break;
-        case 'u':
-          u = va_arg(ap, unsigned int);
-          snprintf(cb, CONVBUF, "%u", u);
-          break;
-        case 'g':
-          g = va_arg(ap, double);
-          snprintf(cb, CONVBUF, "%.1f", g);
-          break;
-        case 'T':
-          t = va_arg(ap, time_t);
-          q9strftime(cb, CONVBUF, t);
-          break;
-        default:
-          /* calls exit(0) */
-          Error("chanserv", ERR_STOP, "Bad format specifier '%c' supplied in q9vsnprintf, format: '%s'", *args, format);
-      }
-    }
-  }
+  q9getargs(argv, format, args, ap);
 
   sbinit(&b, buf, size);
 
@@ -106,12 +109,12 @@ void q9vsnprintf(char *buf, size_t size, const char *format, const char *args, v
       case '7':
       case '8':
       case '9':
-        c = convbuf[*p - '0']; break;
+        c = argv[*p - '0'].text; break;
       default:
         c = "(bad format specifier)";
     }
     if(c)
-      if(!sbaddstr(&b, c))
+      if(!sbaddstr(&b, (char *)c))
         break;
   }
 
@@ -130,3 +133,58 @@ void q9snprintf(char *buf, size_t size, const char *format, const char *args, ..
   q9vsnprintf(buf, size, format, args, ap);
   va_end(ap);
 }
+
+/*
+ * q9vsendlines:
+ *  Expands a compiled message, handing it to fn a line at a time.  Lines
+ *  are broken at \n and after maxlinelen+1 characters, empty lines are
+ *  skipped.
+ */
+void q9vsendlines(const q9template *tp, const char *args, int maxlinelen, Q9LineCallback fn, void *arg, va_list ap) {
+  q9arg argv[MAXARGS];
+  char line[Q9MAXLINE+1];
+  const q9segment *sp;
+  const char *p;
+  size_t n, total=0;
+  unsigned int i;
+  int len=0;
+
+  if(maxlinelen > Q9MAXLINE-1)
+    maxlinelen = Q9MAXLINE-1;
+
+  q9getargs(argv, "(compiled)", args, ap);
+
+  for(i=0;i<tp->segments;i++) {
+    sp = &tp->segment[i];
+    if(sp->text) {
+      p = sp->text;
+      n = sp->len;
+    } else {
+      p = argv[sp->arg].text;
+      n = strlen(p);
+    }
+
+    for(;n;n--,p++) {
+      if(++total > Q9MAXOUTPUT)
+        goto out;
+
+      if(*p == '\n' || len > maxlinelen) {
+        if(len) {
+          line[len] = '\0';
+          fn(arg, line);
+          len = 0;
+        }
+        if(*p == '\n')
+          continue;
+      }
+
+      line[len++] = *p;
+    }
+  }
+
+out:
+  if(len) {
+    line[len] = '\0';
+    fn(arg, line);
+  }
+}
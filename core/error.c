@@ -4,10 +4,13 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "error.h"
 #include "hooks.h"
+#include "logbuf.h"
 
-FILE *logfile;
+static logbuf *logfile, *errout;
 
 static corehandler *coreh, *coret;
 
@@ -38,13 +41,14 @@ char *sevtostring(int severity) {
 
 void reopen_logfile(int hooknum, void *arg) {
   if (logfile)
-    fclose(logfile);
-  
-  logfile=fopen("logs/newserv.log","a");
+    logbuf_reopen(logfile);
+  else
+    logfile=logbuf_open("logs/newserv.log",0666);
 }
 
 void init_logfile() {
-  logfile=fopen("logs/newserv.log","a");
+  errout=logbuf_fdopen(STDERR_FILENO);
+  logfile=logbuf_open("logs/newserv.log",0666);
   if (!logfile) {
     fprintf(stderr,"Failed to open logfile...\n");
   }
@@ -54,7 +58,10 @@ void init_logfile() {
 void fini_logfile() {
   deregisterhook(HOOK_CORE_SIGUSR1, reopen_logfile);
   if (logfile)
-    fclose(logfile);
+    logbuf_close(logfile);
+  if (errout)
+    logbuf_close(errout);
+  logfile=errout=NULL;
 }
 
 void Error(char *source, int severity, char *reason, ... ) {
@@ -63,6 +70,8 @@ void Error(char *source, int severity, char *reason, ... ) {
   struct tm *tm;
   time_t now;
   char timebuf[100];
+  char line[1024];
+  int len;
   struct error_event evt;
     
   va_start(va,reason);
@@ -78,13 +87,22 @@ void Error(char *source, int severity, char *reason, ... ) {
     now=time(NULL);
     tm=gmtime(&now);
     strftime(timebuf,100,"%Y-%m-%d %H:%M:%S",tm);
-    fprintf(stderr,"[%s] %s(%s): %s\n",timebuf,sevtostring(severity),source,buf);
-    fflush(stderr);
-
-    if (logfile)  {
-      fprintf(logfile,"[%s] %s(%s): %s\n",timebuf,sevtostring(severity),source,buf);
-      fflush(logfile);
+    len=snprintf(line,sizeof(line),"[%s] %s(%s): %s\n",timebuf,sevtostring(severity),source,buf);
+    if (len>=(int)sizeof(line))
+      len=sizeof(line)-1;
+
+    if (errout) {
+      logbuf_write(errout,line,len);
+    } else {
+      fputs(line,stderr);
     }
+
+    if (logfile)
+      logbuf_write(logfile,line,len);
+
+    /* don't sit on anything serious */
+    if (severity>=ERR_FATAL)
+      logbuf_flushall();
   }
   
   if (severity>=ERR_STOP) {
@@ -101,6 +101,7 @@
 #define HOOK_TRUSTS_MODIFYGROUP    910 /* Argument is trustgroup* */
 #define HOOK_TRUSTS_LOSTHOST       911 /* Argument is trusthost* */
 #define HOOK_TRUSTS_MODIFYHOST     912 /* Argument is trusthost* */
+#define HOOK_TRUSTS_DB_RECONCILED  913 /* No arg */
 
 #define HOOK_SIGNONTRACKER_HAVETIME 1100 /* Argument is nick* */
 
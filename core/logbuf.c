@@ -0,0 +1,249 @@
+/* logbuf.c */
+
+#define _GNU_SOURCE
+
+#include "logbuf.h"
+#include "config.h"
+#include "hooks.h"
+#include "schedule.h"
+#include "../lib/sstring.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static logbuf *logbufs;
+static int logsync, unbuffered;
+
+/* for the logs that have gone away */
+static unsigned long closedlines, closedwrites, closeddropped;
+
+static void logbuf_doflush(void *arg);
+static void logbuf_stats(int hooknum, void *arg);
+static void logbuf_rehash(int hooknum, void *arg);
+
+void initlogbufs() {
+  logbufs=NULL;
+  logsync=0;
+  schedulerecurring(time(NULL)+LOGBUF_FLUSHINTERVAL, 0, LOGBUF_FLUSHINTERVAL, logbuf_doflush, NULL);
+  registerhook(HOOK_CORE_STATSREQUEST, &logbuf_stats);
+  registerhook(HOOK_CORE_REHASH, &logbuf_rehash);
+}
+
+void finilogbufs() {
+  deregisterhook(HOOK_CORE_REHASH, &logbuf_rehash);
+  deregisterhook(HOOK_CORE_STATSREQUEST, &logbuf_stats);
+  deleteallschedules(logbuf_doflush);
+
+  while (logbufs)
+    logbuf_close(logbufs);
+}
+
+/* Called once the config file is loaded, and again on rehash */
+void configurelogbufs() {
+  sstring *s;
+
+  s=getcopyconfigitem("core", "logsync", "0", 10);
+  logsync=atoi(s->content);
+  freesstring(s);
+
+  if (logsync<0)
+    logsync=0;
+}
+
+static void logbuf_rehash(int hooknum, void *arg) {
+  configurelogbufs();
+}
+
+static logbuf *logbuf_new(int fd) {
+  logbuf *lb;
+
+  if (!(lb=malloc(sizeof(logbuf))))
+    return NULL;
+
+  if (!(lb->buf=malloc(LOGBUF_SIZE))) {
+    free(lb);
+    return NULL;
+  }
+
+  lb->filename=NULL;
+  lb->mode=0;
+  lb->fd=fd;
+  lb->used=0;
+  lb->lines=lb->writes=lb->dropped=0;
+  lb->lastsync=time(NULL);
+
+  lb->next=logbufs;
+  logbufs=lb;
+
+  return lb;
+}
+
+logbuf *logbuf_open(const char *filename, int mode) {
+  logbuf *lb;
+  int fd;
+
+  if ((fd=open(filename, O_RDWR|O_CREAT|O_APPEND, mode))<0)
+    return NULL;
+
+  if (!(lb=logbuf_new(fd)) || !(lb->filename=strdup(filename))) {
+    if (lb)
+      logbuf_close(lb);
+    else
+      close(fd);
+    return NULL;
+  }
+
+  lb->mode=mode;
+
+  return lb;
+}
+
+/* Buffers a descriptor we didn't open, e.g. stderr.  It's never closed. */
+logbuf *logbuf_fdopen(int fd) {
+  return logbuf_new(fd);
+}
+
+/* Writes out what we have and opens the file again, for log rotation */
+int logbuf_reopen(logbuf *lb) {
+  int fd;
+
+  logbuf_flush(lb);
+
+  if (!lb->filename)
+    return 0;
+
+  if ((fd=open(lb->filename, O_RDWR|O_CREAT|O_APPEND, lb->mode))<0)
+    return -1;
+
+  if (lb->fd>=0)
+    close(lb->fd);
+  lb->fd=fd;
+
+  return 0;
+}
+
+void logbuf_close(logbuf *lb) {
+  logbuf **lbh;
+
+  logbuf_flush(lb);
+
+  for (lbh=&logbufs;*lbh;lbh=&((*lbh)->next)) {
+    if (*lbh==lb) {
+      *lbh=lb->next;
+      break;
+    }
+  }
+
+  closedlines+=lb->lines;
+  closedwrites+=lb->writes;
+  closeddropped+=lb->dropped;
+
+  if (lb->filename && lb->fd>=0)
+    close(lb->fd);
+
+  free(lb->filename);
+  free(lb->buf);
+  free(lb);
+}
+
+/*
+ * Returns 1 if the line was taken, 0 if it had to be dropped (the log
+ * couldn't be written and the buffer is full).
+ */
+int logbuf_write(logbuf *lb, const char *line, size_t len) {
+  if (len>LOGBUF_SIZE-lb->used)
+    logbuf_flush(lb);
+
+  if (lb->fd<0 || len>LOGBUF_SIZE-lb->used) {
+    lb->dropped++;
+    return 0;
+  }
+
+  memcpy(lb->buf+lb->used, line, len);
+  lb->used+=len;
+  lb->lines++;
+
+  if (unbuffered)
+    logbuf_flush(lb);
+
+  return 1;
+}
+
+void logbuf_flush(logbuf *lb) {
+  size_t done=0;
+  ssize_t res;
+  char *cp;
+  time_t now;
+
+  if (!lb->used || lb->fd<0)
+    return;
+
+  while (done<lb->used) {
+    res=write(lb->fd, lb->buf+done, lb->used-done);
+    if (res<0 && errno==EINTR)
+      continue;
+    if (res<=0)
+      break;
+    done+=res;
+  }
+
+  /* whatever didn't make it is lost, count the lines */
+  for (cp=lb->buf+done;cp<lb->buf+lb->used;cp++)
+    if (*cp=='\n')
+      lb->dropped++;
+
+  lb->used=0;
+  lb->writes++;
+
+  if (logsync) {
+    now=time(NULL);
+    if (now-lb->lastsync>=logsync) {
+      fsync(lb->fd);
+      lb->lastsync=now;
+    }
+  }
+}
+
+void logbuf_flushall() {
+  logbuf *lb;
+
+  for (lb=logbufs;lb;lb=lb->next)
+    logbuf_flush(lb);
+}
+
+/* For forked children: write every line out straight away from now on */
+void logbuf_unbuffered() {
+  logbuf_flushall();
+  unbuffered=1;
+}
+
+static void logbuf_doflush(void *arg) {
+  logbuf_flushall();
+}
+
+static void logbuf_stats(int hooknum, void *arg) {
+  long level=(long)arg;
+  unsigned long lines=closedlines, writes=closedwrites, dropped=closeddropped;
+  logbuf *lb;
+  int count=0;
+  char buf[512];
+
+  if (level>5) {
+    for (lb=logbufs;lb;lb=lb->next) {
+      lines+=lb->lines;
+      writes+=lb->writes;
+      dropped+=lb->dropped;
+      count++;
+    }
+
+    sprintf(buf,"Logs    :%7d open, %7lu lines in %7lu writes, %7lu dropped, sync %s",
+            count,lines,writes,dropped,logsync?"on":"off");
+    triggerhook(HOOK_CORE_STATSREPLY,(void *)buf);
+  }
+}
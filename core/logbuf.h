@@ -0,0 +1,49 @@
+/* logbuf.h */
+
+#ifndef __LOGBUF_H
+#define __LOGBUF_H
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Buffered log files: lines are copied into memory and written out in
+ * one go every LOGBUF_FLUSHINTERVAL seconds (or when the buffer fills),
+ * rather than each line costing a write() on the main loop.
+ *
+ * fsync policy comes from "logsync" in the [core] section: 0 (the
+ * default) never syncs, N syncs each log at most every N seconds.
+ *
+ * Anything that forks must call logbuf_flushall() first so the child
+ * doesn't inherit (and later repeat) pending lines, and the child should
+ * call logbuf_unbuffered() as it will usually leave with _exit().
+ */
+
+#define LOGBUF_SIZE           65536
+#define LOGBUF_FLUSHINTERVAL  1
+
+typedef struct logbuf {
+  char *filename;      /* NULL if we don't own fd */
+  int mode;
+  int fd;
+  char *buf;
+  size_t used;
+  unsigned long lines, writes, dropped;
+  time_t lastsync;
+  struct logbuf *next;
+} logbuf;
+
+void initlogbufs();
+void finilogbufs();
+void configurelogbufs();
+
+logbuf *logbuf_open(const char *filename, int mode);
+logbuf *logbuf_fdopen(int fd);
+int logbuf_reopen(logbuf *lb);
+void logbuf_close(logbuf *lb);
+int logbuf_write(logbuf *lb, const char *line, size_t len);
+void logbuf_flush(logbuf *lb);
+void logbuf_flushall();
+void logbuf_unbuffered();
+
+#endif
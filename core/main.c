@@ -7,6 +7,7 @@
 #include "config.h"
 #include "error.h"
 #include "nsmalloc.h"
+#include "logbuf.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -25,6 +26,7 @@ void fini_logfile();
 void siginthandler(int sig);
 void sigusr1handler(int sig);
 void sigsegvhandler(int sig);
+void sigfatalhandler(int sig);
 void sighuphandler(int sig);
 void handlecore(void);
 void handlesignals(void);
@@ -42,6 +44,7 @@ int main(int argc, char **argv) {
   inithooks();
   inithandlers();
   initschedule();
+  initlogbufs();
 
   init_logfile();
   
@@ -58,6 +61,7 @@ int main(int argc, char **argv) {
   }
 
   initconfig(config);
+  configurelogbufs();
 
   /* modules can rely on this directory always being there */
   if (mkdir("data", 0700) < 0 && errno != EEXIST) {
@@ -72,6 +76,9 @@ int main(int argc, char **argv) {
   signal(SIGUSR1, sigusr1handler);
   signal(SIGHUP, sighuphandler);
   oldsegv = signal(SIGSEGV, sigsegvhandler);
+  signal(SIGABRT, sigfatalhandler);
+  signal(SIGBUS, sigfatalhandler);
+  signal(SIGFPE, sigfatalhandler);
 
   /* Main loop */
   for(;;) {
@@ -89,6 +96,7 @@ int main(int argc, char **argv) {
   freeconfig();
 
   fini_logfile();
+  finilogbufs();
   finischedule();
   finihandlers();
 
@@ -149,7 +157,16 @@ void sighuphandler(int sig) {
 }
 
 void sigsegvhandler(int sig) {
+  logbuf_flushall();
   handlecore();
 
   oldsegv(sig);
 }
+
+/* don't take up to a second of buffered logs down with us */
+void sigfatalhandler(int sig) {
+  logbuf_flushall();
+
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
@@ -27,6 +27,7 @@ typedef PQResult DBResult;
 
 #define dbconnected() pqconnected()
 #define dbgetid() pqgetid()
+#define dbgetpooledid() pqgetpooledid()
 #define dbfreeid(x) pqfreeid(x)
 
 #define dbattach(schema) pqcreateschema(schema)
@@ -36,6 +37,8 @@ typedef PQResult DBResult;
 #define dbloadtable_tag(tablename, init, data, fini, tag) pqloadtable(tablename, init, data, fini, tag);
 
 #define dbasyncqueryf(id, handler, tag, flags, format, ...) pqasyncqueryf(id, handler, tag, flags, format , ##__VA_ARGS__)
+#define dbasyncqueryparams(id, handler, tag, flags, query, nparams, values, types) pqasyncqueryparams(id, handler, tag, flags, query, nparams, values)
+#define dbasyncbulkinsert(id, handler, tag, table, columns, ncolumns, nrows, values, types) pqasynccopy(id, handler, tag, table, columns, ncolumns, nrows, values)
 #define dbquerysuccessful(x) pqquerysuccessful(x)
 #define dbgetresult(conn) pqgetresult(conn)
 #define dbnumfields(x) PQnfields(x->result)
@@ -60,6 +63,7 @@ typedef SQLiteResult DBResult;
 
 #define dbconnected() sqliteconnected()
 #define dbgetid() sqlitegetid()
+#define dbgetpooledid() sqlitegetid()
 #define dbfreeid(x) sqlitefreeid(x)
 
 #define dbattach(schema) sqliteattach((schema))
@@ -69,6 +73,8 @@ typedef SQLiteResult DBResult;
 #define dbloadtable_tag(tablename, init, data, fini, tag) sqliteloadtable(tablename, init, data, fini, tag);
 
 #define dbasyncqueryf(id, handler, tag, flags, format, ...) sqliteasyncqueryf(id, handler, tag, flags, format , ##__VA_ARGS__)
+#define dbasyncqueryparams(id, handler, tag, flags, query, nparams, values, types) sqliteasyncqueryparams(id, handler, tag, flags, query, nparams, values, types)
+#define dbasyncbulkinsert(id, handler, tag, table, columns, ncolumns, nrows, values, types) sqliteasyncbulkinsert(id, handler, tag, table, columns, ncolumns, nrows, values, types)
 #define dbquerysuccessful(x) sqlitequerysuccessful(x)
 #define dbgetresult(conn) sqlitegetresult(conn)
 #define dbnumfields(x) sqlite3_column_count(x->r)
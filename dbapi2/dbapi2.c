@@ -12,6 +12,7 @@
 #include <stdint.h>
 
 #include "../core/error.h"
+#include "../core/schedule.h"
 #include "../lib/strlfunc.h"
 #include "../lib/stringbuf.h"
 #include "../lib/version.h"
@@ -26,14 +27,56 @@ struct DBAPIProviderData {
 static DBAPIProvider *providerobjs[MAX_PROVIDERS];
 static struct DBAPIProviderData providerdata[MAX_PROVIDERS];
 
-static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char *format, const char *types, va_list ap);
+/* Values pulled out of a query for the provider to bind, types has an
+ * 'i' (integer), 'f' (float) or 's' (string) for each.
+ */
+typedef struct DBAPIParams {
+  int count;
+  const char *values[VSNPF_MAXARGS];
+  char types[VSNPF_MAXARGS+1];
+
+  /* terminated copies of 'S' values, freed once the query is sent */
+  int ncopies;
+  char *copies[VSNPF_MAXARGS];
+} DBAPIParams;
+
+/* A bulk writer's rows are kept as NUL terminated values one after
+ * another in buf, offsets has where each starts (-1 for NULL).
+ */
+struct DBAPIBulkData {
+  DBAPIBulk bulk;
+  const DBAPIConn *db;
+  char *table, *columns;
+  char types[VSNPF_MAXARGS+1];      /* as given to bulkopen */
+  char bindtypes[VSNPF_MAXARGS+1];  /* what the provider binds them as */
+  int ncolumns;
+
+  char *buf;
+  size_t buflen, bufsize;
+  long *offsets;
+  int rows, offsetsize;
+  time_t oldest;
+
+  int pending, closed;
+  unsigned long dropped;
+
+  struct DBAPIBulkData *next;
+};
+
+static struct DBAPIBulkData *bulkwriters;
+
+static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char *format, const char *types, va_list ap, DBAPIParams *params);
+static void dbbulktimer(void *arg);
 
 void _init(void) {
   memset(providerobjs, 0, sizeof(providerobjs));
+  bulkwriters = NULL;
+  schedulerecurring(time(NULL)+1, 0, 1, dbbulktimer, NULL);
 }
 
 void _fini(void) {
   /* everything should be unregistered already */
+  deleteallschedules(dbbulktimer);
 }
 
 int registerdbprovider(const char *name, DBAPIProvider *provider) {
@@ -64,11 +107,22 @@ void deregisterdbprovider(int handle) {
   providerobjs[handle] = NULL;
 }
 
-static void dbclose(DBAPIConn *db) {
+static void dbreallyclose(DBAPIConn *db) {
   db->__close(db);
   free((DBAPIConn *)db);
 }
 
+/* closing the provider drops queries it hasn't sent, so wait for any
+ * bulk writes still on their way */
+static void dbclose(DBAPIConn *db) {
+  if(db->__bulkpending) {
+    db->__closing = 1;
+    return;
+  }
+
+  dbreallyclose(db);
+}
+
 static void dbunsafequery(const DBAPIConn *db, DBAPIQueryCallback cb, DBAPIUserData data, const char *format, ...) {
   va_list ap;
   char buf[QUERYBUFLEN];
@@ -114,15 +168,35 @@ static void dbunsafesimplequery(const DBAPIConn *db, const char *format, ...) {
   db->__query(db, NULL, NULL, buf);
 }
 
+/* Values go to the provider as parameters when it can take them, so the
+ * query text only varies with the tables in it and can be prepared once.
+ */
+static void dbsendquery(const DBAPIConn *db, DBAPIQueryCallback cb, DBAPIUserData data, const char *buf, DBAPIParams *params) {
+  int i;
+
+  if(params && params->count) {
+    params->types[params->count] = '\0';
+    db->__queryparams(db, cb, data, buf, params->count, params->values, params->types);
+  } else {
+    db->__query(db, cb, data, buf);
+  }
+
+  /* the provider has its own copies by now */
+  if(params)
+    for(i=0;i<params->ncopies;i++)
+      free(params->copies[i]);
+}
+
 static void dbsafequery(const DBAPIConn *db, DBAPIQueryCallback cb, DBAPIUserData data, const char *format, const char *types, ...) {
   va_list ap;
   char buf[QUERYBUFLEN];
+  DBAPIParams params;
 
   va_start(ap, types);
-  dbvsnprintf(db, buf, sizeof(buf), format, types, ap);
+  dbvsnprintf(db, buf, sizeof(buf), format, types, ap, db->__queryparams?&params:NULL);
   va_end(ap);
 
-  db->__query(db, cb, data, buf);
+  dbsendquery(db, cb, data, buf, db->__queryparams?&params:NULL);
 }
 
 static void dbsafecreatetable(const DBAPIConn *db, DBAPIQueryCallback cb, DBAPIUserData data, const char *format, const char *types, ...) {
@@ -130,7 +204,7 @@ static void dbsafecreatetable(const DBAPIConn *db, DBAPIQueryCallback cb, DBAPIU
   char buf[QUERYBUFLEN];
 
   va_start(ap, types);
-  dbvsnprintf(db, buf, sizeof(buf), format, types, ap);
+  dbvsnprintf(db, buf, sizeof(buf), format, types, ap, NULL);
   va_end(ap);
 
   db->__createtable(db, cb, data, buf);
@@ -139,12 +213,13 @@ static void dbsafecreatetable(const DBAPIConn *db, DBAPIQueryCallback cb, DBAPIU
 static void dbsafesimplequery(const DBAPIConn *db, const char *format, const char *types, ...) {
   va_list ap;
   char buf[QUERYBUFLEN];
+  DBAPIParams params;
 
   va_start(ap, types);
-  dbvsnprintf(db, buf, sizeof(buf), format, types, ap);
+  dbvsnprintf(db, buf, sizeof(buf), format, types, ap, db->__queryparams?&params:NULL);
   va_end(ap);
 
-  db->__query(db, NULL, NULL, buf);
+  dbsendquery(db, NULL, NULL, buf, db->__queryparams?&params:NULL);
 }
 
 static void dbloadtable(const DBAPIConn *db, DBAPIQueryCallback init, DBAPIQueryCallback data, DBAPIQueryCallback fini, DBAPIUserData tag, const char *tablename) {
@@ -156,7 +231,7 @@ static void dbcall(const DBAPIConn *db, DBAPIQueryCallback cb, DBAPIUserData dat
   char buf[QUERYBUFLEN];
 
   va_start(ap, types);
-  dbvsnprintf(db, buf, sizeof(buf), format, types, ap);
+  dbvsnprintf(db, buf, sizeof(buf), format, types, ap, NULL);
   va_end(ap);
 
   db->__call(db, cb, data, function, buf);
@@ -167,12 +242,301 @@ static void dbsimplecall(const DBAPIConn *db, const char *function, const char *
   char buf[QUERYBUFLEN];
 
   va_start(ap, types);
-  dbvsnprintf(db, buf, sizeof(buf), format, types, ap);
+  dbvsnprintf(db, buf, sizeof(buf), format, types, ap, NULL);
   va_end(ap);
 
   db->__call(db, NULL, NULL, function, buf);
 }
 
+static char *dbbulkcopy(const char *s) {
+  size_t len = strlen(s) + 1;
+  char *p = malloc(len);
+
+  if(p)
+    memcpy(p, s, len);
+
+  return p;
+}
+
+static void dbbulkfree(struct DBAPIBulkData *d) {
+  free(d->table);
+  free(d->columns);
+  free(d->buf);
+  free(d->offsets);
+  free(d);
+}
+
+static void dbbulkdoflush(struct DBAPIBulkData *d, int force);
+
+static void dbbulkdone(const DBAPIResult *result, void *arg) {
+  struct DBAPIBulkData *d = arg;
+  DBAPIConn *db = (DBAPIConn *)d->db;
+
+  d->pending--;
+  db->__bulkpending--;
+
+  /* pqsql only counts results with rows as successful, a COPY that
+   * went in still has its row count */
+  if(!result || (!result->success && !result->affected))
+    Error("dbapi2", ERR_WARNING, "Bulk insert into %s failed, database: %s", d->table, d->db->name);
+
+  if(result)
+    result->clear(result);
+
+  if(d->closed) {
+    if(!d->pending)
+      dbbulkfree(d);
+    if(db->__closing && !db->__bulkpending)
+      dbreallyclose(db);
+    return;
+  }
+
+  if(d->dropped) {
+    Error("dbapi2", ERR_WARNING, "Bulk writer for %s caught up, %lu rows were dropped, database: %s", d->table, d->dropped, d->db->name);
+    d->dropped = 0;
+  }
+
+  /* we may have been holding rows back */
+  if(d->rows >= DBAPI2_BULK_ROWS)
+    dbbulkdoflush(d, 0);
+}
+
+/*
+ * Hands the waiting rows to the provider, unless too many flushes are
+ * outstanding already and we're not being forced.  The buffer is
+ * detached first as the provider might call us back before returning.
+ */
+static void dbbulkdoflush(struct DBAPIBulkData *d, int force) {
+  const char **values;
+  char *buf;
+  long *offsets;
+  int i, rows;
+
+  if(!d->rows || (!force && d->pending >= DBAPI2_BULK_MAXPENDING))
+    return;
+
+  buf = d->buf;
+  offsets = d->offsets;
+  rows = d->rows;
+
+  d->buf = NULL;
+  d->buflen = d->bufsize = 0;
+  d->offsets = NULL;
+  d->offsetsize = 0;
+  d->rows = 0;
+
+  values = malloc(sizeof(char *) * rows * d->ncolumns);
+  if(!values) {
+    Error("dbapi2", ERR_WARNING, "Unable to allocate memory for bulk insert into %s, %d rows dropped, database: %s", d->table, rows, d->db->name);
+  } else {
+    for(i=0;i<rows*d->ncolumns;i++)
+      values[i] = (offsets[i] < 0) ? NULL : buf + offsets[i];
+
+    d->pending++;
+    ((DBAPIConn *)d->db)->__bulkpending++;
+    d->db->__bulkinsert(d->db, dbbulkdone, d, d->table, d->columns, d->ncolumns, rows, values, d->bindtypes);
+    free(values);
+  }
+
+  free(buf);
+  free(offsets);
+}
+
+static int dbbulkappend(struct DBAPIBulkData *d, const char *value, size_t len, long *offset) {
+  size_t newsize;
+  char *newbuf;
+
+  if(d->buflen + len + 1 > d->bufsize) {
+    newsize = d->bufsize ? d->bufsize * 2 : 8192;
+    while(newsize < d->buflen + len + 1)
+      newsize *= 2;
+
+    if(!(newbuf = realloc(d->buf, newsize)))
+      return 0;
+
+    d->buf = newbuf;
+    d->bufsize = newsize;
+  }
+
+  memcpy(d->buf + d->buflen, value, len);
+  d->buf[d->buflen + len] = '\0';
+  *offset = d->buflen;
+  d->buflen += len + 1;
+
+  return 1;
+}
+
+/* Adds a row, the arguments are as the types given to bulkopen.
+ * Returns 0 if the row was dropped as the database has fallen behind.
+ */
+static int dbbulkadd(DBAPIBulk *b, ...) {
+  struct DBAPIBulkData *d = b->__data;
+  char convbuf[VSNPF_MAXARGS][64];
+  const char *value;
+  long *offsets, *row;
+  size_t len = 0;
+  va_list ap;
+  int i, ok;
+
+  if(d->rows >= DBAPI2_BULK_MAXROWS) {
+    if(!d->dropped++)
+      Error("dbapi2", ERR_WARNING, "Bulk writer for %s is falling behind, dropping rows, database: %s", d->table, d->db->name);
+    return 0;
+  }
+
+  if((d->rows + 1) * d->ncolumns > d->offsetsize) {
+    int newsize = d->offsetsize ? d->offsetsize * 2 : DBAPI2_BULK_ROWS * d->ncolumns;
+
+    if(!(offsets = realloc(d->offsets, sizeof(long) * newsize))) {
+      d->dropped++;
+      return 0;
+    }
+
+    d->offsets = offsets;
+    d->offsetsize = newsize;
+  }
+
+  row = d->offsets + d->rows * d->ncolumns;
+
+  va_start(ap, b);
+  for(i=0,ok=1;i<d->ncolumns;i++) {
+    value = convbuf[i];
+
+    switch(d->types[i]) {
+      case 's':
+        value = va_arg(ap, char *);
+        len = value ? strlen(value) : 0;
+        break;
+      case 'S':
+        value = va_arg(ap, char *);
+        len = va_arg(ap, size_t);
+        break;
+      case 'd':
+        len = snprintf(convbuf[i], sizeof(convbuf[i]), "%d", va_arg(ap, int));
+        break;
+      case 'u':
+        len = snprintf(convbuf[i], sizeof(convbuf[i]), "%u", va_arg(ap, unsigned int));
+        break;
+      case 't':
+        len = snprintf(convbuf[i], sizeof(convbuf[i]), "%jd", (intmax_t)va_arg(ap, time_t));
+        break;
+      case 'D':
+        len = snprintf(convbuf[i], sizeof(convbuf[i]), "%ld", va_arg(ap, long));
+        break;
+      case 'U':
+        len = snprintf(convbuf[i], sizeof(convbuf[i]), "%lu", va_arg(ap, unsigned long));
+        break;
+      case 'g':
+        len = snprintf(convbuf[i], sizeof(convbuf[i]), "%.1f", va_arg(ap, double));
+        break;
+    }
+
+    /* a NULL string goes in as SQL NULL, not an empty one */
+    if(!value)
+      row[i] = -1;
+    else if(ok && !dbbulkappend(d, value, len, &row[i]))
+      ok = 0;
+  }
+  va_end(ap);
+
+  if(!ok) {
+    d->dropped++;
+    return 0;
+  }
+
+  if(!d->rows)
+    d->oldest = time(NULL);
+  d->rows++;
+
+  if(d->rows >= DBAPI2_BULK_ROWS)
+    dbbulkdoflush(d, 0);
+
+  return 1;
+}
+
+static void dbbulkflush(DBAPIBulk *b) {
+  dbbulkdoflush(b->__data, 1);
+}
+
+/* Writes out what's left, the writer goes once the database is done with it */
+static void dbbulkclose(DBAPIBulk *b) {
+  struct DBAPIBulkData *d = b->__data, **dh;
+
+  dbbulkdoflush(d, 1);
+
+  for(dh=&bulkwriters;*dh;dh=&((*dh)->next)) {
+    if(*dh == d) {
+      *dh = d->next;
+      break;
+    }
+  }
+
+  d->closed = 1;
+  if(!d->pending)
+    dbbulkfree(d);
+}
+
+/*
+ * dbbulkopen():
+ *  Gets a writer for rows of table (columns), types has a letter for each
+ *  column as in query() (s, S, d, u, t, D, U or g).
+ *
+ * Rows are buffered and written DBAPI2_BULK_ROWS at a time, or after
+ * DBAPI2_BULK_INTERVAL seconds, in one go (COPY on PostgreSQL, a single
+ * transaction on SQLite).  Returns NULL if the provider can't do this,
+ * callers should fall back to inserting rows one by one.
+ */
+static DBAPIBulk *dbbulkopen(const DBAPIConn *db, const char *table, const char *columns, const char *types) {
+  struct DBAPIBulkData *d;
+  int i;
+
+  if(!db->__bulkinsert)
+    return NULL;
+
+  if(!*types || strlen(types) > VSNPF_MAXARGS || strspn(types, "sSdutDUg") != strlen(types)) {
+    Error("dbapi2", ERR_WARNING, "Bad types '%s' for bulk writer on %s, database: %s", types, table, db->name);
+    return NULL;
+  }
+
+  d = calloc(1, sizeof(struct DBAPIBulkData));
+  if(!d)
+    return NULL;
+
+  d->db = db;
+  d->table = dbbulkcopy(db->tablename(db, table));
+  d->columns = dbbulkcopy(columns);
+  if(!d->table || !d->columns) {
+    dbbulkfree(d);
+    return NULL;
+  }
+
+  strlcpy(d->types, types, sizeof(d->types));
+  d->ncolumns = strlen(types);
+  for(i=0;i<d->ncolumns;i++)
+    d->bindtypes[i] = (types[i] == 's' || types[i] == 'S') ? 's' : (types[i] == 'g') ? 'f' : 'i';
+
+  d->bulk.add = dbbulkadd;
+  d->bulk.flush = dbbulkflush;
+  d->bulk.close = dbbulkclose;
+  d->bulk.__data = d;
+
+  d->next = bulkwriters;
+  bulkwriters = d;
+
+  return &d->bulk;
+}
+
+static void dbbulktimer(void *arg) {
+  struct DBAPIBulkData *d, *nd;
+  time_t now = time(NULL);
+
+  for(d=bulkwriters;d;d=nd) {
+    nd = d->next;
+    if(d->rows && now - d->oldest >= DBAPI2_BULK_INTERVAL)
+      dbbulkdoflush(d, 0);
+  }
+}
+
 DBAPIConn *dbapi2open(const char *provider, const char *database) {
   int i, found = -1;
   DBAPIConn *db;
@@ -221,8 +585,11 @@ DBAPIConn *dbapi2open(const char *provider, const char *database) {
   db->unsafecreatetable = dbunsafecreatetable;
   db->call = dbcall;
   db->scall = dbsimplecall;
+  db->bulkopen = dbbulkopen;
 
   db->__query = p->query;
+  db->__queryparams = p->queryparams;
+  db->__bulkinsert = p->bulkinsert;
   db->__close = p->close;
   db->__quotestring = p->quotestring;
   db->__createtable = p->createtable;
@@ -243,15 +610,28 @@ DBAPIConn *dbapi2open(const char *provider, const char *database) {
   return db;
 }
 
-static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char *format, const char *types, va_list ap) {
+/*
+ * dbvsnprintf():
+ *  Fills in the ?s in format from the arguments described by types.
+ *
+ * With params, values (everything but T and R) aren't put in the query
+ * but become $1, $2... with the values left in params for binding.
+ */
+static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char *format, const char *types, va_list ap, DBAPIParams *params) {
   StringBuf b;
   const char *p;
   static char convbuf[VSNPF_MAXARGS][VSNPF_MAXARGLEN+10];
+  static const char *argvalue[VSNPF_MAXARGS];
+  static char argtype[VSNPF_MAXARGS];
+  char placeholder[16];
   int arg, argcount;
 
   if(size == 0)
     return;
 
+  if(params)
+    params->count = params->ncopies = 0;
+
   {
     int i;
 
@@ -272,11 +652,16 @@ static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char
     for(;*types;types++) {
       char *cb = convbuf[argcount];
 
-      if(argcount++ >= VSNPF_MAXARGS) {
+      if(argcount >= VSNPF_MAXARGS) {
         /* calls exit(0) */
         Error("dbapi2", ERR_STOP, "Maximum arguments reached in dbvsnprintf, format: '%s', database: %s", format, db->name);
       }
 
+      /* numbers are bound as themselves, strings are overridden below */
+      argvalue[argcount] = cb;
+      argtype[argcount] = params?'i':0;
+      argcount++;
+
       fallthrough = 0;
       switch(*types) {
         case 's':
@@ -292,7 +677,25 @@ static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char
             l = va_arg(ap, size_t);
           }
 
-          if(!s) {
+          if(params) {
+            argtype[argcount-1] = 's';
+
+            if(!s || fallthrough) {
+              /* the provider copies it, no need for our own */
+              argvalue[argcount-1] = s;
+            } else {
+              /* not quoted into convbuf, so there's no length limit, it
+                 just needs terminating */
+              char *copy = malloc(l + 1);
+              if(!copy)
+                Error("dbapi2", ERR_STOP, "Unable to allocate memory in dbvsnprintf, format: '%s', database: %s", format, db->name);
+
+              memcpy(copy, s, l);
+              copy[l] = '\0';
+              params->copies[params->ncopies++] = copy;
+              argvalue[argcount-1] = copy;
+            }
+          } else if(!s) {
             strlcpy(cb, "NULL", sizeof(convbuf[0]));
           } else if((l > (VSNPF_MAXARGLEN / 2)) || !db->__quotestring(db, cb, sizeof(convbuf[0]), s, l)) {
             /* now... this is a guess, but we should catch it most of the time */
@@ -305,11 +708,13 @@ static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char
           s = va_arg(ap, char *);
 
           strlcpy(cb, s, sizeof(convbuf[0]));
+          argtype[argcount-1] = 0;
           break;
         case 'T':
           s = va_arg(ap, char *);
 
           strlcpy(cb, db->tablename(db, s), sizeof(convbuf[0]));
+          argtype[argcount-1] = 0;
           break;
         case 'd':
           d = va_arg(ap, int);
@@ -334,6 +739,8 @@ static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char
         case 'g':
           g = va_arg(ap, double);
           snprintf(cb, VSNPF_MAXARGLEN, "%.1f", g);
+          if(params)
+            argtype[argcount-1] = 'f';
           break;
         default:
           /* calls exit(0) */
@@ -357,8 +764,17 @@ static void dbvsnprintf(const DBAPIConn *db, char *buf, size_t size, const char
     if(arg >= argcount)
       Error("dbapi2", ERR_STOP, "Gone over number of arguments in dbvsnprintf, format: '%s', database: %s", format, db->name);
 
-    if(!sbaddstr(&b, convbuf[arg]))
+    if(argtype[arg]) {
+      params->values[params->count] = argvalue[arg];
+      params->types[params->count] = argtype[arg];
+      params->count++;
+
+      snprintf(placeholder, sizeof(placeholder), "$%d", params->count);
+      if(!sbaddstr(&b, placeholder))
+        Error("dbapi2", ERR_STOP, "Possible truncation in dbvsnprintf, format: '%s', database: %s", format, db->name);
+    } else if(!sbaddstr(&b, convbuf[arg])) {
       Error("dbapi2", ERR_STOP, "Possible truncation in dbvsnprintf, format: '%s', database: %s", format, db->name);
+    }
 
     arg++;
   }
@@ -7,6 +7,15 @@
 
 #define DBAPI2_DEFAULT NULL
 
+/* bulk writers flush once this many rows are waiting... */
+#define DBAPI2_BULK_ROWS 500
+/* ...or the oldest has waited this many seconds */
+#define DBAPI2_BULK_INTERVAL 2
+/* flushes a writer can have outstanding before it holds rows back */
+#define DBAPI2_BULK_MAXPENDING 2
+/* rows a writer holds back while the database catches up, more are dropped */
+#define DBAPI2_BULK_MAXROWS 50000
+
 #include <stdlib.h>
 #include <stdarg.h>
 
@@ -23,6 +32,7 @@ struct DBAPIConn;
 typedef void *DBAPIUserData;
 
 struct DBAPIResult;
+struct DBAPIBulk;
 
 typedef DBAPI2_HANDLE *(*DBAPINew)(const struct DBAPIConn *);
 typedef void (*DBAPIClose)(struct DBAPIConn *);
@@ -32,6 +42,7 @@ typedef void (*DBAPIQueryCallback)(const struct DBAPIResult *, void *);
 typedef void (*DBAPIQuery)(const struct DBAPIConn *, DBAPIQueryCallback, DBAPIUserData, const char *, ...) __attribute__ ((format (printf, 4, 5)));
 typedef void (*DBAPISimpleQuery)(const struct DBAPIConn *, const char *, ...) __attribute__ ((format (printf, 2, 3)));
 typedef void (*DBAPIQueryV)(const struct DBAPIConn *, DBAPIQueryCallback, DBAPIUserData, const char *);
+typedef void (*DBAPIQueryParamsV)(const struct DBAPIConn *, DBAPIQueryCallback, DBAPIUserData, const char *, int, const char * const *, const char *);
 typedef void (*DBAPICallV)(const struct DBAPIConn *, DBAPIQueryCallback, DBAPIUserData, const char *, const char *);
 typedef void (*DBAPICreateTable)(const struct DBAPIConn *, DBAPIQueryCallback, DBAPIUserData, const char *, ...) __attribute__ ((format (printf, 4, 5)));
 typedef void (*DBAPICreateTableV)(const struct DBAPIConn *, DBAPIQueryCallback, DBAPIUserData, const char *);
@@ -48,6 +59,12 @@ typedef void (*DBAPISimpleCall)(const struct DBAPIConn *, const char *, const ch
 
 typedef char *(*DBAPITableName)(const struct DBAPIConn *, const char *);
 
+typedef void (*DBAPIBulkInsertV)(const struct DBAPIConn *, DBAPIQueryCallback, DBAPIUserData, const char *, const char *, int, int, const char * const *, const char *);
+typedef struct DBAPIBulk *(*DBAPIBulkOpen)(const struct DBAPIConn *, const char *, const char *, const char *);
+typedef int (*DBAPIBulkAdd)(struct DBAPIBulk *, ...);
+typedef void (*DBAPIBulkFlush)(struct DBAPIBulk *);
+typedef void (*DBAPIBulkClose)(struct DBAPIBulk *);
+
 struct DBAPIProviderData;
 
 typedef struct DBAPIProvider {
@@ -55,6 +72,8 @@ typedef struct DBAPIProvider {
   DBAPIClose close;
 
   DBAPIQueryV query;
+  DBAPIQueryParamsV queryparams; /* optional, query has $1.. placeholders, see dbvsnprintf */
+  DBAPIBulkInsertV bulkinsert; /* optional, rows of values for table (columns) */
   DBAPICreateTableV createtable;
   DBAPILoadTable loadtable;
 
@@ -85,6 +104,8 @@ typedef struct DBAPIConn {
   DBAPICall call;
   DBAPISimpleCall scall;
 
+  DBAPIBulkOpen bulkopen;
+
   char name[DBNAME_LEN+1];
 
   void *handle;
@@ -93,9 +114,13 @@ typedef struct DBAPIConn {
   DBAPIClose __close;
   DBAPIQuoteString __quotestring;
   DBAPIQueryV __query;
+  DBAPIQueryParamsV __queryparams;
+  DBAPIBulkInsertV __bulkinsert;
   DBAPICreateTableV __createtable;
   DBAPILoadTable __loadtable;
   DBAPICallV __call;
+
+  int __bulkpending, __closing;
 } DBAPIConn;
 
 typedef char *(*DBAPIResultGet)(const struct DBAPIResult *, unsigned int);
@@ -112,6 +137,18 @@ typedef struct DBAPIResult {
   DBAPIResultClear clear;
 } DBAPIResult;
 
+struct DBAPIBulkData;
+
+/* Buffers rows for one table and writes them in batches, see dbbulkopen */
+typedef struct DBAPIBulk {
+  DBAPIBulkAdd add;
+  DBAPIBulkFlush flush;
+  DBAPIBulkClose close;
+
+/* private members */
+  struct DBAPIBulkData *__data;
+} DBAPIBulk;
+
 int registerdbprovider(const char *, DBAPIProvider *);
 void deregisterdbprovider(int);
 DBAPIConn *dbapi2open(const char *, const char *);
@@ -0,0 +1,389 @@
+/*
+ * acmatch.c:
+ *  Aho-Corasick multiple literal matching, used to avoid running regular
+ *  expressions that can't possibly match.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "acmatch.h"
+
+acmatcher *ac_new(void) {
+  acmatcher *ac = calloc(1, sizeof(acmatcher));
+
+  return ac;
+}
+
+void ac_free(acmatcher *ac) {
+  int i;
+
+  if(!ac)
+    return;
+
+  for(i=0;i<ac->npatterns;i++)
+    free(ac->patterns[i].literal);
+
+  free(ac->patterns);
+  free(ac->go);
+  free(ac->fail);
+  free(ac->dictlink);
+  free(ac->out);
+  free(ac->outnext);
+  free(ac);
+}
+
+int ac_add(acmatcher *ac, const char *literal, size_t len, void *data) {
+  acpattern *pp;
+  size_t i;
+
+  if(!len)
+    return 0;
+
+  if(ac->npatterns >= ac->patterncap) {
+    int newcap = ac->patterncap ? ac->patterncap * 2 : 64;
+
+    pp = realloc(ac->patterns, newcap * sizeof(acpattern));
+    if(!pp)
+      return 0;
+
+    ac->patterns = pp;
+    ac->patterncap = newcap;
+  }
+
+  pp = &ac->patterns[ac->npatterns];
+  pp->literal = malloc(len);
+  if(!pp->literal)
+    return 0;
+
+  for(i=0;i<len;i++)
+    pp->literal[i] = tolower((unsigned char)literal[i]);
+
+  pp->len = len;
+  pp->data = data;
+  ac->npatterns++;
+
+  return 1;
+}
+
+/*
+ * Builds the full transition table so scanning is one lookup per byte.
+ * Only bytes that appear in some literal get their own column.
+ */
+int ac_build(acmatcher *ac) {
+  int maxstates = 1, i, s, c, head, tail, *queue;
+  size_t j;
+
+  memset(ac->symbol, 0, sizeof(ac->symbol));
+  ac->symbols = 1;
+
+  for(i=0;i<ac->npatterns;i++) {
+    maxstates += ac->patterns[i].len;
+
+    for(j=0;j<ac->patterns[i].len;j++) {
+      unsigned char ch = ac->patterns[i].literal[j];
+
+      if(!ac->symbol[ch]) {
+        ac->symbol[ch] = ac->symbols++;
+        if(isalpha(ch))
+          ac->symbol[toupper(ch)] = ac->symbol[ch];
+      }
+    }
+  }
+
+  free(ac->go);
+  free(ac->fail);
+  free(ac->dictlink);
+  free(ac->out);
+  free(ac->outnext);
+
+  ac->go = calloc((size_t)maxstates * ac->symbols, sizeof(int));
+  ac->fail = calloc(maxstates, sizeof(int));
+  ac->dictlink = calloc(maxstates, sizeof(int));
+  ac->out = malloc(maxstates * sizeof(int));
+  ac->outnext = malloc((ac->npatterns + 1) * sizeof(int));
+  queue = malloc(maxstates * sizeof(int));
+
+  if(!ac->go || !ac->fail || !ac->dictlink || !ac->out || !ac->outnext || !queue) {
+    free(queue);
+    ac->states = 0;
+    return 0;
+  }
+
+  for(i=0;i<maxstates;i++)
+    ac->out[i] = -1;
+
+  /* trie, state 0 is the root and 0 in go[] means "no edge yet" */
+  ac->states = 1;
+  for(i=0;i<ac->npatterns;i++) {
+    s = 0;
+    for(j=0;j<ac->patterns[i].len;j++) {
+      int *edge = &ac->go[s * ac->symbols + ac->symbol[(unsigned char)ac->patterns[i].literal[j]]];
+
+      if(!*edge)
+        *edge = ac->states++;
+      s = *edge;
+    }
+
+    ac->outnext[i] = ac->out[s];
+    ac->out[s] = i;
+  }
+
+  /* breadth first, filling in fail links and the missing edges */
+  head = tail = 0;
+  for(c=1;c<ac->symbols;c++)
+    if(ac->go[c])
+      queue[tail++] = ac->go[c];
+
+  while(head < tail) {
+    s = queue[head++];
+
+    for(c=1;c<ac->symbols;c++) {
+      int *edge = &ac->go[s * ac->symbols + c], f = ac->go[ac->fail[s] * ac->symbols + c];
+
+      if(*edge) {
+        ac->fail[*edge] = f;
+        ac->dictlink[*edge] = (ac->out[f] >= 0) ? f : ac->dictlink[f];
+        queue[tail++] = *edge;
+      } else {
+        *edge = f;
+      }
+    }
+  }
+
+  free(queue);
+
+  return 1;
+}
+
+/*
+ * Calls fn once for every occurrence of every literal in subject.
+ */
+void ac_scan(acmatcher *ac, const char *subject, size_t len, acmatch_fn *fn, void *arg) {
+  const unsigned char *p = (const unsigned char *)subject, *end = p + len;
+  int s = 0, t, o;
+
+  if(!ac->states)
+    return;
+
+  for(;p<end;p++) {
+    s = ac->go[s * ac->symbols + ac->symbol[*p]];
+
+    for(t=(ac->out[s] >= 0)?s:ac->dictlink[s];t;t=ac->dictlink[t])
+      for(o=ac->out[t];o>=0;o=ac->outnext[o])
+        fn(ac->patterns[o].data, arg);
+  }
+}
+
+/* Skips a {..}, <..> or '..' argument starting at p, returns its last character */
+static const char *skipdelimited(const char *p) {
+  char close;
+
+  switch(*p) {
+    case '{': close = '}'; break;
+    case '<': close = '>'; break;
+    case '\'': close = '\''; break;
+    default: return NULL;
+  }
+
+  for(p++;*p && *p != close;p++)
+    ;
+
+  return *p ? p : NULL;
+}
+
+/*
+ * Given p at the letter or digit of an escape, returns the last character
+ * the escape uses, e.g. the 1 of \x41 or the } of \p{L}, or NULL if the
+ * regex ends part way through.  None of these are literal text.
+ */
+static const char *skipescape(const char *p) {
+  const char *q;
+  int i;
+
+  switch(*p) {
+    case 'x':
+      if(p[1] == '{')
+        return skipdelimited(p + 1);
+      for(i=0;i<2 && isxdigit((unsigned char)p[1]);i++)
+        p++;
+      return p;
+    case 'c':
+      return p[1] ? p + 1 : NULL;
+    case 'o':
+    case 'N':
+      /* a bare \N is "not a newline", it takes nothing */
+      if(p[1] == '{')
+        return skipdelimited(p + 1);
+      return p;
+    case 'p':
+    case 'P':
+      if(p[1] == '{')
+        return skipdelimited(p + 1);
+      return p[1] ? p + 1 : NULL;
+    case 'g':
+    case 'k':
+      if((q = skipdelimited(p + 1)))
+        return q;
+      if(p[1] == '{' || p[1] == '<' || p[1] == '\'')
+        return NULL;
+      if(p[1] == '-' || p[1] == '+')
+        p++;
+      while(isdigit((unsigned char)p[1]))
+        p++;
+      return p;
+    default:
+      /* octal or a back reference, either way every digit goes */
+      if(isdigit((unsigned char)*p))
+        while(isdigit((unsigned char)p[1]))
+          p++;
+      return p;
+  }
+}
+
+/*
+ * regexliteral:
+ *  Finds the longest string that any match of a PCRE style regex has to
+ *  contain, lowercased, and copies it to buf (AC_MAXLITERAL + 1 bytes).
+ *  Only looks outside groups, returns 0 if nothing is certain, e.g. the
+ *  regex has a top level alternation.
+ */
+size_t regexliteral(const char *regex, char *buf) {
+  char run[AC_MAXLITERAL];
+  size_t runlen = 0, best = 0;
+  int depth = 0, inrun = 0;
+  const char *p;
+
+#define ENDRUN() do { if(runlen > best) { best = runlen; memcpy(buf, run, runlen); } runlen = 0; inrun = 0; } while(0)
+#define SKIPMODIFIER() do { if(p[1] == '?' || p[1] == '+') p++; } while(0)
+
+  for(p=regex;*p;p++) {
+    switch(*p) {
+      case '\\':
+        if(!p[1])
+          return 0;
+        p++;
+        if(*p == 'Q' || *p == 'E')
+          return 0;
+        if(isalnum((unsigned char)*p)) {
+          /* \d, \b, \x41 and friends, their arguments aren't literal either */
+          if(!(p = skipescape(p)))
+            return 0;
+          if(!depth)
+            ENDRUN();
+          break;
+        }
+        if(depth)
+          break;
+        goto literal;
+      case '[':
+        /* skip the class, a ] straight after the [ or [^ is literal */
+        p++;
+        if(*p == '^')
+          p++;
+        if(*p == ']')
+          p++;
+        for(;*p && *p != ']';p++)
+          if(*p == '\\' && p[1])
+            p++;
+        if(!*p)
+          return 0;
+        if(!depth)
+          ENDRUN();
+        break;
+      case '(':
+        if(p[1] == '?') {
+          const char *o;
+
+          /* extended mode would make whitespace meaningless */
+          for(o=p+2;*o && *o != ')' && *o != ':';o++)
+            if(*o == 'x')
+              return 0;
+        }
+        if(!depth)
+          ENDRUN();
+        depth++;
+        break;
+      case ')':
+        if(!depth)
+          return 0;
+        depth--;
+        break;
+      case '|':
+        if(!depth)
+          return 0;
+        break;
+      case '*':
+      case '?':
+        if(depth)
+          break;
+        /* the previous atom is optional */
+        if(inrun)
+          runlen--;
+        ENDRUN();
+        SKIPMODIFIER();
+        break;
+      case '+':
+        if(depth)
+          break;
+        ENDRUN();
+        SKIPMODIFIER();
+        break;
+      case '{':
+        if(isdigit((unsigned char)p[1])) {
+          const char *q = p + 1;
+          long min = strtol(q, (char **)&q, 10);
+
+          if(*q == ',') {
+            q++;
+            while(isdigit((unsigned char)*q))
+              q++;
+          }
+
+          if(*q == '}') {
+            p = q;
+            if(depth)
+              break;
+            if(!min && inrun)
+              runlen--;
+            ENDRUN();
+            SKIPMODIFIER();
+            break;
+          }
+        }
+        if(depth)
+          break;
+        goto literal;
+      case '.':
+      case '^':
+      case '$':
+        if(!depth)
+          ENDRUN();
+        break;
+      default:
+        if(depth)
+          break;
+      literal:
+        if(runlen >= sizeof(run)) {
+          /* too long, what we have is still certain */
+          ENDRUN();
+          break;
+        }
+        run[runlen++] = tolower((unsigned char)*p);
+        inrun = 1;
+        break;
+    }
+  }
+
+  if(depth)
+    return 0;
+
+  ENDRUN();
+
+#undef ENDRUN
+#undef SKIPMODIFIER
+
+  buf[best] = '\0';
+  return best;
+}
@@ -0,0 +1,46 @@
+/* acmatch.h */
+
+#ifndef __ACMATCH_H
+#define __ACMATCH_H
+
+#include <stddef.h>
+
+/* longest literal regexliteral() will return */
+#define AC_MAXLITERAL 64
+
+typedef struct acpattern {
+  char *literal;
+  size_t len;
+  void *data;
+} acpattern;
+
+/*
+ * Aho-Corasick automaton over a set of literals, matching is case
+ * insensitive (ASCII only).  Add every literal, build, then scan.
+ */
+typedef struct acmatcher {
+  acpattern *patterns;
+  int npatterns, patterncap;
+
+  unsigned char symbol[256]; /* byte -> input symbol, 0 is "not in any literal" */
+  int symbols;
+
+  int states;
+  int *go;        /* states * symbols */
+  int *fail;
+  int *dictlink;  /* next state down the fail chain with outputs */
+  int *out;       /* first output for each state, -1 if none */
+  int *outnext;   /* indexed by pattern, next output for the same state */
+} acmatcher;
+
+typedef void (acmatch_fn)(void *data, void *arg);
+
+acmatcher *ac_new(void);
+void ac_free(acmatcher *ac);
+int ac_add(acmatcher *ac, const char *literal, size_t len, void *data);
+int ac_build(acmatcher *ac);
+void ac_scan(acmatcher *ac, const char *subject, size_t len, acmatch_fn *fn, void *arg);
+
+size_t regexliteral(const char *regex, char *buf);
+
+#endif
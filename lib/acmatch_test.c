@@ -0,0 +1,99 @@
+/*
+ * acmatch_test: checks regexliteral() and the matcher against known
+ * regexes.
+ *
+ * Build with: make -C lib acmatch_test
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "acmatch.h"
+
+static struct {
+  const char *regex, *literal;
+} literals[] = {
+  { "foobar", "foobar" },
+  { "^FooBar$", "foobar" },
+  { "abc.*defgh", "defgh" },
+  { "abcd?efg", "abc" },
+  { "ab|cd", "" },
+  { "(ab|cd)xyz", "xyz" },
+  { "foo\\.bar", "foo.bar" },
+  { "foo\\d+barbaz", "barbaz" },
+
+  /* escapes with arguments, none of which is literal text */
+  { "^\\x01VERSION", "version" },
+  { "foo\\x41bar", "foo" },
+  { "foo\\x{41}barbaz", "barbaz" },
+  { "\\cAhello", "hello" },
+  { "abc\\011def", "abc" },
+  { "abc\\0defg", "defg" },
+  { "foo\\p{L}xyzw", "xyzw" },
+  { "foo\\PLxyzw", "xyzw" },
+  { "(a)bc\\g{1}defg", "defg" },
+  { "(a)bc\\g-1defg", "defg" },
+  { "(?<n>a)bc\\k<n>defg", "defg" },
+  { "abc\\N{U+41}defg", "defg" },
+  { "abc\\o{101}defg", "defg" },
+  { "(\\x29)abcd", "abcd" },
+  { "abc\\x{41", "" },
+  { "abc\\Qdef\\E", "" },
+  { NULL, NULL }
+};
+
+/* each regex matches its subject, so its literal has to be found there */
+static struct {
+  const char *regex, *subject;
+} matches[] = {
+  { "^\\x01VERSION", "\001VERSION\001" },
+  /* trojanscan style CTCP phrases */
+  { "^\\x01VERSION\\x01$", "\001VERSION\001" },
+  { "^\\cAVERSION\\cA$", "\001VERSION\001" },
+  { "^\\001VERSION\\001$", "\001VERSION\001" },
+  { "\\001DCC SEND \\S+\\.exe", "\001DCC SEND iloveyou.exe 1 2 3\001" },
+  { "\\x{01}PING \\d+", "\001PING 12345\001" },
+  { "^\\x01ACTION \\x42ots", "\001ACTION Bots\001" },
+  { NULL, NULL }
+};
+
+static void found(void *data, void *arg) {
+  (*(int *)arg)++;
+}
+
+int main(int argc, char **argv) {
+  char buf[AC_MAXLITERAL + 1];
+  acmatcher *ac;
+  int i, j, failed = 0, hits;
+
+  for(i=0;literals[i].regex;i++) {
+    if(!regexliteral(literals[i].regex, buf))
+      buf[0] = '\0';
+
+    if(strcmp(buf, literals[i].literal)) {
+      printf("FAIL: regexliteral(\"%s\") gave \"%s\", wanted \"%s\"\n", literals[i].regex, buf, literals[i].literal);
+      failed++;
+    }
+  }
+
+  for(j=0;matches[j].regex;j++) {
+    /* nothing certain means the regex is always run, which is fine */
+    if(!regexliteral(matches[j].regex, buf))
+      continue;
+
+    ac = ac_new();
+    ac_add(ac, buf, strlen(buf), NULL);
+    ac_build(ac);
+
+    hits = 0;
+    ac_scan(ac, matches[j].subject, strlen(matches[j].subject), found, &hits);
+    if(!hits) {
+      printf("FAIL: literal \"%s\" of \"%s\" not found in its subject\n", buf, matches[j].regex);
+      failed++;
+    }
+    ac_free(ac);
+  }
+
+  printf("%d of %d checks failed\n", failed, i + j);
+
+  return failed ? 1 : 0;
+}
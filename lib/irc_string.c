@@ -145,6 +145,16 @@ unsigned long irc_crc32i(const char *s) {
   return crc32val;
 }
 
+/* Binary version of the above, pass the previous result to continue a checksum */
+unsigned long irc_crc32buf(unsigned long crc32val, const void *buf, size_t len) {
+  const unsigned char *cp = buf;
+
+  for (;len;len--,cp++) {
+    crc32val=crc32_tab[(crc32val^(*cp)) & 0xff] ^ (crc32val >> 8);
+  }
+  return crc32val;
+}
+
 /* ircd_strcmp/ircd_strncmp
  *
  * Copyright (c) 1987
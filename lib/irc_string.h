@@ -14,6 +14,7 @@ int match2strings(const char *patrn, const char *strng);
 int match2patterns(const char *patrn, const char *strng);
 unsigned long irc_crc32(const char *s);
 unsigned long irc_crc32i(const char *s);
+unsigned long irc_crc32buf(unsigned long crc32val, const void *buf, size_t len);
 int ircd_strcmp(const char *s1, const char *s2);
 int ircd_strncmp(const char *s1, const char *s2, size_t len);
 char *delchars(char *string, const char *badchars);
@@ -115,7 +115,7 @@ nick *registerlocaluserflagsip(char *nickname, char *ident, char *host, char *re
   memcpy(&newuser->ipaddress, ipaddress, sizeof(struct irc_in_addr));
 
   newuser->ipnode = refnode(iptree, ipaddress, PATRICIA_MAXBITS);
-  node_increment_usercount(newuser->ipnode);
+  node_increment_usercount(newuser->ipnode, NickOnServiceServer(newuser));
 
   newuser->timestamp=getnettime();
   newuser->shident=NULL;
@@ -223,7 +223,7 @@ void deletenick(nick *np) {
   freesstring(np->opername); 
   freesstring(np->message);
 
-  node_decrement_usercount(np->ipnode);
+  node_decrement_usercount(np->ipnode, NickOnServiceServer(np));
   derefnode(iptree, np->ipnode);
   
   /* TODO: figure out how to cleanly remove nodes without affecting other modules */
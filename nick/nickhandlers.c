@@ -148,7 +148,7 @@ int handlenickmsg(void *source, int cargc, char **cargv) {
 
     ip_canonicalize_tunnel(&ipaddress_canonical, &ipaddress);
     np->ipnode = refnode(iptree, &ipaddress_canonical, PATRICIA_MAXBITS);
-    node_increment_usercount(np->ipnode);
+    node_increment_usercount(np->ipnode, NickOnServiceServer(np));
 
     np->away=NULL;
     np->shident=NULL;
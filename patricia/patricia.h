@@ -61,6 +61,7 @@ union prefixes {
 typedef struct _patricia_node_t {
    unsigned char bit;		/* flag if this node used */
    int usercount;               /* number of users on a given node */
+   int serviceusercount;        /* number of those users that are on service servers */
    prefix_t *prefix;		/* who we are in patricia tree */
    struct _patricia_node_t *l, *r;	/* left and right children */
    struct _patricia_node_t *parent;/* may be used */
@@ -96,8 +97,8 @@ int registernodeext(const char *name);
 int findnodeext(const char *name);
 void releasenodeext(int index);
 
-void node_increment_usercount( patricia_node_t *node);
-void node_decrement_usercount( patricia_node_t *node);
+void node_increment_usercount( patricia_node_t *node, int serviceuser);
+void node_decrement_usercount( patricia_node_t *node, int serviceuser);
 int is_normalized_ipmask( struct irc_in_addr *sin, unsigned char bitlen );
 
 /* alloc */
@@ -140,7 +140,7 @@ int nc_cmd_usercount(void *source, int cargc, char **cargv) {
   struct irc_in_addr sin;
   unsigned char bits;
   patricia_node_t *head;
-  int count;
+  int count, servicecount;
 
   if (cargc < 1) {
     return CMD_USAGE;
@@ -155,10 +155,11 @@ int nc_cmd_usercount(void *source, int cargc, char **cargv) {
   head = refnode(iptree, &sin, bits);
 
   count = head->usercount;
+  servicecount = head->serviceusercount;
 
   derefnode(iptree, head);
 
-  controlreply(np, "%d user(s) found.", count);
+  controlreply(np, "%d user(s) found (%d on service servers).", count, servicecount);
 
   return CMD_OK;
 }
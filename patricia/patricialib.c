@@ -421,6 +421,7 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	}
 	node->parent = new_node;
         new_node->usercount = node->usercount;
+        new_node->serviceusercount = node->serviceusercount;
     }
     else {
         glue = patricia_new_node(patricia, differ_bit, NULL);
@@ -448,6 +449,7 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	}
 	node->parent = glue;
         glue->usercount = node->usercount;
+        glue->serviceusercount = node->serviceusercount;
     }
 
     return (new_node);
@@ -606,30 +608,35 @@ patricia_node_t *patricia_new_node(patricia_tree_t *patricia, unsigned char bit,
   new_node->bit = bit;
   new_node->prefix = prefix;
   new_node->usercount = 0;
+  new_node->serviceusercount = 0;
   new_node->parent = NULL;
   new_node->l = new_node->r = NULL;
   patricia->num_active_node++;
   return new_node;  
 }
 
-void node_increment_usercount( patricia_node_t *node) {
+void node_increment_usercount( patricia_node_t *node, int serviceuser) {
 #ifdef LEAK_DETECTION
   node = getrealnode(node);
 #endif
 
   while(node) {
     node->usercount++;
+    if (serviceuser)
+      node->serviceusercount++;
     node=node->parent;
   }
 }
 
-void node_decrement_usercount( patricia_node_t *node) {
+void node_decrement_usercount( patricia_node_t *node, int serviceuser) {
 #ifdef LEAK_DETECTION
   node = getrealnode(node);
 #endif
 
   while(node) {
     node->usercount--;
+    if (serviceuser)
+      node->serviceusercount--;
     node=node->parent;
   }
 }
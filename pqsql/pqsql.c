@@ -20,6 +20,7 @@
 
 #include <stdlib.h>
 #include <sys/poll.h>
+#include <sys/time.h>
 #include <stdarg.h>
 #include <string.h>
 
@@ -44,9 +45,37 @@ typedef struct pqasyncquery_s {
   PQQueryHandler handler;
   int flags;
   PQModuleIdentifier identifier;
+  struct timeval queued;
+  int kind;
+  char stmtname[PQ_STMTNAMELEN];
+  int nparams;
+  char **params;
+  char *copydata;
+  size_t copylen, copydone;
+  int copystate;
   struct pqasyncquery_s *next;
 } pqasyncquery_s;
 
+#define PQ_QUERY   0   /* plain query text */
+#define PQ_PREPARE 1   /* prepare query as stmtname */
+#define PQ_EXECUTE 2   /* run stmtname with params, query is the text for errors */
+#define PQ_COPY    3   /* query is a COPY ... FROM STDIN, copydata is fed to it */
+
+#define PQ_COPYSTART 0 /* waiting for the server to ask for data */
+#define PQ_COPYDATA  1 /* sending copydata */
+#define PQ_COPYEND   2 /* all sent, waiting for the result */
+
+#define PQ_COPYCHUNK 8192
+
+/* A statement prepared on one connection, looked up by its query text */
+typedef struct pqstatement_s {
+  char name[PQ_STMTNAMELEN];
+  char *query;
+  unsigned long hash;
+  unsigned long lastused;
+  struct pqstatement_s *next;
+} pqstatement_s;
+
 typedef struct pqtableloaderinfo_s
 {
     sstring *tablename;
@@ -54,11 +83,34 @@ typedef struct pqtableloaderinfo_s
     void *tag;
 } pqtableloaderinfo_s;
 
-pqasyncquery_s *queryhead = NULL, *querytail = NULL;
+/* One of these per connection in the pool.
+ *
+ * Queries are kept in the order they were queued: the first inflight of
+ * them have been sent, unsent points at the first one that hasn't.  In
+ * pipeline mode every query is followed by its own sync, so an error only
+ * ever affects the query that caused it, same as without pipelining.
+ */
+typedef struct pqconn_s {
+  PGconn *conn;
+  int fd;
+  int pipeline;     /* queries we'll have in flight at once, 1 is no pipelining */
+  int needsync;     /* the last query's sync result hasn't been read yet */
+  int writewait;    /* registered for POLLOUT as libpq couldn't send it all */
+  int copying;      /* a COPY is running, nothing else goes until it's done */
+  pqasyncquery_s *queryhead, *querytail, *unsent;
+  int queued, inflight, maxqueued;
+  unsigned long completed;
+  unsigned long totallatency, maxlatency; /* ms, queued to completed */
+  pqstatement_s *statements[PQ_STATEMENTHASHSIZE];
+  int nstatements;
+  unsigned long statementclock, statementserial, executed, prepared;
+} pqconn_s;
+
+static pqconn_s conns[PQ_MAXCONNECTIONS];
+static int nconns = 0;
 
 static int dbconnected = 0;
 static PQModuleIdentifier moduleid = 0;
-static PGconn *dbconn;
 
 void dbhandler(int fd, short revents);
 void pqstartloadtable(PGconn *dbconn, void *arg);
@@ -85,41 +137,397 @@ PQModuleIdentifier pqgetid(void) {
   return moduleid;
 }
 
+/* For users whose every query, writes included, carries the identifier */
+PQModuleIdentifier pqgetpooledid(void) {
+  return pqgetid() | PQ_POOLEDID;
+}
+
+/* Anonymous queries all go down the first connection, so transactions,
+ * table loads and anything else relying on dbquery() ordering keep it.
+ * Plain identifiers go there too: modules read through them but write
+ * with dbquery() (so the writes survive pqfreeid), and must see their
+ * own writes.  Pooled identifiers each stick to one of the others, so
+ * their queries stay in order, but a slow one only holds up its own
+ * connection.
+ */
+static pqconn_s *pqconnfor(PQModuleIdentifier identifier) {
+  if(nconns == 1 || !(identifier & PQ_POOLEDID))
+    return &conns[0];
+
+  return &conns[1 + (unsigned int)(identifier & ~PQ_POOLEDID) % (nconns - 1)];
+}
+
+static void pqfreequery(pqasyncquery_s *q) {
+  int i;
+
+  if (q->query_ss) {
+    freesstring(q->query_ss);
+  } else if (q->query) {
+    nsfree(POOL_PQSQL, q->query);
+  }
+
+  if (q->params) {
+    for(i=0;i<q->nparams;i++)
+      if (q->params[i])
+        nsfree(POOL_PQSQL, q->params[i]);
+    nsfree(POOL_PQSQL, q->params);
+  }
+
+  if (q->copydata)
+    nsfree(POOL_PQSQL, q->copydata);
+
+  nsfree(POOL_PQSQL, q);
+}
+
 void pqfreeid(PQModuleIdentifier identifier) {
-  pqasyncquery_s *q, *p;
+  pqasyncquery_s *q, **qh;
+  pqconn_s *c;
+  int i, sent;
   
-  if(identifier == 0 || !queryhead)
+  if(identifier == 0)
     return;
 
-  if(queryhead->identifier == identifier) {
-    (queryhead->handler)(NULL, queryhead->tag);
-    queryhead->identifier = QH_ALREADYFIRED;
+  for(i=0;i<nconns;i++) {
+    c = &conns[i];
+    c->querytail = NULL;
+    sent = 1;
+
+    for(qh=&c->queryhead;(q=*qh);) {
+      if(q == c->unsent)
+        sent = 0;
+
+      if(q->identifier != identifier) {
+        c->querytail = q;
+        qh = &q->next;
+        continue;
+      }
+
+      if(q->handler)
+        (q->handler)(NULL, q->tag);
+
+      if(sent) {
+        /* it's with the server, the result still has to be read */
+        q->identifier = QH_ALREADYFIRED;
+        c->querytail = q;
+        qh = &q->next;
+        continue;
+      }
+
+      if(c->unsent == q)
+        c->unsent = q->next;
+
+      *qh = q->next;
+      c->queued--;
+      pqfreequery(q);
+    }
   }
+}
 
-  for(p=queryhead,q=queryhead->next;q;) {
-    if(q->identifier == identifier) {
-      (q->handler)(NULL, q->tag);
-      p->next = q->next;
+/* Sends what's left in libpq's buffer, asking for POLLOUT if it won't all go */
+static void pqflushconn(pqconn_s *c) {
+  int want = (PQflush(c->conn) == 1);
 
-      if (q->query_ss) {
-        freesstring(q->query_ss);
-      } else {
-        nsfree(POOL_PQSQL, q->query);
+  if(want == c->writewait)
+    return;
+
+  deregisterhandler(c->fd, 0);
+  registerhandler(c->fd, want ? (POLLIN|POLLOUT) : POLLIN, dbhandler);
+  c->writewait = want;
+}
+
+/* Drops the query at the head, it has to have been sent */
+static void pqadvance(pqconn_s *c) {
+  pqasyncquery_s *qqp = c->queryhead;
+  struct timeval now;
+  unsigned long latency;
+
+  gettimeofday(&now, NULL);
+  latency = (now.tv_sec - qqp->queued.tv_sec) * 1000 + (now.tv_usec - qqp->queued.tv_usec) / 1000;
+
+  c->completed++;
+  c->totallatency += latency;
+  if(latency > c->maxlatency)
+    c->maxlatency = latency;
+
+  c->queryhead = qqp->next;
+  if(!c->queryhead)
+    c->querytail = NULL;
+
+  c->queued--;
+  c->inflight--;
+
+  pqfreequery(qqp);
+}
+
+/* Puts as many waiting queries on the wire as the pipeline allows */
+static void pqsendqueued(pqconn_s *c) {
+  pqasyncquery_s *q;
+  int sent = 0, ok;
+
+  while(!c->copying && (q = c->unsent) && c->inflight < c->pipeline) {
+    if(q->kind == PQ_COPY) {
+      /* COPY can't be pipelined, it has the connection to itself */
+      if(c->inflight || c->needsync)
+        break;
+
+#ifdef LIBPQ_HAS_PIPELINING
+      if(c->pipeline > 1 && !PQexitPipelineMode(c->conn)) {
+        Error("pqsql", ERR_WARNING, "Unable to leave pipeline mode for COPY: %s", pqlasterror(c->conn));
+        break;
       }
-      nsfree(POOL_PQSQL, q);
-      q = p->next;
-    } else {
-      p = q;
-      q = q->next;
+#endif
+    }
+
+    switch(q->kind) {
+      case PQ_PREPARE:
+        ok = PQsendPrepare(c->conn, q->stmtname, q->query, 0, NULL);
+        break;
+      case PQ_EXECUTE:
+        ok = PQsendQueryPrepared(c->conn, q->stmtname, q->nparams, (const char * const *)q->params, NULL, NULL, 0);
+        break;
+      default:
+#ifdef LIBPQ_HAS_PIPELINING
+        if(c->pipeline > 1)
+          ok = PQsendQueryParams(c->conn, q->query, 0, NULL, NULL, NULL, NULL, 0);
+        else
+#endif
+          ok = PQsendQuery(c->conn, q->query);
+        break;
+    }
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if(ok && c->pipeline > 1 && q->kind != PQ_COPY)
+      ok = PQpipelineSync(c->conn);
+#endif
+
+    if(!ok) {
+      /* it stays queued, we'll try again when something else happens */
+      Error("pqsql", ERR_WARNING, "Unable to send query (query: %s): %s", q->query, pqlasterror(c->conn));
+      break;
+    }
+
+    c->unsent = q->next;
+    c->inflight++;
+    sent = 1;
+
+    if(q->kind == PQ_COPY) {
+      q->copystate = PQ_COPYSTART;
+      c->copying = 1;
     }
   }
 
-  querytail = p;
+  if(sent)
+    pqflushconn(c);
+}
+
+static pqasyncquery_s *pqnewquery(PQModuleIdentifier identifier, PQQueryHandler handler, void *tag, int flags, const char *query, int len) {
+  pqasyncquery_s *qp;
+
+  /* PPA: no check here... */
+  qp = (pqasyncquery_s *)nsmalloc(POOL_PQSQL, sizeof(pqasyncquery_s));
+
+  if(!qp)
+    Error("pqsql",ERR_STOP,"malloc() failed in pqsql.c");
+
+  /* Use sstring or allocate (see above rant) */
+  if (len > SSTRING_MAX) {
+    qp->query = (char *)nsmalloc(POOL_PQSQL, len+1);
+    memcpy(qp->query,query,len);
+    qp->query[len] = '\0';
+    qp->query_ss=NULL;
+  } else {
+    qp->query_ss = getsstring(query, len);
+    qp->query = qp->query_ss->content;
+  }
+  qp->tag = tag;
+  qp->handler = handler;
+  qp->next = NULL; /* shove them at the end */
+  qp->flags = flags;
+  qp->identifier = identifier;
+  qp->kind = PQ_QUERY;
+  qp->stmtname[0] = '\0';
+  qp->nparams = 0;
+  qp->params = NULL;
+  qp->copydata = NULL;
+  qp->copylen = qp->copydone = 0;
+  qp->copystate = PQ_COPYSTART;
+  gettimeofday(&qp->queued, NULL);
+
+  return qp;
+}
+
+static void pqqueue(pqconn_s *c, pqasyncquery_s *qp) {
+  if(c->querytail) {
+    c->querytail->next = qp;
+    c->querytail = qp;
+  } else {
+    c->querytail = c->queryhead = qp;
+  }
+
+  if(!c->unsent)
+    c->unsent = qp;
+
+  if(++c->queued > c->maxqueued)
+    c->maxqueued = c->queued;
+
+  pqsendqueued(c);
+}
+
+static void pqfreestatement(pqstatement_s *st) {
+  nsfree(POOL_PQSQL, st->query);
+  nsfree(POOL_PQSQL, st);
+}
+
+/* Drops a statement from the cache, e.g. because it didn't prepare */
+static void pqforgetstatement(pqconn_s *c, const char *name) {
+  pqstatement_s *st, **sh;
+  int i;
+
+  for(i=0;i<PQ_STATEMENTHASHSIZE;i++) {
+    for(sh=&c->statements[i];(st=*sh);sh=&st->next) {
+      if(!strcmp(st->name, name)) {
+        *sh = st->next;
+        c->nstatements--;
+        pqfreestatement(st);
+        return;
+      }
+    }
+  }
+}
+
+/* Makes room by deallocating the statement that's gone longest unused */
+static void pqevictstatement(pqconn_s *c) {
+  pqstatement_s *st, *oldest = NULL;
+  char querybuf[PQ_STMTNAMELEN + 20];
+  int i, len;
+
+  for(i=0;i<PQ_STATEMENTHASHSIZE;i++)
+    for(st=c->statements[i];st;st=st->next)
+      if(!oldest || st->lastused < oldest->lastused)
+        oldest = st;
+
+  if(!oldest)
+    return;
+
+  /* anything still to run it is ahead of this in the queue */
+  len = snprintf(querybuf, sizeof(querybuf), "DEALLOCATE %s", oldest->name);
+  pqqueue(c, pqnewquery(DB_NULLIDENTIFIER, NULL, NULL, 0, querybuf, len));
+
+  pqforgetstatement(c, oldest->name);
+}
+
+/* Finds query in c's cache, queueing up its PREPARE if it's not there */
+static pqstatement_s *pqgetstatement(pqconn_s *c, const char *query) {
+  pqstatement_s *st;
+  pqasyncquery_s *qp;
+  unsigned long hash = irc_crc32(query);
+
+  for(st=c->statements[hash%PQ_STATEMENTHASHSIZE];st;st=st->next) {
+    if(st->hash == hash && !strcmp(st->query, query)) {
+      st->lastused = ++c->statementclock;
+      return st;
+    }
+  }
+
+  if(c->nstatements >= PQ_MAXSTATEMENTS)
+    pqevictstatement(c);
+
+  st = (pqstatement_s *)nsmalloc(POOL_PQSQL, sizeof(pqstatement_s));
+  if(st)
+    st->query = (char *)nsmalloc(POOL_PQSQL, strlen(query) + 1);
+  if(!st || !st->query)
+    Error("pqsql",ERR_STOP,"malloc() failed in pqsql.c");
+
+  strcpy(st->query, query);
+  snprintf(st->name, sizeof(st->name), "nsps%lu", ++c->statementserial);
+  st->hash = hash;
+  st->lastused = ++c->statementclock;
+  st->next = c->statements[hash%PQ_STATEMENTHASHSIZE];
+  c->statements[hash%PQ_STATEMENTHASHSIZE] = st;
+  c->nstatements++;
+  c->prepared++;
+
+  /* never dropped by pqfreeid, the statement stays around for others */
+  qp = pqnewquery(DB_NULLIDENTIFIER, NULL, NULL, 0, query, strlen(query));
+  qp->kind = PQ_PREPARE;
+  strcpy(qp->stmtname, st->name);
+  pqqueue(c, qp);
+
+  return st;
+}
+
+/* Feeds the running COPY its data, returns 0 while waiting for POLLOUT */
+static int pqcopydata(pqconn_s *c, pqasyncquery_s *q) {
+  size_t len;
+  int res;
+
+  while(q->copydone < q->copylen) {
+    len = q->copylen - q->copydone;
+    if(len > PQ_COPYCHUNK)
+      len = PQ_COPYCHUNK;
+
+    res = PQputCopyData(c->conn, q->copydata + q->copydone, len);
+    if(res < 0) {
+      Error("pqsql", ERR_WARNING, "Error sending COPY data (query: %s): %s", q->query, pqlasterror(c->conn));
+      break;
+    }
+
+    if(res == 0) { /* libpq's buffer is full */
+      pqflushconn(c);
+      if(c->writewait)
+        return 0;
+      continue;
+    }
+
+    q->copydone += len;
+  }
+
+  res = PQputCopyEnd(c->conn, (q->copydone < q->copylen) ? "newserv couldn't send the data" : NULL);
+  if(res == 0) {
+    pqflushconn(c);
+    return 0;
+  }
+
+  q->copystate = PQ_COPYEND;
+  pqflushconn(c);
+
+  return 1;
+}
+
+static int pqconnectone(pqconn_s *c, char *connectstr, int pipeline) {
+  memset(c, 0, sizeof(pqconn_s));
+
+  /* Blocking connect for now.. */
+  c->conn = PQconnectdb(connectstr);
+  
+  if (!c->conn || (PQstatus(c->conn) != CONNECTION_OK)) {
+    Error("pqsql", ERR_ERROR, "Unable to connect to db: %s", pqlasterror(c->conn));
+    if(c->conn)
+      PQfinish(c->conn);
+    c->conn = NULL;
+    return 0;
+  }
+
+  PQsetnonblocking(c->conn, 1);
+
+  c->pipeline = 1;
+#ifdef LIBPQ_HAS_PIPELINING
+  if(pipeline > 1 && PQenterPipelineMode(c->conn))
+    c->pipeline = pipeline;
+#endif
+
+  c->fd = PQsocket(c->conn);
+
+  /* this kicks ass, thanks splidge! */
+  registerhandler(c->fd, POLLIN, dbhandler);
+
+  return 1;
 }
 
 void connectdb(void) {
-  sstring *dbhost, *dbusername, *dbpassword, *dbdatabase, *dbport;
+  sstring *dbhost, *dbusername, *dbpassword, *dbdatabase, *dbport, *dbconnections, *dbpipeline;
   char connectstr[1024];
+  int wanted, pipeline;
 
   if(pqconnected())
     return;
@@ -130,14 +538,18 @@ void connectdb(void) {
   dbpassword = getcopyconfigitem("pqsql", "password", "moo", 20);
   dbdatabase = getcopyconfigitem("pqsql", "database", "newserv", 20);
   dbport = getcopyconfigitem("pqsql", "port", "431", 8);
+  dbconnections = getcopyconfigitem("pqsql", "connections", "1", 8);
+  dbpipeline = getcopyconfigitem("pqsql", "pipeline", PQ_DEFAULTPIPELINE, 8);
 
-  if(!dbhost || !dbusername || !dbpassword || !dbdatabase || !dbport) {
+  if(!dbhost || !dbusername || !dbpassword || !dbdatabase || !dbport || !dbconnections || !dbpipeline) {
     /* freesstring allows NULL */
     freesstring(dbhost);
     freesstring(dbusername);
     freesstring(dbpassword);
     freesstring(dbdatabase);
     freesstring(dbport);
+    freesstring(dbconnections);
+    freesstring(dbpipeline);
     return;
   }
   
@@ -147,56 +559,134 @@ void connectdb(void) {
     snprintf(connectstr, sizeof(connectstr), "host=%s port=%s dbname=%s user=%s password=%s", dbhost->content, dbport->content, dbdatabase->content, dbusername->content, dbpassword->content);
   }  
 
+  wanted = atoi(dbconnections->content);
+  if(wanted < 1)
+    wanted = 1;
+  if(wanted > PQ_MAXCONNECTIONS)
+    wanted = PQ_MAXCONNECTIONS;
+
+  pipeline = atoi(dbpipeline->content);
+  if(pipeline < 1)
+    pipeline = 1;
+
   freesstring(dbhost);
   freesstring(dbusername);
   freesstring(dbpassword);
   freesstring(dbdatabase);
   freesstring(dbport);
+  freesstring(dbconnections);
+  freesstring(dbpipeline);
 
   Error("pqsql", ERR_INFO, "Attempting database connection: %s", connectstr);
 
-  /* Blocking connect for now.. */
-  dbconn = PQconnectdb(connectstr);
-  
-  if (!dbconn || (PQstatus(dbconn) != CONNECTION_OK)) {
-    Error("pqsql", ERR_ERROR, "Unable to connect to db: %s", pqlasterror(dbconn));
+  /* make do with however many we get */
+  for(nconns=0;nconns<wanted;nconns++)
+    if(!pqconnectone(&conns[nconns], connectstr, pipeline))
+      break;
+
+  if(!nconns)
     return;
-  }
-  Error("pqsql", ERR_INFO, "Connected!");
 
-  dbconnected = 1;
+  Error("pqsql", ERR_INFO, "Connected! (%d of %d connection%s, pipeline depth %d)", nconns, wanted, wanted==1?"":"s", conns[0].pipeline);
 
-  PQsetnonblocking(dbconn, 1);
+  dbconnected = 1;
 
-  /* this kicks ass, thanks splidge! */
-  registerhandler(PQsocket(dbconn), POLLIN, dbhandler);
   registerhook(HOOK_CORE_STATSREQUEST, dbstatus);
 }
 
 void dbhandler(int fd, short revents) {
   PGresult *res;
   pqasyncquery_s *qqp;
+  pqconn_s *c = NULL;
+  int i, kind;
+
+  for(i=0;i<nconns;i++) {
+    if(conns[i].fd == fd) {
+      c = &conns[i];
+      break;
+    }
+  }
+
+  if(!c)
+    return;
+
+  if(revents & POLLOUT) {
+    pqflushconn(c);
+
+    if(c->copying && !c->writewait && c->queryhead->copystate == PQ_COPYDATA)
+      pqcopydata(c, c->queryhead);
+  }
 
   if(revents & POLLIN) {
-    PQconsumeInput(dbconn);
+    PQconsumeInput(c->conn);
     
-    if(!PQisBusy(dbconn)) { /* query is complete */
-      if(queryhead->handler && queryhead->identifier != QH_ALREADYFIRED)
-        (queryhead->handler)(dbconn, queryhead->tag);
+    for(;;) {
+      if(PQisBusy(c->conn)) /* nothing more is complete */
+        break;
+
+      if(c->needsync) {
+        if(!(res = PQgetResult(c->conn)))
+          break;
+
+#ifdef LIBPQ_HAS_PIPELINING
+        if(PQresultStatus(res) == PGRES_PIPELINE_SYNC)
+          c->needsync = 0;
+#endif
+        PQclear(res);
+        continue;
+      }
 
-      while((res = PQgetResult(dbconn))) {
-        if(queryhead->identifier != QH_ALREADYFIRED) {
+      if(!c->inflight)
+        break;
+
+      qqp = c->queryhead;
+
+      if(c->copying && qqp->copystate == PQ_COPYSTART) {
+        res = PQgetResult(c->conn);
+        if(res && PQresultStatus(res) == PGRES_COPY_IN) {
+          qqp->copystate = PQ_COPYDATA;
+        } else {
+          /* refused, the handler will see no result */
+          Error("pqsql", ERR_WARNING, "Unable to start COPY (query: %s): %s", qqp->query, res?PQresultErrorMessage(res):pqlasterror(c->conn));
+          qqp->copystate = PQ_COPYEND;
+        }
+
+        if(res)
+          PQclear(res);
+        continue;
+      }
+
+      if(c->copying && qqp->copystate == PQ_COPYDATA) {
+        if(!pqcopydata(c, qqp))
+          break;
+        continue;
+      }
+
+      kind = qqp->kind;
+
+      if(qqp->handler && qqp->identifier != QH_ALREADYFIRED)
+        (qqp->handler)(c->conn, qqp->tag);
+
+      while((res = PQgetResult(c->conn))) {
+        if(qqp->identifier != QH_ALREADYFIRED) {
           switch(PQresultStatus(res)) {
             case PGRES_TUPLES_OK:
-              if(!(queryhead->flags & DB_CALL))
-                Error("pqsql", ERR_WARNING, "Unhandled tuples output (query: %s)", queryhead->query);
+              if(!(qqp->flags & DB_CALL))
+                Error("pqsql", ERR_WARNING, "Unhandled tuples output (query: %s)", qqp->query);
               break;
 
             case PGRES_NONFATAL_ERROR:
             case PGRES_FATAL_ERROR:
+              if(qqp->kind == PQ_PREPARE) {
+                /* it'll be tried again next time, the execute will fail on its own */
+                Error("pqsql", ERR_WARNING, "Unable to prepare statement (query: %s): %s", qqp->query, PQresultErrorMessage(res));
+                pqforgetstatement(c, qqp->stmtname);
+                break;
+              }
+
               /* if a create query returns an error assume it went ok, paul will winge about this */
-              if(!(queryhead->flags & DB_CREATE))
-                Error("pqsql", ERR_WARNING, "Unhandled error response (query: %s): %s", queryhead->query, PQresultErrorMessage(res));
+              if(!(qqp->flags & DB_CREATE))
+                Error("pqsql", ERR_WARNING, "Unhandled error response (query: %s): %s", qqp->query, PQresultErrorMessage(res));
               break;
 	  
             default:
@@ -208,27 +698,23 @@ void dbhandler(int fd, short revents) {
       }
 
       /* Free the query and advance */
-      qqp = queryhead;
-      if(queryhead == querytail)
-        querytail = NULL;
-
-      queryhead = queryhead->next;
-
-      if (qqp->query_ss) {
-        freesstring(qqp->query_ss);
-        qqp->query_ss=NULL;
-        qqp->query=NULL;
-      } else if (qqp->query) {
-        nsfree(POOL_PQSQL, qqp->query);
-        qqp->query=NULL;
-      }
-      nsfree(POOL_PQSQL, qqp);
-
-      if(queryhead) { /* Submit the next query */	      
-        PQsendQuery(dbconn, queryhead->query);
-        PQflush(dbconn);
+      pqadvance(c);
+
+      if(kind == PQ_COPY) {
+        c->copying = 0;
+#ifdef LIBPQ_HAS_PIPELINING
+        if(c->pipeline > 1 && !PQenterPipelineMode(c->conn)) {
+          Error("pqsql", ERR_WARNING, "Unable to go back to pipeline mode after COPY: %s", pqlasterror(c->conn));
+          c->pipeline = 1;
+        }
+#endif
+      } else if(c->pipeline > 1) {
+        c->needsync = 1;
       }
     }
+
+    /* Submit the next queries */
+    pqsendqueued(c);
   }
 }
 
@@ -236,7 +722,6 @@ void dbhandler(int fd, short revents) {
 void pqasyncqueryf(int identifier, PQQueryHandler handler, void *tag, int flags, char *format, ...) {
   char querybuf[8192];
   int len;
-  pqasyncquery_s *qp;
   va_list va;
 
   if(!pqconnected())
@@ -246,35 +731,127 @@ void pqasyncqueryf(int identifier, PQQueryHandler handler, void *tag, int flags,
   len = vsnprintf(querybuf, sizeof(querybuf), format, va);
   va_end(va);
 
-  /* PPA: no check here... */
-  qp = (pqasyncquery_s *)nsmalloc(POOL_PQSQL, sizeof(pqasyncquery_s));
+  if(len >= (int)sizeof(querybuf))
+    len = sizeof(querybuf) - 1;
 
-  if(!qp)
-    Error("pqsql",ERR_STOP,"malloc() failed in pqsql.c");
+  pqqueue(pqconnfor(identifier), pqnewquery(identifier, handler, tag, flags, querybuf, len));
+}
 
-  /* Use sstring or allocate (see above rant) */
-  if (len > SSTRING_MAX) {
-    qp->query = (char *)nsmalloc(POOL_PQSQL, len+1);
-    strcpy(qp->query,querybuf);
-    qp->query_ss=NULL;
-  } else {
-    qp->query_ss = getsstring(querybuf, len);
-    qp->query = qp->query_ss->content;
+/* Runs query (with $1.. placeholders) as a prepared statement on the
+ * identifier's connection, preparing it there first if it's new.
+ */
+void pqasyncqueryparams(PQModuleIdentifier identifier, PQQueryHandler handler, void *tag, int flags, const char *query, int nparams, const char * const *values) {
+  pqasyncquery_s *qp;
+  pqstatement_s *st;
+  pqconn_s *c;
+  int i;
+
+  if(!pqconnected())
+    return;
+
+  c = pqconnfor(identifier);
+  st = pqgetstatement(c, query);
+
+  qp = pqnewquery(identifier, handler, tag, flags, query, strlen(query));
+  qp->kind = PQ_EXECUTE;
+  strcpy(qp->stmtname, st->name);
+
+  if(nparams > 0) {
+    qp->nparams = nparams;
+    qp->params = (char **)nsmalloc(POOL_PQSQL, sizeof(char *) * nparams);
+    if(!qp->params)
+      Error("pqsql",ERR_STOP,"malloc() failed in pqsql.c");
+
+    for(i=0;i<nparams;i++) {
+      if(values[i]) {
+        qp->params[i] = (char *)nsmalloc(POOL_PQSQL, strlen(values[i]) + 1);
+        if(!qp->params[i])
+          Error("pqsql",ERR_STOP,"malloc() failed in pqsql.c");
+        strcpy(qp->params[i], values[i]);
+      } else {
+        qp->params[i] = NULL;
+      }
+    }
   }
-  qp->tag = tag;
-  qp->handler = handler;
-  qp->next = NULL; /* shove them at the end */
-  qp->flags = flags;
-  qp->identifier = identifier;
 
-  if(querytail) {
-    querytail->next = qp;
-    querytail = qp;
-  } else {
-    querytail = queryhead = qp;
-    PQsendQuery(dbconn, qp->query);
-    PQflush(dbconn);
+  c->executed++;
+  pqqueue(c, qp);
+}
+
+/* Appends value to buf in COPY's text format, returns the length it took */
+static size_t pqcopyescape(char *buf, const char *value) {
+  size_t len = 0;
+  const char *p;
+
+  if(!value) {
+    if(buf)
+      memcpy(buf, "\\N", 2);
+    return 2;
   }
+
+  for(p=value;*p;p++) {
+    char e = 0;
+
+    switch(*p) {
+      case '\\': e = '\\'; break;
+      case '\n': e = 'n'; break;
+      case '\r': e = 'r'; break;
+      case '\t': e = 't'; break;
+    }
+
+    if(e) {
+      if(buf) {
+        buf[len] = '\\';
+        buf[len+1] = e;
+      }
+      len += 2;
+    } else {
+      if(buf)
+        buf[len] = *p;
+      len++;
+    }
+  }
+
+  return len;
+}
+
+/* Loads nrows rows of ncolumns values (row by row, NULL for NULL) into
+ * table with a COPY FROM STDIN, on the identifier's connection.
+ */
+void pqasynccopy(PQModuleIdentifier identifier, PQQueryHandler handler, void *tag, const char *table, const char *columns, int ncolumns, int nrows, const char * const *values) {
+  char querybuf[1024];
+  pqasyncquery_s *qp;
+  size_t size = 0, pos = 0;
+  int i, len;
+
+  if(!pqconnected() || nrows <= 0 || ncolumns <= 0)
+    return;
+
+  /* every value is followed by a tab or, at the end of a row, a newline */
+  for(i=0;i<nrows*ncolumns;i++)
+    size += pqcopyescape(NULL, values[i]) + 1;
+
+  len = snprintf(querybuf, sizeof(querybuf), "COPY %s (%s) FROM STDIN", table, columns);
+  if(len >= (int)sizeof(querybuf)) {
+    Error("pqsql", ERR_WARNING, "COPY statement too long for table %s", table);
+    if(handler)
+      handler(NULL, tag);
+    return;
+  }
+
+  qp = pqnewquery(identifier, handler, tag, 0, querybuf, len);
+  qp->kind = PQ_COPY;
+  qp->copydata = (char *)nsmalloc(POOL_PQSQL, size);
+  if(!qp->copydata)
+    Error("pqsql",ERR_STOP,"malloc() failed in pqsql.c");
+
+  for(i=0;i<nrows*ncolumns;i++) {
+    pos += pqcopyescape(qp->copydata + pos, values[i]);
+    qp->copydata[pos++] = ((i + 1) % ncolumns) ? '\t' : '\n';
+  }
+  qp->copylen = pos;
+
+  pqqueue(pqconnfor(identifier), qp);
 }
 
 void pqloadtable(char *tablename, PQQueryHandler init, PQQueryHandler data, PQQueryHandler fini, void *tag)
@@ -330,50 +907,67 @@ void pqstartloadtable(PGconn *dbconn, void *arg)
 }
 
 void disconnectdb(void) {
-  pqasyncquery_s *qqp = queryhead, *nqqp;
+  pqasyncquery_s *qqp, *nqqp;
+  pqstatement_s *st, *nst;
+  pqconn_s *c;
+  int i, j;
 
   if(!pqconnected())
     return;
 
-  /* do this first else we may get conflicts */
-  deregisterhandler(PQsocket(dbconn), 0);
-
-  /* Throw all the queued queries away, beware of data malloc()ed inside the query item.. */
-  while(qqp) {
-    nqqp = qqp->next;
-    if (qqp->query_ss) {
-      freesstring(qqp->query_ss);
-      qqp->query_ss=NULL;
-      qqp->query=NULL;
-    } else if (qqp->query) {
-      nsfree(POOL_PQSQL, qqp->query);
-      qqp->query=NULL;
+  for(i=0;i<nconns;i++) {
+    c = &conns[i];
+
+    /* do this first else we may get conflicts */
+    deregisterhandler(c->fd, 0);
+
+    /* Throw all the queued queries away, beware of data malloc()ed inside the query item.. */
+    for(qqp=c->queryhead;qqp;qqp=nqqp) {
+      nqqp = qqp->next;
+      pqfreequery(qqp);
+    }
+
+    for(j=0;j<PQ_STATEMENTHASHSIZE;j++) {
+      for(st=c->statements[j];st;st=nst) {
+        nst = st->next;
+        pqfreestatement(st);
+      }
     }
-    nsfree(POOL_PQSQL, qqp);
-    qqp = nqqp;
+
+    PQfinish(c->conn);
+    memset(c, 0, sizeof(pqconn_s));
   }
 
   deregisterhook(HOOK_CORE_STATSREQUEST, dbstatus);
-  PQfinish(dbconn);
-  dbconn = NULL; /* hmm? */
 
+  nconns = 0;
   dbconnected = 0;
 }
 
 /* more stolen code from Q9 */
 void dbstatus(int hooknum, void *arg) {
   if ((long)arg > 10) {
-    int i = 0;
-    pqasyncquery_s *qqp;
-    char message[100];
+    int i, queued = 0;
+    pqconn_s *c;
+    char message[200];
 
-    if(queryhead)
-      for(qqp=queryhead;qqp;qqp=qqp->next)
-        i++;
+    for(i=0;i<nconns;i++)
+      queued += conns[i].queued;
      
-    snprintf(message, sizeof(message), "PQSQL   : %6d queries queued.",i);
-    
+    snprintf(message, sizeof(message), "PQSQL   : %6d queries queued.",queued);
     triggerhook(HOOK_CORE_STATSREPLY, message);
+
+    for(i=0;i<nconns;i++) {
+      c = &conns[i];
+      snprintf(message, sizeof(message), "PQSQL   : connection %2d: %6d queued (%6d max), %3d/%3d in flight, %9lu done, latency %5lums avg %7lums max",
+               i, c->queued, c->maxqueued, c->inflight, c->pipeline, c->completed,
+               c->completed ? c->totallatency / c->completed : 0, c->maxlatency);
+      triggerhook(HOOK_CORE_STATSREPLY, message);
+
+      snprintf(message, sizeof(message), "PQSQL   : connection %2d: %4d statements cached, %9lu executed, %7lu prepared",
+               i, c->nstatements, c->executed, c->prepared);
+      triggerhook(HOOK_CORE_STATSREPLY, message);
+    }
   }  
 }
 
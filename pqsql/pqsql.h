@@ -7,6 +7,20 @@
 
 #define QH_ALREADYFIRED 1
 
+/* [pqsql] connections is capped at this.  Anonymous queries and plain
+ * (old dbapi) identifiers always use the first connection, only pooled
+ * identifiers are spread over the rest. */
+#define PQ_MAXCONNECTIONS 16
+/* default for [pqsql] pipeline, queries in flight per connection */
+#define PQ_DEFAULTPIPELINE "8"
+/* set on identifiers from pqgetpooledid, which may use the other connections */
+#define PQ_POOLEDID 0x40000000
+
+/* prepared statements kept per connection for pqasyncqueryparams */
+#define PQ_MAXSTATEMENTS 256
+#define PQ_STATEMENTHASHSIZE 128
+#define PQ_STMTNAMELEN 24
+
 typedef struct PQResult {
   PGresult *result;
   int row;
@@ -19,6 +33,8 @@ typedef void (*PQQueryHandler)(PGconn *, void *);
 void pqloadtable(char *tablename, PQQueryHandler init, PQQueryHandler data, PQQueryHandler fini, void *tag);
 
 void pqasyncqueryf(PQModuleIdentifier identifier, PQQueryHandler handler, void *tag, int flags, char *format, ...) __attribute__ ((format (printf, 5, 6)));
+void pqasyncqueryparams(PQModuleIdentifier identifier, PQQueryHandler handler, void *tag, int flags, const char *query, int nparams, const char * const *values);
+void pqasynccopy(PQModuleIdentifier identifier, PQQueryHandler handler, void *tag, const char *table, const char *columns, int ncolumns, int nrows, const char * const *values);
 #define pqasyncqueryi(identifier, handler, tag, format, ...) pqasyncqueryf(identifier, handler, tag, 0, format , ##__VA_ARGS__)
 #define pqasyncquery(handler, tag, format, ...) pqasyncqueryf(DB_NULLIDENTIFIER, handler, tag, 0, format , ##__VA_ARGS__)
 #define pqcreatequery(format, ...) pqasyncqueryf(DB_NULLIDENTIFIER, NULL, NULL, DB_CREATE, format , ##__VA_ARGS__)
@@ -27,6 +43,7 @@ void pqasyncqueryf(PQModuleIdentifier identifier, PQQueryHandler handler, void *
 int pqconnected(void);
 
 PQModuleIdentifier pqgetid(void);
+PQModuleIdentifier pqgetpooledid(void);
 void pqfreeid(PQModuleIdentifier identifier);
 
 #define pqquerysuccessful(x) (x && (PQresultStatus(x->result) == PGRES_TUPLES_OK))
@@ -34,13 +34,18 @@ MODULE_VERSION("")
 
 #define SCANTIMEOUT      60
 
-#define SCANHOSTHASHSIZE 1000
-#define SCANHASHSIZE     400
-
 /* It's unlikely you'll get 10k of preamble before a connect... */
 #define READ_SANITY_LIMIT 10240
 
-scan *scantable[SCANHASHSIZE];
+/* active scans indexed by fd */
+scan **scantable;
+int scantablesize;
+
+/* pending timeouts, slot is expiry time modulo PSCAN_WHEELSIZE */
+scan *scanwheel[PSCAN_WHEELSIZE];
+time_t wheeltime, lastlimitadjust;
+
+scantypestats scanstats[STYPE_MAX+1];
 
 CommandTree *ps_commands;
 
@@ -54,6 +59,8 @@ int warningsent;
 int glinedhosts;
 time_t ps_starttime;
 int ps_cache_ext;
+int ps_prefix_ext;
+int minyield;
 int ps_extscan_ext;
 int ps_ready;
 
@@ -88,7 +95,8 @@ FILE *ps_logfile;
 
 /* Local functions */
 void handlescansock(int fd, short events);
-void timeoutscansock(void *arg);
+void timeoutscansock(scan *sp);
+void scanwheeltick(void *arg);
 void proxyscan_newnick(int hooknum, void *arg);
 void proxyscan_lostnick(int hooknum, void *arg);
 void proxyscan_onconnect(int hooknum, void *arg);
@@ -143,6 +151,7 @@ void proxyscan_addscantype(int type, int port) {
   thescans[numscans].type=type;
   thescans[numscans].port=port;
   thescans[numscans].hits=0;
+  thescans[numscans].scans=0;
   
   numscans++;
 }
@@ -250,8 +259,17 @@ void _init(void) {
     Error("proxyscan",ERR_INFO,"failed to reg node ext");
     return;
   }
+  ps_prefix_ext = registernodeext("proxyscanprefix");
+  if ( ps_prefix_ext == -1) { 
+    Error("proxyscan",ERR_INFO,"failed to reg node ext");
+    return;
+  }
 
-  memset(scantable,0,sizeof(scantable));
+  scantable=NULL;
+  scantablesize=0;
+  memset(scanwheel,0,sizeof(scanwheel));
+  memset(scanstats,0,sizeof(scanstats));
+  wheeltime=lastlimitadjust=time(NULL);
   maxscans=200;
   activescans=0;
   queuedhosts=0;
@@ -273,6 +291,20 @@ void _init(void) {
   maxscans=strtol(cfgstr->content,NULL,10);
   freesstring(cfgstr);
 
+  /* Start at the ceiling, timeouts will bring us down */
+  scanlimit=maxscans;
+  aimdsamples=aimdtimeouts=aimdlastrate=0;
+
+  /* Percentage of connects timing out before we reduce concurrency */
+  cfgstr=getcopyconfigitem("proxyscan","timeoutthreshold","50",3);
+  timeoutthreshold=strtol(cfgstr->content,NULL,10);
+  freesstring(cfgstr);
+
+  /* Hits per 100000 scans below which a scan type only runs in the background */
+  cfgstr=getcopyconfigitem("proxyscan","minyield","1",10);
+  minyield=strtol(cfgstr->content,NULL,10);
+  freesstring(cfgstr);
+
   /* Clean host timeout */
   cfgstr=getcopyconfigitem("proxyscan","rescaninterval","3600",7);
   rescaninterval=strtol(cfgstr->content,NULL,10);
@@ -396,13 +428,17 @@ void _init(void) {
 
   /* Schedule saves */
   schedulerecurring(time(NULL)+3600,0,3600,&dumpcachehosts,NULL);
+  schedulerecurring(time(NULL)+10,0,10,&flushcachejournal,NULL);
+
+  /* Scan timeouts and concurrency adjustments */
+  schedulerecurring(time(NULL)+1,0,1,&scanwheeltick,NULL);
  
   ps_logfile=fopen("logs/proxyscan.log","a");
 
   if (connected) {
     /* if we're already connected, assume we're just reloading module (i.e. have a completed burst) */
     ps_ready = 1;
-    startqueuedscans();
+    kickscans();
   }
 }
 
@@ -450,18 +486,22 @@ void _fini(void) {
   deregisterhook(HOOK_CORE_STATSREQUEST,&proxyscanstats);
 
   deleteschedule(NULL,&dumpcachehosts,NULL);
+  deleteschedule(NULL,&flushcachejournal,NULL);
+  deleteschedule(NULL,&scanwheeltick,NULL);
+  cancelkickscans();
  
   destroycommandtree(ps_commands);
  
   /* Kill any scans in progress */
   killallscans();
 
-  /* Dump the database - AFTER killallscans() which prunes it */
-  dumpcachehosts(NULL);
+  /* Close the journal - AFTER killallscans() which prunes it */
+  closecachehosts();
 
   /* dump any cached hosts before deleting the extensions */
   releasenodeext(ps_cache_ext);
   releasenodeext(ps_extscan_ext);
+  releasenodeext(ps_prefix_ext);
 
   /* free() all our structures */
   nsfreeall(POOL_PROXYSCAN);
@@ -522,43 +562,100 @@ void proxyscanuserhandler(nick *target, int message, void **params) {
   }
 }
 
-void addscantohash(scan *sp) {
-  int hash;
-  hash=(sp->fd)%SCANHASHSIZE;
-  
-  sp->next=scantable[hash];
-  scantable[hash]=sp;
-  
+int addscantotable(scan *sp) {
+  if (sp->fd>=scantablesize) {
+    scan **newtable;
+    int newsize=scantablesize?scantablesize:1024;
+
+    while (newsize<=sp->fd)
+      newsize*=2;
+
+    if (!(newtable=nsrealloc(POOL_PROXYSCAN,scantable,newsize*sizeof(scan *))))
+      return 1;
+
+    memset(newtable+scantablesize,0,(newsize-scantablesize)*sizeof(scan *));
+    scantable=newtable;
+    scantablesize=newsize;
+  }
+
+  scantable[sp->fd]=sp;
   activescans++;
+
+  return 0;
 }
 
-void delscanfromhash(scan *sp) {
-  int hash;
-  scan **sh;
-  
-  hash=(sp->fd)%SCANHASHSIZE;
-  
-  for (sh=&(scantable[hash]);*sh;sh=&((*sh)->next)) {
-    if (*sh==sp) {
-      (*sh)=sp->next;
-      break;
-    }
-  } 
-  
+void delscanfromtable(scan *sp) {
+  scantable[sp->fd]=NULL;
   activescans--;
 }
 
 scan *findscan(int fd) {
-  int hash;
-  scan *sp;
-  
-  hash=fd%SCANHASHSIZE;
-  
-  for (sp=scantable[hash];sp;sp=sp->next)
-    if (sp->fd==fd)
-      return sp;
-  
-  return NULL;
+  if (fd<0 || fd>=scantablesize)
+    return NULL;
+
+  return scantable[fd];
+}
+
+static void canceltimeout(scan *sp) {
+  if (!sp->wheelprev)
+    return;
+
+  *(sp->wheelprev)=sp->wheelnext;
+  if (sp->wheelnext)
+    sp->wheelnext->wheelprev=sp->wheelprev;
+
+  sp->wheelnext=NULL;
+  sp->wheelprev=NULL;
+}
+
+/* (re)arm the scan's timeout, SCANTIMEOUT seconds from now */
+static void scheduletimeout(scan *sp) {
+  scan **slot;
+
+  canceltimeout(sp);
+
+  sp->expires=time(NULL)+SCANTIMEOUT;
+  slot=&scanwheel[sp->expires&(PSCAN_WHEELSIZE-1)];
+
+  sp->wheelnext=*slot;
+  if (*slot)
+    (*slot)->wheelprev=&(sp->wheelnext);
+  sp->wheelprev=slot;
+  *slot=sp;
+}
+
+void scanwheeltick(void *arg) {
+  time_t now=time(NULL);
+  scan *sp, *nsp;
+
+  /* after a long stall one lap of the wheel covers everything */
+  if (now-wheeltime>=PSCAN_WHEELSIZE)
+    wheeltime=now-PSCAN_WHEELSIZE+1;
+
+  for (;wheeltime<=now;wheeltime++) {
+    for (sp=scanwheel[wheeltime&(PSCAN_WHEELSIZE-1)];sp;sp=nsp) {
+      nsp=sp->wheelnext;
+      /* slots are shared by times a lap apart */
+      if (sp->expires<=wheeltime)
+        timeoutscansock(sp);
+    }
+  }
+
+  if (now>=lastlimitadjust+PSCAN_AIMD_WINDOW) {
+    adjustscanlimit();
+    lastlimitadjust=now;
+  }
+
+  /* timed scans may have become due */
+  kickscans();
+}
+
+static unsigned long msecssince(struct timeval *tv) {
+  struct timeval now;
+
+  gettimeofday(&now,NULL);
+
+  return (now.tv_sec-tv->tv_sec)*1000+(now.tv_usec-tv->tv_usec)/1000;
 }
 
 void startscan(patricia_node_t *node, int type, int port, int class) {
@@ -590,6 +687,8 @@ void startscan(patricia_node_t *node, int type, int port, int class) {
   sp->class=class;
   sp->bytesread=0;
   sp->totalbytesread=0;
+  sp->wheelnext=NULL;
+  sp->wheelprev=NULL;
   memset(sp->readbuf, '\0', PSCAN_READBUFSIZE);
 
   sp->fd=createconnectsocket(&((patricia_node_t *)sp->node)->prefix->sin,sp->port);
@@ -600,19 +699,153 @@ void startscan(patricia_node_t *node, int type, int port, int class) {
     freescan(sp);
     return;
   }
+  if (addscantotable(sp)) {
+    close(sp->fd);
+    derefnode(iptree,sp->node);
+    freescan(sp);
+    return;
+  }
+
+  gettimeofday(&sp->started,NULL);
+  scanstats[sp->type].started++;
+
   /* Wait until it is writeable */
   registerhandler(sp->fd,POLLERR|POLLHUP|POLLOUT,&handlescansock);
   /* And set a timeout */
-  sp->sch=scheduleoneshot(time(NULL)+SCANTIMEOUT,&timeoutscansock,(void *)sp);
-  addscantohash(sp);
+  scheduletimeout(sp);
 }
 
-void timeoutscansock(void *arg) {
-  scan *sp=(scan *)arg;
+void timeoutscansock(scan *sp) {
+  scanstats[sp->type].timeouts++;
+
+  if (sp->state==SSTATE_CONNECTING) {
+    aimdsamples++;
+    aimdtimeouts++;
+  }
 
   killsock(sp, SOUTCOME_CLOSED);
 }
 
+static patricia_node_t *prefixnode(patricia_node_t *node, int create) {
+  struct irc_in_addr prefix;
+  int bits, i;
+
+  prefix=node->prefix->sin;
+
+  if (irc_in_addr_is_ipv4(&prefix)) {
+    bits=96+PSCAN_PREFIXBITS4;
+  } else {
+    bits=PSCAN_PREFIXBITS6;
+  }
+
+  for (i=bits/16;i<8;i++)
+    prefix.in6_16[i]=0;
+
+  if (create)
+    return refnode(iptree, &prefix, bits);
+
+  return patricia_search_exact(iptree, &prefix, bits);
+}
+
+static void addprefixhit(patricia_node_t *node, short type, unsigned short port) {
+  patricia_node_t *pnode;
+  prefixhits *php;
+
+  if (!(pnode=prefixnode(node, 1)))
+    return;
+
+  /* the extension holds the only reference we keep */
+  if (pnode->exts[ps_prefix_ext])
+    derefnode(iptree,pnode);
+
+  for (php=pnode->exts[ps_prefix_ext];php;php=php->next)
+    if (php->type==type && php->port==port)
+      break;
+
+  if (!php) {
+    if (!(php=nsmalloc(POOL_PROXYSCAN, sizeof(prefixhits))))
+      return;
+
+    php->type=type;
+    php->port=port;
+    php->hits=0;
+    php->next=pnode->exts[ps_prefix_ext];
+    pnode->exts[ps_prefix_ext]=php;
+  }
+
+  php->hits++;
+}
+
+static unsigned int scanprefixhits(prefixhits *php, int i) {
+  for (;php;php=php->next)
+    if (php->type==thescans[i].type && php->port==thescans[i].port)
+      return php->hits;
+
+  return 0;
+}
+
+static int lowyield(int i) {
+  return thescans[i].scans>=PSCAN_YIELDSAMPLES &&
+         (unsigned long long)thescans[i].hits*100000 < (unsigned long long)thescans[i].scans*minyield;
+}
+
+static prefixhits *sortprefixhits;
+
+static int probesort(const void *a, const void *b) {
+  int ra = *((const int *)a);
+  int rb = *((const int *)b);
+  unsigned int pa=scanprefixhits(sortprefixhits, ra), pb=scanprefixhits(sortprefixhits, rb);
+  unsigned long long ya, yb;
+
+  if (pa!=pb)
+    return (pa>pb)?-1:1;
+
+  /* hit rates, with one extra hit and scan so untried scan types go early */
+  ya=(unsigned long long)(thescans[ra].hits+1)*(thescans[rb].scans+1);
+  yb=(unsigned long long)(thescans[rb].hits+1)*(thescans[ra].scans+1);
+
+  if (ya!=yb)
+    return (ya>yb)?-1:1;
+
+  return ra-rb;
+}
+
+/*
+ * queuenormalscans:
+ *  Queues the first pass of scans for a host, most likely to find a proxy
+ *  first.  Scan types that hardly ever find anything go in the background.
+ */
+
+void queuenormalscans(patricia_node_t *node, time_t when, foundproxy *skip) {
+  patricia_node_t *pnode;
+  prefixhits *php=NULL;
+  foundproxy *fpp;
+  int ord[PSCAN_MAXSCANS];
+  int i, n=0;
+
+  if ((pnode=prefixnode(node, 0)))
+    php=pnode->exts[ps_prefix_ext];
+
+  for (i=0;i<numscans;i++) {
+    for (fpp=skip;fpp;fpp=fpp->next)
+      if (fpp->type==thescans[i].type && fpp->port==thescans[i].port)
+        break;
+
+    if (!fpp)
+      ord[n++]=i;
+  }
+
+  sortprefixhits=php;
+  qsort(ord,n,sizeof(int),probesort);
+
+  for (i=0;i<n;i++) {
+    if (lowyield(ord[i]) && !scanprefixhits(php, ord[i]))
+      queuescan(node, thescans[ord[i]].type, thescans[ord[i]].port, SCLASS_BACKGROUND, 0);
+    else
+      queuescan(node, thescans[ord[i]].type, thescans[ord[i]].port, SCLASS_NORMAL, when);
+  }
+}
+
 void killsock(scan *sp, int outcome) {
   int i;
   cachehost *chp;
@@ -623,17 +856,30 @@ void killsock(scan *sp, int outcome) {
   scansdone++;
   scansbyclass[sp->class]++;
 
-  /* Remove the socket from the schedule/event lists */
+  for(i=0;i<numscans;i++) {
+    if (thescans[i].type==sp->type && thescans[i].port==sp->port) {
+      thescans[i].scans++;
+      break;
+    }
+  }
+
+  scanstats[sp->type].finished++;
+  scanstats[sp->type].scanms+=msecssince(&sp->started);
+  if (outcome==SOUTCOME_OPEN)
+    scanstats[sp->type].open++;
+
+  /* Remove the socket from the timeout/event lists */
   deregisterhandler(sp->fd,1);  /* this will close the fd for us */
-  deleteschedule(sp->sch,&timeoutscansock,(void *)sp);
+  canceltimeout(sp);
 
   sp->outcome=outcome;
-  delscanfromhash(sp);
+  delscanfromtable(sp);
 
   /* See if we need to queue another scan.. */
   if (sp->outcome==SOUTCOME_CLOSED &&
       ((sp->class==SCLASS_CHECK) ||
-       (sp->class==SCLASS_NORMAL && (sp->state==SSTATE_SENTREQUEST || sp->state==SSTATE_GOTRESPONSE))))
+       ((sp->class==SCLASS_NORMAL || sp->class==SCLASS_BACKGROUND) &&
+        (sp->state==SSTATE_SENTREQUEST || sp->state==SSTATE_GOTRESPONSE))))
     queuescan(sp->node, sp->type, sp->port, SCLASS_PASS2, time(NULL)+300);
 
   if (sp->outcome==SOUTCOME_CLOSED && sp->class==SCLASS_PASS2)
@@ -647,9 +893,8 @@ void killsock(scan *sp, int outcome) {
   
     /* Lets try and get the cache record.  If there isn't one, make a new one. */
     if (!(chp=findcachehost(sp->node))) {
-      chp=addcleanhost(time(NULL));
+      chp=addcleanhost(sp->node, time(NULL));
       patricia_ref_prefix(sp->node->prefix);
-      sp->node->exts[ps_cache_ext] = chp;
     }
     /* Stick it on the cache's list of proxies, if necessary */
     for (fpp=chp->proxies;fpp;fpp=fpp->next)
@@ -685,6 +930,8 @@ void killsock(scan *sp, int outcome) {
       loggline(chp, sp->node);  /* Update log only */
     }
 
+    journalcachehost(sp->node, chp);
+
     /* Update counter */
     for(i=0;i<numscans;i++) {
       if (thescans[i].type==sp->type && thescans[i].port==sp->port) {
@@ -692,6 +939,11 @@ void killsock(scan *sp, int outcome) {
 	break;
       }
     }
+
+    addprefixhit(sp->node, sp->type, sp->port);
+
+    /* they're glined, the remaining first pass scans won't tell us anything useful */
+    cancelqueuedscans(sp->node);
   }
 
   /* deref prefix (referenced in queuescan) */
@@ -699,7 +951,7 @@ void killsock(scan *sp, int outcome) {
   freescan(sp);
 
   /* kick the queue.. */
-  startqueuedscans();
+  kickscans();
 }
 
 void handlescansock(int fd, short events) {
@@ -715,8 +967,15 @@ void handlescansock(int fd, short events) {
     return;
   }
 
-  /* It woke up, delete the alarm call.. */
-  deleteschedule(sp->sch,&timeoutscansock,(void *)sp);
+  if (sp->state==SSTATE_CONNECTING) {
+    /* got an answer one way or another before the timeout */
+    aimdsamples++;
+
+    if (!(events & (POLLERR|POLLHUP))) {
+      scanstats[sp->type].connected++;
+      scanstats[sp->type].connectms+=msecssince(&sp->started);
+    }
+  }
 
   if (events & (POLLERR|POLLHUP)) {
     /* Some kind of error; give up on this socket */
@@ -743,7 +1002,7 @@ void handlescansock(int fd, short events) {
     deregisterhandler(fd,0);
     /* Set the new one */
     registerhandler(fd,POLLERR|POLLHUP|POLLIN,&handlescansock);
-    sp->sch=scheduleoneshot(time(NULL)+SCANTIMEOUT,&timeoutscansock,(void *)sp);
+    scheduletimeout(sp);
     /* Update state */
     sp->state=SSTATE_SENTREQUEST;
 
@@ -955,8 +1214,8 @@ void handlescansock(int fd, short events) {
       return;
     }
     
-    /* No magic string yet, we schedule another timeout in case it comes later. */
-    sp->sch=scheduleoneshot(time(NULL)+SCANTIMEOUT,&timeoutscansock,(void *)sp);
+    /* No magic string yet, push the timeout back in case it comes later. */
+    scheduletimeout(sp);
     return;    
   }
 }
@@ -966,19 +1225,21 @@ void killallscans() {
   scan *sp;
   cachehost *chp;
   
-  for(i=0;i<SCANHASHSIZE;i++) {
-    for(sp=scantable[i];sp;sp=sp->next) {
-      /* If there is a pending scan, delete it's clean host record.. */
-      if ((chp=findcachehost(sp->node)) && !chp->proxies) {
-        sp->node->exts[ps_cache_ext] = NULL;
-        derefnode(iptree,sp->node); 
-        delcachehost(chp);
-      }
-        
-      if (sp->fd!=-1) {
-	deregisterhandler(sp->fd,1);
-	deleteschedule(sp->sch,&timeoutscansock,(void *)(sp));
-      }
+  for(i=0;i<scantablesize;i++) {
+    if (!(sp=scantable[i]))
+      continue;
+
+    /* If there is a pending scan, delete it's clean host record.. */
+    if ((chp=findcachehost(sp->node)) && !chp->proxies) {
+      journalcachehost(sp->node, NULL);
+      sp->node->exts[ps_cache_ext] = NULL;
+      derefnode(iptree,sp->node); 
+      delcachehost(chp);
+    }
+      
+    if (sp->fd!=-1) {
+      deregisterhandler(sp->fd,1);
+      canceltimeout(sp);
     }
   }
 }
@@ -1029,15 +1290,25 @@ int proxyscandostatus(void *sender, int cargc, char **cargv) {
   sendnoticetouser(proxyscannick,np,"pendingscan structures: %lu x %lu bytes = %lu bytes total",countpendingscan,
 	sizeof(pendingscan), (countpendingscan * sizeof(pendingscan)));
 
-  sendnoticetouser(proxyscannick,np,"Currently active scans: %d/%d",activescans,maxscans);
+  sendnoticetouser(proxyscannick,np,"Currently active scans: %d/%d (ceiling %d)",activescans,scanlimit,maxscans);
+  sendnoticetouser(proxyscannick,np,"Connect timeout rate:   %u%% last window, %u/%u this window (threshold %d%%)",
+                   aimdlastrate,aimdtimeouts,aimdsamples,timeoutthreshold);
   sendnoticetouser(proxyscannick,np,"Processing speed:       %lu scans per minute",scanspermin);
   sendnoticetouser(proxyscannick,np,"Normal queued scans:    %d",normalqueuedscans);
   sendnoticetouser(proxyscannick,np,"Timed queued scans:     %d",prioqueuedscans);
+  sendnoticetouser(proxyscannick,np,"Queued by class:        %u normal, %u check, %u pass2, %u pass3, %u pass4",
+                   queuedbyclass[SCLASS_NORMAL],queuedbyclass[SCLASS_CHECK],queuedbyclass[SCLASS_PASS2],
+                   queuedbyclass[SCLASS_PASS3],queuedbyclass[SCLASS_PASS4]);
+  sendnoticetouser(proxyscannick,np,"Background queued scans: %u (%lu dropped as too old or over the limit)",backgroundqueuedscans,backgrounddropped);
+  sendnoticetouser(proxyscannick,np,"Duplicate scans dropped: %lu, aged ahead of timed scans: %lu",droppedscans,agedscans);
+  sendnoticetouser(proxyscannick,np,"Scans cancelled after a hit: %lu",cancelledscans);
+  sendnoticetouser(proxyscannick,np,"Queue wait:             50%% <%lums, 90%% <%lums, 99%% <%lums",
+                   queuewaitpercentile(50),queuewaitpercentile(90),queuewaitpercentile(99));
   sendnoticetouser(proxyscannick,np,"'Clean' cached hosts:   %d",cleancount());
   sendnoticetouser(proxyscannick,np,"'Dirty' cached hosts:   %d",dirtycount());
  
   sendnoticetouser(proxyscannick,np,"Extra scans: %d", extrascancount());
-  for (i=0;i<5;i++)
+  for (i=0;i<=SCLASS_MAX;i++)
     sendnoticetouser(proxyscannick,np,"Open proxies, class %1d:  %d/%d (%.2f%%)",i,hitsbyclass[i],scansbyclass[i],((float)hitsbyclass[i]*100)/scansbyclass[i]);
   
   for (i=0;i<numscans;i++)
@@ -1048,11 +1319,26 @@ int proxyscandostatus(void *sender, int cargc, char **cargv) {
   
   qsort(ord,numscans,sizeof(int),pscansort);
   
-  sendnoticetouser(proxyscannick,np,"Scan type    Port  Detections");
+  sendnoticetouser(proxyscannick,np,"Scan type    Port  Detections           Hit rate");
   for (i=0;i<numscans;i++)
-    sendnoticetouser(proxyscannick,np,"%-12s %-5d %d (%.2f%%)",
-                     scantostr(thescans[ord[i]].type), thescans[ord[i]].port, thescans[ord[i]].hits, ((float)thescans[ord[i]].hits*100)/totaldetects);
+    sendnoticetouser(proxyscannick,np,"%-12s %-5d %-8d (%6.2f%%)  %.3f%% of %u%s",
+                     scantostr(thescans[ord[i]].type), thescans[ord[i]].port, thescans[ord[i]].hits, ((float)thescans[ord[i]].hits*100)/totaldetects,
+                     thescans[ord[i]].scans?((float)thescans[ord[i]].hits*100)/thescans[ord[i]].scans:0.0, thescans[ord[i]].scans,
+                     lowyield(ord[i])?" (background)":"");
   
+  sendnoticetouser(proxyscannick,np,"Scan type    Started   Open      Timeouts  Connected  Avg connect  Avg scan");
+  for (i=0;i<=STYPE_MAX;i++) {
+    scantypestats *ssp=&scanstats[i];
+
+    if (!ssp->started)
+      continue;
+
+    sendnoticetouser(proxyscannick,np,"%-12s %-9u %-9u %-9u %-10u %-8lums   %lums",
+                     scantostr(i), ssp->started, ssp->open, ssp->timeouts, ssp->connected,
+                     ssp->connected?(unsigned long)(ssp->connectms/ssp->connected):0UL,
+                     ssp->finished?(unsigned long)(ssp->scanms/ssp->finished):0UL);
+  }
+
   sendnoticetouser(proxyscannick,np,"End of list.");
   return CMD_OK;
 }
@@ -1067,15 +1353,16 @@ int proxyscandebug(void *sender, int cargc, char **cargv) {
 
   sendnoticetouser(proxyscannick,np,"Active scans : %d",activescans);
   
-  for (i=0;i<SCANHASHSIZE;i++) {
-    for (sp=scantable[i];sp;sp=sp->next) {
-      if (sp->outcome==SOUTCOME_INPROGRESS) {
-	activescansfound++;
-      }
-      totalscansfound++;
-      sendnoticetouser(proxyscannick,np,"fd: %d type: %d port: %d state: %d outcome: %d IP: %s",
-		       sp->fd,sp->type,sp->port,sp->state,sp->outcome,IPtostr(((patricia_node_t *)sp->node)->prefix->sin));
+  for (i=0;i<scantablesize;i++) {
+    if (!(sp=scantable[i]))
+      continue;
+
+    if (sp->outcome==SOUTCOME_INPROGRESS) {
+      activescansfound++;
     }
+    totalscansfound++;
+    sendnoticetouser(proxyscannick,np,"fd: %d type: %d port: %d state: %d outcome: %d IP: %s",
+		     sp->fd,sp->type,sp->port,sp->state,sp->outcome,IPtostr(((patricia_node_t *)sp->node)->prefix->sin));
   }
 
   sendnoticetouser(proxyscannick,np,"Total %d scans actually found (%d active)",totalscansfound,activescansfound);
@@ -1086,13 +1373,13 @@ void proxyscan_onconnect(int hooknum, void *arg) {
   ps_ready = 1;
 
   /* kick the queue.. */
-  startqueuedscans();
+  kickscans();
 }
 
 int proxyscandosave(void *sender, int cargc, char **cargv) {
   nick *np = (nick *)sender;
 
-  sendnoticetouser(proxyscannick,np,"Saving cached hosts...");
+  sendnoticetouser(proxyscannick,np,"Saving cached hosts in the background...");
   dumpcachehosts(NULL);
   sendnoticetouser(proxyscannick,np,"Done.");
   return CMD_OK;
@@ -1134,11 +1421,8 @@ int proxyscandoshowkill(void *sender, int cargc, char **cargv) {
 
 void startnickscan(nick *np) {
   time_t t = time(NULL);
-  int i;
-  for(i=0;i<numscans;i++) {
-    /* @@@TODO: we allow a forced scan to scan the same IP multiple times atm */
-    queuescan(np->ipnode,thescans[i].type,thescans[i].port,SCLASS_NORMAL,t);
-  }
+
+  queuenormalscans(np->ipnode, t, NULL);
 }
 
 int proxyscandoscan(void *sender, int cargc, char **cargv) {
@@ -1146,7 +1430,6 @@ int proxyscandoscan(void *sender, int cargc, char **cargv) {
   patricia_node_t *node;
   struct irc_in_addr sin;
   unsigned char bits;
-  int i;
 
   if(cargc < 1)
     return CMD_USAGE;
@@ -1168,10 +1451,7 @@ int proxyscandoscan(void *sender, int cargc, char **cargv) {
     // * Just queue the scans directly here.. plonk them on the priority queue * /
     node = refnode(iptree, &sin, bits); /* node leaks node here - should only allow to scan a nick? */
     t = time(NULL);
-    for(i=0;i<numscans;i++) {
-      /* @@@TODO: we allow a forced scan to scan the same IP multiple times atm */
-      queuescan(node,thescans[i].type,thescans[i].port,SCLASS_NORMAL,t);
-    }
+    queuenormalscans(node, t, NULL);
   }
   return CMD_OK;
 }
@@ -6,6 +6,7 @@
 #include "../lib/splitline.h"
 #include <time.h>
 #include <stdint.h>
+#include <sys/time.h>
 
 /* string seen when:
  * - a HTTP/SOCKS/... proxy connects directly to our listener (because we told it to)
@@ -24,6 +25,38 @@
 
 #define PSCAN_MAXSCANS      100
 
+/* scan timeouts live on a wheel with one slot per second, must be a power of 2 > SCANTIMEOUT */
+#define PSCAN_WHEELSIZE     64
+
+/* most connect()s issued in one pass of the event loop */
+#define PSCAN_CONNECTBATCH  100
+
+/* adaptive concurrency: every PSCAN_AIMD_WINDOW seconds, with at least PSCAN_AIMD_MINSAMPLES
+ * finished connects, shrink the limit to 3/4 if too many connects timed out, otherwise grow
+ * it by PSCAN_AIMD_INCREASE up to maxscans */
+#define PSCAN_AIMD_WINDOW     10
+#define PSCAN_AIMD_MINSAMPLES 20
+#define PSCAN_AIMD_INCREASE   10
+#define PSCAN_AIMD_MINSCANS   10
+
+/* scan queue: duplicate detection and per-prefix bucket hash sizes (powers of 2), once the
+ * next normal scan has waited PSCAN_QUEUEAGE seconds it goes ahead of due timed scans */
+#define PSCAN_QUEUEHASHSIZE   65536
+#define PSCAN_BUCKETHASHSIZE  16384
+#define PSCAN_QUEUEAGE        30
+
+/* probe ordering: a scan type with at least PSCAN_YIELDSAMPLES finished scans and fewer
+ * than minyield hits per 100000 only runs in the background pass, unless it has found
+ * proxies in the same prefix before */
+#define PSCAN_YIELDSAMPLES    10000
+#define PSCAN_PREFIXBITS4     16
+#define PSCAN_PREFIXBITS6     32
+
+/* background queue: at most PSCAN_BACKGROUNDMAX scans (the oldest go first), and
+ * anything that waited longer than PSCAN_BACKGROUNDAGE seconds is dropped */
+#define PSCAN_BACKGROUNDMAX   100000
+#define PSCAN_BACKGROUNDAGE   1800
+
 #define P_MAX(a,b) (((a)>(b))?(a):(b))
 #define PSCAN_READBUFSIZE   (P_MAX(MAGICSTRINGLENGTH, P_MAX(MAGICROUTERSTRINGLENGTH, MAGICEXTTRINGLENGTH)))*2
 
@@ -54,13 +87,24 @@
 #define SCLASS_PASS2        2
 #define SCLASS_PASS3        3
 #define SCLASS_PASS4        4
+#define SCLASS_BACKGROUND   5
+#define SCLASS_MAX          5
 
 typedef struct scantype {
   int type;
   int port;
   int hits;
+  unsigned int scans;  /* finished scans, for the hit rate */
 } scantype;
 
+/* open proxies found in a /16 (IPv4) or /32 (IPv6), kept on that prefix's node */
+typedef struct prefixhits {
+  short type;
+  unsigned short port;
+  unsigned int hits;
+  struct prefixhits *next;
+} prefixhits;
+
 typedef struct extrascan {
   unsigned short port;
   unsigned char type;
@@ -74,9 +118,20 @@ typedef struct pendingscan {
   unsigned char type;
   unsigned char class;
   time_t when;
-  struct pendingscan *next;
+  struct timeval queued;
+  struct pendingscan *next;     /* next in the same scanbucket */
+  struct pendingscan *hashnext; /* duplicate detection */
+  unsigned char cancelled;      /* host already found to be a proxy */
 } pendingscan;
 
+/* normal scans are grouped per /24 (IPv4) or /48 (IPv6) and the groups served round robin */
+typedef struct scanbucket {
+  struct irc_in_addr prefix;
+  pendingscan *head, *tail;
+  struct scanbucket *next;      /* round robin ring */
+  struct scanbucket *hashnext;
+} scanbucket;
+
 typedef struct foundproxy {
   short type;
   unsigned short port;
@@ -93,7 +148,8 @@ typedef struct cachehost {
   sstring *lasthostmask; /* Not saved to disk */
   time_t lastconnect;    /* Not saved to disk */
 #endif
-  struct cachehost *next; 
+  patricia_node_t *node;
+  struct cachehost *prev, *next; /* all cached hosts, for the expiry sweep */
 } cachehost;
 
 typedef struct scan {
@@ -104,13 +160,24 @@ typedef struct scan {
   unsigned short state;
   unsigned short outcome;
   unsigned short class;
-  struct scan *next;
-  void *sch;
+  time_t expires;
+  struct scan *wheelnext, **wheelprev;
+  struct timeval started;
   char readbuf[PSCAN_READBUFSIZE];
   int bytesread;
   int totalbytesread;
 } scan;
 
+typedef struct scantypestats {
+  unsigned int started;
+  unsigned int finished;
+  unsigned int open;
+  unsigned int timeouts;       /* includes timeouts after connecting */
+  unsigned int connected;      /* completed the TCP handshake */
+  unsigned long long connectms; /* summed over connected scans */
+  unsigned long long scanms;    /* summed over finished scans */
+} scantypestats;
+
 #if defined(PROXYSCAN_MAIL)
 extern unsigned int ps_mailip;
 extern unsigned int ps_mailport;
@@ -120,6 +187,10 @@ extern int psm_mailerfd;
 
 extern int activescans;
 extern int maxscans;
+extern int scanlimit;
+extern int timeoutthreshold;
+extern unsigned int aimdsamples, aimdtimeouts, aimdlastrate;
+extern scantypestats scanstats[];
 extern int numscans;
 extern scantype thescans[];
 extern int brokendb;
@@ -134,6 +205,14 @@ extern int extport;
 
 extern unsigned int normalqueuedscans;
 extern unsigned int prioqueuedscans;
+extern unsigned int queuedbyclass[];
+extern unsigned int backgroundqueuedscans;
+extern unsigned long droppedscans;
+extern unsigned long agedscans;
+extern unsigned long backgrounddropped;
+extern unsigned long cancelledscans;
+extern int ps_prefix_ext;
+extern int minyield;
 
 extern unsigned int ps_start_ts;
 
@@ -142,12 +221,16 @@ extern unsigned long countpendingscan;
 extern unsigned long scanspermin;
 
 /* proxyscancache.c */
-cachehost *addcleanhost(time_t timestamp);
+cachehost *addcleanhost(patricia_node_t *node, time_t timestamp);
 cachehost *findcachehost(patricia_node_t *node);
 void delcachehost(cachehost *);
-void dumpcachehosts();
+void dumpcachehosts(void *arg);
 void loadcachehosts();
+void journalcachehost(patricia_node_t *node, cachehost *chp);
+void flushcachejournal(void *arg);
+void closecachehosts();
 unsigned int cleancount();
+unsigned int cachedcount();
 unsigned int dirtycount();
 void cachehostinit(time_t ri);
 void scanall(int type, int port);
@@ -188,6 +271,12 @@ void ps_makereportmail(scanhost *shp);
 /* proxyscanqueue.c */
 void queuescan(patricia_node_t *node, short scantype, unsigned short port, char class, time_t when);
 void startqueuedscans();
+void cancelqueuedscans(patricia_node_t *node);
+void queuenormalscans(patricia_node_t *node, time_t when, foundproxy *skip);
+unsigned long queuewaitpercentile(int pct);
+void kickscans();
+void cancelkickscans();
+void adjustscanlimit();
 
 /* proxyscan.c */
 void startscan(patricia_node_t *node, int type, int port, int class);
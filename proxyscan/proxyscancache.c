@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 /*
  * proxyscancache.c:
  *  This file deals with the cache of known hosts, clean or otherwise.
@@ -6,18 +7,36 @@
 #include "proxyscan.h"
 #include <time.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
 #include "../core/error.h"
+#include "../core/logbuf.h"
 #include <string.h>
 
 time_t cleanscaninterval;
 time_t dirtyscaninterval;
 
+/* expired hosts are swept from this list a slice at a time, see expirecachehosts() */
+static cachehost *cachehosts, *sweepcursor;
+static unsigned int cachehostcount;
+
 void cachehostinit(time_t ri) {
   cleanscaninterval=ri;
   dirtyscaninterval=ri*7;
 }
 
-cachehost *addcleanhost(time_t timestamp) {
+/*
+ * addcleanhost:
+ *  Creates a cache entry and attaches it to node, the caller deals with the
+ *  node's reference.
+ */
+
+cachehost *addcleanhost(patricia_node_t *node, time_t timestamp) {
   cachehost *chp;
 
   chp=getcachehost();
@@ -25,6 +44,16 @@ cachehost *addcleanhost(time_t timestamp) {
   chp->proxies=NULL;
   chp->glineid=0;
   chp->lastgline=0;  
+  chp->node=node;
+
+  chp->prev=NULL;
+  chp->next=cachehosts;
+  if (cachehosts)
+    cachehosts->prev=chp;
+  cachehosts=chp;
+  cachehostcount++;
+
+  node->exts[ps_cache_ext]=chp;
   
   return chp;
 }
@@ -32,6 +61,17 @@ cachehost *addcleanhost(time_t timestamp) {
 void delcachehost(cachehost *chp) {
   foundproxy *fpp, *nfpp;
 
+  if (sweepcursor==chp)
+    sweepcursor=chp->next;
+
+  if (chp->prev)
+    chp->prev->next=chp->next;
+  else
+    cachehosts=chp->next;
+  if (chp->next)
+    chp->next->prev=chp->prev;
+  cachehostcount--;
+
   for (fpp=chp->proxies;fpp;fpp=nfpp) {
     nfpp=fpp->next;
     freefoundproxy(fpp);
@@ -39,6 +79,10 @@ void delcachehost(cachehost *chp) {
   freecachehost(chp);
 }
 
+unsigned int cachedcount() {
+  return cachehostcount;
+}
+
 /*
  * Returns a cachehost * for the named IP
  */
@@ -64,60 +108,399 @@ cachehost *findcachehost(patricia_node_t *node) {
   return NULL;
 }
 
-/* 
- * dumpcleanhosts:
- *  Dumps all cached hosts to a savefile.  Expires hosts as it goes along
+/*
+ * On-disk cache:
+ *  data/cleanhosts.bin holds fixed size records for every cached host, it's
+ *  rewritten in a forked child so the main loop isn't held up.  Changes made
+ *  since are appended to data/cleanhosts.journal.<n>, the base file header
+ *  says which journal it's up to date with.  Records in later journals
+ *  replace earlier ones for the same prefix.
  */
 
-void dumpcachehosts(void *arg) {
-  FILE *fp;
+#define CACHEFILE        "data/cleanhosts.bin"
+#define CACHETMPFILE     "data/cleanhosts.bin.tmp"
+#define CACHEDIR         "data"
+#define CACHEJOURNALNAME "cleanhosts.journal."
+#define CACHEJOURNALFMT  CACHEDIR "/" CACHEJOURNALNAME "%u"
+#define LEGACYCACHEFILE  "data/cleanhosts"
+
+#define CACHEMAGIC       0x50534331 /* "PSC1" */
+#define CACHEVERSION     1
+
+#define CACHEPROXIES     6
+
+#define CACHEREC_DELETE  0x01 /* forget this prefix */
+#define CACHEREC_MORE    0x02 /* more proxies for the previous record */
+
+/* compact early once the journals hold this many records, and more than the base file */
+#define CACHEJOURNALMAX  100000
+
+/* cached hosts checked for expiry on each journal flush */
+#define CACHESWEEPSTEP   5000
+
+struct cachefileheader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t journal;
+  uint32_t pad;
+  uint64_t count;
+};
+
+struct cacherecord {
+  struct irc_in_addr ip;
+  uint8_t bits;
+  uint8_t flags;
+  uint8_t nproxies;
+  uint8_t pad;
+  int32_t glineid;
+  int64_t lastscan;
+  int64_t lastgline;
+  struct {
+    uint16_t type;
+    uint16_t port;
+  } proxies[CACHEPROXIES];
+};
+
+static FILE *cachejournal;
+static unsigned int journalfirst, journalcur;
+static unsigned long journalrecords, basecount;
+static pid_t compactpid;
+static unsigned int compactjournal;
+
+static int cachehostexpired(cachehost *chp, time_t now) {
+  return chp->lastscan < (now-(chp->proxies ? dirtyscaninterval : cleanscaninterval));
+}
+
+static void openjournal(unsigned int n) {
+  char filename[100];
+
+  snprintf(filename, sizeof(filename), CACHEJOURNALFMT, n);
+  if (!(cachejournal=fopen(filename, "ab"))) {
+    Error("proxyscan",ERR_ERROR,"Unable to open %s for writing!", filename);
+    return;
+  }
+
+  journalcur=n;
+}
+
+static int writecacherecords(FILE *fp, patricia_node_t *node, cachehost *chp) {
+  struct cacherecord rec;
+  foundproxy *fpp;
+  int written=0;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.ip=node->prefix->sin;
+  rec.bits=node->prefix->bitlen;
+
+  if (!chp) {
+    rec.flags=CACHEREC_DELETE;
+    return fwrite(&rec, sizeof(rec), 1, fp);
+  }
+
+  rec.glineid=chp->glineid;
+  rec.lastscan=chp->lastscan;
+  rec.lastgline=chp->lastgline;
+
+  fpp=chp->proxies;
+  do {
+    for (rec.nproxies=0;fpp && rec.nproxies<CACHEPROXIES;fpp=fpp->next,rec.nproxies++) {
+      rec.proxies[rec.nproxies].type=fpp->type;
+      rec.proxies[rec.nproxies].port=fpp->port;
+    }
+
+    if (fwrite(&rec, sizeof(rec), 1, fp)!=1)
+      return 0;
+
+    written++;
+    rec.flags=CACHEREC_MORE;
+  } while (fpp);
+
+  return written;
+}
+
+/*
+ * journalcachehost:
+ *  Records the current state of a cached host, or its removal if chp is NULL.
+ */
+
+void journalcachehost(patricia_node_t *node, cachehost *chp) {
+  if (!cachejournal)
+    return;
+
+  journalrecords+=writecacherecords(cachejournal, node, chp);
+}
+
+/*
+ * expirecachehosts:
+ *  Looks at the next CACHESWEEPSTEP cached hosts and drops the expired
+ *  ones, so the whole cache is never walked in one go.  Nothing is
+ *  journalled: expired records are skipped on load and compaction anyway.
+ */
+
+static void expirecachehosts(time_t now) {
+  cachehost *chp;
+  patricia_node_t *node;
+  int i;
+
+  if (!sweepcursor)
+    sweepcursor=cachehosts;
+
+  for (i=0;sweepcursor && i<CACHESWEEPSTEP;i++) {
+    chp=sweepcursor;
+    sweepcursor=chp->next;
+
+    if (cachehostexpired(chp, now)) {
+      node=chp->node;
+      node->exts[ps_cache_ext] = NULL;
+      delcachehost(chp);
+      derefnode(iptree,node);
+    }
+  }
+}
+
+/* runs in the child, everything here is a private copy */
+static int writecachefile(unsigned int journal, time_t now) {
+  struct cachefileheader hdr;
   cachehost *chp;
+  patricia_node_t *node;
+  FILE *fp;
+  int ok=1;
+
+  if ((fp=fopen(CACHETMPFILE,"wb"))==NULL)
+    return 0;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic=CACHEMAGIC;
+  hdr.version=CACHEVERSION;
+  hdr.journal=journal;
+
+  /* count is filled in once we're done */
+  if (fwrite(&hdr, sizeof(hdr), 1, fp)!=1)
+    ok=0;
+
+  PATRICIA_WALK (iptree->head, node) {
+    if (ok && (chp=node->exts[ps_cache_ext]) && !cachehostexpired(chp, now)) {
+      int n=writecacherecords(fp, node, chp);
+      if (!n)
+        ok=0;
+      hdr.count+=n;
+    }
+  } PATRICIA_WALK_END;
+
+  if (ok && (fseek(fp, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, fp)!=1))
+    ok=0;
+
+  if (fflush(fp) || fsync(fileno(fp)))
+    ok=0;
+
+  if (fclose(fp))
+    ok=0;
+
+  if (!ok || rename(CACHETMPFILE, CACHEFILE)) {
+    unlink(CACHETMPFILE);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void reapcompaction(int block) {
+  char filename[100];
+  int status;
+  pid_t pid;
+
+  if (!compactpid)
+    return;
+
+  pid=waitpid(compactpid, &status, block?0:WNOHANG);
+  if (pid==0)
+    return;
+
+  compactpid=0;
+
+  if (pid<0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    /* journals are still around, we'll try again next time */
+    Error("proxyscan",ERR_ERROR,"Error writing cache file, keeping journals.");
+    return;
+  }
+
+  for (;journalfirst<compactjournal;journalfirst++) {
+    snprintf(filename, sizeof(filename), CACHEJOURNALFMT, journalfirst);
+    unlink(filename);
+  }
+
+  Error("proxyscan",ERR_INFO,"Cache file written, up to date with journal %u.", compactjournal);
+}
+
+/*
+ * dumpcachehosts:
+ *  Starts writing out a new cache file in the background, the child leaves
+ *  out expired hosts.  Anything changed after this point goes in a new
+ *  journal.
+ */
+
+void dumpcachehosts(void *arg) {
   time_t now=time(NULL);
-  foundproxy *fpp;
+  pid_t pid;
+
+  reapcompaction(0);
+  if (compactpid)
+    return;
+
+  if (cachejournal) {
+    fclose(cachejournal);
+    cachejournal=NULL;
+  }
+
+  openjournal(journalcur+1);
+
+  logbuf_flushall();
+  pid=fork();
+  if (pid<0) {
+    Error("proxyscan",ERR_ERROR,"Unable to fork to write cache file!");
+    return;
+  }
+
+  if (pid==0) {
+    logbuf_unbuffered();
+    _exit(writecachefile(journalcur, now)?0:1);
+  }
+
+  compactpid=pid;
+  compactjournal=journalcur;
+  journalrecords=0;
+  basecount=cachehostcount;
+}
+
+void flushcachejournal(void *arg) {
+  reapcompaction(0);
+  expirecachehosts(time(NULL));
+
+  if (cachejournal)
+    fflush(cachejournal);
+
+  if (journalrecords>CACHEJOURNALMAX && journalrecords>basecount)
+    dumpcachehosts(NULL);
+}
+
+void closecachehosts() {
+  if (cachejournal) {
+    fclose(cachejournal);
+    cachejournal=NULL;
+  }
+
+  reapcompaction(1);
+}
+
+static void applycacherecord(struct cacherecord *rec, time_t now) {
   patricia_node_t *node;
+  cachehost *chp;
+  foundproxy *fpp;
+  int i;
+
+  if (rec->bits>128)
+    return;
 
-  if ((fp=fopen("data/cleanhosts","w"))==NULL) {
-    Error("proxyscan",ERR_ERROR,"Unable to open cleanhosts file for writing!");
+  if (rec->flags & CACHEREC_DELETE) {
+    if ((node=patricia_search_exact(iptree, &rec->ip, rec->bits)) && (chp=node->exts[ps_cache_ext])) {
+      node->exts[ps_cache_ext]=NULL;
+      delcachehost(chp);
+      derefnode(iptree,node);
+    }
     return;
   }
 
-  PATRICIA_WALK_CLEAR (iptree->head, node) {
-    if (node->exts[ps_cache_ext] ) {
-      chp = (cachehost *) node->exts[ps_cache_ext];
-      if (chp) { 
-        if (chp->proxies) {
-          if (chp->lastscan < (now-dirtyscaninterval)) {
-            derefnode(iptree,node); 
-	    delcachehost(chp);
-  	    node->exts[ps_cache_ext] = NULL;
-          } else
-        
-          for (fpp=chp->proxies;fpp;fpp=fpp->next) 
-            fprintf(fp, "%s %lu %u %i %u %lu\n",IPtostr(node->prefix->sin),chp->lastscan,chp->glineid,fpp->type,fpp->port,chp->lastgline);
-        } else {
-          if (chp->lastscan < (now-cleanscaninterval)) {
-            /* Needs rescan anyway, so delete it */
-	    derefnode(iptree,node); 
-	    delcachehost(chp);
-            node->exts[ps_cache_ext] = NULL;          
-          } else
-          fprintf(fp,"%s %lu\n",IPtostr(node->prefix->sin),chp->lastscan);
-        }
-      }
+  if (rec->flags & CACHEREC_MORE) {
+    node=patricia_search_exact(iptree, &rec->ip, rec->bits);
+    chp=node?node->exts[ps_cache_ext]:NULL;
+  } else {
+    if (!(node=refnode(iptree, &rec->ip, rec->bits)))
+      return;
+
+    /* a later record replaces what we had, we keep our reference for the new one */
+    if ((chp=node->exts[ps_cache_ext])) {
+      node->exts[ps_cache_ext]=NULL;
+      delcachehost(chp);
+      derefnode(iptree,node);
+    }
+
+    if (rec->lastscan < (now-(rec->nproxies ? dirtyscaninterval : cleanscaninterval))) {
+      derefnode(iptree,node);
+      return;
     }
-  } PATRICIA_WALK_CLEAR_END;
 
-//  patricia_tidy_tree(iptree); 
+    chp=addcleanhost(node, rec->lastscan);
+    chp->glineid=rec->glineid;
+    chp->lastgline=rec->lastgline;
+  }
 
-  fclose(fp);
+  if (!chp)
+    return;
+
+  for (i=0;i<rec->nproxies && i<CACHEPROXIES;i++) {
+    fpp=getfoundproxy();
+    fpp->type=rec->proxies[i].type;
+    fpp->port=rec->proxies[i].port;
+    fpp->next=chp->proxies;
+    chp->proxies=fpp;
+  }
+}
+
+/* returns the number of records applied, -1 if the file can't be used */
+static long loadcachefile(const char *filename, size_t offset, struct cachefileheader *hdr, time_t now) {
+  struct stat st;
+  struct cacherecord *recs;
+  char *map;
+  size_t i, count;
+  int fd;
+
+  if ((fd=open(filename, O_RDONLY))<0)
+    return -1;
+
+  if (fstat(fd, &st) || st.st_size<offset) {
+    close(fd);
+    return -1;
+  }
+
+  /* nothing journalled yet */
+  if (st.st_size==0) {
+    close(fd);
+    return 0;
+  }
+
+  map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map==MAP_FAILED)
+    return -1;
+
+  if (hdr) {
+    memcpy(hdr, map, sizeof(*hdr));
+    if (hdr->magic!=CACHEMAGIC || hdr->version!=CACHEVERSION) {
+      munmap(map, st.st_size);
+      return -1;
+    }
+  }
+
+  /* a partial record at the end of a journal is just a write we didn't finish */
+  count=(st.st_size-offset)/sizeof(struct cacherecord);
+  if (hdr && hdr->count<count)
+    count=hdr->count;
+
+  recs=(struct cacherecord *)(map+offset);
+  for (i=0;i<count;i++)
+    applycacherecord(&recs[i], now);
+
+  munmap(map, st.st_size);
+
+  return count;
 }
 
 /*
- * loadcleanhosts:
- *  Loads clean hosts in from database. 
+ * loadlegacycachehosts:
+ *  Loads the old text format cache, only used if there's no binary one yet.
  */
 
-void loadcachehosts() {
+static int loadlegacycachehosts() {
   FILE *fp;
   unsigned long timestamp,glineid,ptype,pport,lastgline;
   char buf[512];
@@ -130,11 +513,8 @@ void loadcachehosts() {
   patricia_node_t *node;
   int i=0;
 
-  if ((fp=fopen("data/cleanhosts","r"))==NULL) {
-    Error("proxyscan",ERR_ERROR,"Unable to open cleanhosts file for reading!");
-    return;
-  }
-
+  if ((fp=fopen(LEGACYCACHEFILE,"r"))==NULL)
+    return 0;
 
   while (!feof(fp)) {
     fgets(buf,512,fp);
@@ -152,9 +532,13 @@ void loadcachehosts() {
     } else {
       node = refnode(iptree, &sin, bits);
       if( node ) {
-        i++;
-        chp=addcleanhost(timestamp);
-        node->exts[ps_cache_ext] = chp;
+        /* dirty hosts have one line per proxy */
+        if ((chp=node->exts[ps_cache_ext])) {
+          derefnode(iptree,node);
+        } else {
+          i++;
+          chp=addcleanhost(node, timestamp);
+        }
       
         if (res==6) {
           chp->glineid=glineid;
@@ -171,7 +555,86 @@ void loadcachehosts() {
 
   fclose(fp);
  
-  Error("proxyscan",ERR_INFO, "Loaded %d entries from cache", i); 
+  Error("proxyscan",ERR_INFO, "Loaded %d entries from legacy cache", i); 
+
+  return 1;
+}
+
+/*
+ * loadcachehosts:
+ *  Loads the cache file and replays any journals written since.
+ */
+
+/*
+ * findjournals:
+ *  Gets the lowest and highest journal numbers on disk, returns 0 if there
+ *  aren't any.
+ */
+
+static int findjournals(unsigned int *first, unsigned int *last) {
+  DIR *dp;
+  struct dirent *de;
+  unsigned int n;
+  char c;
+  int found=0;
+
+  if (!(dp=opendir(CACHEDIR)))
+    return 0;
+
+  while ((de=readdir(dp))) {
+    if (sscanf(de->d_name, CACHEJOURNALNAME "%u%c", &n, &c)!=1)
+      continue;
+
+    if (!found || n<*first)
+      *first=n;
+    if (!found || n>*last)
+      *last=n;
+    found=1;
+  }
+
+  closedir(dp);
+
+  return found;
+}
+
+void loadcachehosts() {
+  struct cachefileheader hdr;
+  char filename[100];
+  time_t now=time(NULL);
+  long res, journalled=0;
+  unsigned int n, first, last;
+  int havejournals;
+
+  havejournals=findjournals(&first, &last);
+
+  res=loadcachefile(CACHEFILE, sizeof(hdr), &hdr, now);
+  if (res<0) {
+    memset(&hdr, 0, sizeof(hdr));
+    if (!loadlegacycachehosts())
+      Error("proxyscan",ERR_ERROR,"Unable to open cache file for reading!");
+
+    /* without a base file every journal we still have is needed */
+    if (havejournals)
+      hdr.journal=first;
+  } else {
+    basecount=res;
+  }
+
+  /* journals older than the base file aren't replayed, only deleted after the next compaction */
+  journalfirst=(havejournals && first<hdr.journal)?first:hdr.journal;
+  journalcur=(havejournals && last>hdr.journal)?last:hdr.journal;
+
+  for (n=hdr.journal;n<=journalcur;n++) {
+    snprintf(filename, sizeof(filename), CACHEJOURNALFMT, n);
+    if ((res=loadcachefile(filename, 0, NULL, now))>0)
+      journalled+=res;
+  }
+
+  journalrecords=journalled;
+  compactpid=0;
+  openjournal(journalcur);
+
+  Error("proxyscan",ERR_INFO, "Loaded %lu entries from cache, %ld from journals", basecount, journalled); 
 }
 
 /*
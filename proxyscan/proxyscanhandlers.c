@@ -12,8 +12,6 @@ void proxyscan_newnick(int hooknum, void *arg) {
   extrascan *esp, *espp;
   char reason[200];
 
-  int i;
-
   /* Skip 127.* and 0.* hosts */
   if (irc_in_addr_is_loopback(&np->ipaddress))
     return;
@@ -59,17 +57,9 @@ void proxyscan_newnick(int hooknum, void *arg) {
     if (time(NULL) < (chp->lastscan + 1800))
       return;
 
-    /* Queue up all the normal scans - on the normal queue */
-    for (i=0;i<numscans;i++) {
-      /* If this port is open DON'T queue the scan - we'll start it later in the CHECK class */
-      for (fpp=chp->proxies;fpp;fpp=fpp->next) {
-        if (fpp->type == thescans[i].type && fpp->port == thescans[i].port)
-          break;
-      
-      if (!fpp)
-        queuescan(np->ipnode, thescans[i].type, thescans[i].port, SCLASS_NORMAL, 0);
-      }
-    }
+    /* Queue up all the normal scans - on the normal queue.
+     * If this port is open DON'T queue the scan - we'll start it later in the CHECK class */
+    queuenormalscans(np->ipnode, 0, chp->proxies);
 
     /* We want these scans to start around now, so we put them at the front of the priority queue */
     for (fpp=chp->proxies;fpp;fpp=nfpp) {
@@ -85,13 +75,13 @@ void proxyscan_newnick(int hooknum, void *arg) {
     chp->lastscan=time(NULL);
     chp->proxies=NULL;
     chp->glineid=0;
+    journalcachehost(np->ipnode, chp);
   } else {
-    chp=addcleanhost(time(NULL));
-    np->ipnode->exts[ps_cache_ext] = chp;
+    chp=addcleanhost(np->ipnode, time(NULL));
     patricia_ref_prefix(np->ipnode->prefix);
+    journalcachehost(np->ipnode, chp);
 
     /* Queue up all the normal scans - on the normal queue */
-    for (i=0;i<numscans;i++)
-      queuescan(np->ipnode, thescans[i].type, thescans[i].port, SCLASS_NORMAL, 0);
+    queuenormalscans(np->ipnode, 0, NULL);
   }
 }
@@ -6,21 +6,328 @@
 #include "proxyscan.h"
 #include "../irc/irc.h"
 #include "../core/error.h"
+#include "../core/schedule.h"
+#include "../core/nsmalloc.h"
 #include <assert.h>
+#include <string.h>
 
-pendingscan *ps_normalqueue=NULL;
-pendingscan *ps_prioqueue=NULL;
-pendingscan *ps_normalqueueend=NULL;
+/*
+ * Normal scans are queued per /24 (or /48) bucket and the buckets are served
+ * round robin, so one prefix full of clones can't hold everyone else up.
+ * Timed scans live on a binary heap ordered by when they're due.  Any scan
+ * already queued for the same node, type and port is dropped.  Background
+ * scans only run when there's nothing else to do.
+ */
+
+static scanbucket *buckethash[PSCAN_BUCKETHASHSIZE];
+static scanbucket *bucketring; /* last bucket in the ring, ->next is the one to serve */
+
+static pendingscan *queuehash[PSCAN_QUEUEHASHSIZE];
+
+static pendingscan **timedheap;
+static unsigned int timedheapsize;
+
+static pendingscan *backgroundqueue, *backgroundqueueend;
 
 unsigned int normalqueuedscans=0;
 unsigned int prioqueuedscans=0;
+unsigned int backgroundqueuedscans=0;
+unsigned int queuedbyclass[SCLASS_MAX+1];
+
+unsigned long droppedscans=0;
+unsigned long agedscans=0;
+unsigned long backgrounddropped=0;
+unsigned long cancelledscans=0;
 
 unsigned long countpendingscan=0;
 
+/* wait times, bucket n counts waits of less than 2^n ms */
+#define QUEUEWAITBUCKETS 24
+static unsigned long queuewaits[QUEUEWAITBUCKETS];
+
+/* current concurrency limit, moves between PSCAN_AIMD_MINSCANS and maxscans */
+int scanlimit;
+int timeoutthreshold;
+unsigned int aimdsamples, aimdtimeouts, aimdlastrate;
+
+static int kickpending;
+
+static unsigned int queuehashval(patricia_node_t *node, short type, unsigned short port) {
+  uintptr_t h=(uintptr_t)node;
+
+  h^=(h>>13);
+  h+=(type*31)+(port*131);
+
+  return (h^(h>>7))&(PSCAN_QUEUEHASHSIZE-1);
+}
+
+static void bucketprefix(patricia_node_t *node, struct irc_in_addr *prefix) {
+  int i;
+
+  *prefix=node->prefix->sin;
+
+  /* keep the first 120 bits (a /24) of an IPv4 address, 48 bits of an IPv6 one */
+  if (irc_in_addr_is_ipv4(prefix)) {
+    prefix->in6_16[7]&=htons(0xff00);
+    return;
+  }
+
+  for (i=3;i<8;i++)
+    prefix->in6_16[i]=0;
+}
+
+static unsigned int buckethashval(struct irc_in_addr *prefix) {
+  unsigned int h=0;
+  int i;
+
+  for (i=0;i<8;i++)
+    h=(h*33)^prefix->in6_16[i];
+
+  return (h^(h>>14))&(PSCAN_BUCKETHASHSIZE-1);
+}
+
+static pendingscan *findqueuedscan(patricia_node_t *node, short type, unsigned short port) {
+  pendingscan *psp;
+
+  for (psp=queuehash[queuehashval(node, type, port)];psp;psp=psp->hashnext)
+    if (psp->node==node && psp->type==type && psp->port==port)
+      return psp;
+
+  return NULL;
+}
+
+static void unhashqueuedscan(pendingscan *psp) {
+  pendingscan **pp;
+
+  for (pp=&queuehash[queuehashval(psp->node, psp->type, psp->port)];*pp;pp=&((*pp)->hashnext)) {
+    if (*pp==psp) {
+      *pp=psp->hashnext;
+      return;
+    }
+  }
+}
+
+static void addnormalscan(pendingscan *psp) {
+  struct irc_in_addr prefix;
+  scanbucket *sbp;
+  unsigned int h;
+
+  bucketprefix(psp->node, &prefix);
+  h=buckethashval(&prefix);
+
+  for (sbp=buckethash[h];sbp;sbp=sbp->hashnext)
+    if (!memcmp(&sbp->prefix, &prefix, sizeof(prefix)))
+      break;
+
+  if (!sbp) {
+    if (!(sbp=nsmalloc(POOL_PROXYSCAN, sizeof(scanbucket))))
+      Error("proxyscan",ERR_STOP,"Unable to allocate memory");
+
+    sbp->prefix=prefix;
+    sbp->head=sbp->tail=NULL;
+    sbp->hashnext=buckethash[h];
+    buckethash[h]=sbp;
+
+    /* new buckets go to the back of the ring */
+    if (bucketring) {
+      sbp->next=bucketring->next;
+      bucketring->next=sbp;
+    } else {
+      sbp->next=sbp;
+    }
+    bucketring=sbp;
+  }
+
+  if (sbp->tail)
+    sbp->tail->next=psp;
+  else
+    sbp->head=psp;
+
+  sbp->tail=psp;
+  normalqueuedscans++;
+}
+
+static pendingscan *nextnormalscan() {
+  if (!bucketring)
+    return NULL;
+
+  return bucketring->next->head;
+}
+
+static pendingscan *takenormalscan() {
+  scanbucket *sbp, **sbh;
+  pendingscan *psp;
+
+  if (!bucketring)
+    return NULL;
+
+  sbp=bucketring->next;
+  psp=sbp->head;
+  sbp->head=psp->next;
+  normalqueuedscans--;
+
+  if (sbp->head) {
+    /* this bucket has had its turn */
+    bucketring=sbp;
+    return psp;
+  }
+
+  /* empty bucket, take it out of the ring and the hash */
+  if (sbp==bucketring)
+    bucketring=NULL;
+  else
+    bucketring->next=sbp->next;
+
+  for (sbh=&buckethash[buckethashval(&sbp->prefix)];*sbh;sbh=&((*sbh)->hashnext)) {
+    if (*sbh==sbp) {
+      *sbh=sbp->hashnext;
+      break;
+    }
+  }
+
+  nsfree(POOL_PROXYSCAN, sbp);
+
+  return psp;
+}
+
+static pendingscan *takebackgroundscan() {
+  pendingscan *psp;
+
+  if (!(psp=backgroundqueue))
+    return NULL;
+
+  if (!(backgroundqueue=psp->next))
+    backgroundqueueend=NULL;
+
+  backgroundqueuedscans--;
+
+  return psp;
+}
+
+/* forgets a background scan that was taken off the queue without being run */
+static void dropbackgroundscan(pendingscan *psp) {
+  countpendingscan--;
+
+  if (!psp->cancelled) {
+    unhashqueuedscan(psp);
+    queuedbyclass[psp->class]--;
+    backgrounddropped++;
+  }
+
+  derefnode(iptree,psp->node);
+  freependingscan(psp);
+}
+
+static void addbackgroundscan(pendingscan *psp) {
+  if (backgroundqueueend)
+    backgroundqueueend->next=psp;
+  else
+    backgroundqueue=psp;
+
+  backgroundqueueend=psp;
+  backgroundqueuedscans++;
+
+  /* it only drains when everything else is idle, don't let it grow forever */
+  while (backgroundqueuedscans>PSCAN_BACKGROUNDMAX)
+    dropbackgroundscan(takebackgroundscan());
+}
+
+static void addtimedscan(pendingscan *psp) {
+  pendingscan **newheap;
+  unsigned int i, parent;
+
+  if (prioqueuedscans>=timedheapsize) {
+    unsigned int newsize=timedheapsize?timedheapsize*2:1024;
+
+    if (!(newheap=nsrealloc(POOL_PROXYSCAN, timedheap, newsize*sizeof(pendingscan *))))
+      Error("proxyscan",ERR_STOP,"Unable to allocate memory");
+
+    timedheap=newheap;
+    timedheapsize=newsize;
+  }
+
+  for (i=prioqueuedscans++;i>0;i=parent) {
+    parent=(i-1)/2;
+    if (timedheap[parent]->when<=psp->when)
+      break;
+    timedheap[i]=timedheap[parent];
+  }
+
+  timedheap[i]=psp;
+}
+
+static pendingscan *taketimedscan() {
+  pendingscan *psp, *last;
+  unsigned int i, child;
+
+  if (!prioqueuedscans)
+    return NULL;
+
+  psp=timedheap[0];
+  last=timedheap[--prioqueuedscans];
+
+  for (i=0;(child=i*2+1)<prioqueuedscans;i=child) {
+    if (child+1<prioqueuedscans && timedheap[child+1]->when<timedheap[child]->when)
+      child++;
+    if (last->when<=timedheap[child]->when)
+      break;
+    timedheap[i]=timedheap[child];
+  }
+
+  timedheap[i]=last;
+
+  return psp;
+}
+
+static void recordqueuewait(pendingscan *psp) {
+  struct timeval now;
+  long waitms;
+  int i;
+
+  gettimeofday(&now,NULL);
+
+  /* timed scans only count from when they were due */
+  if (psp->when>psp->queued.tv_sec)
+    waitms=(now.tv_sec-psp->when)*1000;
+  else
+    waitms=(now.tv_sec-psp->queued.tv_sec)*1000+(now.tv_usec-psp->queued.tv_usec)/1000;
+
+  for (i=0;i<QUEUEWAITBUCKETS-1 && waitms>=(1L<<i);i++)
+    ;
+
+  queuewaits[i]++;
+}
+
+/*
+ * queuewaitpercentile:
+ *  Upper bound in ms on the queue wait of the given percentage of scans.
+ */
+
+unsigned long queuewaitpercentile(int pct) {
+  unsigned long total=0, seen=0;
+  int i;
+
+  for (i=0;i<QUEUEWAITBUCKETS;i++)
+    total+=queuewaits[i];
+
+  if (!total)
+    return 0;
+
+  for (i=0;i<QUEUEWAITBUCKETS;i++) {
+    seen+=queuewaits[i];
+    if (seen*100>=total*pct)
+      break;
+  }
+
+  return 1UL<<i;
+}
+
 void queuescan(patricia_node_t *node, short scantype, unsigned short port, char class, time_t when) {
-  pendingscan *psp, *psp2;
+  pendingscan *psp;
+  unsigned int h;
 
-  /* we can just blindly queue the scans as node extension cleanhost cache blocks duplicate scans normally.
+  /* the cleanhost cache normally blocks duplicates, but lots of clones connecting before
+   * the first scan has started would all queue the same scans again.
    * Scans may come from:
    * a) scan <node> (from an oper)
    * b) newnick handler - which ignores clean hosts, only scans new hosts or dirty hosts
@@ -29,17 +336,17 @@ void queuescan(patricia_node_t *node, short scantype, unsigned short port, char
 
   /* we should never have an internal node */
   assert(node->prefix);
-  /* reference the node - we either start a or queue a single scan */
-  patricia_ref_prefix(node->prefix);
-  
-  /* If there are scans spare, just start it immediately.. 
-   * provided we're not supposed to wait */
-  if (activescans < maxscans && when<=time(NULL) && ps_ready) {
-    startscan(node, scantype, port, class);
+
+  if (findqueuedscan(node, scantype, port)) {
+    droppedscans++;
     return;
   }
 
-  /* We have to queue it */
+  /* reference the node - we either start a or queue a single scan */
+  patricia_ref_prefix(node->prefix);
+  
+  /* Everything goes through the queue, connects are issued in batches
+   * once per pass of the event loop */
   if (!(psp=getpendingscan()))
     Error("proxyscan",ERR_STOP,"Unable to allocate memory");
 
@@ -51,58 +358,150 @@ void queuescan(patricia_node_t *node, short scantype, unsigned short port, char
   psp->class=class;
   psp->when=when;
   psp->next=NULL;
+  psp->cancelled=0;
+  gettimeofday(&psp->queued,NULL);
 
-  if (!when) {
-    /* normal queue */
-    normalqueuedscans++;
-    if (ps_normalqueueend) {
-      ps_normalqueueend->next=psp;
-      ps_normalqueueend=psp;
-    } else {
-      ps_normalqueueend=ps_normalqueue=psp;
-    }
-  } else {
-    prioqueuedscans++;
-    if (!ps_prioqueue || ps_prioqueue->when > when) {
-      psp->next=ps_prioqueue;
-      ps_prioqueue=psp;
-    } else {
-      for (psp2=ps_prioqueue; ;psp2=psp2->next) {
-	if (!psp2->next || psp2->next->when > when) {
-	  psp->next = psp2->next;
-	  psp2->next = psp;
-	  break;
-	}
-      }
-    }
+  h=queuehashval(node, scantype, port);
+  psp->hashnext=queuehash[h];
+  queuehash[h]=psp;
+
+  if (class>=0 && class<=SCLASS_MAX)
+    queuedbyclass[(int)class]++;
+
+  if (class==SCLASS_BACKGROUND)
+    addbackgroundscan(psp);
+  else if (!when)
+    addnormalscan(psp);
+  else
+    addtimedscan(psp);
+
+  if (when<=time(NULL))
+    kickscans();
+}
+
+static void kickscanscallback(void *arg) {
+  kickpending=0;
+  startqueuedscans();
+}
+
+void kickscans() {
+  if (kickpending || !ps_ready)
+    return;
+
+  kickpending=1;
+  scheduleoneshot(time(NULL),&kickscanscallback,NULL);
+}
+
+void cancelkickscans() {
+  if (kickpending)
+    deleteschedule(NULL,&kickscanscallback,NULL);
+
+  kickpending=0;
+}
+
+void adjustscanlimit() {
+  int floor=(maxscans<PSCAN_AIMD_MINSCANS)?maxscans:PSCAN_AIMD_MINSCANS;
+
+  if (scanlimit>maxscans)
+    scanlimit=maxscans;
+
+  if (aimdsamples<PSCAN_AIMD_MINSAMPLES)
+    return;
+
+  aimdlastrate=(aimdtimeouts*100)/aimdsamples;
+
+  if (aimdlastrate>timeoutthreshold) {
+    /* probably saturating our own link or a firewall along the way, back off */
+    scanlimit=(scanlimit*3)/4;
+    if (scanlimit<floor)
+      scanlimit=floor;
+  } else if (activescans>=scanlimit || normalqueuedscans) {
+    /* only grow while we're actually using the slots we've got */
+    scanlimit+=PSCAN_AIMD_INCREASE;
+    if (scanlimit>maxscans)
+      scanlimit=maxscans;
   }
+
+  aimdsamples=aimdtimeouts=0;
 }
 
 void startqueuedscans() {
-  pendingscan *psp=NULL;
-
-  while (activescans < maxscans) {
-    if (ps_prioqueue && (ps_prioqueue->when <= time(NULL))) {
-      psp=ps_prioqueue;
-      ps_prioqueue=psp->next;
-      prioqueuedscans--;
-    } else if (ps_normalqueue) {
-      psp=ps_normalqueue;
-      ps_normalqueue=psp->next;
-      if (!ps_normalqueue)
-	ps_normalqueueend=NULL;
-      normalqueuedscans--;
+  pendingscan *psp, *npsp;
+  time_t now=time(NULL);
+  int started=0;
+
+  if (!ps_ready)
+    return;
+
+  while (activescans < scanlimit) {
+    if (started>=PSCAN_CONNECTBATCH) {
+      /* give the rest of the event loop a go, pick up where we left off next time */
+      kickscans();
+      break;
     }
-    
-    if (psp) {
-      startscan(psp->node, psp->type, psp->port, psp->class);
-      freependingscan(psp);
-      countpendingscan--;
-      psp=NULL;
+
+    npsp=nextnormalscan();
+    if (prioqueuedscans && (timedheap[0]->when <= now) &&
+        !(npsp && npsp->queued.tv_sec+PSCAN_QUEUEAGE <= now)) {
+      psp=taketimedscan();
+    } else if (npsp) {
+      if (prioqueuedscans && (timedheap[0]->when <= now))
+        agedscans++;
+      psp=takenormalscan();
+    } else if (backgroundqueue) {
+      psp=takebackgroundscan();
+
+      /* the host has probably been and gone by now */
+      if (psp->queued.tv_sec+PSCAN_BACKGROUNDAGE<=now) {
+        dropbackgroundscan(psp);
+        continue;
+      }
     } else {
       break;
     }
+
+    countpendingscan--;
+
+    if (psp->cancelled) {
+      /* already out of the hash and counts, just drop the reference from queuescan */
+      derefnode(iptree,psp->node);
+      freependingscan(psp);
+      continue;
+    }
+
+    unhashqueuedscan(psp);
+    recordqueuewait(psp);
+    if (psp->class<=SCLASS_MAX)
+      queuedbyclass[psp->class]--;
+
+    startscan(psp->node, psp->type, psp->port, psp->class);
+    freependingscan(psp);
+    started++;
+  }
+}
+
+/*
+ * cancelqueuedscans:
+ *  Once a host is known to be a proxy there's no point trying the rest of
+ *  the scan types on it.  The scans are skipped when they reach the front
+ *  of their queue.
+ */
+
+void cancelqueuedscans(patricia_node_t *node) {
+  pendingscan *psp;
+  int i;
+
+  for (i=0;i<numscans;i++) {
+    if (!(psp=findqueuedscan(node, thescans[i].type, thescans[i].port)))
+      continue;
+
+    /* rescans of earlier results aren't affected */
+    if (psp->class!=SCLASS_NORMAL && psp->class!=SCLASS_BACKGROUND)
+      continue;
+
+    unhashqueuedscan(psp);
+    queuedbyclass[psp->class]--;
+    psp->cancelled=1;
+    cancelledscans++;
   }
 }
-    
-    
@@ -0,0 +1,620 @@
+/*
+ * fakeproxy: a set of fake proxies for testing proxyscan's scan engine.
+ *
+ * Every <mode>:<address> given listens on the ports proxyscan probes by
+ * default for each type it knows about:
+ *   23    wingate and cisco
+ *   1080  socks4 and socks5 (told apart by the version byte)
+ *   3128  http CONNECT and the router GET
+ *   8080  http CONNECT
+ *
+ * The modes are:
+ *   open    speaks the protocol and relays to whatever it's asked for, so
+ *           proxyscan's magic string comes back and it should find every
+ *           type (the router answers as a Mikrotik proxy)
+ *   refuse  speaks the protocol but turns every request down
+ *   silent  accepts and never says anything, for the timeout path
+ *   close   closes each connection as soon as it's accepted
+ *
+ * proxyscan won't scan loopback, so give the addresses to an interface:
+ *   ip addr add 10.99.0.1/32 dev lo   (and .2, .3, .4)
+ *   fakeproxy open:10.99.0.1 refuse:10.99.0.2 silent:10.99.0.3 close:10.99.0.4
+ * then "scan 10.99.0.1" and so on to proxyscan.  Each probe is logged here
+ * with what happened to it.  Afterwards "status" should show opens for
+ * socks4, socks5, http, wingate, cisco and router against the open address
+ * only, and timeouts for the silent one once the scan timeout has passed.
+ *
+ * Port 23 needs root (or CAP_NET_BIND_SERVICE), ports that can't be bound
+ * are skipped with a warning.
+ *
+ * Build with: make -C proxyscan utils/fakeproxy
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAXLISTENERS   64
+#define LINELEN        512
+#define HEADERLEN      4096
+#define CHILDTIMEOUT   60
+
+#define MODE_OPEN      0
+#define MODE_REFUSE    1
+#define MODE_SILENT    2
+#define MODE_CLOSE     3
+
+#define KIND_TELNET    0
+#define KIND_SOCKS     1
+#define KIND_HTTP      2
+
+static const char *modenames[] = { "open", "refuse", "silent", "close", NULL };
+
+static const struct {
+  int port, kind;
+} ports[] = {
+  { 23, KIND_TELNET },
+  { 1080, KIND_SOCKS },
+  { 3128, KIND_HTTP },
+  { 8080, KIND_HTTP },
+};
+
+typedef struct listener {
+  int fd, mode, kind, port;
+  char address[64];
+} listener;
+
+static listener listeners[MAXLISTENERS];
+static int nlisteners;
+
+/* what the current child is serving, for log lines */
+static const listener *current;
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s <mode>:<address> [<mode>:<address> ...]\n", name);
+  fprintf(stderr, "  mode is one of open, refuse, silent or close\n");
+  exit(1);
+}
+
+static void logprobe(const char *fmt, ...) {
+  va_list ap;
+
+  printf("[%d] %s %s:%d: ", (int)getpid(), modenames[current->mode], current->address, current->port);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+}
+
+static int openlistener(const char *address, int port) {
+  struct addrinfo hints, *res;
+  char portbuf[16];
+  int s, one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+
+  snprintf(portbuf, sizeof(portbuf), "%d", port);
+  if(getaddrinfo(address, portbuf, &hints, &res)) {
+    fprintf(stderr, "bad address %s\n", address);
+    exit(1);
+  }
+
+  s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if(s < 0) {
+    freeaddrinfo(res);
+    return -1;
+  }
+
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if(bind(s, res->ai_addr, res->ai_addrlen) || listen(s, 128)) {
+    fprintf(stderr, "unable to listen on %s:%d: %s, skipping\n", address, port, strerror(errno));
+    close(s);
+    s = -1;
+  }
+
+  freeaddrinfo(res);
+  return s;
+}
+
+static int doconnect(const char *host, const char *port) {
+  struct addrinfo hints, *res, *ai;
+  int s = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if(getaddrinfo(host, port, &hints, &res))
+    return -1;
+
+  for(ai=res;ai;ai=ai->ai_next) {
+    s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(s < 0)
+      continue;
+
+    if(connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+
+    close(s);
+    s = -1;
+  }
+
+  freeaddrinfo(res);
+  return s;
+}
+
+static int readall(int fd, void *buf, int len) {
+  char *p = buf;
+  int r;
+
+  while(len > 0) {
+    r = read(fd, p, len);
+    if(r < 0 && errno == EINTR)
+      continue;
+    if(r <= 0)
+      return 0;
+
+    p += r;
+    len -= r;
+  }
+
+  return 1;
+}
+
+static int writeall(int fd, const void *buf, int len) {
+  const char *p = buf;
+  int r;
+
+  while(len > 0) {
+    r = write(fd, p, len);
+    if(r < 0 && errno == EINTR)
+      continue;
+    if(r <= 0)
+      return 0;
+
+    p += r;
+    len -= r;
+  }
+
+  return 1;
+}
+
+static int writestr(int fd, const char *s) {
+  return writeall(fd, s, strlen(s));
+}
+
+/* a byte at a time, the rest of the stream belongs to whoever we relay to */
+static char *readline(int fd) {
+  static char line[LINELEN];
+  int len = 0;
+  char c;
+
+  while(readall(fd, &c, 1)) {
+    if(c == '\n') {
+      if(len && line[len-1] == '\r')
+        len--;
+      line[len] = '\0';
+      return line;
+    }
+
+    if(len < LINELEN - 1)
+      line[len++] = c;
+  }
+
+  return NULL;
+}
+
+/* copies both ways until either end closes */
+static void relay(int client, int target, const char *what) {
+  struct pollfd pfd[2];
+  char buf[4096];
+  long back = 0;
+  int r, i;
+
+  pfd[0].fd = client;
+  pfd[1].fd = target;
+  pfd[0].events = pfd[1].events = POLLIN;
+
+  for(;;) {
+    if(poll(pfd, 2, -1) < 0) {
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+
+    for(i=0;i<2;i++) {
+      if(!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+
+      r = read(pfd[i].fd, buf, sizeof(buf));
+      if(r <= 0 || !writeall(pfd[!i].fd, buf, r))
+        goto done;
+
+      if(i == 1)
+        back += r;
+    }
+  }
+
+done:
+  logprobe("%s: relayed, %ld bytes back to the scanner", what, back);
+  close(target);
+}
+
+/* splits "host:port" on the last colon, taking off any [] */
+static int splittarget(char *target, char **host, char **port) {
+  char *p = strrchr(target, ':');
+
+  if(!p || p == target)
+    return 0;
+
+  *p = '\0';
+  *port = p + 1;
+  *host = target;
+
+  if(**host == '[' && p[-1] == ']') {
+    p[-1] = '\0';
+    (*host)++;
+  }
+
+  return 1;
+}
+
+static void dosocks4(int fd) {
+  unsigned char req[7], reply[8];
+  char host[INET_ADDRSTRLEN], port[8], c;
+  int target, i;
+
+  if(!readall(fd, req, 7)) {
+    logprobe("socks4: short request");
+    return;
+  }
+
+  /* user id, NUL terminated */
+  for(i=0;i<256 && readall(fd, &c, 1) && c;i++)
+    ;
+
+  inet_ntop(AF_INET, req + 3, host, sizeof(host));
+  snprintf(port, sizeof(port), "%d", (req[1] << 8) | req[2]);
+
+  memset(reply, 0, sizeof(reply));
+  memcpy(reply + 2, req + 1, 6);
+
+  if(current->mode == MODE_REFUSE || req[0] != 1 || (target = doconnect(host, port)) < 0) {
+    reply[1] = 0x5b;
+    writeall(fd, reply, sizeof(reply));
+    logprobe("socks4: refused %s:%s", host, port);
+    return;
+  }
+
+  reply[1] = 0x5a;
+  writeall(fd, reply, sizeof(reply));
+  logprobe("socks4: connected to %s:%s", host, port);
+  relay(fd, target, "socks4");
+}
+
+static void dosocks5(int fd) {
+  unsigned char buf[256], reply[10] = { 5, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+  char host[INET6_ADDRSTRLEN + 1], port[8];
+  int target, len;
+
+  if(!readall(fd, buf, 1) || !readall(fd, buf + 1, buf[0])) {
+    logprobe("socks5: short greeting");
+    return;
+  }
+
+  if(current->mode == MODE_REFUSE) {
+    writeall(fd, "\005\377", 2);
+    logprobe("socks5: refused authentication");
+    return;
+  }
+
+  writeall(fd, "\005\000", 2);
+
+  if(!readall(fd, buf, 4)) {
+    logprobe("socks5: short request");
+    return;
+  }
+
+  switch(buf[3]) {
+    case 1:
+      if(!readall(fd, buf + 4, 4 + 2))
+        return;
+      inet_ntop(AF_INET, buf + 4, host, sizeof(host));
+      len = 4;
+      break;
+    case 4:
+      if(!readall(fd, buf + 4, 16 + 2))
+        return;
+      inet_ntop(AF_INET6, buf + 4, host, sizeof(host));
+      len = 16;
+      break;
+    case 3:
+      if(!readall(fd, buf + 4, 1) || !readall(fd, buf + 5, buf[4] + 2))
+        return;
+      memcpy(host, buf + 5, buf[4]);
+      host[buf[4]] = '\0';
+      len = buf[4] + 1;
+      break;
+    default:
+      logprobe("socks5: unknown address type %d", buf[3]);
+      return;
+  }
+
+  snprintf(port, sizeof(port), "%d", (buf[4 + len] << 8) | buf[5 + len]);
+
+  if(buf[1] != 1 || (target = doconnect(host, port)) < 0) {
+    reply[1] = 5;
+    writeall(fd, reply, sizeof(reply));
+    logprobe("socks5: unable to connect to %s:%s", host, port);
+    return;
+  }
+
+  writeall(fd, reply, sizeof(reply));
+  logprobe("socks5: connected to %s:%s", host, port);
+  relay(fd, target, "socks5");
+}
+
+static void dohttp(int fd) {
+  char header[HEADERLEN + 1], *end, *target, *host, *port, *sp;
+  int len = 0, r, t;
+
+  /* anything after the header goes on to the target */
+  while(!(end = (len >= 4) ? strstr(header, "\r\n\r\n") : NULL)) {
+    if(len == HEADERLEN) {
+      logprobe("http: header too long");
+      return;
+    }
+
+    r = read(fd, header + len, HEADERLEN - len);
+    if(r <= 0) {
+      logprobe("http: closed before the end of the header");
+      return;
+    }
+
+    len += r;
+    header[len] = '\0';
+  }
+
+  end += 4;
+
+  if(!strncmp(header, "GET ", 4)) {
+    if(current->mode == MODE_OPEN) {
+      writestr(fd, "HTTP/1.0 404 Not Found\r\nServer: Mikrotik HttpProxy\r\nContent-Length: 0\r\n\r\n");
+      logprobe("router: answered as a Mikrotik proxy");
+    } else {
+      writestr(fd, "HTTP/1.0 404 Not Found\r\nServer: fakeproxy\r\nContent-Length: 0\r\n\r\n");
+      logprobe("router: answered as a web server");
+    }
+    return;
+  }
+
+  if(strncmp(header, "CONNECT ", 8)) {
+    writestr(fd, "HTTP/1.0 405 Method Not Allowed\r\n\r\n");
+    logprobe("http: not a CONNECT");
+    return;
+  }
+
+  target = header + 8;
+  if(!(sp = strpbrk(target, " \r")))
+    return;
+  *sp = '\0';
+
+  if(!splittarget(target, &host, &port)) {
+    writestr(fd, "HTTP/1.0 400 Bad Request\r\n\r\n");
+    logprobe("http: bad target %s", target);
+    return;
+  }
+
+  if(current->mode == MODE_REFUSE || (t = doconnect(host, port)) < 0) {
+    writestr(fd, "HTTP/1.0 403 Forbidden\r\n\r\n");
+    logprobe("http: refused %s:%s", host, port);
+    return;
+  }
+
+  writestr(fd, "HTTP/1.0 200 Connection established\r\n\r\n");
+  writeall(t, end, header + len - end);
+  logprobe("http: connected to %s:%s", host, port);
+  relay(fd, t, "http");
+}
+
+static void dotelnet(int fd) {
+  char *line, *host, *port, *p;
+  int target, cisco = 0;
+
+  if(!(line = readline(fd))) {
+    logprobe("telnet: closed without a request");
+    return;
+  }
+
+  if(!strcmp(line, "cisco")) {
+    cisco = 1;
+
+    if(current->mode == MODE_REFUSE) {
+      writestr(fd, "% Bad passwords\r\n");
+      logprobe("cisco: refused login");
+      return;
+    }
+
+    writestr(fd, "router>");
+    if(!(line = readline(fd)) || strncmp(line, "telnet ", 7)) {
+      logprobe("cisco: no telnet command");
+      return;
+    }
+
+    /* "telnet <host> <port>" */
+    host = line + 7;
+    if(!(p = strrchr(host, ' ')))
+      return;
+    *p = '\0';
+    port = p + 1;
+  } else if(!splittarget(line, &host, &port)) {
+    writestr(fd, "Invalid request\r\n");
+    logprobe("wingate: bad target %s", line);
+    return;
+  }
+
+  if(current->mode == MODE_REFUSE || (target = doconnect(host, port)) < 0) {
+    writestr(fd, "Connection refused\r\n");
+    logprobe("%s: refused %s:%s", cisco?"cisco":"wingate", host, port);
+    return;
+  }
+
+  writestr(fd, "Connected\r\n");
+  logprobe("%s: connected to %s:%s", cisco?"cisco":"wingate", host, port);
+  relay(fd, target, cisco?"cisco":"wingate");
+}
+
+static void serve(int fd) {
+  unsigned char version;
+  char buf[512];
+  long got = 0;
+  int r;
+
+  alarm(CHILDTIMEOUT);
+
+  switch(current->mode) {
+    case MODE_CLOSE:
+      logprobe("closed straight away");
+      return;
+
+    case MODE_SILENT:
+      while((r = read(fd, buf, sizeof(buf))) > 0)
+        got += r;
+      logprobe("stayed silent, scanner sent %ld bytes and went away", got);
+      return;
+  }
+
+  switch(current->kind) {
+    case KIND_SOCKS:
+      if(!readall(fd, &version, 1))
+        return;
+      if(version == 4)
+        dosocks4(fd);
+      else if(version == 5)
+        dosocks5(fd);
+      else
+        logprobe("socks: unknown version %d", version);
+      break;
+    case KIND_HTTP:
+      dohttp(fd);
+      break;
+    case KIND_TELNET:
+      dotelnet(fd);
+      break;
+  }
+}
+
+static void addlisteners(char *arg) {
+  char *address = strchr(arg, ':');
+  unsigned int i;
+  int mode, fd;
+
+  if(!address)
+    usage("fakeproxy");
+  *address++ = '\0';
+
+  for(mode=0;modenames[mode];mode++)
+    if(!strcmp(arg, modenames[mode]))
+      break;
+
+  if(!modenames[mode])
+    usage("fakeproxy");
+
+  for(i=0;i<sizeof(ports)/sizeof(ports[0]);i++) {
+    if(nlisteners == MAXLISTENERS) {
+      fprintf(stderr, "too many listeners\n");
+      exit(1);
+    }
+
+    if((fd = openlistener(address, ports[i].port)) < 0)
+      continue;
+
+    listeners[nlisteners].fd = fd;
+    listeners[nlisteners].mode = mode;
+    listeners[nlisteners].kind = ports[i].kind;
+    listeners[nlisteners].port = ports[i].port;
+    snprintf(listeners[nlisteners].address, sizeof(listeners[nlisteners].address), "%s", address);
+    nlisteners++;
+
+    printf("%s proxy listening on %s:%d\n", modenames[mode], address, ports[i].port);
+  }
+}
+
+int main(int argc, char **argv) {
+  struct pollfd pfd[MAXLISTENERS];
+  pid_t pid;
+  int i, fd;
+
+  if(argc < 2)
+    usage(argv[0]);
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  /* children are reaped for us, and a scanner hanging up mustn't kill us */
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  for(i=1;i<argc;i++)
+    addlisteners(argv[i]);
+
+  if(!nlisteners) {
+    fprintf(stderr, "nothing to listen on\n");
+    return 1;
+  }
+
+  for(i=0;i<nlisteners;i++) {
+    pfd[i].fd = listeners[i].fd;
+    pfd[i].events = POLLIN;
+  }
+
+  for(;;) {
+    if(poll(pfd, nlisteners, -1) < 0) {
+      if(errno == EINTR)
+        continue;
+      perror("poll");
+      return 1;
+    }
+
+    for(i=0;i<nlisteners;i++) {
+      if(!(pfd[i].revents & POLLIN))
+        continue;
+
+      if((fd = accept(pfd[i].fd, NULL, NULL)) < 0)
+        continue;
+
+      pid = fork();
+      if(pid == 0) {
+        int j;
+
+        for(j=0;j<nlisteners;j++)
+          close(listeners[j].fd);
+
+        current = &listeners[i];
+        serve(fd);
+        close(fd);
+        _exit(0);
+      }
+
+      if(pid < 0)
+        perror("fork");
+
+      close(fd);
+    }
+  }
+}
@@ -16,6 +16,7 @@
 #include "../server/server.h"
 #include "../lib/strlfunc.h"
 #include "../glines/glines.h"
+#include "../lib/acmatch.h"
 #include <stdint.h>
 
 #define INSTANT_IDENT_GLINE  1
@@ -71,6 +72,13 @@ static int attached = 0, started = 0;
 
 static unsigned int getrgmarker(void);
 
+/* literals that must occur for each regex to match, rebuilt when the list changes */
+static acmatcher *rg_prefilter;
+static int rg_prefilterdirty = 1;
+static unsigned long rg_pf_subjects, rg_pf_run, rg_pf_skipped, rg_pf_hits;
+
+int rg_stats(void *source, int cargc, char **cargv);
+
 #define RESERVED_NICK_CLASS "reservednick"
 /* shadowserver only reports classes[0] */
 static const char *classes[] = { "drone", "proxy", "spam", "other", RESERVED_NICK_CLASS, (char *)0 };
@@ -183,6 +191,7 @@ void _fini(void) {
     deregistercontrolcmd("regexgline", rg_gline);
     deregistercontrolcmd("regexidlookup", rg_idlist);
     deregistercontrolcmd("regexrescan", rg_rescan);
+    deregistercontrolcmd("regexstats", rg_stats);
   }
 
   if(rg_delays) {
@@ -207,6 +216,9 @@ void _fini(void) {
     rg_freestruct(oldgp);
   }
 
+  ac_free(rg_prefilter);
+  rg_prefilter = NULL;
+
   if(attached) {
     dbdetach("regexgline");
     dbfreeid(dbid);
@@ -443,6 +455,7 @@ static void dbloadfini(DBConn *dbconn, void *arg) {
   registercontrolhelpcmd("regexspew", NO_OPER, 1, &rg_spew, "Usage: regexspew <pattern>\nLists users currently on the network which match the given pattern.");
   registercontrolhelpcmd("regexidlookup", NO_OPER, 1, &rg_idlist, "Usage: regexidlookup <id>\nFinds a regular expression pattern by it's ID number.");
   registercontrolhelpcmd("regexrescan", NO_OPER, 1, &rg_rescan, "Usage: regexrescan ?-g?\nRescans the net for missed clients, optionally glining matches (used for debugging).");
+  registercontrolhelpcmd("regexstats", NO_OPER, 0, &rg_stats, "Usage: regexstats\nShows how often the literal prefilter saved running a regex.");
 
   registerhook(HOOK_NICK_NEWNICK, &rg_nick);
   registerhook(HOOK_NICK_RENAME, &rg_rename);
@@ -462,24 +475,101 @@ void rg_dbload(void) {
   dbloadtable("regexgline.glines", NULL, dbloaddata, dbloadfini);
 }
 
+static void rg_buildprefilter(void) {
+  struct rg_struct *rp;
+  char literal[AC_MAXLITERAL + 1];
+  size_t len;
+
+  rg_prefilterdirty = 0;
+
+  ac_free(rg_prefilter);
+  rg_prefilter = ac_new();
+
+  for(rp=rg_list;rp;rp=rp->next) {
+    len = regexliteral(rp->mask->content, literal);
+    rp->prefiltered = (rg_prefilter && len >= RG_MIN_LITERAL_LEN && ac_add(rg_prefilter, literal, len, rp));
+  }
+
+  if(rg_prefilter && !ac_build(rg_prefilter)) {
+    ac_free(rg_prefilter);
+    rg_prefilter = NULL;
+  }
+
+  if(!rg_prefilter) {
+    /* no prefilter, run them all */
+    Error("regexgline", ERR_WARNING, "Unable to build literal prefilter.");
+    for(rp=rg_list;rp;rp=rp->next)
+      rp->prefiltered = 0;
+  }
+}
+
+static void rg_prefiltermatch(void *data, void *arg) {
+  struct rg_struct *rp = (struct rg_struct *)data;
+
+  rp->marker = *(unsigned int *)arg;
+}
+
 static void rg_scannick(nick *np, scannick_fn *fn, void *arg) {
   struct rg_struct *rp;
   char hostname[RG_MASKLEN];
   int hostlen;
+  unsigned int m;
 
   if(ignorable_nick(np))
     return;
 
   hostlen = RGBuildHostname(hostname, np);
 
+  if(rg_prefilterdirty)
+    rg_buildprefilter();
+
+  /* mark every regex whose literal is in the hostname */
+  m = getrgmarker();
+  if(rg_prefilter)
+    ac_scan(rg_prefilter, hostname, hostlen, rg_prefiltermatch, &m);
+
+  rg_pf_subjects++;
+
   for(rp=rg_list;rp;rp=rp->next) {
+    if(rp->prefiltered && rp->marker != m) {
+      rg_pf_skipped++;
+      continue;
+    }
+
+    rg_pf_run++;
     if(pcre_exec(rp->regex, rp->hint, hostname, hostlen, 0, 0, NULL, 0) >= 0) {
+      rg_pf_hits++;
       fn(rp, np, hostname, arg);
       break;
     }
   }
 }
 
+int rg_stats(void *source, int cargc, char **cargv) {
+  nick *np = (nick *)source;
+  struct rg_struct *rp;
+  int total = 0, prefiltered = 0;
+
+  if(rg_prefilterdirty)
+    rg_buildprefilter();
+
+  for(rp=rg_list;rp;rp=rp->next) {
+    total++;
+    if(rp->prefiltered)
+      prefiltered++;
+  }
+
+  controlreply(np, "Regexglines:        %d (%d prefiltered, %d always run)", total, prefiltered, total - prefiltered);
+  controlreply(np, "Prefilter states:   %d", rg_prefilter ? rg_prefilter->states : 0);
+  controlreply(np, "Users scanned:      %lu", rg_pf_subjects);
+  controlreply(np, "Regexes run:        %lu (%.2f per user)", rg_pf_run, rg_pf_subjects ? (double)rg_pf_run / rg_pf_subjects : 0.0);
+  controlreply(np, "Regexes skipped:    %lu (%.2f%%)", rg_pf_skipped, (rg_pf_run + rg_pf_skipped) ? (double)rg_pf_skipped * 100 / (rg_pf_run + rg_pf_skipped) : 0.0);
+  controlreply(np, "Matches:            %lu", rg_pf_hits);
+  controlreply(np, "End of list.");
+
+  return CMD_OK;
+}
+
 static void rg_gline_match(struct rg_struct *rp, nick *np, char *hostname, void *arg) {
   struct rg_glinelist *gll = (struct rg_glinelist *)arg;
 
@@ -963,6 +1053,8 @@ void rg_startup(void) {
 }
 
 void rg_freestruct(struct rg_struct *rp) {
+  rg_prefilterdirty = 1;
+
   freesstring(rp->mask);
   freesstring(rp->setby);
   freesstring(rp->reason);
@@ -984,6 +1076,7 @@ struct rg_struct *rg_newstruct(time_t expires) {
 
     memset(rp, 0, sizeof(rg_struct));
     rp->expires = expires;
+    rg_prefilterdirty = 1;
 
     for(lp=NULL,tp=rg_list;tp;lp=tp,tp=tp->next) {
       if (expires <= tp->expires) { /* <= possible, slight speed increase */
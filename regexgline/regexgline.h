@@ -25,6 +25,7 @@
 #define RG_MASKLEN                HOSTLEN + USERLEN + NICKLEN + REALLEN + 5 /* includes NULL terminator */
 #define RG_PCREFLAGS              PCRE_CASELESS
 #define RG_MIN_MASK_LEN           5
+#define RG_MIN_LITERAL_LEN        3 /* shorter literals are too common to be worth prefiltering on */
 #define RG_MAX_PER_GLINE_DEFAULT  5
 #define RG_MINIMUM_DELAY_TIME     5
 #define RG_MAXIMUM_RAND_TIME      15
@@ -49,6 +50,7 @@ typedef struct rg_struct {
   unsigned long    hits;      /* hits since we were loaded */
   unsigned long    hitssaved; /* hits (persistent) */
   unsigned int     marker;    /* newserv style marker */
+  short            prefiltered; /* only run if the literal prefilter marked it */
   time_t           lastseen;  /* ... */
   short            dirty;     /* whether or not we need to flush to the db */
   struct rg_struct *next;     /* ... pointer to next item */
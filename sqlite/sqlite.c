@@ -21,6 +21,7 @@
 #include "../lib/strlfunc.h"
 #include "../core/nsmalloc.h"
 #include "../core/schedule.h"
+#include "../lib/irc_string.h"
 
 #define BUILDING_DBAPI
 #include "../dbapi/dbapi.h"
@@ -46,10 +47,30 @@ static int queuesize;
 static void *processsched;
 static int inited;
 
+/* Statements for sqliteasyncqueryparams, kept prepared for reuse.  One
+ * that's still queued or being read is busy, and anyone else wanting
+ * the same query gets a statement of their own meanwhile.
+ */
+struct sqlitestatement {
+  sqlite3_stmt *statement;
+  char *query;
+  unsigned long hash;
+  unsigned long lastused;
+  int busy;
+  struct sqlitestatement *next;
+};
+
+static struct sqlitestatement *statements[SQLITE_STATEMENTHASHSIZE];
+static int nstatements;
+static unsigned long statementclock, statementhits, statementmisses;
+
 #define SYNC_MODE "OFF"
 
 static void sqlitequeueprocessor(void *arg);
 static void dbstatus(int hooknum, void *arg);
+static void sqlitereleasestatement(sqlite3_stmt *s);
+static void sqlitesubmit(sqlite3_stmt *s, int identifier, SQLiteQueryHandler handler, void *tag, char *querybuf);
+static void sqlitefreestatements(void);
 
 void _init(void) {
   sstring *dbfile;
@@ -106,10 +127,11 @@ void _fini(void) {
      */
     for(q=head;q;q=nq) {
       nq = q->next;
-      sqlite3_finalize(q->statement);
+      sqlitereleasestatement(q->statement);
       nsfree(POOL_SQLITE, q);
     }
 
+    sqlitefreestatements();
     sqlite3_close(conn);
 
     dbconnected = 0;
@@ -131,6 +153,7 @@ static void processstatement(int rc, sqlite3_stmt *s, SQLiteQueryHandler handler
     if((rc != SQLITE_ROW) && (rc != SQLITE_DONE)) {
       Error("sqlite", ERR_WARNING, "SQL error %d: %s (query: %s)", rc, sqlite3_errmsg(conn), querybuf);
       handler(NULL, tag);
+      sqlitereleasestatement(s);
       return;
     }
 
@@ -149,7 +172,7 @@ static void processstatement(int rc, sqlite3_stmt *s, SQLiteQueryHandler handler
     } else if(rc != SQLITE_DONE) {
       Error("sqlite", ERR_WARNING, "SQL error %d: %s (query: %s)", rc, sqlite3_errmsg(conn), querybuf);
     }
-    sqlite3_finalize(s);
+    sqlitereleasestatement(s);
   }
 }
 
@@ -217,6 +240,13 @@ void sqliteasyncqueryf(int identifier, SQLiteQueryHandler handler, void *tag, in
     return;
   }
 
+  sqlitesubmit(s, identifier, handler, tag, querybuf);
+}
+
+/* Runs the statement now if nothing's ahead of it, queues it otherwise */
+static void sqlitesubmit(sqlite3_stmt *s, int identifier, SQLiteQueryHandler handler, void *tag, char *querybuf) {
+  int rc;
+
   if(head) { /* stuff already queued */
     pushqueue(s, identifier, handler, tag);
     return;
@@ -231,6 +261,215 @@ void sqliteasyncqueryf(int identifier, SQLiteQueryHandler handler, void *tag, in
   processstatement(rc, s, handler, tag, querybuf);
 }
 
+static void sqlitefreestatement(struct sqlitestatement *st) {
+  sqlite3_finalize(st->statement);
+  nsfree(POOL_SQLITE, st->query);
+  nsfree(POOL_SQLITE, st);
+}
+
+static void sqlitefreestatements(void) {
+  struct sqlitestatement *st, *nst;
+  int i;
+
+  for(i=0;i<SQLITE_STATEMENTHASHSIZE;i++) {
+    for(st=statements[i];st;st=nst) {
+      nst = st->next;
+      sqlitefreestatement(st);
+    }
+    statements[i] = NULL;
+  }
+
+  nstatements = 0;
+}
+
+static struct sqlitestatement *findstatement(sqlite3_stmt *s) {
+  struct sqlitestatement *st;
+  const char *query = sqlite3_sql(s);
+  unsigned long hash;
+
+  if(!query)
+    return NULL;
+
+  hash = irc_crc32(query);
+  for(st=statements[hash%SQLITE_STATEMENTHASHSIZE];st;st=st->next)
+    if(st->statement == s)
+      return st;
+
+  return NULL;
+}
+
+/* Done with s: a cached statement is reset for next time, anything else goes */
+static void sqlitereleasestatement(sqlite3_stmt *s) {
+  struct sqlitestatement *st;
+
+  if(!s)
+    return;
+
+  if(!(st = findstatement(s))) {
+    sqlite3_finalize(s);
+    return;
+  }
+
+  sqlite3_reset(s);
+  sqlite3_clear_bindings(s);
+  st->busy = 0;
+}
+
+/* Throws away the idle statement that's gone longest unused, if there is one */
+static void evictstatement(void) {
+  struct sqlitestatement *st, **sh, **oldest = NULL;
+  int i;
+
+  for(i=0;i<SQLITE_STATEMENTHASHSIZE;i++)
+    for(sh=&statements[i];(st=*sh);sh=&st->next)
+      if(!st->busy && (!oldest || st->lastused < (*oldest)->lastused))
+        oldest = sh;
+
+  if(!oldest)
+    return;
+
+  st = *oldest;
+  *oldest = st->next;
+  nstatements--;
+  sqlitefreestatement(st);
+}
+
+/* Gets a statement for query, from the cache if there's an idle one */
+static sqlite3_stmt *sqlitegetstatement(const char *query) {
+  struct sqlitestatement *st;
+  unsigned long hash = irc_crc32(query);
+  sqlite3_stmt *s;
+  int cached = 0, rc;
+
+  for(st=statements[hash%SQLITE_STATEMENTHASHSIZE];st;st=st->next) {
+    if(st->hash != hash || strcmp(st->query, query))
+      continue;
+
+    cached = 1;
+    if(st->busy)
+      continue;
+
+    st->busy = 1;
+    st->lastused = ++statementclock;
+    statementhits++;
+    return st->statement;
+  }
+
+  statementmisses++;
+
+  rc = sqlite3_prepare_v2(conn, query, -1, &s, NULL);
+  if(rc != SQLITE_OK)
+    return NULL;
+
+  /* one copy of each query is enough */
+  if(cached)
+    return s;
+
+  if(nstatements >= SQLITE_MAXSTATEMENTS)
+    evictstatement();
+
+  if(nstatements >= SQLITE_MAXSTATEMENTS)
+    return s;
+
+  st = (struct sqlitestatement *)nsmalloc(POOL_SQLITE, sizeof(struct sqlitestatement));
+  if(st)
+    st->query = (char *)nsmalloc(POOL_SQLITE, strlen(query) + 1);
+
+  if(!st || !st->query) {
+    if(st)
+      nsfree(POOL_SQLITE, st);
+    return s;
+  }
+
+  strcpy(st->query, query);
+  st->statement = s;
+  st->hash = hash;
+  st->lastused = ++statementclock;
+  st->busy = 1;
+  st->next = statements[hash%SQLITE_STATEMENTHASHSIZE];
+  statements[hash%SQLITE_STATEMENTHASHSIZE] = st;
+  nstatements++;
+
+  return s;
+}
+
+/* query uses $1.. placeholders, types has an 'i' (integer), 'f' (float)
+ * or 's' (string) for each of the values, NULL values are bound as NULL.
+ */
+void sqliteasyncqueryparams(int identifier, SQLiteQueryHandler handler, void *tag, int flags, const char *query, int nparams, const char * const *values, const char *types) {
+  sqlite3_stmt *s;
+  int i, rc = SQLITE_OK;
+
+  if(!sqliteconnected())
+    return;
+
+  if(!(s = sqlitegetstatement(query))) {
+    if(flags != DB_CREATE)
+      Error("sqlite", ERR_WARNING, "SQL error: %s (query: %s)", sqlite3_errmsg(conn), query);
+    if(handler)
+      handler(NULL, tag);
+    return;
+  }
+
+  for(i=0;i<nparams && rc==SQLITE_OK;i++) {
+    if(!values[i]) {
+      rc = sqlite3_bind_null(s, i + 1);
+      continue;
+    }
+
+    switch(types[i]) {
+      case 'i':
+        rc = sqlite3_bind_int64(s, i + 1, strtoll(values[i], NULL, 10));
+        break;
+      case 'f':
+        rc = sqlite3_bind_double(s, i + 1, strtod(values[i], NULL));
+        break;
+      default:
+        rc = sqlite3_bind_text(s, i + 1, values[i], -1, SQLITE_TRANSIENT);
+        break;
+    }
+  }
+
+  if(rc != SQLITE_OK) {
+    Error("sqlite", ERR_WARNING, "SQL error %d binding parameters: %s (query: %s)", rc, sqlite3_errmsg(conn), query);
+    sqlitereleasestatement(s);
+    if(handler)
+      handler(NULL, tag);
+    return;
+  }
+
+  sqlitesubmit(s, identifier, handler, tag, (char *)query);
+}
+
+/* Inserts nrows rows of ncolumns values (row by row) into table, all in
+ * one transaction with the INSERT prepared once.  handler gets the COMMIT.
+ */
+void sqliteasyncbulkinsert(int identifier, SQLiteQueryHandler handler, void *tag, const char *table, const char *columns, int ncolumns, int nrows, const char * const *values, const char *types) {
+  char querybuf[8192];
+  int i, len;
+
+  if(!sqliteconnected() || nrows <= 0 || ncolumns <= 0)
+    return;
+
+  len = snprintf(querybuf, sizeof(querybuf), "INSERT INTO %s (%s) VALUES (", table, columns);
+  for(i=0;i<ncolumns && len<(int)sizeof(querybuf);i++)
+    len += snprintf(querybuf + len, sizeof(querybuf) - len, "%s$%d", i?", ":"", i + 1);
+  if(len < (int)sizeof(querybuf))
+    len += snprintf(querybuf + len, sizeof(querybuf) - len, ")");
+
+  if(len >= (int)sizeof(querybuf)) {
+    Error("sqlite", ERR_WARNING, "Bulk insert statement too long for table %s", table);
+    if(handler)
+      handler(NULL, tag);
+    return;
+  }
+
+  sqliteasyncqueryf(identifier, NULL, NULL, 0, "BEGIN TRANSACTION");
+  for(i=0;i<nrows;i++)
+    sqliteasyncqueryparams(identifier, NULL, NULL, 0, querybuf, ncolumns, values + i * ncolumns, types);
+  sqliteasyncqueryf(identifier, handler, tag, 0, "COMMIT TRANSACTION");
+}
+
 int sqliteconnected(void) {
   return dbconnected;
 }
@@ -296,7 +535,7 @@ void sqliteclear(SQLiteResult *r) {
     return;
 
   if(r->r)
-    sqlite3_finalize(r->r);
+    sqlitereleasestatement(r->r);
 
   nsfree(POOL_SQLITE, r);
 }
@@ -410,7 +649,7 @@ void sqlitefreeid(int id) {
         if(q == tail)
           tail = NULL;
       }
-      sqlite3_finalize(q->statement);
+      sqlitereleasestatement(q->statement);
 
       q->handler(NULL, q->tag);
       nsfree(POOL_SQLITE, q);
@@ -449,6 +688,9 @@ static void dbstatus(int hooknum, void *arg) {
 
     snprintf(message, sizeof(message), "SQLite  : %6d queries queued.", queuesize);
     triggerhook(HOOK_CORE_STATSREPLY, message);
+
+    snprintf(message, sizeof(message), "SQLite  : %6d statements cached, %lu reused, %lu prepared.", nstatements, statementhits, statementmisses);
+    triggerhook(HOOK_CORE_STATSREPLY, message);
   }
 }
 
@@ -5,6 +5,10 @@
 
 #include "../sqlite/libsqlite3/sqlite3.h"
 
+/* prepared statements kept for sqliteasyncqueryparams */
+#define SQLITE_MAXSTATEMENTS 256
+#define SQLITE_STATEMENTHASHSIZE 128
+
 typedef struct SQLiteResult {
   sqlite3_stmt *r;
   char first, final;
@@ -16,6 +20,8 @@ typedef int SQLiteModuleIdentifier;
 typedef void (*SQLiteQueryHandler)(SQLiteConn *, void *);
 
 void sqliteasyncqueryf(SQLiteModuleIdentifier identifier, SQLiteQueryHandler handler, void *tag, int flags, char *format, ...) __attribute__ ((format (printf, 5, 6)));
+void sqliteasyncqueryparams(SQLiteModuleIdentifier identifier, SQLiteQueryHandler handler, void *tag, int flags, const char *query, int nparams, const char * const *values, const char *types);
+void sqliteasyncbulkinsert(SQLiteModuleIdentifier identifier, SQLiteQueryHandler handler, void *tag, const char *table, const char *columns, int ncolumns, int nrows, const char * const *values, const char *types);
 void sqliteasyncqueryfv(int identifier, SQLiteQueryHandler handler, void *tag, int flags, char *format, va_list ap);
 
 int sqliteconnected(void);
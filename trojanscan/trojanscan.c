@@ -45,6 +45,8 @@ static void *trojanscan_connect_nick_schedule;
 
 static void *db_ping_schedule;
 
+static unsigned long phrasemessages, phraseruns, phraseskips;
+
 void _init() {
   trojanscan_cmds = newcommandtree();
 
@@ -60,6 +62,7 @@ void _init() {
   addcommandtotree(trojanscan_cmds, "deluser", TROJANSCAN_ACL_TEAMLEADER | TROJANSCAN_ACL_OPER, 2, &trojanscan_deluser);
   addcommandtotree(trojanscan_cmds, "mew", TROJANSCAN_ACL_STAFF, 2, &trojanscan_mew);
   addcommandtotree(trojanscan_cmds, "status", TROJANSCAN_ACL_STAFF | TROJANSCAN_ACL_OPER, 0, &trojanscan_status);
+  addcommandtotree(trojanscan_cmds, "phrasestats", TROJANSCAN_ACL_STAFF | TROJANSCAN_ACL_OPER, 1, &trojanscan_phrasestats);
   addcommandtotree(trojanscan_cmds, "listusers", TROJANSCAN_ACL_TEAMLEADER, 0, &trojanscan_listusers);
 
   addcommandtotree(trojanscan_cmds, "rehash", TROJANSCAN_ACL_WEBSITE, 0, &trojanscan_rehash);
@@ -136,6 +139,7 @@ void _fini(void) {
   deletecommandfromtree(trojanscan_cmds, "deluser", &trojanscan_deluser);
   deletecommandfromtree(trojanscan_cmds, "mew", &trojanscan_mew);
   deletecommandfromtree(trojanscan_cmds, "status", &trojanscan_status);
+  deletecommandfromtree(trojanscan_cmds, "phrasestats", &trojanscan_phrasestats);
   deletecommandfromtree(trojanscan_cmds, "listusers", &trojanscan_listusers);
   deletecommandfromtree(trojanscan_cmds, "rehash", &trojanscan_rehash);
   deletecommandfromtree(trojanscan_cmds, "cat", &trojanscan_cat);
@@ -351,18 +355,25 @@ void trojanscan_rehash_schedule(void *arg) {
   }
 }
 
+static void trojanscan_free_phrases(trojanscan_phrases *phrases, int total, acmatcher *matcher) {
+  int i;
+  for(i=0;i<total;i++) {
+    if (phrases[i].phrase)
+      pcre_free(phrases[i].phrase);
+    if (phrases[i].hint)
+      pcre_free(phrases[i].hint);
+  }
+  tfree(phrases);
+  ac_free(matcher);
+}
+
 void trojanscan_free_database(void) {
   int i;
   for(i=0;i<trojanscan_database.total_channels;i++)
     freesstring(trojanscan_database.channels[i].name);
   tfree(trojanscan_database.channels);
-  for(i=0;i<trojanscan_database.total_phrases;i++) {
-    if (trojanscan_database.phrases[i].phrase)
-      pcre_free(trojanscan_database.phrases[i].phrase);
-    if (trojanscan_database.phrases[i].hint)
-      pcre_free(trojanscan_database.phrases[i].hint);
-  }
-  tfree(trojanscan_database.phrases);
+  trojanscan_free_phrases(trojanscan_database.phrases, trojanscan_database.total_phrases, trojanscan_database.matcher);
+  trojanscan_database.matcher = NULL;
   for(i=0;i<trojanscan_database.total_worms;i++)
     freesstring(trojanscan_database.worms[i].name);
   tfree(trojanscan_database.worms);
@@ -476,17 +487,31 @@ struct trojanscan_worms *trojanscan_find_worm_by_id(int id) {
 
 void trojanscan_read_database(int first_time) {
   const char *error;
-  int erroroffset, i, tempresult;
+  int erroroffset, i, j, tempresult;
+  trojanscan_phrases *oldphrases = NULL, *phrases = NULL;
+  int oldtotal = 0, total = 0;
+  acmatcher *matcher = NULL;
+  char literal[AC_MAXLITERAL + 1];
+  size_t literallen;
 
   trojanscan_database_res *res;
   trojanscan_database_row sqlrow;
 
   if (!first_time) {
+    /* keep the old phrases out of the way until the new set is ready, for their stats */
+    oldphrases = trojanscan_database.phrases;
+    oldtotal = trojanscan_database.total_phrases;
+    ac_free(trojanscan_database.matcher);
+    trojanscan_database.phrases = NULL;
+    trojanscan_database.total_phrases = 0;
+    trojanscan_database.matcher = NULL;
+
     trojanscan_free_database();
   } else {
     trojanscan_database.total_channels = 0;
     trojanscan_database.total_phrases = 0;
     trojanscan_database.total_worms = 0;
+    trojanscan_database.matcher = NULL;
   }
   
   if (!(trojanscan_database_query("SELECT channel, exempt FROM channels"))) {
@@ -541,31 +566,67 @@ void trojanscan_read_database(int first_time) {
   
   if (!(trojanscan_database_query("SELECT id, phrase, wormid FROM phrases WHERE disabled = 0 ORDER BY priority DESC"))) {
     if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      trojanscan_database.total_phrases = trojanscan_database_num_rows(res);
-      if (trojanscan_database.total_phrases > 0) {
-        if ((trojanscan_database.phrases = (trojanscan_phrases *)tmalloc(sizeof(trojanscan_phrases) * trojanscan_database.total_phrases))) {
+      total = trojanscan_database_num_rows(res);
+      if (total > 0) {
+        matcher = ac_new();
+        if ((phrases = (trojanscan_phrases *)tmalloc(sizeof(trojanscan_phrases) * total))) {
+          memset(phrases, 0, sizeof(trojanscan_phrases) * total);
           i = 0;
           while((sqlrow = trojanscan_database_fetch_row(res))) {
-            trojanscan_database.phrases[i].id = atoi(sqlrow[0]);
-            trojanscan_database.phrases[i].worm = trojanscan_find_worm_by_id(atoi(sqlrow[2]));
-            if (!(trojanscan_database.phrases[i].phrase = pcre_compile(sqlrow[1], PCRE_CASELESS, &error, &erroroffset, NULL))) {
+            phrases[i].id = atoi(sqlrow[0]);
+            phrases[i].worm = trojanscan_find_worm_by_id(atoi(sqlrow[2]));
+            if (!(phrases[i].phrase = pcre_compile(sqlrow[1], PCRE_CASELESS, &error, &erroroffset, NULL))) {
               Error("trojanscan", ERR_WARNING, "Error compiling expression %s at offset %d: %s", sqlrow[1], erroroffset, error);
             } else {
-              trojanscan_database.phrases[i].hint = pcre_study(trojanscan_database.phrases[i].phrase, 0, &error);
+              phrases[i].hint = pcre_study(phrases[i].phrase, 0, &error);
               if (error) {
                 Error("trojanscan", ERR_WARNING, "Error studying expression %s: %s", sqlrow[1], error);
-                pcre_free(trojanscan_database.phrases[i].phrase);
-                trojanscan_database.phrases[i].phrase = NULL;
+                pcre_free(phrases[i].phrase);
+                phrases[i].phrase = NULL;
               }
             }
+
+            literallen = regexliteral(sqlrow[1], literal);
+            phrases[i].prefiltered = (matcher && literallen >= TROJANSCAN_MIN_LITERAL_LEN && ac_add(matcher, literal, literallen, &phrases[i]));
             i++;
           }
+        } else {
+          total = 0;
+        }
+
+        if (matcher && !ac_build(matcher)) {
+          ac_free(matcher);
+          matcher = NULL;
+        }
+
+        if (!matcher) {
+          Error("trojanscan", ERR_WARNING, "Unable to build phrase matcher, running every phrase.");
+          for(i=0;i<total;i++)
+            phrases[i].prefiltered = 0;
         }
       }
       trojanscan_database_free_result(res);
     }
   }
 
+  /* carry the stats over for phrases we already had */
+  for(i=0;i<total;i++) {
+    for(j=0;j<oldtotal;j++) {
+      if (oldphrases[j].id == phrases[i].id) {
+        phrases[i].runs = oldphrases[j].runs;
+        phrases[i].hits = oldphrases[j].hits;
+        phrases[i].usecs = oldphrases[j].usecs;
+        break;
+      }
+    }
+  }
+
+  trojanscan_free_phrases(oldphrases, oldtotal, NULL);
+
+  trojanscan_database.phrases = phrases;
+  trojanscan_database.total_phrases = total;
+  trojanscan_database.matcher = matcher;
+
   trojanscan_database_query("UPDATE settings SET value = '0' where setting = 'rehash'");
 }
 
@@ -648,6 +709,64 @@ int trojanscan_status(void *sender, int cargc, char **cargv) {
   return CMD_OK;
 }
 
+static int trojanscan_phrasecostsort(const void *v1, const void *v2) {
+  const trojanscan_phrases *p1 = *(const trojanscan_phrases **)v1, *p2 = *(const trojanscan_phrases **)v2;
+
+  if(p1->usecs == p2->usecs)
+    return 0;
+
+  return (p1->usecs > p2->usecs) ? -1 : 1;
+}
+
+int trojanscan_phrasestats(void *sender, int cargc, char **cargv) {
+  nick *np = (nick *)sender;
+  trojanscan_phrases **sorted;
+  int i, count = 10, prefiltered = 0;
+
+  if(cargc > 0)
+    count = atoi(cargv[0]);
+
+  if(count <= 0)
+    count = 10;
+
+  for(i=0;i<trojanscan_database.total_phrases;i++)
+    if(trojanscan_database.phrases[i].prefiltered)
+      prefiltered++;
+
+  trojanscan_log(np, "phrasestats", "%d", count);
+  trojanscan_reply(np, "Phrases: %d (%d prefiltered, %d always run), matcher states: %d", trojanscan_database.total_phrases,
+                   prefiltered, trojanscan_database.total_phrases - prefiltered, trojanscan_database.matcher ? trojanscan_database.matcher->states : 0);
+  trojanscan_reply(np, "Messages: %lu, phrases run: %lu (%.2f per message), skipped: %lu", phrasemessages, phraseruns,
+                   phrasemessages ? (double)phraseruns / phrasemessages : 0.0, phraseskips);
+
+  if(!trojanscan_database.total_phrases)
+    return CMD_OK;
+
+  sorted = (trojanscan_phrases **)tmalloc(sizeof(trojanscan_phrases *) * trojanscan_database.total_phrases);
+  if(!sorted) {
+    trojanscan_reply(np, "Memory allocation error.");
+    return CMD_ERROR;
+  }
+
+  for(i=0;i<trojanscan_database.total_phrases;i++)
+    sorted[i] = &trojanscan_database.phrases[i];
+
+  qsort(sorted, trojanscan_database.total_phrases, sizeof(trojanscan_phrases *), trojanscan_phrasecostsort);
+
+  trojanscan_reply(np, "ID     Worm                 Runs       Hits     Avg(us)  Total(ms)  Prefiltered");
+  for(i=0;i<count && i<trojanscan_database.total_phrases;i++) {
+    trojanscan_phrases *p = sorted[i];
+
+    trojanscan_reply(np, "%-6d %-20s %-10lu %-8lu %-8lu %-10llu %s", p->id, p->worm ? p->worm->name->content : "(none)", p->runs, p->hits,
+                     p->runs ? (unsigned long)(p->usecs / p->runs) : 0UL, p->usecs / 1000, p->prefiltered ? "yes" : "no");
+  }
+
+  tfree(sorted);
+  trojanscan_reply(np, "End of list.");
+
+  return CMD_OK;
+}
+
 int trojanscan_chanlist(void *sender, int cargc, char **cargv) {
   int i;
   nick *np = (nick *)sender;
@@ -873,6 +992,9 @@ int trojanscan_help(void *sender, int cargc, char **cargv) {
   } else if (!strcasecmp("status", cargv[0])) {
     trojanscan_reply(np, "Syntax: status");
     trojanscan_reply(np, "Gives statistical information about the bot.");
+  } else if (!strcasecmp("phrasestats", cargv[0])) {
+    trojanscan_reply(np, "Syntax: phrasestats ?count?");
+    trojanscan_reply(np, "Lists the phrases that have cost the most matching time, with hit counts.");
   } else if (!strcasecmp("join", cargv[0])) {
     trojanscan_reply(np, "Syntax: join <#channel>");
     trojanscan_reply(np, "Orders a clone to join supplied channel.");
@@ -1701,17 +1823,46 @@ char trojanscan_getmtfrommessagetype(int input) {
   }
 }
 
+static void trojanscan_phrasemark(void *data, void *arg) {
+  trojanscan_phrases *phrase = (trojanscan_phrases *)data;
+
+  phrase->marker = *(unsigned int *)arg;
+}
+
+static unsigned int trojanscan_getphrasemarker(void) {
+  static unsigned int marker = 0;
+  int i;
+
+  marker++;
+  if(!marker) {
+    /* If we wrapped to zero, zap the marker on all phrases */
+    for(i=0;i<trojanscan_database.total_phrases;i++)
+      trojanscan_database.phrases[i].marker = 0;
+    marker++;
+  }
+
+  return marker;
+}
+
 static void trojanscan_process(nick *sender, channel *cp, char mt, char *pretext) {
   char text[513];
   unsigned int len;
-  unsigned int i;
+  unsigned int i, m;
   struct trojanscan_worms *worm;
   int vector[30], detected = 0;
+  struct timeval before, after;
 
   trojanscan_strip_codes(text, sizeof(text) - 1, pretext);
       
   len = strlen(text);
-      
+
+  /* one pass over the text marks every phrase whose literal occurs in it */
+  m = trojanscan_getphrasemarker();
+  if(trojanscan_database.matcher)
+    ac_scan(trojanscan_database.matcher, text, len, trojanscan_phrasemark, &m);
+
+  phrasemessages++;
+
   for(i=0;i<trojanscan_database.total_phrases;i++) {
     if (
          (
@@ -1737,8 +1888,24 @@ static void trojanscan_process(nick *sender, channel *cp, char mt, char *pretext
          ) &&
          (trojanscan_database.phrases[i].phrase)
        ) {
-      int pre = pcre_exec(trojanscan_database.phrases[i].phrase, trojanscan_database.phrases[i].hint, text, len, 0, 0, vector, 30);
+      trojanscan_phrases *phrase = &trojanscan_database.phrases[i];
+      int pre;
+
+      if(phrase->prefiltered && (phrase->marker != m)) {
+        phraseskips++;
+        continue;
+      }
+
+      gettimeofday(&before, NULL);
+      pre = pcre_exec(phrase->phrase, phrase->hint, text, len, 0, 0, vector, 30);
+      gettimeofday(&after, NULL);
+
+      phraseruns++;
+      phrase->runs++;
+      phrase->usecs += (after.tv_sec - before.tv_sec) * 1000000 + (after.tv_usec - before.tv_usec);
+
       if(pre >= 0) {
+        phrase->hits++;
         char matchbuf[513];
         matchbuf[0] = 0;
         matchbuf[512] = 0; /* hmm */
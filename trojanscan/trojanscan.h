@@ -6,6 +6,7 @@
 #include "../lib/irc_string.h"
 #include "../lib/splitline.h"
 #include "../lib/strlfunc.h"
+#include "../lib/acmatch.h"
 #include "../localuser/localuserchannel.h"
 
 #include <assert.h>
@@ -16,6 +17,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <strings.h>
+#include <sys/time.h>
 
 #define TROJANSCAN_VERSION "2.73"
 
@@ -64,6 +66,8 @@
 #define TROJANSCAN_FIRST_OFFENSE 12
 #define TROJANSCAN_IPLEN         20
 
+#define TROJANSCAN_MIN_LITERAL_LEN 3 /* shorter phrase literals aren't worth prefiltering on */
+
 #define TROJANSCAN_VERSION_DETECT "\001VERSION"
 #define TROJANSCAN_DEFAULT_VERSION_REPLY "mIRC v6.35 Khaled Mardam-Bey"
 
@@ -94,6 +98,10 @@ typedef struct trojanscan_phrases {
   pcre *phrase;
   pcre_extra *hint;
   trojanscan_worms *worm;
+  short prefiltered;          /* only run if the matcher marked it */
+  unsigned int marker;
+  unsigned long runs, hits;
+  unsigned long long usecs;   /* time spent in pcre_exec */
 } trojanscan_phrases;
 
 typedef struct trojanscan_db {
@@ -101,6 +109,7 @@ typedef struct trojanscan_db {
   trojanscan_channels       *channels;
   trojanscan_phrases        *phrases;
   trojanscan_worms          *worms;
+  acmatcher                 *matcher; /* literals of the phrases, rebuilt with them */
 } trojanscan_db;
 
 typedef struct trojanscan_prechannels {
@@ -184,6 +193,7 @@ typedef MYSQL trojanscan_database_connection;
 #define TROJANSCAN_ACL_TEAMLEADER 0x40
 
 int trojanscan_status(void *sender, int cargc, char **cargv);
+int trojanscan_phrasestats(void *sender, int cargc, char **cargv);
 int trojanscan_showcommands(void *sender, int cargc, char **cargv);
 int trojanscan_help(void *sender, int cargc, char **cargv);
 int trojanscan_hello(void *sender, int cargc, char **cargv);
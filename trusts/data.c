@@ -7,6 +7,7 @@
 #include "../core/hooks.h"
 #include "../core/nsmalloc.h"
 #include "../lib/irc_string.h"
+#include "../lib/strlfunc.h"
 #include "../irc/irc.h"
 #include "trusts.h"
 
@@ -104,10 +105,128 @@ trusthost *th_add(trusthost *ith) {
   return th;
 }
 
+static void tg_freeidents(trustgroup *tg) {
+  trustident *ti, *nti;
+  int i;
+
+  if(!tg->identhash)
+    return;
+
+  for(i=0;i<tg->identhashsize;i++) {
+    for(ti=tg->identhash[i];ti;ti=nti) {
+      nti = ti->next;
+      nsfree(POOL_TRUSTS, ti);
+    }
+  }
+
+  nsfree(POOL_TRUSTS, tg->identhash);
+  tg->identhash = NULL;
+  tg->identhashsize = tg->identcount = 0;
+}
+
+static void tg_resizeidenthash(trustgroup *tg, unsigned int size) {
+  trustident **newhash, *ti, *nti;
+  int i;
+
+  newhash = nscalloc(POOL_TRUSTS, size, sizeof(trustident *));
+  if(!newhash)
+    return; /* just keep using the old table */
+
+  for(i=0;i<tg->identhashsize;i++) {
+    for(ti=tg->identhash[i];ti;ti=nti) {
+      nti = ti->next;
+      ti->next = newhash[ti->hash % size];
+      newhash[ti->hash % size] = ti;
+    }
+  }
+
+  if(tg->identhash)
+    nsfree(POOL_TRUSTS, tg->identhash);
+
+  tg->identhash = newhash;
+  tg->identhashsize = size;
+}
+
+static trustident *tg_findident(trustgroup *tg, const char *ident, unsigned long hash) {
+  trustident *ti;
+
+  if(!tg->identhash)
+    return NULL;
+
+  for(ti=tg->identhash[hash % tg->identhashsize];ti;ti=ti->next)
+    if(ti->hash == hash && !ircd_strcmp(ti->ident, ident))
+      return ti;
+
+  return NULL;
+}
+
+void tg_addident(trustgroup *tg, const char *ident) {
+  unsigned long hash = irc_crc32i(ident);
+  trustident *ti = tg_findident(tg, ident, hash);
+
+  if(ti) {
+    ti->count++;
+    return;
+  }
+
+  /* tables start small and double whenever the load factor goes above 1 */
+  if(!tg->identhash)
+    tg_resizeidenthash(tg, TRUSTIDENTHASHMIN);
+  else if(tg->identcount >= tg->identhashsize)
+    tg_resizeidenthash(tg, tg->identhashsize * 2);
+
+  if(!tg->identhash)
+    return;
+
+  ti = nsmalloc(POOL_TRUSTS, sizeof(trustident));
+  if(!ti)
+    return;
+
+  ti->hash = hash;
+  ti->count = 1;
+  strlcpy(ti->ident, ident, sizeof(ti->ident));
+
+  ti->next = tg->identhash[hash % tg->identhashsize];
+  tg->identhash[hash % tg->identhashsize] = ti;
+  tg->identcount++;
+}
+
+void tg_delident(trustgroup *tg, const char *ident) {
+  unsigned long hash = irc_crc32i(ident);
+  trustident **pnext, *ti;
+
+  if(!tg->identhash)
+    return;
+
+  for(pnext=&tg->identhash[hash % tg->identhashsize];*pnext;pnext=&((*pnext)->next)) {
+    ti = *pnext;
+    if(ti->hash != hash || ircd_strcmp(ti->ident, ident))
+      continue;
+
+    if(--ti->count == 0) {
+      *pnext = ti->next;
+      nsfree(POOL_TRUSTS, ti);
+
+      if(--tg->identcount == 0)
+        tg_freeidents(tg);
+    }
+
+    return;
+  }
+}
+
+unsigned int tg_getidentcount(trustgroup *tg, const char *ident) {
+  trustident *ti = tg_findident(tg, ident, irc_crc32i(ident));
+
+  return ti?ti->count:0;
+}
+
 void tg_free(trustgroup *tg, int created) {
   if(created)
     triggerhook(HOOK_TRUSTS_LOSTGROUP, tg);
 
+  tg_freeidents(tg);
+
   freesstring(tg->name);
   freesstring(tg->createdby);
   freesstring(tg->contact);
@@ -122,6 +241,9 @@ trustgroup *tg_add(trustgroup *itg) {
 
   memcpy(tg, itg, sizeof(trustgroup));
 
+  tg->identhash = NULL;
+  tg->identhashsize = tg->identcount = 0;
+
   tg->name = getsstring(tg->name->content, TRUSTNAMELEN);
   tg->createdby = getsstring(tg->createdby->content, CREATEDBYLEN);
   tg->contact = getsstring(tg->contact->content, CONTACTLEN);
@@ -110,6 +110,7 @@ static void tm_final(void *tag, int errcode) {
     trustsdb->squery(trustsdb, "ALTER TABLE ? RENAME TO groups", "T", "migration_groups");
     trustsdb->squery(trustsdb, "DROP TABLE ?", "T", "hosts");
     trustsdb->squery(trustsdb, "ALTER TABLE ? RENAME TO hosts", "T", "migration_hosts");
+    trustsdb_bumpgeneration();
     trustsdb->query(trustsdb, tm_complete, cbd, "COMMIT", "");
   }
 }
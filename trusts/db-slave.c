@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include "../dbapi2/dbapi2.h"
 #include "../core/error.h"
 #include "trusts.h"
@@ -38,5 +39,44 @@ void trusts_replication_swap(void) {
   trustsdb->squery(trustsdb, "ALTER TABLE ? RENAME TO groups", "T", "replication_groups");
   trustsdb->squery(trustsdb, "DROP TABLE ?", "T", "hosts");
   trustsdb->squery(trustsdb, "ALTER TABLE ? RENAME TO hosts", "T", "replication_hosts");
+  trustsdb_bumpgeneration();
   trustsdb->query(trustsdb, tr_complete, NULL, "COMMIT", "");
 }
+
+static void (*statecallback)(unsigned int, unsigned int);
+
+static void tr_loadstate(const DBAPIResult *r, void *tag) {
+  unsigned int epoch = 0, seq = 0;
+
+  if(r) {
+    if(r->success && r->fields == 2 && r->next(r)) {
+      epoch = strtoul(r->get(r, 0), NULL, 10);
+      seq = strtoul(r->get(r, 1), NULL, 10);
+    }
+
+    r->clear(r);
+  }
+
+  if(statecallback)
+    statecallback(epoch, seq);
+}
+
+void trusts_replication_loadstate(void (*callback)(unsigned int, unsigned int)) {
+  statecallback = callback;
+
+  trustsdb->createtable(trustsdb, NULL, NULL, "CREATE TABLE ? (epoch INT, seq INT)", "T", "replication_state");
+  trustsdb->query(trustsdb, tr_loadstate, NULL, "SELECT epoch, seq FROM ?", "T", "replication_state");
+}
+
+void trusts_replication_cancelloadstate(void) {
+  statecallback = NULL;
+}
+
+void trusts_replication_savestate(unsigned int epoch, unsigned int seq) {
+  trustsdb->squery(trustsdb, "DELETE FROM ?", "T", "replication_state");
+  trustsdb->squery(trustsdb, "INSERT INTO ? (epoch, seq) VALUES (?, ?)", "Tuu", "replication_state", epoch, seq);
+}
+
+void trusts_replication_clearstate(void) {
+  trustsdb->squery(trustsdb, "DELETE FROM ?", "T", "replication_state");
+}
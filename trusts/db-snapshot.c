@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../core/error.h"
+#include "trusts.h"
+
+#define SNAPSHOT_MAGIC   0x54534e50 /* "TSNP" */
+#define SNAPSHOT_VERSION 1
+
+#define SNAPSHOT_FILE    "data/trusts.snapshot"
+#define SNAPSHOT_TMPFILE "data/trusts.snapshot.tmp"
+
+void trusts_freeall(void);
+
+/*
+ * Local binary copy of the groups and hosts tables, so we can start
+ * enforcing limits before the database has finished loading.
+ *
+ * Layout (host byte order, it never leaves this machine):
+ *   header:  magic, version, generation, tgmaxid, thmaxid, groups
+ *   group:   fixed fields, 4 length-prefixed strings, host count, hosts
+ *   host:    fixed fields
+ *   trailer: magic
+ */
+
+struct snapshotheader {
+  uint32_t magic, version, generation;
+  uint32_t tgmaxid, thmaxid, groups;
+};
+
+struct snapshotgroup {
+  uint32_t id, trustedfor, maxusage;
+  int32_t flags, maxperident;
+  int64_t expires, lastseen, lastmaxusereset;
+  uint32_t hosts;
+};
+
+struct snapshothost {
+  uint32_t id, maxusage;
+  int32_t maxpernode, nodebits;
+  int64_t created, lastseen;
+  struct irc_in_addr ip;
+  uint8_t bits;
+};
+
+static int writestring(FILE *fp, sstring *s) {
+  uint16_t len = s->length;
+
+  return fwrite(&len, sizeof(len), 1, fp) == 1 && fwrite(s->content, 1, len, fp) == len;
+}
+
+static sstring *readstring(FILE *fp, int maxlen) {
+  char buf[512];
+  uint16_t len;
+
+  if(fread(&len, sizeof(len), 1, fp) != 1 || len > maxlen || len >= sizeof(buf))
+    return NULL;
+
+  if(fread(buf, 1, len, fp) != len)
+    return NULL;
+
+  buf[len] = '\0';
+
+  return getsstring(buf, maxlen);
+}
+
+int trusts_savesnapshot(unsigned int generation, unsigned int tgmaxid, unsigned int thmaxid) {
+  struct snapshotheader hdr;
+  struct snapshotgroup sg;
+  struct snapshothost sh;
+  trustgroup *tg;
+  trusthost *th;
+  uint32_t trailer = SNAPSHOT_MAGIC;
+  FILE *fp;
+  int ok = 1;
+
+  fp = fopen(SNAPSHOT_TMPFILE, "wb");
+  if(!fp) {
+    Error("trusts", ERR_WARNING, "Unable to open %s for writing.", SNAPSHOT_TMPFILE);
+    return 0;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SNAPSHOT_MAGIC;
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.generation = generation;
+  hdr.tgmaxid = tgmaxid;
+  hdr.thmaxid = thmaxid;
+
+  for(tg=tglist;tg;tg=tg->next)
+    hdr.groups++;
+
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+  for(tg=tglist;tg && ok;tg=tg->next) {
+    memset(&sg, 0, sizeof(sg));
+    sg.id = tg->id;
+    sg.trustedfor = tg->trustedfor;
+    sg.maxusage = tg->maxusage;
+    sg.flags = tg->flags;
+    sg.maxperident = tg->maxperident;
+    sg.expires = tg->expires;
+    sg.lastseen = tg->lastseen;
+    sg.lastmaxusereset = tg->lastmaxusereset;
+
+    for(th=tg->hosts;th;th=th->next)
+      sg.hosts++;
+
+    ok = fwrite(&sg, sizeof(sg), 1, fp) == 1 &&
+         writestring(fp, tg->name) && writestring(fp, tg->createdby) &&
+         writestring(fp, tg->contact) && writestring(fp, tg->comment);
+
+    for(th=tg->hosts;th && ok;th=th->next) {
+      memset(&sh, 0, sizeof(sh));
+      sh.id = th->id;
+      sh.maxusage = th->maxusage;
+      sh.maxpernode = th->maxpernode;
+      sh.nodebits = th->nodebits;
+      sh.created = th->created;
+      sh.lastseen = th->lastseen;
+      sh.ip = th->ip;
+      sh.bits = th->bits;
+
+      ok = fwrite(&sh, sizeof(sh), 1, fp) == 1;
+    }
+  }
+
+  if(ok)
+    ok = fwrite(&trailer, sizeof(trailer), 1, fp) == 1;
+
+  if(fclose(fp))
+    ok = 0;
+
+  if(!ok || rename(SNAPSHOT_TMPFILE, SNAPSHOT_FILE)) {
+    Error("trusts", ERR_WARNING, "Error writing trust snapshot.");
+    remove(SNAPSHOT_TMPFILE);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Adds every group and host in the snapshot, the caller must link the tree.
+ * On failure anything partially loaded is freed again.
+ */
+int trusts_loadsnapshot(unsigned int *generation, unsigned int *tgmaxid, unsigned int *thmaxid) {
+  struct snapshotheader hdr;
+  struct snapshotgroup sg;
+  struct snapshothost sh;
+  trustgroup itg, *tg;
+  trusthost ith;
+  uint32_t trailer, i, j;
+  unsigned int hosts = 0;
+  FILE *fp;
+  int ok;
+
+  fp = fopen(SNAPSHOT_FILE, "rb");
+  if(!fp)
+    return 0;
+
+  if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+    Error("trusts", ERR_WARNING, "Ignoring trust snapshot with bad header.");
+    fclose(fp);
+    return 0;
+  }
+
+  ok = 1;
+  for(i=0;i<hdr.groups && ok;i++) {
+    if(fread(&sg, sizeof(sg), 1, fp) != 1) {
+      ok = 0;
+      break;
+    }
+
+    itg.id = sg.id;
+    itg.trustedfor = sg.trustedfor;
+    itg.maxusage = sg.maxusage;
+    itg.flags = sg.flags;
+    itg.maxperident = sg.maxperident;
+    itg.expires = sg.expires;
+    itg.lastseen = sg.lastseen;
+    itg.lastmaxusereset = sg.lastmaxusereset;
+    itg.name = readstring(fp, TRUSTNAMELEN);
+    itg.createdby = readstring(fp, CREATEDBYLEN);
+    itg.contact = readstring(fp, CONTACTLEN);
+    itg.comment = readstring(fp, COMMENTLEN);
+
+    tg = NULL;
+    if(itg.name && itg.createdby && itg.contact && itg.comment)
+      tg = tg_add(&itg);
+
+    freesstring(itg.name);
+    freesstring(itg.createdby);
+    freesstring(itg.contact);
+    freesstring(itg.comment);
+
+    if(!tg) {
+      ok = 0;
+      break;
+    }
+
+    for(j=0;j<sg.hosts;j++) {
+      if(fread(&sh, sizeof(sh), 1, fp) != 1) {
+        ok = 0;
+        break;
+      }
+
+      ith.id = sh.id;
+      ith.maxusage = sh.maxusage;
+      ith.maxpernode = sh.maxpernode;
+      ith.nodebits = sh.nodebits;
+      ith.created = sh.created;
+      ith.lastseen = sh.lastseen;
+      ith.ip = sh.ip;
+      ith.bits = sh.bits;
+      ith.group = tg;
+
+      if(!th_add(&ith)) {
+        ok = 0;
+        break;
+      }
+
+      hosts++;
+    }
+  }
+
+  if(ok && (fread(&trailer, sizeof(trailer), 1, fp) != 1 || trailer != SNAPSHOT_MAGIC))
+    ok = 0;
+
+  fclose(fp);
+
+  if(!ok) {
+    Error("trusts", ERR_WARNING, "Trust snapshot is truncated or corrupt, ignoring.");
+    trusts_freeall();
+    return 0;
+  }
+
+  *generation = hdr.generation;
+  *tgmaxid = hdr.tgmaxid;
+  *thmaxid = hdr.thmaxid;
+
+  Error("trusts", ERR_INFO, "Loaded %u groups and %u hosts from trust snapshot (generation %u).", hdr.groups, hosts, hdr.generation);
+
+  return 1;
+}
@@ -90,9 +90,13 @@ static void __counthandler(int hooknum, void *arg) {
     tg->count++;
     if(tg->count > tg->maxusage)
       tg->maxusage = tg->count;
+
+    tg_addident(tg, ((nick *)args[0])->ident);
   } else {
     th->count--;
     tg->count--;
+
+    tg_delident(tg, ((nick *)args[0])->ident);
   }
 }
 
@@ -5,6 +5,7 @@
 #include "../core/error.h"
 #include "../core/nsmalloc.h"
 #include "../server/server.h"
+#include "../lib/prng.h"
 #include "trusts.h"
 
 MODULE_VERSION("");
@@ -19,8 +20,48 @@ static sstring *tgextnames[MAXTGEXTS];
 
 int trusts_thext, trusts_nextuserext;
 int trustsdbloaded;
+int trustsdbreconciling;
+
+static prngctx rng;
+
+static void seedrng(void) {
+  size_t ret;
+  FILE *e = fopen(TRUSTS_ENTROPYSOURCE, "rb");
+
+  if(!e) {
+    Error("trusts", ERR_STOP, "Unable to open entropy source.");
+    /* shouldn't be running now... */
+  }
+
+  ret = fread(rng.randrsl, 1, sizeof(rng.randrsl), e);
+  fclose(e);
+
+  if(ret != sizeof(rng.randrsl)) {
+    Error("trusts", ERR_STOP, "Unable to read entropy.");
+    /* shouldn't be running now... */
+  }
+
+  prnginit(&rng, 1);
+}
+
+unsigned int trusts_getrandint(void) {
+  return prng(&rng);
+}
+
+void trusts_getrandbytes(unsigned char *buf, size_t bytes) {
+  ub4 b;
+  size_t n;
+
+  for(;bytes>0;bytes-=n,buf+=n) {
+    b = prng(&rng);
+    n = (bytes < 4) ? bytes : 4;
+    memcpy(buf, &b, n);
+  }
+}
 
 void _init(void) {
+  seedrng();
+
   trusts_thext = registernickext("trustth");
   if(trusts_thext == -1) {
     Error("trusts", ERR_ERROR, "Unable to register first nick extension.");
@@ -16,6 +16,8 @@
 #define CREATEDBYLEN NICKLEN + 1
 #define TRUSTLOGLEN 200
 
+#define TRUSTS_ENTROPYSOURCE "/dev/urandom"
+
 #define MAXTGEXTS 5
 
 #define MAXTRUSTEDFOR 5000
@@ -51,8 +53,17 @@
 #define TRUST_MIN_UNPRIVILEGED_NODEBITS_IPV4 (96 + 24)
 #define TRUST_MIN_UNPRIVILEGED_NODEBITS_IPV6 48
 
+#define TRUSTIDENTHASHMIN 8
+
 struct trustmigration;
 
+typedef struct trustident {
+  unsigned long hash;
+  unsigned int count;
+  struct trustident *next;
+  char ident[USERLEN+1];
+} trustident;
+
 struct trusthost;
 
 typedef struct trusthost {
@@ -95,6 +106,10 @@ typedef struct trustgroup {
   trusthost *hosts;
   unsigned int count;
 
+  /* ident -> user count for all users in this group, maintained by the newnick/lostnick events */
+  trustident **identhash;
+  unsigned int identhashsize, identcount;
+
   unsigned int marker;
 
   struct trustgroup *next;
@@ -113,6 +128,8 @@ int findtgext(const char *);
 int registertgext(const char *);
 void releasetgext(int);
 int trusts_fullyonline(void);
+unsigned int trusts_getrandint(void);
+void trusts_getrandbytes(unsigned char *, size_t);
 
 /* formats.c */
 char *trusts_timetostr(time_t);
@@ -143,6 +160,9 @@ unsigned int nextthmarker(void);
 trusthost *th_getbyid(unsigned int);
 int tg_modify(trustgroup *, trustgroup *);
 int th_modify(trusthost *, trusthost *);
+void tg_addident(trustgroup *, const char *);
+void tg_delident(trustgroup *, const char *);
+unsigned int tg_getidentcount(trustgroup *, const char *);
 
 /* migration.c */
 typedef void (*TrustMigrationGroup)(void *, trustgroup *);
@@ -150,8 +170,9 @@ typedef void (*TrustMigrationHost)(void *, trusthost *, unsigned int);
 typedef void (*TrustMigrationFini)(void *, int);
 
 /* trusts_db.c */
-extern int trustsdbloaded;
+extern int trustsdbloaded, trustsdbreconciling;
 int trusts_loaddb(void);
+void trustsdb_bumpgeneration(void);
 void trusts_closedb(int);
 trustgroup *tg_new(trustgroup *);
 trusthost *th_new(trustgroup *, char *);
@@ -172,6 +172,30 @@ static char *formatlimit(unsigned int limit) {
   return buf;
 }
 
+#define TOPIDENTS 10
+
+static void displayidents(nick *sender, trustgroup *tg) {
+  trustident *ti, *top[TOPIDENTS];
+  int i, j, found = 0;
+
+  for(i=0;i<tg->identhashsize;i++) {
+    for(ti=tg->identhash[i];ti;ti=ti->next) {
+      for(j=found;j>0 && top[j-1]->count < ti->count;j--)
+        if(j < TOPIDENTS)
+          top[j] = top[j-1];
+
+      if(j < TOPIDENTS) {
+        top[j] = ti;
+        if(found < TOPIDENTS)
+          found++;
+      }
+    }
+  }
+
+  for(i=0;i<found;i++)
+    controlreply(sender, "Ident usage      : %-10s %u", top[i]->ident, top[i]->count);
+}
+
 static void displaygroup(nick *sender, trustgroup *tg, int showchildren) {
   trusthost *th, **p2;
   unsigned int marker;
@@ -184,6 +208,9 @@ static void displaygroup(nick *sender, trustgroup *tg, int showchildren) {
   controlreply(sender, "Trusted for      : %s", formatlimit(tg->trustedfor));
   controlreply(sender, "Currently using  : %d", tg->count);
   controlreply(sender, "Clients per user : %s", formatlimit(tg->maxperident));
+  controlreply(sender, "Distinct idents  : %u", tg->identcount);
+  if(showchildren)
+    displayidents(sender, tg);
   controlreply(sender, "Flags            : %s", formatflags(tg->flags));
   controlreply(sender, "Contact          : %s", tg->contact->content);
   controlreply(sender, "Expires in       : %s", (tg->expires)?((tg->expires>t)?longtoduration(tg->expires - t, 2):"the past (will be removed during next cleanup)"):"never");
@@ -350,7 +377,7 @@ static void registercommands(int hooknum, void *arg) {
     return;
   commandsregistered = 1;
 
-  registercontrolhelpcmd("trustlist", NO_OPER, 2, trusts_cmdtrustlist, "Usage: trustlist [-v] <#id|name|IP|&qid>\nShows trust data for the specified trust group.");
+  registercontrolhelpcmd("trustlist", NO_OPER, 2, trusts_cmdtrustlist, "Usage: trustlist [-v] <#id|name|IP|&qid>\nShows trust data for the specified trust group, -v also shows child hosts and the most used idents.");
   registercontrolhelpcmd("trustlistrelay", NO_RELAY, 2, trusts_cmdtrustlist, "Same as trustlist, but for the relay.");
   registercontrolhelpcmd("trustglinesuggest", NO_OPER, 1, trusts_cmdtrustglinesuggest, "Usage: trustglinesuggest <user@host>\nSuggests glines for the specified hostmask.");
   registercontrolhelpcmd("trustspew", NO_OPER, 1, trusts_cmdtrustspew, "Usage: trustspew <#id|name>\nShows currently connected users for the specified trust group.");
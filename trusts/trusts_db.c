@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 #include "../lib/version.h"
+#include "../lib/array.h"
 #include "../dbapi2/dbapi2.h"
 #include "../core/error.h"
 #include "../core/hooks.h"
@@ -16,11 +20,26 @@ static int tgmaxid, thmaxid;
 static int loaderror;
 static void *flushschedule;
 
+/* generation of the groups/hosts tables, bumped on every change we make to them */
+static unsigned int dbgeneration;
+static unsigned int snapshotgeneration;
+static int snapshotchecked, nosnapshot, reconcilestale;
+
+struct reconcilehost {
+  trusthost th;
+  unsigned int groupid;
+};
+
+static array reconcilegroups, reconcilehosts;
+
 void createtrusttables(int migration);
 void trusts_flush(void (*)(trusthost *), void (*)(trustgroup *));
 void trusts_freeall(void);
+int trusts_savesnapshot(unsigned int, unsigned int, unsigned int);
+int trusts_loadsnapshot(unsigned int *, unsigned int *, unsigned int *);
 static void th_dbupdatecounts(trusthost *th);
 static void tg_dbupdatecounts(trustgroup *tg);
+static void startreconcile(void);
 
 void createtrusttables(int mode) {
   char *groups, *hosts;
@@ -48,10 +67,35 @@ void createtrusttables(int mode) {
     "CREATE TABLE ? (groupid INT, groupname VARCHAR(?), ts INT, username VARCHAR(?), message VARCHAR(?))",
     "Tddd", "log", TRUSTNAMELEN, CREATEDBYLEN, TRUSTLOGLEN
   );
+
+  if(mode == TABLES_REGULAR)
+    trustsdb->createtable(trustsdb, NULL, NULL, "CREATE TABLE ? (generation INT)", "T", "generation");
+}
+
+void trustsdb_bumpgeneration(void) {
+  unsigned int t = time(NULL);
+
+  /* anything we read back for reconciliation is now out of date */
+  if(trustsdbreconciling)
+    reconcilestale = 1;
+
+  dbgeneration = (t > dbgeneration) ? t : dbgeneration + 1;
+
+  trustsdb->squery(trustsdb, "DELETE FROM ?", "T", "generation");
+  trustsdb->squery(trustsdb, "INSERT INTO ? (generation) VALUES (?)", "Tu", "generation", dbgeneration);
+}
+
+static void savesnapshot(void) {
+  /* until we've caught up with the database the snapshot would lie about its generation */
+  if(trustsdbreconciling || nosnapshot)
+    return;
+
+  trusts_savesnapshot(dbgeneration, tgmaxid, thmaxid);
 }
 
 static void flushdatabase(void *arg) {
   trusts_flush(th_dbupdatecounts, tg_dbupdatecounts);
+  savesnapshot();
 }
 
 static void triggerdbloaded(void *arg) {
@@ -70,59 +114,72 @@ static void loadcomplete(void) {
   scheduleoneshot(time(NULL), triggerdbloaded, NULL);
 }
 
-static void loadhosts_data(const DBAPIResult *result, void *tag) {
-  if(!result) {
-    loaderror = 1;
-    return;
+static int parsehostrow(const DBAPIResult *result, trusthost *th, unsigned int *groupid) {
+  char *host;
+
+  th->id = strtoul(result->get(result, 0), NULL, 10);
+  *groupid = strtoul(result->get(result, 1), NULL, 10);
+
+  host = result->get(result, 2);
+  if(!ipmask_parse(host, &th->ip, &th->bits)) {
+    Error("trusts", ERR_WARNING, "Error parsing cidr for host: %s", host);
+    return 0;
   }
 
+  th->maxusage = strtoul(result->get(result, 3), NULL, 10);
+  th->created = (time_t)strtoul(result->get(result, 4), NULL, 10);
+  th->lastseen = (time_t)strtoul(result->get(result, 5), NULL, 10);
+  th->maxpernode = strtol(result->get(result, 6), NULL, 10);
+  th->nodebits = strtol(result->get(result, 7), NULL, 10);
+
+  return 1;
+}
+
+static int checkhostresult(const DBAPIResult *result) {
+  if(!result)
+    return 0;
+
   if(!result->success) {
     Error("trusts", ERR_ERROR, "Error loading hosts table.");
-    loaderror = 1;
 
     result->clear(result);
-    return;
+    return 0;
   }
 
   if(result->fields != 8) {
     Error("trusts", ERR_ERROR, "Wrong number of fields in hosts table.");
-    loaderror = 1;
 
     result->clear(result);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void loadhosts_data(const DBAPIResult *result, void *tag) {
+  if(!checkhostresult(result)) {
+    loaderror = 1;
     return;
   }
 
   while(result->next(result)) {
     unsigned int groupid;
     trusthost th;
-    char *host;
 
-    th.id = strtoul(result->get(result, 0), NULL, 10);
+    if(!parsehostrow(result, &th, &groupid))
+      continue;
+
     if(th.id > thmaxid)
       thmaxid = th.id;
 
-    groupid = strtoul(result->get(result, 1), NULL, 10);
-
     th.group = tg_getbyid(groupid);
     if(!th.group) {
       Error("trusts", ERR_WARNING, "Orphaned trust group host: %d", groupid);
       continue;
     }
 
-    host = result->get(result, 2);
-    if(!ipmask_parse(host, &th.ip, &th.bits)) {
-      Error("trusts", ERR_WARNING, "Error parsing cidr for host: %s", host);
-      continue;
-    }
-
-    th.maxusage = strtoul(result->get(result, 3), NULL, 10);
-    th.created = (time_t)strtoul(result->get(result, 4), NULL, 10);
-    th.lastseen = (time_t)strtoul(result->get(result, 5), NULL, 10);
-    th.maxpernode = strtol(result->get(result, 6), NULL, 10);
-    th.nodebits = strtol(result->get(result, 7), NULL, 10);
-
     if(!th_add(&th))
-      Error("trusts", ERR_WARNING, "Error adding host to trust %d: %s", groupid, host);
+      Error("trusts", ERR_WARNING, "Error adding host to trust %d: %s", groupid, result->get(result, 2));
   }
 
   result->clear(result);
@@ -134,53 +191,71 @@ static void loadhosts_fini(const DBAPIResult *result, void *tag) {
   Error("trusts", ERR_INFO, "Finished loading hosts, maximum id: %d", thmaxid);
 }
 
-static void loadgroups_data(const DBAPIResult *result, void *tag) {
-  if(!result) {
-    loaderror = 1;
-    return;
-  }
+static int parsegrouprow(const DBAPIResult *result, trustgroup *tg) {
+  tg->id = strtoul(result->get(result, 0), NULL, 10);
+  tg->name = getsstring(rtrim(result->get(result, 1)), TRUSTNAMELEN);
+  tg->trustedfor = strtoul(result->get(result, 2), NULL, 10);
+  tg->flags = atoi(result->get(result, 3));
+  tg->maxperident = strtoul(result->get(result, 4), NULL, 10);
+  tg->maxusage = strtoul(result->get(result, 5), NULL, 10);
+  tg->expires = (time_t)strtoul(result->get(result, 6), NULL, 10);
+  tg->lastseen = (time_t)strtoul(result->get(result, 7), NULL, 10);
+  tg->lastmaxusereset = (time_t)strtoul(result->get(result, 8), NULL, 10);
+  tg->createdby = getsstring(rtrim(result->get(result, 9)), CREATEDBYLEN);
+  tg->contact = getsstring(rtrim(result->get(result, 10)), CONTACTLEN);
+  tg->comment = getsstring(rtrim(result->get(result, 11)), COMMENTLEN);
+
+  if(tg->name && tg->createdby && tg->contact && tg->comment)
+    return 1;
+
+  Error("trusts", ERR_ERROR, "Error allocating sstring in group loader, id: %d", tg->id);
+
+  freesstring(tg->name);
+  freesstring(tg->createdby);
+  freesstring(tg->contact);
+  freesstring(tg->comment);
+
+  return 0;
+}
+
+static int checkgroupresult(const DBAPIResult *result) {
+  if(!result)
+    return 0;
 
   if(!result->success) {
     Error("trusts", ERR_ERROR, "Error loading group table.");
-    loaderror = 1;
 
     result->clear(result);
-    return;
+    return 0;
   }
 
   if(result->fields != 12) {
     Error("trusts", ERR_ERROR, "Wrong number of fields in groups table.");
-    loaderror = 1;
 
     result->clear(result);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void loadgroups_data(const DBAPIResult *result, void *tag) {
+  if(!checkgroupresult(result)) {
+    loaderror = 1;
     return;
   }
 
   while(result->next(result)) {
     trustgroup tg;
 
-    tg.id = strtoul(result->get(result, 0), NULL, 10);
+    if(!parsegrouprow(result, &tg))
+      continue;
+
     if(tg.id > tgmaxid)
       tgmaxid = tg.id;
 
-    tg.name = getsstring(rtrim(result->get(result, 1)), TRUSTNAMELEN);
-    tg.trustedfor = strtoul(result->get(result, 2), NULL, 10);
-    tg.flags = atoi(result->get(result, 3));
-    tg.maxperident = strtoul(result->get(result, 4), NULL, 10);
-    tg.maxusage = strtoul(result->get(result, 5), NULL, 10);
-    tg.expires = (time_t)strtoul(result->get(result, 6), NULL, 10);
-    tg.lastseen = (time_t)strtoul(result->get(result, 7), NULL, 10);
-    tg.lastmaxusereset = (time_t)strtoul(result->get(result, 8), NULL, 10);
-    tg.createdby = getsstring(rtrim(result->get(result, 9)), CREATEDBYLEN);
-    tg.contact = getsstring(rtrim(result->get(result, 10)), CONTACTLEN);
-    tg.comment = getsstring(rtrim(result->get(result, 11)), COMMENTLEN);
-
-    if(tg.name && tg.createdby && tg.contact && tg.comment) {
-      if(!tg_add(&tg))
-        Error("trusts", ERR_WARNING, "Error adding trustgroup %d: %s", tg.id, tg.name->content);
-    } else {
-      Error("trusts", ERR_ERROR, "Error allocating sstring in group loader, id: %d", tg.id);
-    }
+    if(!tg_add(&tg))
+      Error("trusts", ERR_WARNING, "Error adding trustgroup %d: %s", tg.id, tg.name->content);
 
     freesstring(tg.name);
     freesstring(tg.createdby);
@@ -195,6 +270,358 @@ static void loadgroups_fini(const DBAPIResult *result, void *tag) {
   Error("trusts", ERR_INFO, "Finished loading groups, maximum id: %d.", tgmaxid);
 }
 
+static unsigned int getgeneration(const DBAPIResult *result) {
+  unsigned int generation = 0;
+
+  if(!result)
+    return 0;
+
+  if(result->success && result->next(result))
+    generation = strtoul(result->get(result, 0), NULL, 10);
+
+  result->clear(result);
+
+  return generation;
+}
+
+static void loadgeneration_data(const DBAPIResult *result, void *tag) {
+  dbgeneration = getgeneration(result);
+}
+
+static void freereconcile(void) {
+  trustgroup *tg;
+  int i;
+
+  for(i=0;i<reconcilegroups.cursi;i++) {
+    tg = &((trustgroup *)reconcilegroups.content)[i];
+
+    freesstring(tg->name);
+    freesstring(tg->createdby);
+    freesstring(tg->contact);
+    freesstring(tg->comment);
+  }
+
+  array_free(&reconcilegroups);
+  array_free(&reconcilehosts);
+}
+
+static void triggerdbreconciled(void *arg) {
+  triggerhook(HOOK_TRUSTS_DB_RECONCILED, NULL);
+}
+
+static void finishreconcile(int changes) {
+  freereconcile();
+  trustsdbreconciling = 0;
+
+  if(changes)
+    savesnapshot();
+
+  scheduleoneshot(time(NULL), triggerdbreconciled, NULL);
+}
+
+static void abortreconcile(void) {
+  Error("trusts", ERR_ERROR, "Unable to reconcile trust snapshot with database, using snapshot data until restart.");
+
+  /* our data no longer corresponds to any database generation */
+  nosnapshot = 1;
+  finishreconcile(0);
+}
+
+static int tg_differs(trustgroup *tg, trustgroup *dbtg) {
+  return tg->trustedfor != dbtg->trustedfor || tg->flags != dbtg->flags || tg->maxperident != dbtg->maxperident ||
+    tg->expires != dbtg->expires || tg->lastmaxusereset != dbtg->lastmaxusereset ||
+    strcmp(tg->name->content, dbtg->name->content) || strcmp(tg->createdby->content, dbtg->createdby->content) ||
+    strcmp(tg->contact->content, dbtg->contact->content) || strcmp(tg->comment->content, dbtg->comment->content);
+}
+
+static trusthost *th_attach(trusthost *);
+static void th_detach(trusthost *);
+static void tg_detach(trustgroup *);
+
+/*
+ * Brings the groups/hosts loaded from the snapshot in line with what the database
+ * holds, firing the same hooks the management commands would so other modules
+ * (e.g. the replication master) see the changes.
+ */
+static int applyreconcile(void) {
+  trustgroup *tg, *dbtg, **tgbyid;
+  trusthost *th, **thbyid;
+  struct reconcilehost *rh;
+  unsigned int tgmarker, thmarker, maxtg, maxth;
+  int i, added = 0, modified = 0, removed = 0;
+  array stale;
+
+  maxtg = tgmaxid;
+  for(i=0;i<reconcilegroups.cursi;i++)
+    if(((trustgroup *)reconcilegroups.content)[i].id > maxtg)
+      maxtg = ((trustgroup *)reconcilegroups.content)[i].id;
+
+  maxth = thmaxid;
+  for(i=0;i<reconcilehosts.cursi;i++)
+    if(((struct reconcilehost *)reconcilehosts.content)[i].th.id > maxth)
+      maxth = ((struct reconcilehost *)reconcilehosts.content)[i].th.id;
+
+  tgbyid = calloc(maxtg + 1, sizeof(trustgroup *));
+  thbyid = calloc(maxth + 1, sizeof(trusthost *));
+  if(!tgbyid || !thbyid) {
+    free(tgbyid);
+    free(thbyid);
+    return -1;
+  }
+
+  for(tg=tglist;tg;tg=tg->next) {
+    if(tg->id <= maxtg)
+      tgbyid[tg->id] = tg;
+
+    for(th=tg->hosts;th;th=th->next)
+      if(th->id <= maxth)
+        thbyid[th->id] = th;
+  }
+
+  tgmarker = nexttgmarker();
+  for(i=0;i<reconcilegroups.cursi;i++) {
+    dbtg = &((trustgroup *)reconcilegroups.content)[i];
+    tg = tgbyid[dbtg->id];
+
+    if(!tg) {
+      tg = tg_add(dbtg);
+      if(!tg) {
+        Error("trusts", ERR_WARNING, "Error adding trustgroup %d: %s", dbtg->id, dbtg->name->content);
+        continue;
+      }
+
+      tgbyid[tg->id] = tg;
+      triggerhook(HOOK_TRUSTS_ADDGROUP, tg);
+      added++;
+    } else {
+      unsigned int maxusage = tg->maxusage;
+      time_t lastseen = tg->lastseen;
+
+      if(tg_differs(tg, dbtg) && tg_modify(tg, dbtg)) {
+        triggerhook(HOOK_TRUSTS_MODIFYGROUP, tg);
+        modified++;
+      }
+
+      /* counts are only flushed periodically, keep whichever is newer */
+      tg->maxusage = (maxusage > dbtg->maxusage) ? maxusage : dbtg->maxusage;
+      tg->lastseen = (lastseen > dbtg->lastseen) ? lastseen : dbtg->lastseen;
+    }
+
+    if(tg->id > tgmaxid)
+      tgmaxid = tg->id;
+
+    tg->marker = tgmarker;
+  }
+
+  thmarker = nextthmarker();
+  for(i=0;i<reconcilehosts.cursi;i++) {
+    rh = &((struct reconcilehost *)reconcilehosts.content)[i];
+
+    tg = (rh->groupid <= maxtg) ? tgbyid[rh->groupid] : NULL;
+    if(!tg || tg->marker != tgmarker) {
+      Error("trusts", ERR_WARNING, "Orphaned trust group host: %d", rh->groupid);
+      continue;
+    }
+
+    th = thbyid[rh->th.id];
+    if(th && (th->group != tg || th->bits != rh->th.bits || memcmp(&th->ip, &rh->th.ip, sizeof(th->ip)))) {
+      /* not something we can modify in place */
+      triggerhook(HOOK_TRUSTS_DELHOST, th);
+      th_detach(th);
+      thbyid[rh->th.id] = th = NULL;
+      removed++;
+    }
+
+    if(!th) {
+      rh->th.group = tg;
+
+      th = th_attach(&rh->th);
+      if(!th) {
+        Error("trusts", ERR_WARNING, "Error adding host to trust %d: %s", tg->id, CIDRtostr(rh->th.ip, rh->th.bits));
+        continue;
+      }
+
+      thbyid[th->id] = th;
+      triggerhook(HOOK_TRUSTS_ADDHOST, th);
+      added++;
+    } else {
+      if(th->maxpernode != rh->th.maxpernode || th->nodebits != rh->th.nodebits) {
+        th_modify(th, &rh->th);
+        triggerhook(HOOK_TRUSTS_MODIFYHOST, th);
+        modified++;
+      }
+
+      if(rh->th.maxusage > th->maxusage)
+        th->maxusage = rh->th.maxusage;
+      if(rh->th.lastseen > th->lastseen)
+        th->lastseen = rh->th.lastseen;
+    }
+
+    if(th->id > thmaxid)
+      thmaxid = th->id;
+
+    th->marker = thmarker;
+  }
+
+  free(tgbyid);
+  free(thbyid);
+
+  /* anything left unmarked has been removed from the database */
+  array_init(&stale, sizeof(trusthost *));
+  for(tg=tglist;tg;tg=tg->next)
+    for(th=tg->hosts;th;th=th->next)
+      if(th->marker != thmarker)
+        ((trusthost **)stale.content)[array_getfreeslot(&stale)] = th;
+
+  for(i=0;i<stale.cursi;i++) {
+    th = ((trusthost **)stale.content)[i];
+    triggerhook(HOOK_TRUSTS_DELHOST, th);
+    th_detach(th);
+    removed++;
+  }
+  array_free(&stale);
+
+  array_init(&stale, sizeof(trustgroup *));
+  for(tg=tglist;tg;tg=tg->next)
+    if(tg->marker != tgmarker)
+      ((trustgroup **)stale.content)[array_getfreeslot(&stale)] = tg;
+
+  for(i=0;i<stale.cursi;i++) {
+    tg = ((trustgroup **)stale.content)[i];
+    triggerhook(HOOK_TRUSTS_DELGROUP, tg);
+    tg_detach(tg);
+    removed++;
+  }
+  array_free(&stale);
+
+  Error("trusts", ERR_INFO, "Reconciled trust snapshot with database (generation %u): %d added, %d modified, %d removed.", dbgeneration, added, modified, removed);
+
+  return added + modified + removed;
+}
+
+static void reconcilegroups_data(const DBAPIResult *result, void *tag) {
+  if(!trustsdbreconciling) {
+    if(result)
+      result->clear(result);
+    return;
+  }
+
+  if(!checkgroupresult(result)) {
+    abortreconcile();
+    return;
+  }
+
+  while(result->next(result)) {
+    trustgroup tg;
+
+    if(!parsegrouprow(result, &tg))
+      continue;
+
+    ((trustgroup *)reconcilegroups.content)[array_getfreeslot(&reconcilegroups)] = tg;
+  }
+
+  result->clear(result);
+}
+
+static void reconcilehosts_data(const DBAPIResult *result, void *tag) {
+  int changes;
+
+  if(!trustsdbreconciling) {
+    if(result)
+      result->clear(result);
+    return;
+  }
+
+  if(!checkhostresult(result)) {
+    abortreconcile();
+    return;
+  }
+
+  while(result->next(result)) {
+    struct reconcilehost rh;
+
+    if(!parsehostrow(result, &rh.th, &rh.groupid))
+      continue;
+
+    ((struct reconcilehost *)reconcilehosts.content)[array_getfreeslot(&reconcilehosts)] = rh;
+  }
+
+  result->clear(result);
+
+  if(reconcilestale) {
+    /* we changed the tables while reading them, go around again */
+    freereconcile();
+    startreconcile();
+    return;
+  }
+
+  changes = applyreconcile();
+  if(changes < 0) {
+    abortreconcile();
+    return;
+  }
+
+  finishreconcile(changes);
+}
+
+static void reconcilegeneration_data(const DBAPIResult *result, void *tag) {
+  unsigned int generation;
+
+  if(!trustsdbreconciling) {
+    if(result)
+      result->clear(result);
+    return;
+  }
+
+  generation = getgeneration(result);
+
+  if(generation == snapshotgeneration && !reconcilestale) {
+    Error("trusts", ERR_INFO, "Trust snapshot is up to date with database (generation %u).", generation);
+    finishreconcile(0);
+    return;
+  }
+
+  dbgeneration = generation;
+
+  trustsdb->loadtable(trustsdb, NULL, reconcilegroups_data, NULL, NULL, "groups");
+  trustsdb->loadtable(trustsdb, NULL, reconcilehosts_data, NULL, NULL, "hosts");
+}
+
+static void startreconcile(void) {
+  reconcilestale = 0;
+
+  array_init(&reconcilegroups, sizeof(trustgroup));
+  array_init(&reconcilehosts, sizeof(struct reconcilehost));
+
+  trustsdb->query(trustsdb, reconcilegeneration_data, NULL, "SELECT generation FROM ?", "T", "generation");
+}
+
+static int loadsnapshot(void) {
+  unsigned int generation, maxtg, maxth;
+  struct timeval start, end;
+
+  gettimeofday(&start, NULL);
+
+  if(!trusts_loadsnapshot(&generation, &maxtg, &maxth))
+    return 0;
+
+  snapshotgeneration = dbgeneration = generation;
+  tgmaxid = maxtg;
+  thmaxid = maxth;
+
+  /* policy can be enforced now, we catch up with the database in the background */
+  trustsdbreconciling = 1;
+  loadcomplete();
+
+  gettimeofday(&end, NULL);
+  Error("trusts", ERR_INFO, "Trust snapshot loaded in %ldms, reconciling with database.",
+    (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000));
+
+  startreconcile();
+
+  return 1;
+}
+
 static int trusts_connectdb(void) {
   if(!trustsdb) {
     trustsdb = dbapi2open("sqlite", "trusts");
@@ -215,6 +642,15 @@ int trusts_loaddb(void) {
 
   loaderror = 0;
 
+  /* only worth it at startup, later loads follow a table swap */
+  if(!snapshotchecked) {
+    snapshotchecked = 1;
+
+    if(loadsnapshot())
+      return 1;
+  }
+
+  trustsdb->query(trustsdb, loadgeneration_data, NULL, "SELECT generation FROM ?", "T", "generation");
   trustsdb->loadtable(trustsdb, NULL, loadgroups_data, loadgroups_fini, NULL, "groups");
   trustsdb->loadtable(trustsdb, NULL, loadhosts_data, loadhosts_fini, NULL, "hosts");
 
@@ -232,6 +668,11 @@ void trusts_closedb(int closeconnection) {
     flushdatabase(NULL);
   }
 
+  if(trustsdbreconciling) {
+    freereconcile();
+    trustsdbreconciling = 0;
+  }
+
   trusts_freeall();
 
   trustsdbloaded = 0;
@@ -253,15 +694,13 @@ static void tg_dbupdatecounts(trustgroup *tg) {
   trustsdb->squery(trustsdb, "UPDATE ? SET lastseen = ?, maxusage = ? WHERE id = ?", "Ttuu", "groups", tg->lastseen, tg->maxusage, tg->id);
 }
 
-trusthost *th_copy(trusthost *ith) {
+static trusthost *th_attach(trusthost *ith) {
   trusthost *th, *superset, *subset;
 
   th = th_add(ith);
   if(!th)
     return NULL;
 
-  trustsdb_insertth("hosts", th, th->group->id);
-
   th_getsuperandsubsets(&ith->ip, ith->bits, &superset, &subset);
   th_adjusthosts(th, superset, subset);
   th_linktree();
@@ -269,9 +708,26 @@ trusthost *th_copy(trusthost *ith) {
   return th;
 }
 
+trusthost *th_copy(trusthost *ith) {
+  trusthost *th;
+
+  th = th_attach(ith);
+  if(!th)
+    return NULL;
+
+  trustsdb_insertth("hosts", th, th->group->id);
+  trustsdb_bumpgeneration();
+
+  return th;
+}
+
 trusthost *th_new(trustgroup *tg, char *host) {
   trusthost *th, nth;
 
+  /* we don't know the highest id in use until the snapshot has been reconciled */
+  if(trustsdbreconciling)
+    return NULL;
+
   if(!ipmask_parse(host, &nth.ip, &nth.bits))
     return NULL;
 
@@ -302,12 +758,17 @@ trustgroup *tg_copy(trustgroup *itg) {
     return NULL;
 
   trustsdb_inserttg("groups", tg);
+  trustsdb_bumpgeneration();
+
   return tg;
 }
 
 trustgroup *tg_new(trustgroup *itg) {
   trustgroup *tg;
 
+  if(trustsdbreconciling)
+    return NULL;
+
   itg->id = tgmaxid + 1;
   itg->maxusage = 0;
   itg->lastseen = 0;
@@ -341,6 +802,7 @@ void tg_update(trustgroup *tg) {
     "UPDATE ? SET name = ?, trustedfor = ?, flags = ?, maxperident = ?, maxusage = ?, expires = ?, lastseen = ?, lastmaxusereset = ?, createdby = ?, contact = ?, comment = ? WHERE id = ?",
     "Tsuuuutttsssu", "groups", tg->name->content, tg->trustedfor, tg->flags, tg->maxperident, tg->maxusage, tg->expires, tg->lastseen, tg->lastmaxusereset, tg->createdby->content, tg->contact->content, tg->comment->content, tg->id
   );
+  trustsdb_bumpgeneration();
 }
 
 void trustsdb_deletetg(char *table, trustgroup *tg)  {
@@ -349,7 +811,7 @@ void trustsdb_deletetg(char *table, trustgroup *tg)  {
     "Tu", "groups", tg->id);
 }
 
-void tg_delete(trustgroup *tg) {
+static void tg_detach(trustgroup *tg) {
   trustgroup **pnext;
 
   for(pnext=&tglist;*pnext;pnext=&((*pnext)->next)) {
@@ -359,15 +821,21 @@ void tg_delete(trustgroup *tg) {
     }
   }
 
-  trustsdb_deletetg("groups", tg);
   tg_free(tg, 1);
 }
 
+void tg_delete(trustgroup *tg) {
+  trustsdb_deletetg("groups", tg);
+  trustsdb_bumpgeneration();
+  tg_detach(tg);
+}
+
 void th_update(trusthost *th) {
   trustsdb->squery(trustsdb,
     "UPDATE ? SET maxpernode = ?, nodebits = ? WHERE id = ?",
     "Tuuu", "hosts", th->maxpernode, th->nodebits, th->id
   );
+  trustsdb_bumpgeneration();
 }
 
 void trustsdb_deleteth(char *table, trusthost *th) {
@@ -376,7 +844,7 @@ void trustsdb_deleteth(char *table, trusthost *th) {
     "Tu", "hosts", th->id); 
 }
 
-void th_delete(trusthost *th) {
+static void th_detach(trusthost *th) {
   trusthost **pnext;
   nick *np;
 
@@ -396,8 +864,10 @@ void th_delete(trusthost *th) {
     }
   }
 
-  for(np=th->users;np;np=nextbytrust(np))
+  for(np=th->users;np;np=nextbytrust(np)) {
     settrusthost(np, NULL);
+    tg_delident(th->group, np->ident);
+  }
 
   th->group->count -= th->count;
 
@@ -408,12 +878,17 @@ void th_delete(trusthost *th) {
       th->parent->lastseen = th->lastseen;
   }
 
-  trustsdb_deleteth("hosts", th);
   th_free(th);
 
   th_linktree();
 }
 
+void th_delete(trusthost *th) {
+  trustsdb_deleteth("hosts", th);
+  trustsdb_bumpgeneration();
+  th_detach(th);
+}
+
 void trustlog(trustgroup *tg, const char *user, const char *format, ...) {
   char buf[TRUSTLOGLEN+1];
   va_list va;
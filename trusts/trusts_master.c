@@ -14,6 +14,23 @@
 
 MODULE_VERSION("");
 
+#define TRUSTCHANGELOGSIZE 1024
+
+typedef struct trustchange {
+  unsigned int seq;
+  char *command;
+  sstring *data;
+} trustchange;
+
+/*
+ * Every change gets a sequence number and is kept in a ring buffer so that
+ * slaves which missed some changes can catch up without a full resync.
+ * The epoch changes whenever the master is restarted, sequence numbers are
+ * only meaningful within an epoch.
+ */
+static trustchange changelog[TRUSTCHANGELOGSIZE];
+static unsigned int epoch, changeseq;
+
 static void broadcast(SHA1_CTX *c, unsigned int replicationid, unsigned int lineno, char *command, char *format, ...) {
   char buf[512], buf2[600];
   va_list va;
@@ -56,7 +73,7 @@ static void replicate(int forced) {
 
   SHA1Init(&s);
   lineno = 1;
-  broadcast(&s, replicationid, lineno++, "trinit", "%d %u", forced, lines);
+  broadcast(&s, replicationid, lineno++, "trinit", "%d %u %u %u", forced, lines, epoch, changeseq);
 
   for(tg=tglist;tg;tg=tg->next) {
     broadcast(&s, replicationid, lineno++, "trdata", "G %s", dumptg(tg, 0));
@@ -82,40 +99,95 @@ static int xsb_tr_requeststart(void *source, int argc, char **argv) {
   return CMD_OK;
 }
 
+/* trrequestdelta epoch seq */
+static int xsb_tr_requestdelta(void *source, int argc, char **argv) {
+  nick *np = source;
+  unsigned int slaveepoch, slaveseq, seq;
+  trustchange *c;
+
+  if(argc < 1)
+    return CMD_ERROR;
+
+  if(sscanf(argv[0], "%u %u", &slaveepoch, &slaveseq) != 2)
+    return CMD_ERROR;
+
+  /* slave has data from a previous master instance or has fallen out of the log */
+  if(slaveepoch != epoch || slaveseq > changeseq || changeseq - slaveseq > TRUSTCHANGELOGSIZE)
+    return xsb_tr_requeststart(source, 0, NULL);
+
+  for(seq=slaveseq+1;seq<=changeseq;seq++) {
+    c = &changelog[seq % TRUSTCHANGELOGSIZE];
+    xsb_unicast(c->command, np, "%u %u %s", epoch, c->seq, c->data->content);
+  }
+
+  xsb_unicast("trdeltaend", np, "%u %u", epoch, changeseq);
+
+  return CMD_OK;
+}
+
+static void logchange(char *command, char *format, ...) {
+  char buf[512];
+  trustchange *c;
+  va_list va;
+
+  va_start(va, format);
+  vsnprintf(buf, sizeof(buf), format, va);
+  va_end(va);
+
+  changeseq++;
+
+  c = &changelog[changeseq % TRUSTCHANGELOGSIZE];
+  freesstring(c->data);
+  c->seq = changeseq;
+  c->command = command;
+  c->data = getsstring(buf, sizeof(buf));
+
+  xsb_broadcast(command, NULL, "%u %u %s", epoch, changeseq, buf);
+}
+
+static void freechangelog(void) {
+  int i;
+
+  for(i=0;i<TRUSTCHANGELOGSIZE;i++) {
+    freesstring(changelog[i].data);
+    changelog[i].data = NULL;
+  }
+}
+
 static void groupadded(int hooknum, void *arg) {
   trustgroup *tg = arg;
 
-  xsb_broadcast("traddgroup", NULL, "%s", dumptg(tg, 0));
+  logchange("traddgroup", "%s", dumptg(tg, 0));
 }
 
 static void groupremoved(int hooknum, void *arg) {
   trustgroup *tg = arg;
 
-  xsb_broadcast("trdelgroup", NULL, "%u", tg->id);
+  logchange("trdelgroup", "%u", tg->id);
 }
 
 static void hostadded(int hooknum, void *arg) {
   trusthost *th = arg;
 
-  xsb_broadcast("traddhost", NULL, "%s", dumpth(th, 0));
+  logchange("traddhost", "%s", dumpth(th, 0));
 }
 
 static void hostremoved(int hooknum, void *arg) {
   trusthost *th = arg;
 
-  xsb_broadcast("trdelhost", NULL, "%u", th->id);
+  logchange("trdelhost", "%u", th->id);
 }
 
 static void groupmodified(int hooknum, void *arg) {
   trustgroup *tg = arg;
 
-  xsb_broadcast("trmodifygroup", NULL, "%s", dumptg(tg, 0));
+  logchange("trmodifygroup", "%s", dumptg(tg, 0));
 }
 
 static void hostmodified(int hooknum, void *arg) {
   trusthost *th = arg;
 
-  xsb_broadcast("trmodifyhost", NULL, "%s", dumpth(th, 0));
+  logchange("trmodifyhost", "%s", dumpth(th, 0));
 }
 
 static int trusts_cmdtrustforceresync(void *source, int argc, char **argv) {
@@ -123,7 +195,7 @@ static int trusts_cmdtrustforceresync(void *source, int argc, char **argv) {
 
   controlreply(np, "Resync in progress. . .");
   replicate(1);
-  controlreply(np, "Resync complete.");
+  controlreply(np, "Resync complete (epoch %u, sequence %u).", epoch, changeseq);
 
   return CMD_OK;
 }
@@ -136,6 +208,7 @@ static void __dbloaded(int hooknum, void *arg) {
   commandsregistered = 1;
 
   xsb_addcommand("trrequeststart", 0, xsb_tr_requeststart);
+  xsb_addcommand("trrequestdelta", 1, xsb_tr_requestdelta);
 
   registerhook(HOOK_TRUSTS_ADDGROUP, groupadded);
   registerhook(HOOK_TRUSTS_DELGROUP, groupremoved);
@@ -158,13 +231,14 @@ static void __dbclosed(int hooknum, void *arg) {
   commandsregistered = 0;
 
   xsb_delcommand("trrequeststart", xsb_tr_requeststart);
+  xsb_delcommand("trrequestdelta", xsb_tr_requestdelta);
 
-  registerhook(HOOK_TRUSTS_ADDGROUP, groupadded);
-  registerhook(HOOK_TRUSTS_DELGROUP, groupremoved);
-  registerhook(HOOK_TRUSTS_ADDHOST, hostadded);
-  registerhook(HOOK_TRUSTS_DELGROUP, hostremoved);
-  registerhook(HOOK_TRUSTS_MODIFYGROUP, groupmodified);
-  registerhook(HOOK_TRUSTS_MODIFYHOST, hostmodified);
+  deregisterhook(HOOK_TRUSTS_ADDGROUP, groupadded);
+  deregisterhook(HOOK_TRUSTS_DELGROUP, groupremoved);
+  deregisterhook(HOOK_TRUSTS_ADDHOST, hostadded);
+  deregisterhook(HOOK_TRUSTS_DELHOST, hostremoved);
+  deregisterhook(HOOK_TRUSTS_MODIFYGROUP, groupmodified);
+  deregisterhook(HOOK_TRUSTS_MODIFYHOST, hostmodified);
 
   deregistercontrolcmd("trustforceresync", trusts_cmdtrustforceresync);
 }
@@ -180,6 +254,14 @@ void _init(void) {
 
   loaded = 1;
 
+  /* slaves holding data from an earlier instance will need a full resync,
+     the random part keeps restarts within the same second apart and 0
+     means "unknown" to them */
+  do {
+    epoch = (unsigned int)time(NULL) ^ trusts_getrandint();
+  } while(!epoch);
+  changeseq = 0;
+
   registerhook(HOOK_TRUSTS_DB_LOADED, __dbloaded);
   registerhook(HOOK_TRUSTS_DB_CLOSED, __dbclosed);
 
@@ -206,4 +288,6 @@ void _fini(void) {
   trusts_closedb(0);
 
   __dbclosed(0, NULL);
+
+  freechangelog();
 }
@@ -16,6 +16,7 @@
 #include <sys/poll.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/time.h>
 
 #include "../lib/version.h"
 #include "../lib/hmac.h"
@@ -28,17 +29,23 @@
 #include "../lib/irc_string.h"
 #include "../irc/irc.h"
 #include "../glines/glines.h"
-#include "../patricianick/patricianick.h"
 #include "trusts.h"
 
 MODULE_VERSION("");
 
-static int countext, enforcepolicy_irc, enforcepolicy_auth;
+static int countext, enforcepolicy_irc, enforcepolicy_auth, defaultmaxinflight;
 
 #define TRUSTBUFSIZE 8192
+#define TRUSTWBUFSIZE 65536
+#define TRUSTLINELEN 1024
 #define TRUSTPASSLEN 128
 #define NONCELEN 16
 
+#define DEFAULT_MAXINFLIGHT 500
+
+/* latency buckets: <100us, <1ms, <10ms, <100ms, <1s, >=1s */
+#define TRUSTLATENCYBUCKETS 6
+
 typedef struct trustsocket {
   int fd;
   int authed;
@@ -52,17 +59,31 @@ typedef struct trustsocket {
   int rejected;
   int unthrottled;
 
+  /* replies are buffered here and written once per batch */
+  char wbuf[TRUSTWBUFSIZE];
+  int wsize;
+  int blocked;
+
+  /* checks whose replies haven't been written to the socket yet */
+  int inflight, maxinflight;
+  struct timeval inflightsince;
+
+  unsigned int checks, batches, maxbatch;
+  unsigned int latency[TRUSTLATENCYBUCKETS];
+  time_t ratesecond;
+  unsigned int ratecount, peakrate;
+
   struct trustsocket *next;
 } trustsocket;
 
 static trustsocket *tslist;
 static int listenerfd = -1;
-static FILE *urandom;
 
 typedef struct trustaccount {
   int used;
   char server[SERVERLEN+1];
   char password[TRUSTPASSLEN+1];
+  int maxinflight;
 } trustaccount;
 
 trustaccount trustaccounts[MAXSERVERS];
@@ -95,25 +116,14 @@ static int checkconnection(const char *username, struct irc_in_addr *ipaddress,
    */
 
   if(hooknum == HOOK_TRUSTS_NEWNICK) {
-    patricia_node_t *head, *node;
-    int i, nodecount = 0;
-    patricianick_t *pnp;
-    nick *npp;
+    patricia_node_t *head;
+    int nodecount = 0;
 
     head = refnode(iptree, &ipaddress_canonical, th->nodebits);
     nodecount = head->usercount;
 
     /* Account for borrowed IP addresses. */
-    PATRICIA_WALK(head, node) {
-      pnp = node->exts[pnode_ext];
-
-      if (pnp)
-        for (i = 0; i < PATRICIANICK_HASHSIZE; i++)
-          for (npp = pnp->identhash[i]; npp; npp=npp->exts[pnick_ext])
-            if (NickOnServiceServer(npp))
-              usercountadjustment--;
-    }
-    PATRICIA_WALK_END;
+    usercountadjustment -= head->serviceusercount;
 
     derefnode(iptree, head);
 
@@ -142,16 +152,7 @@ static int checkconnection(const char *username, struct irc_in_addr *ipaddress,
     }
 
     if(tg->maxperident > 0) {
-      int identcount = 0;
-      trusthost *th2;
-      nick *tnp;
-
-      for(th2=tg->hosts;th2;th2=th2->next) {
-        for(tnp=th2->users;tnp;tnp=nextbytrust(tnp)) {
-          if(!ircd_strcmp(tnp->ident, username))
-            identcount++;
-        }
-      }
+      int identcount = tg_getidentcount(tg, username);
 
       if(identcount + usercountadjustment > tg->maxperident) {
         controlwall(NO_OPER, NL_CLONING, "Hard ident limit exceeded: %s@%s (group: %s): %d connected, %d max.", username, IPtostr(*ipaddress), tg->name->content, identcount + usercountadjustment, tg->maxperident);
@@ -173,22 +174,79 @@ static int checkconnection(const char *username, struct irc_in_addr *ipaddress,
   return POLICY_SUCCESS;
 }
 
+static void processtrustclient(int fd, short events);
+
+static int trustflush(trustsocket *sock) {
+  int r;
+
+  while(sock->wsize > 0) {
+    r = write(sock->fd, sock->wbuf, sock->wsize);
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      return 0;
+    }
+
+    sock->wsize -= r;
+    memmove(sock->wbuf, sock->wbuf + r, sock->wsize);
+  }
+
+  if(sock->wsize == 0 && sock->inflight > 0) {
+    struct timeval now;
+    long usec;
+    int bucket;
+
+    gettimeofday(&now, NULL);
+    usec = (now.tv_sec - sock->inflightsince.tv_sec) * 1000000 + (now.tv_usec - sock->inflightsince.tv_usec);
+
+    for(bucket=0;bucket<TRUSTLATENCYBUCKETS-1 && usec >= 100;bucket++)
+      usec /= 10;
+
+    sock->latency[bucket] += sock->inflight;
+    sock->inflight = 0;
+  }
+
+  if(sock->wsize > 0 && !sock->blocked) {
+    /* stop reading until the ircd has caught up with our replies */
+    sock->blocked = 1;
+    deregisterhandler(sock->fd, 0);
+    registerhandler(sock->fd, POLLOUT|POLLERR|POLLHUP, processtrustclient);
+  } else if(sock->wsize == 0 && sock->blocked) {
+    sock->blocked = 0;
+    deregisterhandler(sock->fd, 0);
+    registerhandler(sock->fd, POLLIN|POLLERR|POLLHUP, processtrustclient);
+  }
+
+  return 1;
+}
+
 static int trustdowrite(trustsocket *sock, char *format, ...) {
-  char buf[1024];
   va_list va;
   int r;
 
+  if(TRUSTWBUFSIZE - sock->wsize < TRUSTLINELEN + 1) {
+    if(!trustflush(sock))
+      return 0;
+
+    /* the in-flight limit should make sure that this doesn't happen */
+    if(TRUSTWBUFSIZE - sock->wsize < TRUSTLINELEN + 1)
+      return 0;
+  }
+
   va_start(va, format);
-  r = vsnprintf(buf, sizeof(buf), format, va);
+  r = vsnprintf(sock->wbuf + sock->wsize, TRUSTLINELEN, format, va);
   va_end(va);
 
-  if(r >= sizeof(buf))
-    r = sizeof(buf) - 1;
+  if(r >= TRUSTLINELEN)
+    r = TRUSTLINELEN - 1;
 
-  buf[r] = '\n';
+  sock->wbuf[sock->wsize + r] = '\n';
+  sock->wsize += r + 1;
 
-  if(write(sock->fd, buf, r + 1) != r + 1)
-    return 0;
   return 1;
 }
 
@@ -197,6 +255,18 @@ static int policycheck_auth(trustsocket *sock, const char *sequence_id, const ch
   int verdict, unthrottle;
   struct irc_in_addr ipaddress;
   unsigned char bits;
+  time_t now = time(NULL);
+
+  if(sock->inflight++ == 0)
+    gettimeofday(&sock->inflightsince, NULL);
+
+  sock->checks++;
+  if(sock->ratesecond != now) {
+    sock->ratesecond = now;
+    sock->ratecount = 0;
+  }
+  if(++sock->ratecount > sock->peakrate)
+    sock->peakrate = sock->ratecount;
 
   if(!ipmask_parse(host, &ipaddress, &bits)) {
     sock->accepted++;
@@ -230,6 +300,7 @@ static int policycheck_auth(trustsocket *sock, const char *sequence_id, const ch
 
 static int trustkillconnection(trustsocket *sock, char *reason) {
   trustdowrite(sock, "QUIT %s", reason);
+  trustflush(sock);
   return 0;
 }
 
@@ -265,6 +336,7 @@ static int handletrustauth(trustsocket *sock, char *server_name, char *mac) {
   for(i=0;i<MAXSERVERS;i++) {
     if(trustaccounts[i].used && strcmp(trustaccounts[i].server, server_name) == 0) {
       password = trustaccounts[i].password;
+      sock->maxinflight = trustaccounts[i].maxinflight;
       break;
     }
   }
@@ -354,25 +426,26 @@ static trustsocket *findtrustsocketbyfd(int fd) {
   return NULL;
 }
 
-static int handletrustclient(trustsocket *sock) {
-  int r, remaining = TRUSTBUFSIZE - sock->size, i;
+static int processtrustlines(trustsocket *sock) {
+  unsigned int checks = sock->checks, batch;
   char *lastpos, *c;
+  int i;
 
-  if(!remaining) {
-    trustkillconnection(sock, "Buffer overflow.");
-    return 0;
-  }
-
-  r = read(sock->fd, sock->buf + sock->size, remaining);
-  if(r <= 0)
-    return 0;
-
-  sock->size+=r;
   lastpos = sock->buf;
 
   for(c=sock->buf,i=0;i<sock->size;i++,c++) {
     if(*c != '\n')
       continue;
+
+    /* leave the rest of the batch in the buffer until our replies have been written */
+    if(sock->authed && (sock->inflight >= sock->maxinflight || TRUSTWBUFSIZE - sock->wsize < 2 * (TRUSTLINELEN + 1))) {
+      if(!trustflush(sock))
+        return 0;
+
+      if(sock->blocked)
+        break;
+    }
+
     *c = '\0';
     if(!handletrustline(sock, lastpos))
       return 0;
@@ -381,8 +454,32 @@ static int handletrustclient(trustsocket *sock) {
   }
   sock->size-=lastpos - sock->buf;
   memmove(sock->buf, lastpos, sock->size);
-  
-  return 1;
+
+  batch = sock->checks - checks;
+  if(batch > 0) {
+    sock->batches++;
+    if(batch > sock->maxbatch)
+      sock->maxbatch = batch;
+  }
+
+  return trustflush(sock);
+}
+
+static int handletrustclient(trustsocket *sock) {
+  int r, remaining = TRUSTBUFSIZE - sock->size;
+
+  if(!remaining) {
+    trustkillconnection(sock, "Buffer overflow.");
+    return 0;
+  }
+
+  r = read(sock->fd, sock->buf + sock->size, remaining);
+  if(r <= 0)
+    return 0;
+
+  sock->size+=r;
+
+  return processtrustlines(sock);
 }
 
 static void processtrustclient(int fd, short events) {
@@ -396,6 +493,19 @@ static void processtrustclient(int fd, short events) {
     return;
   }
 
+  if(events & POLLOUT) {
+    if(!trustflush(sock)) {
+      trustfreeconnection(sock, 1);
+      return;
+    }
+
+    /* carry on with whatever was left over from the last batch */
+    if(!sock->blocked && !processtrustlines(sock)) {
+      trustfreeconnection(sock, 1);
+      return;
+    }
+  }
+
   if(events & POLLIN)
     if(!handletrustclient(sock))
       trustfreeconnection(sock, 1);
@@ -432,7 +542,7 @@ static void processtrustlistener(int fd, short events) {
       return;
     }
 
-    if(fcntl(fd, F_SETFL, flags|O_NONBLOCK) < 0) {
+    if(fcntl(newfd, F_SETFL, flags|O_NONBLOCK) < 0) {
       Error("trusts_policy", ERR_WARNING, "Unable to set socket non-blocking.");
       close(newfd);
       return;
@@ -459,26 +569,29 @@ static void processtrustlistener(int fd, short events) {
     sock->next = tslist;
     tslist = sock;
     
-    if(fread((char *)sock->nonce, 1, NONCELEN, urandom) != NONCELEN) {
-      Error("trusts_policy", ERR_WARNING, "Error getting random bytes.");
+    trusts_getrandbytes(sock->nonce, NONCELEN);
+
+    sock->authed = 0;
+    sock->size = 0;
+    sock->connected = time(NULL);
+    sock->timeout = time(NULL) + 30;
+    sock->accepted = 0;
+    sock->rejected = 0;
+    sock->unthrottled = 0;
+    sock->wsize = 0;
+    sock->blocked = 0;
+    sock->inflight = 0;
+    sock->maxinflight = defaultmaxinflight;
+    sock->checks = sock->batches = sock->maxbatch = 0;
+    memset(sock->latency, 0, sizeof(sock->latency));
+    sock->ratesecond = 0;
+    sock->ratecount = sock->peakrate = 0;
+    if(!trustdowrite(sock, "AUTH %s", hmac_printhex(sock->nonce, buf, NONCELEN)) || !trustflush(sock)) {
+      Error("trusts_policy", ERR_WARNING, "Error writing auth to fd %d.", newfd);
       deregisterhandler(newfd, 1);
       tslist = sock->next;
       nsfree(POOL_TRUSTS, sock);
-    } else {
-      sock->authed = 0;
-      sock->size = 0;
-      sock->connected = time(NULL);
-      sock->timeout = time(NULL) + 30;
-      sock->accepted = 0;
-      sock->rejected = 0;
-      sock->unthrottled = 0;
-      if(!trustdowrite(sock, "AUTH %s", hmac_printhex(sock->nonce, buf, NONCELEN))) {
-        Error("trusts_policy", ERR_WARNING, "Error writing auth to fd %d.", newfd);
-        deregisterhandler(newfd, 1);
-        tslist = sock->next;
-        nsfree(POOL_TRUSTS, sock);
-        return;
-      }
+      return;
     }
   }
 }
@@ -588,8 +701,14 @@ static int trusts_cmdtrustsockets(void *source, int cargc, char **cargv) {
 
   controlreply(sender, "Server                              Connected for        Accepted        Rejected        Unthrottled");
 
-  for(sock=tslist;sock;sock=sock->next)
+  for(sock=tslist;sock;sock=sock->next) {
     controlreply(sender, "%-35s %-20s %-15d %-15d %-15d", sock->authed?sock->authuser:"<unauthenticated connection>", longtoduration(now - sock->connected, 0), sock->accepted, sock->rejected, sock->unthrottled);
+    controlreply(sender, "  Checks: %u (%.1f/s average, %u/s peak), batches: %u (largest: %u), in flight: %d/%d%s",
+      sock->checks, (now > sock->connected)?(double)sock->checks / (now - sock->connected):0.0, sock->peakrate,
+      sock->batches, sock->maxbatch, sock->inflight, sock->maxinflight, sock->blocked?" (blocked)":"");
+    controlreply(sender, "  Latency: <100us: %u, <1ms: %u, <10ms: %u, <100ms: %u, <1s: %u, >=1s: %u",
+      sock->latency[0], sock->latency[1], sock->latency[2], sock->latency[3], sock->latency[4], sock->latency[5]);
+  }
 
   controlreply(sender, "-- End of list.");
   return CMD_OK;
@@ -597,9 +716,16 @@ static int trusts_cmdtrustsockets(void *source, int cargc, char **cargv) {
 
 void loadtrustaccounts(void) {
   array *accts;
+  sstring *m;
 
   memset(trustaccounts, 0, sizeof(trustaccounts));
 
+  m = getconfigitem("trusts_policy", "maxinflight");
+  if(m && atoi(m->content) > 0)
+    defaultmaxinflight = atoi(m->content);
+  else
+    defaultmaxinflight = DEFAULT_MAXINFLIGHT;
+
   accts = getconfigitems("trusts_policy", "server");
   if(!accts) {
     Error("trusts_policy", ERR_INFO, "No servers added.");
@@ -624,11 +750,45 @@ void loadtrustaccounts(void) {
         continue;
       }
 
-      *pos = '\0';
+      *pos++ = '\0';
 
       trustaccounts[i].used = 1;
       strncpy(trustaccounts[i].server, server, SERVERLEN);
-      strncpy(trustaccounts[i].password, pos+1, TRUSTPASSLEN);
+      strncpy(trustaccounts[i].password, pos, TRUSTPASSLEN);
+      trustaccounts[i].maxinflight = defaultmaxinflight;
+    }
+  }
+
+  /* per-server overrides: servermaxinflight=server,limit */
+  accts = getconfigitems("trusts_policy", "servermaxinflight");
+  if(accts) {
+    sstring **limits = (sstring **)(accts->content);
+    int i, j;
+    for(i=0;i<accts->cursi;i++) {
+      char server[512];
+      char *pos;
+
+      strncpy(server, limits[i]->content, sizeof(server));
+      server[sizeof(server) - 1] = '\0';
+
+      pos = strchr(server, ',');
+
+      if(!pos || atoi(pos + 1) <= 0) {
+        Error("trusts_policy", ERR_INFO, "Invalid servermaxinflight line: %s", server);
+        continue;
+      }
+
+      *pos++ = '\0';
+
+      for(j=0;j<MAXSERVERS;j++) {
+        if(trustaccounts[j].used && !strcmp(trustaccounts[j].server, server)) {
+          trustaccounts[j].maxinflight = atoi(pos);
+          break;
+        }
+      }
+
+      if(j==MAXSERVERS)
+        Error("trusts_policy", ERR_INFO, "servermaxinflight given for unknown server: %s", server);
     }
   }
 }
@@ -670,13 +830,9 @@ void _init(void) {
 
   registercontrolhelpcmd("trustpolicyirc", NO_DEVELOPER, 1, trusts_cmdtrustpolicyirc, "Usage: trustpolicyirc ?1|0?\nEnables or disables policy enforcement (IRC). Shows current status when no parameter is specified.");
   registercontrolhelpcmd("trustpolicyauth", NO_DEVELOPER, 1, trusts_cmdtrustpolicyauth, "Usage: trustpolicyauth ?1|0?\nEnables or disables policy enforcement (IAuth). Shows current status when no parameter is specified.");
-  registercontrolhelpcmd("trustsockets", NO_DEVELOPER, 0, trusts_cmdtrustsockets, "Usage: trustsockets\nLists all currently active TRUST sockets.");
+  registercontrolhelpcmd("trustsockets", NO_DEVELOPER, 0, trusts_cmdtrustsockets, "Usage: trustsockets\nLists all currently active TRUST sockets along with their throughput and latency statistics.");
 
   schedulerecurring(time(NULL)+1, 0, 5, trustdotimeout, NULL);
-  
-  urandom = fopen("/dev/urandom", "rb");
-  if(!urandom)
-    Error("trusts_policy", ERR_ERROR, "Couldn't open /dev/urandom.");
 }
 
 void _fini(void) {
@@ -697,9 +853,6 @@ void _fini(void) {
   
   deleteallschedules(trustdotimeout); 
  
-  if (urandom)
-    fclose(urandom);
-
   if (listenerfd != -1)
     deregisterhandler(listenerfd, 1);
 
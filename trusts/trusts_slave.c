@@ -18,15 +18,24 @@
 
 MODULE_VERSION("");
 
-static int syncing, synced;
+static int syncing, synced, stateloaded;
 static sstring *smasterserver;
 
 static unsigned int curlineno, totallines;
 static SHA1_CTX s;
 
+/* position in the master's change stream that our tables correspond to, epoch 0 means unknown */
+static unsigned int masterepoch, lastseq;
+static unsigned int snapshotepoch, snapshotseq;
+static time_t lastdeltarequest;
+
 void trusts_replication_createtables(void);
 void trusts_replication_swap(void);
 void trusts_replication_complete(int);
+void trusts_replication_loadstate(void (*)(unsigned int, unsigned int));
+void trusts_replication_cancelloadstate(void);
+void trusts_replication_savestate(unsigned int, unsigned int);
+void trusts_replication_clearstate(void);
 
 static int masterserver(void *source);
 
@@ -44,11 +53,86 @@ static void __abandonreplication(const char *fn, int line, char *error, ...) {
 
   syncing = synced = 0;
 
+  /* we can't trust our position in the change stream any more */
+  masterepoch = 0;
+  trusts_replication_clearstate();
+
   controlwall(NO_DEVELOPER, NL_TRUSTS, "Warning: %s", buf2);
 }
 
 #define abandonreplication(x, ...) __abandonreplication(__FUNCTION__, __LINE__, x , # __VA_ARGS__)
 
+static void requestsync(void) {
+  time_t t = time(NULL);
+
+  synced = 0;
+
+  if(syncing || !stateloaded)
+    return;
+
+  if(masterepoch && trustsdbloaded) {
+    /* deltas apply to the database's tables, not a snapshot that may be behind them */
+    if(trustsdbreconciling)
+      return;
+
+    if(t - lastdeltarequest < 5)
+      return;
+
+    lastdeltarequest = t;
+    xsb_broadcast("trrequestdelta", NULL, "%u %u", masterepoch, lastseq);
+  } else {
+    xsb_broadcast("trrequeststart", NULL, "%s", "");
+  }
+}
+
+/*
+ * Checks the epoch and sequence number of an incremental change.
+ * Returns the payload if the change is the next one we need, NULL otherwise.
+ */
+static char *checkchange(void *source, int argc, char **argv, unsigned int *seq) {
+  unsigned int epoch;
+  int chars = 0;
+
+  if(!masterserver(source))
+    return NULL;
+
+  if(argc < 1) {
+    abandonreplication("bad number of arguments");
+    return NULL;
+  }
+
+  /* we're in the middle of a full sync, or haven't loaded our tables yet */
+  if(!masterepoch || !trustsdbloaded || trustsdbreconciling)
+    return NULL;
+
+  if(sscanf(argv[0], "%u %u %n", &epoch, seq, &chars) != 2 || chars <= 0) {
+    abandonreplication("bad sequence prefix: %s", argv[0]);
+    return NULL;
+  }
+
+  if(epoch != masterepoch) {
+    /* master has restarted, our position is meaningless now */
+    masterepoch = 0;
+    requestsync();
+    return NULL;
+  }
+
+  if(*seq <= lastseq)
+    return NULL;
+
+  if(*seq != lastseq + 1) {
+    requestsync();
+    return NULL;
+  }
+
+  return &argv[0][chars];
+}
+
+static void changeapplied(unsigned int seq) {
+  lastseq = seq;
+  trusts_replication_savestate(masterepoch, lastseq);
+}
+
 void trusts_replication_complete(int error) {
   if(error) {
     abandonreplication("final replication stage: error %d", error);
@@ -134,7 +218,7 @@ static int xsb_trinit(void *source, int argc, char **argv) {
   if(!buf)
     return CMD_ERROR;
 
-  if((sscanf(buf, "%u %u", &forced, &totallines) != 2)) {
+  if((sscanf(buf, "%u %u %u %u", &forced, &totallines, &snapshotepoch, &snapshotseq) != 4)) {
     abandonreplication("bad number for sscanf result");
     return CMD_ERROR;
   }
@@ -152,6 +236,10 @@ static int xsb_trinit(void *source, int argc, char **argv) {
 
   trusts_replication_createtables();
 
+  /* if we die half way through the swap we'll need to start from scratch */
+  masterepoch = 0;
+  trusts_replication_clearstate();
+
   syncing = 1;
 
   Error("trusts_slave", ERR_INFO, "Replication in progress. . .");
@@ -247,6 +335,11 @@ static int xsb_trfini(void *source, int argc, char **argv) {
 
   trusts_replication_swap();
 
+  masterepoch = snapshotepoch;
+  lastseq = snapshotseq;
+  trusts_replication_savestate(masterepoch, lastseq);
+
+  /* anything we miss while the tables are being reloaded is fetched afterwards */
   synced = 1;
   syncing = 0;
 
@@ -255,20 +348,15 @@ static int xsb_trfini(void *source, int argc, char **argv) {
 
 static int xsb_traddgroup(void *source, int argc, char **argv) {
   trustgroup tg, *otg;
+  unsigned int seq;
+  char *data;
 
-  if(!synced)
+  data = checkchange(source, argc, argv, &seq);
+  if(!data)
     return CMD_OK;
 
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  if(!parsetg(argv[0], &tg, 0)) {
-    abandonreplication("bad trustgroup line: %s", argv[0]);
+  if(!parsetg(data, &tg, 0)) {
+    abandonreplication("bad trustgroup line: %s", data);
     return CMD_ERROR;
   }
 
@@ -284,26 +372,22 @@ static int xsb_traddgroup(void *source, int argc, char **argv) {
     return CMD_ERROR;
   }
 
+  changeapplied(seq);
+
   return CMD_OK;
 }
 
 static int xsb_traddhost(void *source, int argc, char **argv) {
-  unsigned int tgid;
+  unsigned int tgid, seq;
+  char *data;
   trusthost th;
 
-  if(!synced)
+  data = checkchange(source, argc, argv, &seq);
+  if(!data)
     return CMD_OK;
 
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  if(!parseth(argv[0], &th, &tgid, 0)) {
-    abandonreplication("bad trusthost line: %s", argv[0]);
+  if(!parseth(data, &th, &tgid, 0)) {
+    abandonreplication("bad trusthost line: %s", data);
     return CMD_ERROR;
   }
 
@@ -318,25 +402,21 @@ static int xsb_traddhost(void *source, int argc, char **argv) {
     return CMD_ERROR;
   }
 
+  changeapplied(seq);
+
   return CMD_OK;
 }
 
 static int xsb_trdelhost(void *source, int argc, char **argv) {
-  unsigned int id;
+  unsigned int id, seq;
+  char *data;
   trusthost *th;
 
-  if(!synced)
+  data = checkchange(source, argc, argv, &seq);
+  if(!data)
     return CMD_OK;
 
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  id = strtoul(argv[0], NULL, 10);
+  id = strtoul(data, NULL, 10);
   if(!id) {
     abandonreplication("unable to convert id to integer");
     return CMD_ERROR;
@@ -350,25 +430,21 @@ static int xsb_trdelhost(void *source, int argc, char **argv) {
 
   th_delete(th);
 
+  changeapplied(seq);
+
   return CMD_OK;
 }
 
 static int xsb_trdelgroup(void *source, int argc, char **argv) {
-  unsigned int id;
+  unsigned int id, seq;
+  char *data;
   trustgroup *tg;
 
-  if(!synced)
+  data = checkchange(source, argc, argv, &seq);
+  if(!data)
     return CMD_OK;
 
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  id = strtoul(argv[0], NULL, 10);
+  id = strtoul(data, NULL, 10);
   if(!id) {
     abandonreplication("unable to convert id to integer");
     return CMD_ERROR;
@@ -382,25 +458,22 @@ static int xsb_trdelgroup(void *source, int argc, char **argv) {
 
   tg_delete(tg);
 
+  changeapplied(seq);
+
   return CMD_OK;
 }
 
 static int xsb_trmodifygroup(void *source, int argc, char **argv) {
   trustgroup tg, *otg;
+  unsigned int seq;
+  char *data;
 
-  if(!synced)
+  data = checkchange(source, argc, argv, &seq);
+  if(!data)
     return CMD_OK;
 
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  if(!parsetg(argv[0], &tg, 0)) {
-    abandonreplication("bad trustgroup line: %s", argv[0]);
+  if(!parsetg(data, &tg, 0)) {
+    abandonreplication("bad trustgroup line: %s", data);
     return CMD_ERROR;
   }
 
@@ -423,27 +496,23 @@ static int xsb_trmodifygroup(void *source, int argc, char **argv) {
 
   tg_update(otg);
 
+  changeapplied(seq);
+
   return CMD_OK;
 }
 
 static int xsb_trmodifyhost(void *source, int argc, char **argv) {
   trustgroup *tg;
   trusthost th, *oth;
-  unsigned int groupid;
+  unsigned int groupid, seq;
+  char *data;
 
-  if(!synced)
+  data = checkchange(source, argc, argv, &seq);
+  if(!data)
     return CMD_OK;
 
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
-
-  if(!parseth(argv[0], &th, &groupid, 0)) {
-    abandonreplication("bad trusthost line: %s", argv[0]);
+  if(!parseth(data, &th, &groupid, 0)) {
+    abandonreplication("bad trusthost line: %s", data);
     return CMD_ERROR;
   }
 
@@ -466,6 +535,34 @@ static int xsb_trmodifyhost(void *source, int argc, char **argv) {
 
   th_update(oth);
 
+  changeapplied(seq);
+
+  return CMD_OK;
+}
+
+/* trdeltaend epoch seq */
+static int xsb_trdeltaend(void *source, int argc, char **argv) {
+  unsigned int epoch, seq;
+
+  if(!masterserver(source))
+    return CMD_ERROR;
+
+  if(argc < 1 || sscanf(argv[0], "%u %u", &epoch, &seq) != 2) {
+    abandonreplication("bad delta end line");
+    return CMD_ERROR;
+  }
+
+  if(epoch != masterepoch || seq != lastseq) {
+    /* missed something, try again later */
+    synced = 0;
+    return CMD_OK;
+  }
+
+  if(!synced)
+    Error("trusts_slave", ERR_INFO, "Caught up with master (sequence %u).", lastseq);
+
+  synced = 1;
+
   return CMD_OK;
 }
 
@@ -489,13 +586,39 @@ static int masterserver(void *source) {
 
 static void checksynced(void *arg) {
   if(!synced && !syncing)
-    xsb_broadcast("trrequeststart", NULL, "%s", "");
+    requestsync();
+}
+
+static void loadstate(unsigned int epoch, unsigned int seq) {
+  stateloaded = 1;
+
+  if(epoch) {
+    Error("trusts_slave", ERR_INFO, "Loading local tables (epoch %u, sequence %u).", epoch, seq);
+
+    masterepoch = epoch;
+    lastseq = seq;
+
+    /* we'll ask for the changes we missed once the tables are loaded */
+    if(!trustsdbloaded && !trusts_loaddb())
+      masterepoch = 0;
+  }
+
+  if(!masterepoch && trusts_fullyonline())
+    checksynced(NULL);
+}
+
+static void __dbloaded(int hooknum, void *arg) {
+  if(masterepoch && trusts_fullyonline()) {
+    lastdeltarequest = 0;
+    requestsync();
+  }
 }
 
 static int trusts_cmdtrustresync(void *source, int argc, char **argv) {
   nick *np = source;
 
   syncing = synced = 0;
+  masterepoch = 0;
 
   checksynced(NULL);
   controlreply(np, "Synchronisation request sent.");
@@ -533,7 +656,7 @@ void _init(void) {
 
   loaded = 1;
 
-  registercontrolhelpcmd("trustresync", NO_DEVELOPER, 0, trusts_cmdtrustresync, "Usage: trustresync");
+  registercontrolhelpcmd("trustresync", NO_DEVELOPER, 0, trusts_cmdtrustresync, "Usage: trustresync\nDiscards the local trust tables and requests a full resync from the master.");
 
   xsb_addcommand("trinit", 1, xsb_trinit);
   xsb_addcommand("trdata", 1, xsb_trdata);
@@ -544,12 +667,15 @@ void _init(void) {
   xsb_addcommand("trdelgroup", 1, xsb_trdelgroup);
   xsb_addcommand("trmodifygroup", 1, xsb_trmodifygroup);
   xsb_addcommand("trmodifyhost", 1, xsb_trmodifyhost);
+  xsb_addcommand("trdeltaend", 1, xsb_trdeltaend);
 
   registerhook(HOOK_SERVER_LINKED, __serverlinked);
+  registerhook(HOOK_TRUSTS_DB_LOADED, __dbloaded);
+  registerhook(HOOK_TRUSTS_DB_RECONCILED, __dbloaded);
   syncsched = schedulerecurring(time(NULL)+5, 0, 60, checksynced, NULL);
-  
-  if(trusts_fullyonline())
-    checksynced(NULL);
+
+  /* see if our tables are recent enough to catch up with deltas */
+  trusts_replication_loadstate(loadstate);
 }
 
 void _fini(void) {
@@ -569,8 +695,13 @@ void _fini(void) {
   xsb_delcommand("trdelgroup", xsb_trdelgroup);
   xsb_delcommand("trmodifygroup", xsb_trmodifygroup);
   xsb_delcommand("trmodifyhost", xsb_trmodifyhost);
+  xsb_delcommand("trdeltaend", xsb_trdeltaend);
 
   deregisterhook(HOOK_SERVER_LINKED, __serverlinked);
+  deregisterhook(HOOK_TRUSTS_DB_LOADED, __dbloaded);
+  deregisterhook(HOOK_TRUSTS_DB_RECONCILED, __dbloaded);
+
+  trusts_replication_cancelloadstate();
 
   deleteschedule(syncsched, checksynced, NULL);
 
@@ -0,0 +1,263 @@
+/*
+ * trustpolicyload: pretends to be an ircd talking to the trusts_policy
+ * listener and fires CHECK requests at it as fast as it can, keeping a
+ * configurable number of them in flight.
+ *
+ * Build with: make -C trusts utils/trustpolicyload
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "../../lib/hmac.h"
+
+#define BUFSIZE 65536
+#define LINELEN 512
+
+static int fd;
+static char rbuf[BUFSIZE];
+static int rsize;
+
+static double now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-h host] [-p port] [-n checks] [-d depth] [-i idents] [-a addresses] <servername> <password>\n", name);
+  fprintf(stderr, "  -h  policy server host (default: 127.0.0.1)\n");
+  fprintf(stderr, "  -p  policy server port (default: 5776)\n");
+  fprintf(stderr, "  -n  total number of checks to send (default: 100000)\n");
+  fprintf(stderr, "  -d  number of checks kept in flight (default: 100)\n");
+  fprintf(stderr, "  -i  number of distinct idents to use (default: 1000)\n");
+  fprintf(stderr, "  -a  number of distinct addresses to use, starting at 10.0.0.0 (default: 65536)\n");
+  exit(1);
+}
+
+static int doconnect(const char *host, const char *port) {
+  struct addrinfo hints, *res, *ai;
+  int s = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if(getaddrinfo(host, port, &hints, &res)) {
+    fprintf(stderr, "unable to resolve %s\n", host);
+    return -1;
+  }
+
+  for(ai=res;ai;ai=ai->ai_next) {
+    s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(s < 0)
+      continue;
+
+    if(connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+
+    close(s);
+    s = -1;
+  }
+
+  freeaddrinfo(res);
+  return s;
+}
+
+/* returns the next complete line from the socket, or NULL on EOF/error */
+static char *readline(void) {
+  static char line[LINELEN];
+  char *p;
+  int r, len;
+
+  for(;;) {
+    p = memchr(rbuf, '\n', rsize);
+    if(p) {
+      len = p - rbuf;
+      if(len >= LINELEN)
+        len = LINELEN - 1;
+
+      memcpy(line, rbuf, len);
+      line[len] = '\0';
+
+      rsize -= p - rbuf + 1;
+      memmove(rbuf, p + 1, rsize);
+
+      return line;
+    }
+
+    if(rsize == BUFSIZE)
+      return NULL;
+
+    r = read(fd, rbuf + rsize, BUFSIZE - rsize);
+    if(r <= 0)
+      return NULL;
+
+    rsize += r;
+  }
+}
+
+static int writeall(const char *buf, int len) {
+  int r;
+
+  while(len > 0) {
+    r = write(fd, buf, len);
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      return 0;
+    }
+
+    buf += r;
+    len -= r;
+  }
+
+  return 1;
+}
+
+static int authenticate(const char *server, const char *password) {
+  char *line, hexbuf[33], buf[LINELEN];
+  unsigned char digest[16];
+  hmacmd5 h;
+
+  line = readline();
+  if(!line || strncmp(line, "AUTH ", 5)) {
+    fprintf(stderr, "expected AUTH, got: %s\n", line?line:"(eof)");
+    return 0;
+  }
+
+  hmacmd5_init(&h, (unsigned char *)password, strlen(password));
+  hmacmd5_update(&h, (unsigned char *)line + 5, strlen(line + 5));
+  hmacmd5_final(&h, digest);
+
+  snprintf(buf, sizeof(buf), "AUTH %s %s\n", server, hmac_printhex(digest, hexbuf, sizeof(digest)));
+  if(!writeall(buf, strlen(buf)))
+    return 0;
+
+  line = readline();
+  if(!line || strcmp(line, "AUTHOK")) {
+    fprintf(stderr, "authentication failed: %s\n", line?line:"(eof)");
+    return 0;
+  }
+
+  return 1;
+}
+
+static int cmpdouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  char *host = "127.0.0.1", *port = "5776";
+  int total = 100000, depth = 100, idents = 1000, addresses = 65536;
+  int sent = 0, done = 0, passed = 0, killed = 0, unthrottled = 0, opt;
+  double *sendtime, *latency, start, elapsed;
+  char *wbuf;
+
+  while((opt = getopt(argc, argv, "h:p:n:d:i:a:")) != -1) {
+    switch(opt) {
+      case 'h': host = optarg; break;
+      case 'p': port = optarg; break;
+      case 'n': total = atoi(optarg); break;
+      case 'd': depth = atoi(optarg); break;
+      case 'i': idents = atoi(optarg); break;
+      case 'a': addresses = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if(argc - optind != 2 || total <= 0 || depth <= 0 || idents <= 0 || addresses <= 0)
+    usage(argv[0]);
+
+  sendtime = calloc(total, sizeof(double));
+  latency = calloc(total, sizeof(double));
+  wbuf = malloc((size_t)depth * LINELEN);
+  if(!sendtime || !latency || !wbuf) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  fd = doconnect(host, port);
+  if(fd < 0) {
+    fprintf(stderr, "unable to connect to %s:%s\n", host, port);
+    return 1;
+  }
+
+  if(!authenticate(argv[optind], argv[optind + 1]))
+    return 1;
+
+  start = now();
+
+  while(done < total) {
+    char *line, *seq;
+    int wsize = 0, id;
+
+    /* top the pipeline up with a single write */
+    while(sent < total && sent - done < depth) {
+      unsigned int addr = sent % addresses;
+
+      wsize += snprintf(wbuf + wsize, LINELEN, "CHECK %d user%d 10.%u.%u.%u\n", sent, sent % idents, (addr >> 16) & 255, (addr >> 8) & 255, addr & 255);
+      sendtime[sent++] = now();
+    }
+
+    if(wsize && !writeall(wbuf, wsize)) {
+      fprintf(stderr, "write error\n");
+      return 1;
+    }
+
+    line = readline();
+    if(!line) {
+      fprintf(stderr, "connection closed after %d replies\n", done);
+      return 1;
+    }
+
+    if(!strncmp(line, "UNTHROTTLE ", 11)) {
+      unthrottled++;
+      continue;
+    } else if(!strncmp(line, "PASS ", 5)) {
+      passed++;
+      seq = line + 5;
+    } else if(!strncmp(line, "KILL ", 5)) {
+      killed++;
+      seq = line + 5;
+    } else {
+      fprintf(stderr, "unexpected reply: %s\n", line);
+      continue;
+    }
+
+    id = atoi(seq);
+    if(id < 0 || id >= sent) {
+      fprintf(stderr, "reply for unknown sequence id: %s\n", line);
+      continue;
+    }
+
+    latency[done++] = now() - sendtime[id];
+  }
+
+  elapsed = now() - start;
+  close(fd);
+
+  qsort(latency, done, sizeof(double), cmpdouble);
+
+  printf("checks:      %d (%d passed, %d killed, %d unthrottled)\n", done, passed, killed, unthrottled);
+  printf("elapsed:     %.3fs (%.0f checks/s)\n", elapsed, done / elapsed);
+  printf("latency:     p50 %.3fms, p90 %.3fms, p99 %.3fms, max %.3fms\n",
+    latency[done / 2] * 1000.0, latency[done * 9 / 10] * 1000.0, latency[done * 99 / 100] * 1000.0, latency[done - 1] * 1000.0);
+
+  free(sendtime);
+  free(latency);
+  free(wbuf);
+
+  return 0;
+}